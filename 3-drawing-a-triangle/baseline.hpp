@@ -0,0 +1,251 @@
+#pragma once
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bench.hpp"
+#include "files.hpp"
+
+/**
+ * What a benchmark result is compared against: its value in the baseline run, which way it
+ * improves, and how far from it the result may go before it counts as a regression. `tolerance`
+ * is relative, `slack` absolute, for values close to 0 like allocations per frame.
+ */
+struct BaselineEntry {
+  double value = 0.0;
+  Better better = Better::Lower;
+  double tolerance = 0.0;
+  double slack = 0.0;
+};
+
+/**
+ * The results of a benchmark run stored with their direction and tolerances, to catch
+ * performance regressions. It is a JSON object from result name to entry:
+ *
+ *   {
+ *     "frames.fps": { "value": 610, "better": "higher", "tolerance": 0.2 },
+ *     "frames.host_allocations_per_frame":
+ *       { "value": 0, "better": "lower", "tolerance": 0.2, "slack": 0.5 }
+ *   }
+ *
+ * write() creates one from a run, with the direction given to BenchmarkResults::add and the same
+ * tolerance everywhere, which can then be edited: noisy results deserve a larger tolerance.
+ */
+class BenchmarkBaseline {
+public:
+  /**
+   * Load a baseline written by write(), or by hand.
+   */
+  static BenchmarkBaseline load(const std::string &path) {
+    std::vector<char> data = readFile(path);
+    if (data.empty()) {
+      throw std::runtime_error("failed to read benchmark baseline " + path + "!");
+    }
+    BenchmarkBaseline baseline;
+    Parser parser(std::string(data.begin(), data.end()), path);
+    parser.expect('{');
+    if (!parser.consume('}')) {
+      do {
+        std::string name = parser.string();
+        parser.expect(':');
+        baseline.entries[name] = parser.entry(name);
+      } while (parser.consume(','));
+      parser.expect('}');
+    }
+    parser.end();
+    return baseline;
+  }
+
+  /**
+   * Write `results` as a baseline, each with a relative `tolerance`. The results with no direction
+   * are left out.
+   */
+  static void write(const std::string &path, const BenchmarkResults &results, double tolerance) {
+    std::ostringstream json;
+    json << std::setprecision(9) << "{\n";
+    bool first = true;
+    for (auto &[name, value, better]: results.values) {
+      if (!std::isfinite(value) || better == Better::None) {
+        continue;
+      }
+      json << (first ? "" : ",\n") << "  \"" << name << "\": { \"value\": " << value
+           << ", \"better\": \"" << (better == Better::Higher ? "higher" : "lower")
+           << "\", \"tolerance\": " << tolerance << " }";
+      first = false;
+    }
+    json << "\n}\n";
+    std::string data = json.str();
+    writeFileAtomically(path, std::vector<char>(data.begin(), data.end()));
+  }
+
+  /**
+   * Compare `results` with the baseline and print every result it has an entry for, in the
+   * direction the entry gives. Returns false if one regressed, or is missing: a renamed or
+   * removed result must not pass silently.
+   */
+  bool check(const BenchmarkResults &results, std::ostream &out) const {
+    std::map<std::string, double> current;
+    for (auto &[name, value, better]: results.values) {
+      if (better != Better::None) {
+        current[name] = value;
+      }
+    }
+
+    uint32_t regressions = 0;
+    uint32_t improvements = 0;
+    out << std::fixed << std::setprecision(3) << "baseline comparison:" << '\n';
+    for (auto &[name, entry]: this->entries) {
+      auto it = current.find(name);
+      out << "  " << std::left << std::setw(44) << name << std::right;
+      if (it == current.end() || !std::isfinite(it->second)) {
+        out << "missing" << '\n';
+        ++regressions;
+        continue;
+      }
+      double value = it->second;
+      double margin = std::abs(entry.value) * entry.tolerance + entry.slack;
+      // Positive when the result got worse.
+      double worse = entry.better == Better::Higher ? entry.value - value : value - entry.value;
+      const char *status = "ok";
+      if (worse > margin) {
+        status = "REGRESSED";
+        ++regressions;
+      } else if (-worse > margin) {
+        status = "improved";
+        ++improvements;
+      }
+      out << std::setw(12) << entry.value << " -> " << std::setw(12) << value;
+      if (entry.value != 0.0) {
+        out << " (" << std::showpos << std::setprecision(1)
+            << (value - entry.value) / std::abs(entry.value) * 100.0 << "%)" << std::noshowpos
+            << std::setprecision(3);
+      }
+      out << "  " << status << '\n';
+    }
+    out << "  " << regressions << " regressions, " << improvements << " improvements";
+    if (improvements > 0) {
+      out << ", the baseline may be worth updating";
+    }
+    out << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+    return regressions == 0;
+  }
+
+  std::map<std::string, BaselineEntry> entries;
+
+private:
+  /**
+   * Just enough JSON for the baselines: objects, strings without escapes and numbers.
+   */
+  class Parser {
+  public:
+    Parser(std::string text, const std::string &path) : text(std::move(text)), path(path) {}
+
+    BaselineEntry entry(const std::string &name) {
+      BaselineEntry entry;
+      bool hasValue = false;
+      bool hasDirection = false;
+      this->expect('{');
+      do {
+        std::string field = this->string();
+        this->expect(':');
+        if (field == "value") {
+          entry.value = this->number();
+          hasValue = true;
+        } else if (field == "tolerance") {
+          entry.tolerance = this->number();
+        } else if (field == "slack") {
+          entry.slack = this->number();
+        } else if (field == "better") {
+          std::string better = this->string();
+          if (better != "lower" && better != "higher") {
+            this->fail(name + " is better " + better + ", expected lower or higher");
+          }
+          entry.better = better == "higher" ? Better::Higher : Better::Lower;
+          hasDirection = true;
+        } else {
+          this->fail("unknown field " + field + " in " + name);
+        }
+      } while (this->consume(','));
+      this->expect('}');
+      if (!hasValue) {
+        this->fail(name + " has no value");
+      }
+      if (!hasDirection) {
+        this->fail(name + " does not say which way is better");
+      }
+      return entry;
+    }
+
+    std::string string() {
+      this->expect('"');
+      size_t end = this->text.find('"', this->position);
+      if (end == std::string::npos) {
+        this->fail("unterminated string");
+      }
+      std::string value = this->text.substr(this->position, end - this->position);
+      this->position = end + 1;
+      return value;
+    }
+
+    double number() {
+      this->skipSpaces();
+      const char *start = this->text.c_str() + this->position;
+      char *end;
+      double value = std::strtod(start, &end);
+      if (end == start) {
+        this->fail("expected a number");
+      }
+      this->position += end - start;
+      return value;
+    }
+
+    bool consume(char c) {
+      this->skipSpaces();
+      if (this->position < this->text.size() && this->text[this->position] == c) {
+        ++this->position;
+        return true;
+      }
+      return false;
+    }
+
+    void expect(char c) {
+      if (!this->consume(c)) {
+        this->fail(std::string("expected '") + c + "'");
+      }
+    }
+
+    void end() {
+      this->skipSpaces();
+      if (this->position != this->text.size()) {
+        this->fail("trailing characters");
+      }
+    }
+
+  private:
+    void skipSpaces() {
+      while (this->position < this->text.size()
+             && std::isspace(static_cast<unsigned char>(this->text[this->position]))) {
+        ++this->position;
+      }
+    }
+
+    [[noreturn]] void fail(const std::string &message) const {
+      throw std::runtime_error("failed to parse benchmark baseline " + this->path + ": " + message
+        + " at offset " + std::to_string(this->position) + "!");
+    }
+
+    std::string text;
+    std::string path;
+    size_t position = 0;
+  };
+};
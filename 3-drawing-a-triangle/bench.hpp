@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "files.hpp"
+
+/**
+ * Time spent running `f`, in milliseconds.
+ */
+template<typename F>
+double timeMilliseconds(F &&f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+    .count();
+}
+
+/**
+ * Timings collected by a benchmark. The median is usually what to look at, the first runs and the
+ * ones interrupted by the OS make the mean noisy.
+ */
+class Samples {
+public:
+  void record(double milliseconds) {
+    this->values.push_back(milliseconds);
+  }
+
+  /**
+   * Nearest-rank percentile, with percentile in [0, 100].
+   */
+  double percentile(double percentile) const {
+    if (this->values.empty()) {
+      return 0.0;
+    }
+    std::vector<double> sorted = this->values;
+    std::sort(sorted.begin(), sorted.end());
+    size_t rank = static_cast<size_t>(std::ceil(percentile / 100.0 * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+  }
+
+  double median() const {
+    return this->percentile(50);
+  }
+
+  double mean() const {
+    double total = 0.0;
+    for (auto value: this->values) {
+      total += value;
+    }
+    return this->values.empty() ? 0.0 : total / this->values.size();
+  }
+
+  std::vector<double> values;
+};
+
+/**
+ * Largest resident set of the process so far, in MiB: the host memory it uses, the driver's
+ * included. Linux gives ru_maxrss in KiB.
+ */
+inline double peakResidentMebibytes() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0.0;
+  }
+  return usage.ru_maxrss / 1024.0;
+}
+
+/**
+ * Time consecutive stages of a sequence, e.g. of the initialization. Each call to mark() ends the
+ * current stage and starts the next one.
+ */
+class StageTimer {
+public:
+  StageTimer() : start(std::chrono::steady_clock::now()), last(start) {}
+
+  void mark(const std::string &stage) {
+    auto now = std::chrono::steady_clock::now();
+    this->stages.emplace_back(stage, std::chrono::duration<double, std::milli>(now - this->last)
+      .count());
+    this->last = now;
+  }
+
+  double total() const {
+    return std::chrono::duration<double, std::milli>(this->last - this->start).count();
+  }
+
+  void report(std::ostream &out) const {
+    out << std::fixed << std::setprecision(3);
+    for (auto &[stage, milliseconds]: this->stages) {
+      out << "  " << std::left << std::setw(20) << stage << std::right << milliseconds << " ms"
+          << '\n';
+    }
+    out << "  " << std::left << std::setw(20) << "total" << std::right << this->total() << " ms"
+        << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+  }
+
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point last;
+  std::vector<std::pair<std::string, double>> stages;
+};
+
+/**
+ * Which way a benchmark result improves. Results with no direction are not compared against a
+ * baseline: they describe the run, like the number of frames or a budget, or are too noisy to
+ * compare, like the slowest frame.
+ */
+enum class Better {
+  Lower,
+  Higher,
+  None,
+};
+
+/**
+ * Benchmark results written as a flat JSON object, name to number, for scripts to compare runs.
+ * Names carry their unit, e.g. "frames.p99_ms".
+ */
+class BenchmarkResults {
+public:
+  struct Result {
+    std::string name;
+    double value;
+    Better better;
+  };
+
+  void add(const std::string &name, double value, Better better) {
+    this->values.push_back({ .name = name, .value = value, .better = better });
+  }
+
+  void write(const std::string &path) const {
+    std::ostringstream json;
+    json << std::setprecision(9) << "{\n";
+    for (size_t idx = 0; idx < this->values.size(); ++idx) {
+      auto &[name, value, better] = this->values[idx];
+      json << "  \"" << name << "\": ";
+      // JSON has no representation for infinities and NaN.
+      if (std::isfinite(value)) {
+        json << value;
+      } else {
+        json << "null";
+      }
+      json << (idx + 1 < this->values.size() ? ",\n" : "\n");
+    }
+    json << "}\n";
+    std::string data = json.str();
+    writeFileAtomically(path, std::vector<char>(data.begin(), data.end()));
+  }
+
+  std::vector<Result> values;
+};
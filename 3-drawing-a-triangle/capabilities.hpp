@@ -0,0 +1,307 @@
+#pragma once
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "files.hpp"
+
+/**
+ * Identify a physical device and its driver across runs. VkPhysicalDevice handles are not stable
+ * between instances, so devices are recognized by what they report instead.
+ *
+ * From Vulkan 1.1, deviceUUID is unique to each device, even to two identical GPUs, and stays the
+ * same across instances and processes. Before it only the model can be identified, so identical
+ * GPUs are indistinguishable; their capabilities are the same anyway.
+ */
+struct DeviceIdentity {
+  uint32_t vendorID;
+  uint32_t deviceID;
+  uint32_t driverVersion;
+  uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+  // All zeros when the instance or the device predates Vulkan 1.1.
+  uint8_t deviceUUID[VK_UUID_SIZE];
+
+  /**
+   * Query the identity of the device. `apiVersion` is the version the instance was created with,
+   * vkGetPhysicalDeviceProperties2 is only called when both it and the device support 1.1.
+   */
+  static DeviceIdentity query(VkPhysicalDevice device,
+    const VkPhysicalDeviceProperties &properties, uint32_t apiVersion) {
+    DeviceIdentity identity = {
+      .vendorID = properties.vendorID,
+      .deviceID = properties.deviceID,
+      .driverVersion = properties.driverVersion,
+    };
+    memcpy(identity.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    memset(identity.deviceUUID, 0, VK_UUID_SIZE);
+    if (apiVersion >= VK_API_VERSION_1_1 && properties.apiVersion >= VK_API_VERSION_1_1) {
+      VkPhysicalDeviceIDProperties idProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+      };
+      VkPhysicalDeviceProperties2 properties2 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &idProperties,
+      };
+      vkGetPhysicalDeviceProperties2(device, &properties2);
+      memcpy(identity.deviceUUID, idProperties.deviceUUID, VK_UUID_SIZE);
+    }
+    return identity;
+  }
+
+  bool hasDeviceUUID() const {
+    static const uint8_t none[VK_UUID_SIZE] = {};
+    return memcmp(this->deviceUUID, none, VK_UUID_SIZE) != 0;
+  }
+
+  /**
+   * Whether both identify the same device with the same driver: by deviceUUID when both have one,
+   * by model and pipeline cache compatibility when neither has.
+   */
+  bool operator==(const DeviceIdentity &other) const {
+    if (this->hasDeviceUUID() || other.hasDeviceUUID()) {
+      return this->driverVersion == other.driverVersion
+        && memcmp(this->deviceUUID, other.deviceUUID, VK_UUID_SIZE) == 0;
+    }
+    return this->vendorID == other.vendorID
+      && this->deviceID == other.deviceID
+      && this->driverVersion == other.driverVersion
+      && memcmp(this->pipelineCacheUUID, other.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+  }
+};
+
+/**
+ * What a physical device can do, as reported by the vkGetPhysicalDevice* and vkEnumerateDevice*
+ * queries. None of it changes as long as the device and its driver stay the same.
+ */
+struct DeviceCapabilities {
+  DeviceIdentity identity;
+
+  VkPhysicalDeviceFeatures features;
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  std::vector<VkQueueFamilyProperties> queueFamilies;
+  std::vector<VkExtensionProperties> extensions;
+
+  /**
+   * Query everything from the device.
+   */
+  static DeviceCapabilities query(VkPhysicalDevice device, const DeviceIdentity &identity) {
+    DeviceCapabilities capabilities = {
+      .identity = identity,
+    };
+    vkGetPhysicalDeviceFeatures(device, &capabilities.features);
+    vkGetPhysicalDeviceMemoryProperties(device, &capabilities.memoryProperties);
+
+    uint32_t queueCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueCount, nullptr);
+    capabilities.queueFamilies.resize(queueCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueCount,
+      capabilities.queueFamilies.data());
+
+    uint32_t extensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
+    capabilities.extensions.resize(extensionCount);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount,
+      capabilities.extensions.data());
+    return capabilities;
+  }
+
+  /**
+   * Whether these capabilities were queried from the same device with the same driver.
+   */
+  bool matches(const DeviceIdentity &identity) const {
+    return this->identity == identity;
+  }
+};
+
+/**
+ * A snapshot of the capabilities of the physical devices, kept in a binary file between runs so
+ * that warm starts only need vkGetPhysicalDeviceProperties to identify each device.
+ *
+ * The file is a header followed by one record per device:
+ *   - magic, format version, and the sizes of the structures dumped as is, so that a file written
+ *     by a build with different Vulkan headers is dropped
+ *   - whether validation layers were enabled, as layers can expose device extensions
+ *   - the index of the device selected by the previous run, -1 if none
+ *   - per device: the fields of DeviceIdentity, features, memory properties, queue families and
+ *     extensions, the last two prefixed by their count
+ * Anything unexpected while reading makes the whole file ignored.
+ */
+class CapabilityCache {
+public:
+  static constexpr uint32_t magic = 0x50434b56; // "VKCP"
+  static constexpr uint32_t version = 2;
+
+  CapabilityCache(std::string path, bool validationLayers)
+    : path(std::move(path)), validationLayers(validationLayers) {
+    if (!this->path.empty() && !this->parse(readFile(this->path))) {
+      this->devices.clear();
+      this->selected = -1;
+    }
+  }
+
+  /**
+   * The cached capabilities of the device, nullptr if the device or its driver is not the one that
+   * was cached.
+   */
+  const DeviceCapabilities *find(const DeviceIdentity &identity) {
+    for (auto &device: this->devices) {
+      if (device.matches(identity)) {
+        ++this->hits;
+        return &device;
+      }
+    }
+    ++this->misses;
+    return nullptr;
+  }
+
+  /**
+   * Add or replace the capabilities of a device, found by the same identity as find.
+   */
+  void store(const DeviceCapabilities &capabilities) {
+    for (auto &device: this->devices) {
+      if (device.matches(capabilities.identity)) {
+        device = capabilities;
+        this->dirty = true;
+        return;
+      }
+    }
+    this->devices.push_back(capabilities);
+    this->dirty = true;
+  }
+
+  /**
+   * The device selected by the previous run, nullptr if none.
+   */
+  const DeviceCapabilities *selectedDevice() const {
+    return this->selected >= 0 ? &this->devices[this->selected] : nullptr;
+  }
+
+  void select(const DeviceIdentity &identity) {
+    for (int32_t idx = 0; idx < static_cast<int32_t>(this->devices.size()); ++idx) {
+      if (this->devices[idx].matches(identity)) {
+        if (this->selected != idx) {
+          this->selected = idx;
+          this->dirty = true;
+        }
+        return;
+      }
+    }
+  }
+
+  /**
+   * Write the snapshot if anything changed since it was loaded.
+   */
+  void save() {
+    if (this->path.empty() || !this->dirty) {
+      return;
+    }
+    std::vector<char> data;
+    auto write = [&data](const void *value, size_t size) {
+      data.insert(data.end(), static_cast<const char *>(value),
+        static_cast<const char *>(value) + size);
+    };
+    for (uint32_t value: this->header()) {
+      write(&value, sizeof(value));
+    }
+    write(&this->selected, sizeof(this->selected));
+    uint32_t deviceCount = this->devices.size();
+    write(&deviceCount, sizeof(deviceCount));
+    for (auto &device: this->devices) {
+      write(&device.identity.vendorID, sizeof(device.identity.vendorID));
+      write(&device.identity.deviceID, sizeof(device.identity.deviceID));
+      write(&device.identity.driverVersion, sizeof(device.identity.driverVersion));
+      write(device.identity.pipelineCacheUUID, VK_UUID_SIZE);
+      write(device.identity.deviceUUID, VK_UUID_SIZE);
+      write(&device.features, sizeof(device.features));
+      write(&device.memoryProperties, sizeof(device.memoryProperties));
+      uint32_t queueCount = device.queueFamilies.size();
+      write(&queueCount, sizeof(queueCount));
+      write(device.queueFamilies.data(), queueCount * sizeof(VkQueueFamilyProperties));
+      uint32_t extensionCount = device.extensions.size();
+      write(&extensionCount, sizeof(extensionCount));
+      write(device.extensions.data(), extensionCount * sizeof(VkExtensionProperties));
+    }
+    writeFileAtomically(this->path, data);
+    this->dirty = false;
+  }
+
+  // Lookups answered from the snapshot, and the ones which had to query the device.
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+
+private:
+  std::vector<uint32_t> header() const {
+    return {
+      magic,
+      version,
+      sizeof(VkPhysicalDeviceFeatures),
+      sizeof(VkPhysicalDeviceMemoryProperties),
+      sizeof(VkQueueFamilyProperties),
+      sizeof(VkExtensionProperties),
+      this->validationLayers ? 1u : 0u,
+    };
+  }
+
+  bool parse(const std::vector<char> &data) {
+    size_t offset = 0;
+    auto read = [&data, &offset](void *value, size_t size) {
+      if (size > data.size() - offset) {
+        return false;
+      }
+      memcpy(value, data.data() + offset, size);
+      offset += size;
+      return true;
+    };
+
+    for (uint32_t expected: this->header()) {
+      uint32_t value;
+      if (!read(&value, sizeof(value)) || value != expected) {
+        return false;
+      }
+    }
+    uint32_t deviceCount;
+    if (!read(&this->selected, sizeof(this->selected))
+        || !read(&deviceCount, sizeof(deviceCount))) {
+      return false;
+    }
+    for (uint32_t idx = 0; idx < deviceCount; ++idx) {
+      DeviceCapabilities device;
+      uint32_t queueCount, extensionCount;
+      if (!read(&device.identity.vendorID, sizeof(device.identity.vendorID))
+          || !read(&device.identity.deviceID, sizeof(device.identity.deviceID))
+          || !read(&device.identity.driverVersion, sizeof(device.identity.driverVersion))
+          || !read(device.identity.pipelineCacheUUID, VK_UUID_SIZE)
+          || !read(device.identity.deviceUUID, VK_UUID_SIZE)
+          || !read(&device.features, sizeof(device.features))
+          || !read(&device.memoryProperties, sizeof(device.memoryProperties))
+          || !read(&queueCount, sizeof(queueCount))
+          || queueCount > (data.size() - offset) / sizeof(VkQueueFamilyProperties)) {
+        return false;
+      }
+      device.queueFamilies.resize(queueCount);
+      if (!read(device.queueFamilies.data(), queueCount * sizeof(VkQueueFamilyProperties))
+          || !read(&extensionCount, sizeof(extensionCount))
+          || extensionCount > (data.size() - offset) / sizeof(VkExtensionProperties)) {
+        return false;
+      }
+      device.extensions.resize(extensionCount);
+      if (!read(device.extensions.data(), extensionCount * sizeof(VkExtensionProperties))) {
+        return false;
+      }
+      this->devices.push_back(std::move(device));
+    }
+    return offset == data.size()
+      && this->selected >= -1 && this->selected < static_cast<int32_t>(this->devices.size());
+  }
+
+  std::string path;
+  bool validationLayers;
+  std::vector<DeviceCapabilities> devices;
+  int32_t selected = -1;
+  // Whether the snapshot differs from the file.
+  bool dirty = false;
+};
@@ -0,0 +1,486 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vulkan/vulkan.h>
+
+#include "files.hpp"
+#include "frames.hpp"
+#include "handles.hpp"
+#include "memory.hpp"
+
+/**
+ * What FrameCapture writes each frame as.
+ */
+enum class CaptureFormat {
+  // One PNG file per frame.
+  Png,
+  // Every frame, RGBA8 rows top to bottom, one after the other in a single file.
+  Raw,
+};
+
+inline CaptureFormat parseCaptureFormat(const std::string &name) {
+  if (name == "png") {
+    return CaptureFormat::Png;
+  } else if (name == "raw") {
+    return CaptureFormat::Raw;
+  }
+  throw std::runtime_error("unknown capture format " + name + ", expected png or raw!");
+}
+
+/**
+ * Encode RGBA8 pixels as a PNG. The image data is deflated with stored blocks, which is no
+ * compression at all: the files are a little larger than raw, but encoding is a copy and two
+ * checksums, and no zlib is needed.
+ */
+inline std::vector<char> encodePng(uint32_t width, uint32_t height, const uint8_t *pixels) {
+  static const std::vector<uint32_t> crcTable = []() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t idx = 0; idx < 256; ++idx) {
+      uint32_t crc = idx;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+      }
+      table[idx] = crc;
+    }
+    return table;
+  }();
+
+  std::vector<char> png = { '\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n' };
+  auto put32 = [](std::vector<char> &out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out.push_back(static_cast<char>(value >> shift));
+    }
+  };
+  // Length, type, data and the CRC of type and data.
+  auto chunk = [&](const char *type, const std::vector<char> &data) {
+    put32(png, data.size());
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    uint32_t crc = 0xffffffff;
+    for (size_t idx = start; idx < png.size(); ++idx) {
+      crc = crcTable[(crc ^ static_cast<uint8_t>(png[idx])) & 0xff] ^ (crc >> 8);
+    }
+    put32(png, crc ^ 0xffffffff);
+  };
+
+  // 8 bits per channel, RGBA, no interlacing.
+  std::vector<char> header;
+  put32(header, width);
+  put32(header, height);
+  header.insert(header.end(), { 8, 6, 0, 0, 0 });
+  chunk("IHDR", header);
+
+  // Each row starts with its filter type, 0 for none.
+  size_t rowSize = size_t(width) * 4;
+  size_t rawSize = (rowSize + 1) * height;
+  std::vector<char> data = { 0x78, 0x01 };
+  data.reserve(rawSize + rawSize / 65535 * 5 + 16);
+  uint32_t adlerA = 1, adlerB = 0;
+  size_t blockLeft = 0;
+  size_t written = 0;
+  auto append = [&](const uint8_t *bytes, size_t size) {
+    while (size > 0) {
+      if (blockLeft == 0) {
+        // A stored block: final flag, length and its complement, little endian.
+        blockLeft = std::min<size_t>(rawSize - written, 65535);
+        bool last = written + blockLeft == rawSize;
+        data.insert(data.end(), {
+          static_cast<char>(last ? 1 : 0),
+          static_cast<char>(blockLeft), static_cast<char>(blockLeft >> 8),
+          static_cast<char>(~blockLeft), static_cast<char>(~blockLeft >> 8),
+        });
+      }
+      size_t count = std::min(size, blockLeft);
+      data.insert(data.end(), bytes, bytes + count);
+      for (size_t idx = 0; idx < count; ++idx) {
+        adlerA = (adlerA + bytes[idx]) % 65521;
+        adlerB = (adlerB + adlerA) % 65521;
+      }
+      bytes += count;
+      size -= count;
+      blockLeft -= count;
+      written += count;
+    }
+  };
+  const uint8_t filter = 0;
+  for (uint32_t row = 0; row < height; ++row) {
+    append(&filter, 1);
+    append(pixels + row * rowSize, rowSize);
+  }
+  put32(data, (adlerB << 16) | adlerA);
+  chunk("IDAT", data);
+  chunk("IEND", {});
+  return png;
+}
+
+/**
+ * Writes rendered frames to disk without stalling the render loop on the encoding.
+ *
+ * record() copies the image of a frame into one of `bufferCount` host visible buffers, host cached
+ * when the device has such memory so that reading it back is not an uncached read. The buffers
+ * stay mapped: the encoder threads read the pixels where the GPU wrote them. Once the frame is
+ * done on the GPU, collect() hands its buffer to an encoder thread, which writes it and frees the
+ * buffer. When every buffer is taken, record() waits for one: encoding slower than rendering
+ * slows the frames down rather than dropping them.
+ */
+class FrameCapture {
+public:
+  FrameCapture(VkDevice device, DeviceMemoryAllocator &allocator,
+    const VkPhysicalDeviceMemoryProperties &memoryProperties, VkDeviceSize nonCoherentAtomSize,
+    VkExtent2D extent, CaptureFormat format, const std::string &directory, uint32_t bufferCount,
+    uint32_t threadCount, uint64_t maxFrames,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      nonCoherentAtomSize(nonCoherentAtomSize), extent(extent), format(format),
+      directory(directory), frameSize(VkDeviceSize(extent.width) * extent.height * 4) {
+    std::filesystem::create_directories(directory);
+    if (format == CaptureFormat::Raw) {
+      // Sized for every frame up front: encoders write their frames at their own offsets.
+      std::string path = directory + "/frames.raw";
+      int file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      this->mappedSize = this->frameSize * maxFrames;
+      if (file < 0 || ftruncate(file, this->mappedSize) != 0) {
+        if (file >= 0) {
+          close(file);
+        }
+        throw std::runtime_error("failed to create " + path + "!");
+      }
+      void *mapped = mmap(nullptr, this->mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+      // The mapping keeps the file open.
+      close(file);
+      if (mapped == MAP_FAILED) {
+        throw std::runtime_error("failed to map " + path + "!");
+      }
+      this->mappedFile = static_cast<uint8_t *>(mapped);
+      this->maxFrames = maxFrames;
+    }
+
+    this->slots.resize(std::max(bufferCount, 1u));
+    for (auto &slot: this->slots) {
+      VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = this->frameSize,
+        .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      };
+      slot.buffer = createDeviceChild<UniqueBuffer>(vkCreateBuffer, device, bufferInfo,
+        allocationCallbacks, "capture buffer");
+      slot.memory = allocator.allocateBuffer(slot.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+        VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+      slot.coherent = memoryProperties.memoryTypes[slot.memory.memoryType].propertyFlags
+        & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    }
+
+    for (uint32_t idx = 0; idx < std::max(threadCount, 1u); ++idx) {
+      this->encoders.emplace_back([this]() { this->encode(); });
+    }
+  }
+
+  ~FrameCapture() {
+    this->stop();
+    for (auto &slot: this->slots) {
+      // The buffer goes before the memory bound to it.
+      slot.buffer.reset();
+      this->allocator.free(slot.memory);
+    }
+    if (this->mappedFile != nullptr) {
+      munmap(this->mappedFile, this->mappedSize);
+    }
+  }
+
+  FrameCapture(const FrameCapture &) = delete;
+  FrameCapture &operator=(const FrameCapture &) = delete;
+
+  /**
+   * Record the copy of `image`, the render target of the frame in
+   * VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, into a free buffer. To be recorded after the render pass,
+   * right before the command buffer is submitted.
+   */
+  void record(VkCommandBuffer commandBuffer, VkImage image, uint64_t frameNumber) {
+    if (this->format == CaptureFormat::Raw && frameNumber >= this->maxFrames) {
+      throw std::runtime_error("the raw capture file has no room for frame "
+        + std::to_string(frameNumber) + "!");
+    }
+    size_t index;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      auto available = [this, &index]() {
+        for (index = 0; index < this->slots.size(); ++index) {
+          if (this->slots[index].state == State::Free) {
+            return true;
+          }
+        }
+        return this->error != nullptr;
+      };
+      if (!available()) {
+        auto start = std::chrono::steady_clock::now();
+        ++this->stalls;
+        this->changed.wait(lock, available);
+        this->stallMilliseconds += std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count();
+      }
+      if (this->error != nullptr) {
+        std::rethrow_exception(this->error);
+      }
+      Slot &slot = this->slots[index];
+      slot.state = State::InFlight;
+      slot.frameNumber = frameNumber;
+      slot.submitted = std::chrono::steady_clock::now();
+      if (this->framesCaptured == 0 && this->inFlight == 0) {
+        this->start = slot.submitted;
+      }
+      ++this->inFlight;
+    }
+
+    // The render pass leaves the image in the right layout, but its writes must still be made
+    // visible to the copy.
+    VkImageMemoryBarrier imageBarrier = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = image,
+      .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+    // Tightly packed rows.
+    VkBufferImageCopy region = {
+      .bufferOffset = 0,
+      .bufferRowLength = 0,
+      .bufferImageHeight = 0,
+      .imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+      .imageOffset = { 0, 0, 0 },
+      .imageExtent = { this->extent.width, this->extent.height, 1 },
+    };
+    vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      this->slots[index].buffer, 1, &region);
+    // And the copy visible to the host once the fence of the frame is signaled.
+    VkBufferMemoryBarrier bufferBarrier = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .buffer = this->slots[index].buffer,
+      .offset = 0,
+      .size = VK_WHOLE_SIZE,
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &bufferBarrier, 0, nullptr);
+  }
+
+  /**
+   * Hand the buffers of the frames before `completedFrames`, done on the GPU, to the encoders.
+   * Called with FrameRing::completedFrames after each begin().
+   */
+  void collect(uint64_t completedFrames) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      for (size_t index = 0; index < this->slots.size(); ++index) {
+        Slot &slot = this->slots[index];
+        if (slot.state == State::InFlight && slot.frameNumber < completedFrames) {
+          slot.state = State::Encoding;
+          this->ready.push_back(index);
+        }
+      }
+    }
+    this->changed.notify_all();
+  }
+
+  /**
+   * Encode everything recorded, the GPU being idle, and wait for it to be on disk. The first
+   * encoding error is rethrown here.
+   */
+  void finish() {
+    this->collect(UINT64_MAX);
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->changed.wait(lock, [this]() { return this->inFlight == 0 || this->error != nullptr; });
+    this->end = std::chrono::steady_clock::now();
+    if (this->error != nullptr) {
+      std::rethrow_exception(this->error);
+    }
+  }
+
+  /**
+   * Frames and MiB per second from the first recorded frame to the last written one, and the
+   * latency from recording the copy to the bytes being handed to the OS. Only valid after
+   * finish().
+   */
+  void report(std::ostream &out) const {
+    double elapsed = this->elapsedMilliseconds();
+    out << std::fixed << std::setprecision(3) << "captured " << this->framesCaptured
+        << " frames to " << this->directory << ": " << this->framesPerSecond() << " fps, "
+        << this->mebibytesPerSecond() << " MiB/s over " << elapsed << " ms" << '\n'
+        << "  latency p50 " << this->latencies.percentile(50) << " ms, p99 "
+        << this->latencies.percentile(99) << " ms, max " << this->latencies.percentile(100)
+        << " ms" << '\n'
+        << "  " << this->stalls << " stalls waiting for a free buffer, " << this->stallMilliseconds
+        << " ms" << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+  }
+
+  double elapsedMilliseconds() const {
+    return std::chrono::duration<double, std::milli>(this->end - this->start).count();
+  }
+
+  double framesPerSecond() const {
+    double elapsed = this->elapsedMilliseconds();
+    return elapsed > 0.0 ? this->framesCaptured * 1000.0 / elapsed : 0.0;
+  }
+
+  double mebibytesPerSecond() const {
+    double elapsed = this->elapsedMilliseconds();
+    return elapsed > 0.0 ? this->bytesWritten / (1024.0 * 1024.0) * 1000.0 / elapsed : 0.0;
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  // Statistics, only read after finish().
+  uint64_t framesCaptured = 0;
+  uint64_t bytesWritten = 0;
+  uint64_t stalls = 0;
+  double stallMilliseconds = 0.0;
+  // From recording the copy to the encoded frame written, in milliseconds.
+  FrameStats latencies;
+
+private:
+  enum class State {
+    Free,
+    // Recorded, the GPU may not be done with it yet.
+    InFlight,
+    // Queued for or being written by an encoder.
+    Encoding,
+  };
+
+  struct Slot {
+    UniqueBuffer buffer;
+    Allocation memory;
+    bool coherent = false;
+    State state = State::Free;
+    uint64_t frameNumber = 0;
+    std::chrono::steady_clock::time_point submitted;
+  };
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->changed.notify_all();
+    for (auto &thread: this->encoders) {
+      thread.join();
+    }
+    this->encoders.clear();
+  }
+
+  void encode() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+      this->changed.wait(lock, [this]() { return this->stopping || !this->ready.empty(); });
+      if (this->ready.empty()) {
+        return;
+      }
+      size_t index = this->ready.front();
+      this->ready.pop_front();
+      // The slot is ours until it is freed, no other thread touches it.
+      Slot &slot = this->slots[index];
+      lock.unlock();
+
+      std::exception_ptr error;
+      try {
+        this->write(slot);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      auto now = std::chrono::steady_clock::now();
+
+      lock.lock();
+      if (error != nullptr && this->error == nullptr) {
+        this->error = error;
+      }
+      slot.state = State::Free;
+      --this->inFlight;
+      ++this->framesCaptured;
+      this->bytesWritten += this->frameSize;
+      this->latencies.record(
+        std::chrono::duration<double, std::milli>(now - slot.submitted).count());
+      this->changed.notify_all();
+    }
+  }
+
+  void write(const Slot &slot) {
+    // Host cached memory is usually not coherent: the CPU caches may hold stale lines.
+    if (!slot.coherent) {
+      VkDeviceSize offset = slot.memory.offset / this->nonCoherentAtomSize
+        * this->nonCoherentAtomSize;
+      VkDeviceSize end = (slot.memory.offset + this->frameSize + this->nonCoherentAtomSize - 1)
+        / this->nonCoherentAtomSize * this->nonCoherentAtomSize;
+      // Rounding up must not go past the memory object, whose size needs not be a multiple of the
+      // atom: the range then extends to its end, which VK_WHOLE_SIZE always allows.
+      VkMappedMemoryRange range = {
+        .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = slot.memory.memory,
+        .offset = offset,
+        .size = end >= slot.memory.memorySize ? VK_WHOLE_SIZE : end - offset,
+      };
+      vkInvalidateMappedMemoryRanges(this->device, 1, &range);
+    }
+    const uint8_t *pixels = static_cast<const uint8_t *>(slot.memory.mapped);
+    if (this->format == CaptureFormat::Raw) {
+      memcpy(this->mappedFile + slot.frameNumber * this->frameSize, pixels, this->frameSize);
+      return;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/frame_%06llu.png",
+      static_cast<unsigned long long>(slot.frameNumber));
+    writeFileAtomically(this->directory + name,
+      encodePng(this->extent.width, this->extent.height, pixels));
+  }
+
+  DeviceMemoryAllocator &allocator;
+  VkDeviceSize nonCoherentAtomSize;
+  VkExtent2D extent;
+  CaptureFormat format;
+  std::string directory;
+  VkDeviceSize frameSize;
+  // The raw file, mapped whole.
+  uint8_t *mappedFile = nullptr;
+  size_t mappedSize = 0;
+  uint64_t maxFrames = 0;
+  std::vector<std::thread> encoders;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  // Everything below is protected by the mutex, and so are the states of the slots.
+  std::vector<Slot> slots;
+  std::deque<size_t> ready;
+  // Slots recorded and not written yet.
+  uint32_t inFlight = 0;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+  std::exception_ptr error;
+  bool stopping = false;
+};
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "handles.hpp"
+#include "memory.hpp"
+#include "shaders.hpp"
+
+/**
+ * A compute pipeline with a single descriptor set and an optional push constant block, both laid
+ * out as the shader declares them (see ShaderReflection).
+ */
+class ComputePipeline {
+public:
+  ComputePipeline(VkDevice device, const Shader &shader, VkPipelineCache pipelineCache,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks) {
+    const ShaderReflection &reflection = shader.reflection;
+    if (reflection.stage != VK_SHADER_STAGE_COMPUTE_BIT) {
+      throw std::runtime_error(shader.path + " is not a compute shader!");
+    }
+    if (reflection.sets.size() > 1 ||
+        (reflection.sets.size() == 1 && !reflection.sets.contains(0))) {
+      throw std::runtime_error(shader.path + " uses other descriptor sets than set 0!");
+    }
+    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = reflection.layoutBindings(0);
+    this->pushConstantSize = reflection.pushConstantSize;
+    VkDescriptorSetLayoutCreateInfo setLayoutInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(layoutBindings.size()),
+      .pBindings = layoutBindings.data(),
+    };
+    this->setLayout = createDeviceChild<UniqueDescriptorSetLayout>(vkCreateDescriptorSetLayout,
+      device, setLayoutInfo, allocationCallbacks, "compute descriptor set layout");
+
+    VkPushConstantRange pushConstantRange = {
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .offset = 0,
+      .size = this->pushConstantSize,
+    };
+    VkPipelineLayoutCreateInfo layoutInfo = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount = 1,
+      .pSetLayouts = this->setLayout.address(),
+      .pushConstantRangeCount = this->pushConstantSize > 0 ? 1u : 0u,
+      .pPushConstantRanges = &pushConstantRange,
+    };
+    this->layout = createDeviceChild<UniquePipelineLayout>(vkCreatePipelineLayout, device,
+      layoutInfo, allocationCallbacks, "compute pipeline layout");
+
+    // The pipeline keeps what it needs from the module.
+    UniqueShaderModule module(shader.createModule(device, allocationCallbacks),
+      { .device = device, .allocationCallbacks = allocationCallbacks });
+
+    VkComputePipelineCreateInfo pipelineInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+        .module = module,
+        .pName = "main",
+      },
+      .layout = this->layout,
+    };
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, allocationCallbacks,
+        &pipeline) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create compute pipeline!");
+    }
+    this->pipeline = UniquePipeline(pipeline,
+      { .device = device, .allocationCallbacks = allocationCallbacks });
+  }
+
+  ComputePipeline(const ComputePipeline &) = delete;
+  ComputePipeline &operator=(const ComputePipeline &) = delete;
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  UniqueDescriptorSetLayout setLayout;
+  UniquePipelineLayout layout;
+  UniquePipeline pipeline;
+  // Of the push constant block of the shader, to check it against what is pushed.
+  uint32_t pushConstantSize = 0;
+};
+
+/**
+ * Submits compute work to a queue of its own, in parallel with the graphics queue. Like FrameRing,
+ * each slot has its own command pool and fence, so the CPU records the next dispatch while the GPU
+ * runs the previous ones.
+ *
+ * Nothing orders these submissions against the graphics queue: work shared between the two needs
+ * semaphores.
+ */
+class ComputeQueue {
+public:
+  ComputeQueue(VkDevice device, VkQueue queue, uint32_t queueFamilyIndex,
+    uint32_t graphicsQueueFamilyIndex, uint32_t slotCount,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), queue(queue),
+      queueFamilyIndex(queueFamilyIndex), graphicsQueueFamilyIndex(graphicsQueueFamilyIndex) {
+    this->slots.resize(std::max(slotCount, 1u));
+    for (auto &slot: this->slots) {
+      VkCommandPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = queueFamilyIndex,
+      };
+      slot.commandPool = createDeviceChild<UniqueCommandPool>(vkCreateCommandPool, device,
+        poolInfo, allocationCallbacks, "compute command pool");
+      VkCommandBufferAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = slot.commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+      };
+      if (vkAllocateCommandBuffers(device, &allocInfo, &slot.commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate compute command buffer!");
+      }
+      VkFenceCreateInfo fenceInfo = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+      };
+      slot.fence = createDeviceChild<UniqueFence>(vkCreateFence, device, fenceInfo,
+        allocationCallbacks, "compute fence");
+    }
+  }
+
+  ~ComputeQueue() {
+    this->waitIdle();
+  }
+
+  ComputeQueue(const ComputeQueue &) = delete;
+  ComputeQueue &operator=(const ComputeQueue &) = delete;
+
+  /**
+   * Whether compute runs on its own queue family.
+   */
+  bool dedicated() const {
+    return this->queueFamilyIndex != this->graphicsQueueFamilyIndex;
+  }
+
+  /**
+   * Wait for the next slot to be free, then reset and begin its command buffer.
+   */
+  VkCommandBuffer begin() {
+    Slot &slot = this->slots[this->next % this->slots.size()];
+    vkWaitForFences(this->device, 1, slot.fence.address(), VK_TRUE, UINT64_MAX);
+    vkResetCommandPool(this->device, slot.commandPool, 0);
+    VkCommandBufferBeginInfo beginInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    if (vkBeginCommandBuffer(slot.commandBuffer, &beginInfo) != VK_SUCCESS) {
+      throw std::runtime_error("failed to begin recording compute command buffer!");
+    }
+    return slot.commandBuffer;
+  }
+
+  /**
+   * End and submit the command buffer returned by begin().
+   */
+  void submit() {
+    Slot &slot = this->slots[this->next++ % this->slots.size()];
+    if (vkEndCommandBuffer(slot.commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record compute command buffer!");
+    }
+    VkSubmitInfo submitInfo = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &slot.commandBuffer,
+    };
+    vkResetFences(this->device, 1, slot.fence.address());
+    if (vkQueueSubmit(this->queue, 1, &submitInfo, slot.fence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to submit compute command buffer!");
+    }
+  }
+
+  /**
+   * Index of the slot of the command buffer being recorded, between begin() and submit().
+   */
+  uint32_t slot() const {
+    return this->next % this->slots.size();
+  }
+
+  void waitIdle() {
+    for (auto &slot: this->slots) {
+      vkWaitForFences(this->device, 1, slot.fence.address(), VK_TRUE, UINT64_MAX);
+    }
+  }
+
+private:
+  struct Slot {
+    // Destroying the pool also frees the command buffer.
+    UniqueCommandPool commandPool;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    UniqueFence fence;
+  };
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  VkQueue queue;
+  std::vector<Slot> slots;
+  uint64_t next = 0;
+
+public:
+  uint32_t queueFamilyIndex;
+  uint32_t graphicsQueueFamilyIndex;
+};
+
+/**
+ * Particles pulled towards the origin, integrated by shaders/particles.comp. Used as a compute
+ * workload independent from the triangle pass.
+ *
+ * The particle buffer is shared by the compute and the graphics queue families, so that the
+ * benchmark can record the same dispatch on either: concurrent sharing saves ownership transfers
+ * between the modes.
+ */
+class ParticleSimulation {
+public:
+  // Matches the push constant block of the shader.
+  struct Parameters {
+    float deltaTime;
+    uint32_t count;
+    uint32_t iterations;
+    uint32_t reset;
+  };
+  // Matches local_size_x in the shader.
+  static constexpr uint32_t workgroupSize = 256;
+
+  ParticleSimulation(VkDevice device, DeviceMemoryAllocator &allocator, const Shader &shader,
+    VkPipelineCache pipelineCache, const std::vector<uint32_t> &queueFamilies,
+    uint32_t particleCount, uint32_t iterations,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      particleCount(particleCount), iterations(iterations),
+      pipeline(device, shader, pipelineCache, allocationCallbacks) {
+    if (this->pipeline.pushConstantSize != sizeof(Parameters)) {
+      throw std::runtime_error("the push constants of " + shader.path + " do not match!");
+    }
+    // A position and a velocity, both vec4.
+    VkBufferCreateInfo bufferInfo = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = VkDeviceSize(particleCount) * 2 * 4 * sizeof(float),
+      .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      .sharingMode = queueFamilies.size() > 1
+        ? VK_SHARING_MODE_CONCURRENT
+        : VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = static_cast<uint32_t>(queueFamilies.size()),
+      .pQueueFamilyIndices = queueFamilies.data(),
+    };
+    this->buffer = createDeviceChild<UniqueBuffer>(vkCreateBuffer, device, bufferInfo,
+      allocationCallbacks, "particle buffer");
+    this->memory = allocator.allocateBuffer(this->buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VkDescriptorPoolSize poolSize = {
+      .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 1,
+    };
+    VkDescriptorPoolCreateInfo poolInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = 1,
+      .poolSizeCount = 1,
+      .pPoolSizes = &poolSize,
+    };
+    this->descriptorPool = createDeviceChild<UniqueDescriptorPool>(vkCreateDescriptorPool,
+      device, poolInfo, allocationCallbacks, "particle descriptor pool");
+    VkDescriptorSetAllocateInfo allocInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = this->descriptorPool,
+      .descriptorSetCount = 1,
+      .pSetLayouts = this->pipeline.setLayout.address(),
+    };
+    if (vkAllocateDescriptorSets(device, &allocInfo, &this->descriptorSet) != VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate particle descriptor set!");
+    }
+    VkDescriptorBufferInfo bufferDescriptor = {
+      .buffer = this->buffer,
+      .offset = 0,
+      .range = VK_WHOLE_SIZE,
+    };
+    VkWriteDescriptorSet write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = this->descriptorSet,
+      .dstBinding = 0,
+      .descriptorCount = 1,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .pBufferInfo = &bufferDescriptor,
+    };
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+  }
+
+  ~ParticleSimulation() {
+    // The buffer goes before the memory bound to it.
+    this->buffer.reset();
+    this->allocator.free(this->memory);
+  }
+
+  ParticleSimulation(const ParticleSimulation &) = delete;
+  ParticleSimulation &operator=(const ParticleSimulation &) = delete;
+
+  /**
+   * Record one simulation step. The barrier first waits for the step recorded before, on this
+   * queue: barriers cover everything submitted earlier to the same queue.
+   */
+  void record(VkCommandBuffer commandBuffer, float deltaTime) {
+    VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    Parameters parameters = {
+      .deltaTime = deltaTime,
+      .count = this->particleCount,
+      .iterations = this->iterations,
+      .reset = this->initialized ? 0u : 1u,
+    };
+    this->initialized = true;
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->pipeline.pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->pipeline.layout,
+      0, 1, &this->descriptorSet, 0, nullptr);
+    vkCmdPushConstants(commandBuffer, this->pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+      sizeof(parameters), &parameters);
+    vkCmdDispatch(commandBuffer, (this->particleCount + workgroupSize - 1) / workgroupSize, 1, 1);
+  }
+
+private:
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  uint32_t particleCount;
+  uint32_t iterations;
+  ComputePipeline pipeline;
+  UniqueBuffer buffer;
+  Allocation memory;
+  UniqueDescriptorPool descriptorPool;
+  VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+  // Whether a step was recorded, the first one initializes the particles.
+  bool initialized = false;
+};
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+/**
+ * A bounded queue any number of threads push to without locking, drained by a single consumer.
+ * Each cell carries a sequence number telling whether it is free for the producer claiming its
+ * position, or filled for the consumer (D. Vyukov's bounded queue). A full queue rejects the push
+ * instead of waiting, producers never block.
+ */
+template<typename T>
+class MessageRing {
+public:
+  // `capacity` must be a power of 2.
+  explicit MessageRing(size_t capacity) : mask(capacity - 1), cells(new Cell[capacity]) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+      throw std::runtime_error("message ring capacity must be a power of 2!");
+    }
+    for (size_t idx = 0; idx < capacity; ++idx) {
+      this->cells[idx].sequence.store(idx, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Fill the next free cell with `fill(T &)`. Returns false if the ring is full.
+   */
+  template<typename F>
+  bool push(F &&fill) {
+    size_t position = this->enqueuePosition.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = &this->cells[position & this->mask];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+      if (difference == 0) {
+        if (this->enqueuePosition.compare_exchange_weak(position, position + 1,
+            std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        // The consumer has not freed the cell since the previous lap.
+        return false;
+      } else {
+        // Another producer claimed this position.
+        position = this->enqueuePosition.load(std::memory_order_relaxed);
+      }
+    }
+    fill(cell->value);
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Move the oldest value out. Returns false if the ring is empty. Single consumer only.
+   */
+  bool pop(T &value) {
+    Cell &cell = this->cells[this->dequeuePosition & this->mask];
+    if (cell.sequence.load(std::memory_order_acquire) != this->dequeuePosition + 1) {
+      return false;
+    }
+    value = cell.value;
+    // Free for the producer of the next lap.
+    cell.sequence.store(this->dequeuePosition + this->mask + 1, std::memory_order_release);
+    ++this->dequeuePosition;
+    return true;
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  size_t mask;
+  std::unique_ptr<Cell[]> cells;
+  // On their own cache lines, producers and the consumer would otherwise keep stealing them.
+  alignas(64) std::atomic<size_t> enqueuePosition = 0;
+  alignas(64) size_t dequeuePosition = 0;
+};
+
+/**
+ * Handles the messages of the debug utils messenger away from the threads emitting them.
+ *
+ * The messenger callback runs on whatever thread called into the driver, and the application waits
+ * for it to return. It only filters the message, then copies it into a MessageRing, truncated to
+ * a fixed size so that nothing is allocated. A background thread drains the ring:
+ *   - performance warnings are counted per message ID rather than printed, see report()
+ *   - other messages are rate limited per message ID: at most `burst` of them per second, the
+ *     number suppressed is printed when the next second starts
+ *   - what remains is written to std::cerr, flushed once per batch rather than once per line
+ * Messages arriving while the ring is full are dropped and counted.
+ *
+ * Severity and type filters can be changed at any time.
+ */
+class DebugMessages {
+public:
+  static constexpr size_t ringCapacity = 1024;
+  // Messages printed per ID and per second before the rest is suppressed.
+  static constexpr uint32_t burst = 5;
+
+  struct Message {
+    VkDebugUtilsMessageSeverityFlagBitsEXT severity;
+    VkDebugUtilsMessageTypeFlagsEXT type;
+    int32_t idNumber;
+    char idName[64];
+    char text[448];
+  };
+
+  DebugMessages(VkDebugUtilsMessageSeverityFlagsEXT severities,
+    VkDebugUtilsMessageTypeFlagsEXT types)
+    : ring(ringCapacity), severities(severities), types(types),
+      drainer([this]() { this->drain(); }) {}
+
+  ~DebugMessages() {
+    this->stop();
+  }
+
+  DebugMessages(const DebugMessages &) = delete;
+  DebugMessages &operator=(const DebugMessages &) = delete;
+
+  void setSeverities(VkDebugUtilsMessageSeverityFlagsEXT severities) {
+    this->severities.store(severities, std::memory_order_relaxed);
+  }
+
+  void setTypes(VkDebugUtilsMessageTypeFlagsEXT types) {
+    this->types.store(types, std::memory_order_relaxed);
+  }
+
+  /**
+   * Called from the messenger callback, on any thread.
+   */
+  void push(VkDebugUtilsMessageSeverityFlagBitsEXT severity, VkDebugUtilsMessageTypeFlagsEXT type,
+    const VkDebugUtilsMessengerCallbackDataEXT *data) {
+    if (!(type & this->types.load(std::memory_order_relaxed))) {
+      return;
+    }
+    // Performance warnings are counted whatever their severity.
+    if (!(type & VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT) &&
+        !(severity & this->severities.load(std::memory_order_relaxed))) {
+      return;
+    }
+    bool pushed = this->ring.push([&](Message &message) {
+      message.severity = severity;
+      message.type = type;
+      message.idNumber = data->messageIdNumber;
+      copyTruncated(message.idName, sizeof(message.idName), data->pMessageIdName);
+      copyTruncated(message.text, sizeof(message.text), data->pMessage);
+    });
+    if (!pushed) {
+      this->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Drain what is left and stop the background thread. The messenger must be destroyed first.
+   */
+  void stop() {
+    if (this->drainer.joinable()) {
+      this->stopping.store(true, std::memory_order_release);
+      this->drainer.join();
+    }
+  }
+
+  /**
+   * Print the performance warning counters and how many messages were suppressed or dropped.
+   * Only meaningful once stopped.
+   */
+  void report(std::ostream &out) const {
+    out << "debug messages: " << this->printed << " printed, " << this->suppressed
+        << " rate limited, " << this->dropped.load(std::memory_order_relaxed)
+        << " dropped on a full ring" << '\n';
+    out << "performance warnings: " << this->performance.size() << " distinct" << '\n';
+    for (auto &[id, counter]: this->performance) {
+      out << "  " << counter.count << "x " << id << ": " << counter.text << '\n';
+    }
+    out << std::flush;
+  }
+
+private:
+  struct Limiter {
+    std::chrono::steady_clock::time_point windowStart;
+    uint32_t printed = 0;
+    uint64_t suppressed = 0;
+  };
+
+  struct Counter {
+    uint64_t count = 0;
+    // The first message with this ID.
+    std::string text;
+  };
+
+  static void copyTruncated(char *destination, size_t size, const char *source) {
+    if (source == nullptr) {
+      destination[0] = '\0';
+      return;
+    }
+    size_t length = strnlen(source, size);
+    if (length < size) {
+      memcpy(destination, source, length + 1);
+    } else {
+      memcpy(destination, source, size - 4);
+      memcpy(destination + size - 4, "...", 4);
+    }
+  }
+
+  static const char *severityName(VkDebugUtilsMessageSeverityFlagBitsEXT severity) {
+    switch (severity) {
+      case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT: return "verbose";
+      case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT: return "info";
+      case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT: return "warning";
+      case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT: return "error";
+      default: return "unknown";
+    }
+  }
+
+  void drain() {
+    std::string output;
+    Message message;
+    while (true) {
+      // Read before draining, so that nothing pushed before stop() is missed.
+      bool stopping = this->stopping.load(std::memory_order_acquire);
+      auto now = std::chrono::steady_clock::now();
+      while (this->ring.pop(message)) {
+        this->handle(message, now, output);
+      }
+      for (auto &[id, limiter]: this->limiters) {
+        this->flushSuppressed(id, limiter, now, stopping, output);
+      }
+      if (!output.empty()) {
+        std::cerr << output << std::flush;
+        output.clear();
+      }
+      if (stopping) {
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+  }
+
+  void handle(const Message &message, std::chrono::steady_clock::time_point now,
+    std::string &output) {
+    std::string id = message.idName[0] != '\0'
+      ? std::string(message.idName)
+      : std::to_string(message.idNumber);
+    if (message.type & VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT) {
+      Counter &counter = this->performance[id];
+      if (counter.count++ == 0) {
+        counter.text = message.text;
+      }
+      return;
+    }
+
+    Limiter &limiter = this->limiters[id];
+    if (now - limiter.windowStart >= std::chrono::seconds(1)) {
+      this->flushSuppressed(id, limiter, now, true, output);
+      limiter.windowStart = now;
+      limiter.printed = 0;
+    }
+    if (limiter.printed >= burst) {
+      ++limiter.suppressed;
+      ++this->suppressed;
+      return;
+    }
+    ++limiter.printed;
+    ++this->printed;
+    output += "validation layer (";
+    output += severityName(message.severity);
+    output += "): ";
+    output += message.text;
+    output += '\n';
+  }
+
+  /**
+   * Say how many messages with this ID were suppressed, once their window is over or when asked.
+   */
+  void flushSuppressed(const std::string &id, Limiter &limiter,
+    std::chrono::steady_clock::time_point now, bool force, std::string &output) {
+    if (limiter.suppressed == 0 ||
+        (!force && now - limiter.windowStart < std::chrono::seconds(1))) {
+      return;
+    }
+    output += "validation layer: " + std::to_string(limiter.suppressed) + " more " + id
+      + " messages suppressed\n";
+    limiter.suppressed = 0;
+  }
+
+  MessageRing<Message> ring;
+  std::atomic<VkDebugUtilsMessageSeverityFlagsEXT> severities;
+  std::atomic<VkDebugUtilsMessageTypeFlagsEXT> types;
+  std::atomic<uint64_t> dropped = 0;
+  std::atomic<bool> stopping = false;
+  // Only touched by the drain thread, or once it is stopped.
+  std::map<std::string, Limiter> limiters;
+  std::map<std::string, Counter> performance;
+  uint64_t printed = 0;
+  uint64_t suppressed = 0;
+  // Started last, once everything it uses is initialized.
+  std::thread drainer;
+};
+
+/**
+ * Parse a minimum severity, "verbose", "info", "warning" or "error", into the mask of the
+ * severities at least as high.
+ */
+inline VkDebugUtilsMessageSeverityFlagsEXT parseMinimumSeverity(const std::string &name) {
+  VkDebugUtilsMessageSeverityFlagsEXT all = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT
+    | VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT
+    | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT
+    | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+  if (name == "verbose") {
+    return all;
+  } else if (name == "info") {
+    return all & ~VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT;
+  } else if (name == "warning") {
+    return VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT
+      | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+  } else if (name == "error") {
+    return VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+  }
+  throw std::runtime_error("unknown debug message severity " + name);
+}
+
+/**
+ * Parse a comma separated list of "general", "validation" and "performance" into a type mask.
+ */
+inline VkDebugUtilsMessageTypeFlagsEXT parseMessageTypes(const std::string &list) {
+  VkDebugUtilsMessageTypeFlagsEXT types = 0;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = std::min(list.find(',', start), list.size());
+    std::string name = list.substr(start, end - start);
+    if (name == "general") {
+      types |= VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT;
+    } else if (name == "validation") {
+      types |= VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT;
+    } else if (name == "performance") {
+      types |= VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+    } else {
+      throw std::runtime_error("unknown debug message type " + name);
+    }
+    start = end + 1;
+  }
+  return types;
+}
@@ -0,0 +1,483 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "handles.hpp"
+#include "memory.hpp"
+
+/**
+ * Where the per-draw data of the mesh comes from, see recordDraws:
+ *   Push      Push constants, which hold little but cost nothing to bind.
+ *   Bindless  The per-frame UniformArena, found through the global descriptor array of
+ *             BindlessTable with an index and an offset pushed per draw. The set is bound once.
+ *   Cached    The per-frame UniformArena, through a dynamic uniform buffer descriptor bound per
+ *             draw from a DescriptorSetCache. What devices without descriptor indexing use.
+ */
+enum class DrawData {
+  Push,
+  Bindless,
+  Cached,
+};
+
+inline const char *drawDataName(DrawData drawData) {
+  switch (drawData) {
+    case DrawData::Bindless:
+      return "bindless";
+    case DrawData::Cached:
+      return "cached";
+    default:
+      return "push";
+  }
+}
+
+inline DrawData parseDrawData(const std::string &name) {
+  for (DrawData drawData: { DrawData::Push, DrawData::Bindless, DrawData::Cached }) {
+    if (name == drawDataName(drawData)) {
+      return drawData;
+    }
+  }
+  throw std::runtime_error("unknown draw data " + name + ", expected push, bindless or cached");
+}
+
+/**
+ * The descriptor indexing features BindlessTable needs. `Features` is either
+ * VkPhysicalDeviceVulkan12Features or VkPhysicalDeviceDescriptorIndexingFeatures, from
+ * VK_EXT_descriptor_indexing: they name the features the same.
+ */
+template<typename Features>
+bool supportsBindless(const Features &features) {
+  return features.runtimeDescriptorArray && features.descriptorBindingPartiallyBound
+    && features.descriptorBindingUpdateUnusedWhilePending
+    && features.descriptorBindingSampledImageUpdateAfterBind
+    && features.descriptorBindingStorageBufferUpdateAfterBind
+    && features.shaderSampledImageArrayNonUniformIndexing;
+}
+
+template<typename Features>
+void enableBindless(Features &features) {
+  features.runtimeDescriptorArray = VK_TRUE;
+  features.descriptorBindingPartiallyBound = VK_TRUE;
+  features.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+  features.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+  features.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+  features.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+}
+
+/**
+ * A single descriptor set holding every texture and every storage buffer the shaders may read,
+ * in two large arrays. Shaders index them with what the draw provides, so that the set is bound
+ * once per command buffer rather than once per draw.
+ *
+ * The set is created update after bind: adding a resource does not invalidate the command buffers
+ * the set is bound in, and entries that no frame in flight uses can be written while those frames
+ * execute. The arrays are partially bound, the entries never written are never read.
+ *
+ * Not thread safe, resources are added and removed from the thread recording the frames.
+ */
+class BindlessTable {
+public:
+  static constexpr uint32_t textureBinding = 0;
+  static constexpr uint32_t bufferBinding = 1;
+
+  BindlessTable(VkDevice device, uint32_t textureCapacity, uint32_t bufferCapacity,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), textureCapacity(textureCapacity),
+      bufferCapacity(bufferCapacity) {
+    VkDescriptorSetLayoutBinding bindings[] = {
+      {
+        .binding = textureBinding,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = textureCapacity,
+        .stageFlags = VK_SHADER_STAGE_ALL,
+      },
+      {
+        .binding = bufferBinding,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = bufferCapacity,
+        .stageFlags = VK_SHADER_STAGE_ALL,
+      },
+    };
+    VkDescriptorBindingFlags flags = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT
+      | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT
+      | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+    VkDescriptorBindingFlags bindingFlags[] = { flags, flags };
+    VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+      .bindingCount = 2,
+      .pBindingFlags = bindingFlags,
+    };
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .pNext = &flagsInfo,
+      .flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+      .bindingCount = 2,
+      .pBindings = bindings,
+    };
+    this->layout = createDeviceChild<UniqueDescriptorSetLayout>(vkCreateDescriptorSetLayout,
+      device, layoutInfo, allocationCallbacks, "bindless descriptor set layout");
+
+    VkDescriptorPoolSize poolSizes[] = {
+      { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, textureCapacity },
+      { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, bufferCapacity },
+    };
+    VkDescriptorPoolCreateInfo poolInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+      .maxSets = 1,
+      .poolSizeCount = 2,
+      .pPoolSizes = poolSizes,
+    };
+    this->pool = createDeviceChild<UniqueDescriptorPool>(vkCreateDescriptorPool, device,
+      poolInfo, allocationCallbacks, "bindless descriptor pool");
+    VkDescriptorSetAllocateInfo allocInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = this->pool,
+      .descriptorSetCount = 1,
+      .pSetLayouts = this->layout.address(),
+    };
+    if (vkAllocateDescriptorSets(device, &allocInfo, &this->set) != VK_SUCCESS) {
+      throw std::runtime_error("failed to allocate bindless descriptor set!");
+    }
+  }
+
+  BindlessTable(const BindlessTable &) = delete;
+  BindlessTable &operator=(const BindlessTable &) = delete;
+
+  /**
+   * Write a texture to a free entry of the texture array and return its index.
+   */
+  uint32_t addTexture(VkImageView imageView, VkSampler sampler,
+    VkImageLayout imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+    uint32_t index = take(this->freeTextures, this->textureCount, this->textureCapacity,
+      "texture");
+    VkDescriptorImageInfo imageInfo = {
+      .sampler = sampler,
+      .imageView = imageView,
+      .imageLayout = imageLayout,
+    };
+    VkWriteDescriptorSet write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = this->set,
+      .dstBinding = textureBinding,
+      .dstArrayElement = index,
+      .descriptorCount = 1,
+      .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+      .pImageInfo = &imageInfo,
+    };
+    vkUpdateDescriptorSets(this->device, 1, &write, 0, nullptr);
+    return index;
+  }
+
+  /**
+   * Write a storage buffer range to a free entry of the buffer array and return its index.
+   */
+  uint32_t addBuffer(VkBuffer buffer, VkDeviceSize offset = 0,
+    VkDeviceSize range = VK_WHOLE_SIZE) {
+    uint32_t index = take(this->freeBuffers, this->bufferCount, this->bufferCapacity, "buffer");
+    VkDescriptorBufferInfo bufferInfo = {
+      .buffer = buffer,
+      .offset = offset,
+      .range = range,
+    };
+    VkWriteDescriptorSet write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = this->set,
+      .dstBinding = bufferBinding,
+      .dstArrayElement = index,
+      .descriptorCount = 1,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .pBufferInfo = &bufferInfo,
+    };
+    vkUpdateDescriptorSets(this->device, 1, &write, 0, nullptr);
+    return index;
+  }
+
+  /**
+   * Give the entries back once no frame in flight reads them anymore. The descriptors are left as
+   * they are until the entries are reused.
+   */
+  void removeTexture(uint32_t index) {
+    this->freeTextures.push_back(index);
+  }
+
+  void removeBuffer(uint32_t index) {
+    this->freeBuffers.push_back(index);
+  }
+
+  void bind(VkCommandBuffer commandBuffer, VkPipelineBindPoint bindPoint,
+    VkPipelineLayout pipelineLayout, uint32_t firstSet = 0) const {
+    vkCmdBindDescriptorSets(commandBuffer, bindPoint, pipelineLayout, firstSet, 1, &this->set, 0,
+      nullptr);
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  UniqueDescriptorSetLayout layout;
+  // Destroying the pool also frees the set.
+  UniqueDescriptorPool pool;
+  VkDescriptorSet set = VK_NULL_HANDLE;
+  uint32_t textureCapacity;
+  uint32_t bufferCapacity;
+
+private:
+  /**
+   * A free entry: one given back first, then the first one never used.
+   */
+  static uint32_t take(std::vector<uint32_t> &freeEntries, uint32_t &count, uint32_t capacity,
+    const char *kind) {
+    if (!freeEntries.empty()) {
+      uint32_t index = freeEntries.back();
+      freeEntries.pop_back();
+      return index;
+    }
+    if (count == capacity) {
+      throw std::runtime_error(std::string("the bindless ") + kind + " array is full!");
+    }
+    return count++;
+  }
+
+  // Entries used at least once, the ones past them were never written.
+  uint32_t textureCount = 0;
+  uint32_t bufferCount = 0;
+  std::vector<uint32_t> freeTextures;
+  std::vector<uint32_t> freeBuffers;
+};
+
+/**
+ * Transient uniform data, e.g. per-draw transforms, bump allocated from a host visible buffer with
+ * one region per frame in flight. A region is reset at the start of its frame, when the GPU is
+ * done with the frame that used it before: nothing is ever freed on its own.
+ *
+ * The buffer is usable both as a uniform buffer, with the offsets of the blocks as dynamic offsets,
+ * and as a storage buffer: blocks are aligned for both.
+ *
+ * allocate() may be called from several recording threads at once, begin() may not.
+ */
+class UniformArena {
+public:
+  // A block of the arena: its offset in the buffer, and where to write its data.
+  struct Block {
+    VkDeviceSize offset;
+    void *data;
+  };
+
+  UniformArena(VkDevice device, DeviceMemoryAllocator &allocator,
+    const VkPhysicalDeviceLimits &limits, uint32_t slotCount, VkDeviceSize slotSize,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      // Storage buffers are read as arrays of vec4 by the shaders, 16 bytes is the least.
+      alignment(std::max({ limits.minUniformBufferOffsetAlignment,
+        limits.minStorageBufferOffsetAlignment, VkDeviceSize(16) })),
+      slotSize(this->align(slotSize)) {
+    VkBufferCreateInfo bufferInfo = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = this->slotSize * std::max(slotCount, 1u),
+      .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    this->buffer = createDeviceChild<UniqueBuffer>(vkCreateBuffer, device, bufferInfo,
+      allocationCallbacks, "uniform arena buffer");
+    // Coherent, so that nothing needs to be flushed after writing.
+    this->memory = allocator.allocateBuffer(this->buffer,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  }
+
+  ~UniformArena() {
+    // The buffer goes before the memory bound to it.
+    this->buffer.reset();
+    this->allocator.free(this->memory);
+  }
+
+  UniformArena(const UniformArena &) = delete;
+  UniformArena &operator=(const UniformArena &) = delete;
+
+  /**
+   * Start allocating from the region of `slot`, which the GPU must be done with.
+   */
+  void begin(uint32_t slot) {
+    this->base = slot * this->slotSize;
+    this->head.store(0, std::memory_order_relaxed);
+  }
+
+  Block allocate(VkDeviceSize size) {
+    VkDeviceSize aligned = this->align(size);
+    VkDeviceSize offset = this->head.fetch_add(aligned, std::memory_order_relaxed);
+    if (offset + aligned > this->slotSize) {
+      throw std::runtime_error("the uniform arena is full!");
+    }
+    return {
+      .offset = this->base + offset,
+      .data = static_cast<char *>(this->memory.mapped) + this->base + offset,
+    };
+  }
+
+  VkDeviceSize align(VkDeviceSize size) const {
+    return (size + this->alignment - 1) / this->alignment * this->alignment;
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  VkDeviceSize alignment;
+  VkDeviceSize slotSize;
+  UniqueBuffer buffer;
+  Allocation memory;
+
+private:
+  VkDeviceSize base = 0;
+  std::atomic<VkDeviceSize> head = 0;
+};
+
+/**
+ * Descriptor sets of one layout, looked up by content: the same resources get the same set,
+ * allocated and written only the first time. What devices without descriptor indexing use instead
+ * of BindlessTable, so that the descriptor sets are not allocated and written again every frame.
+ *
+ * Sets come from pools of `setsPerPool` sets, a new pool is created when the current one is
+ * exhausted. The cached sets reference the resources they were written with: clear() the cache,
+ * once no frame in flight uses its sets, before destroying any of them.
+ *
+ * Not thread safe.
+ */
+class DescriptorSetCache {
+public:
+  // What goes into one binding of a set, buffer or image.
+  struct Resource {
+    uint32_t binding;
+    VkDescriptorType type;
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize range = 0;
+    VkImageView imageView = VK_NULL_HANDLE;
+    VkSampler sampler = VK_NULL_HANDLE;
+    VkImageLayout imageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    auto operator<=>(const Resource &) const = default;
+  };
+
+  DescriptorSetCache(VkDevice device, const std::vector<VkDescriptorSetLayoutBinding> &bindings,
+    uint32_t setsPerPool = 64, const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), setsPerPool(setsPerPool) {
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(bindings.size()),
+      .pBindings = bindings.data(),
+    };
+    this->layout = createDeviceChild<UniqueDescriptorSetLayout>(vkCreateDescriptorSetLayout,
+      device, layoutInfo, allocationCallbacks, "cached descriptor set layout");
+    for (auto &binding: bindings) {
+      auto it = std::find_if(this->poolSizes.begin(), this->poolSizes.end(),
+        [&binding](auto &size) { return size.type == binding.descriptorType; });
+      if (it == this->poolSizes.end()) {
+        this->poolSizes.push_back({ binding.descriptorType, 0 });
+        it = this->poolSizes.end() - 1;
+      }
+      it->descriptorCount += binding.descriptorCount * setsPerPool;
+    }
+  }
+
+  DescriptorSetCache(const DescriptorSetCache &) = delete;
+  DescriptorSetCache &operator=(const DescriptorSetCache &) = delete;
+
+  /**
+   * The set holding `resources`, one per binding of the layout.
+   */
+  VkDescriptorSet get(const std::vector<Resource> &resources) {
+    auto it = this->sets.find(resources);
+    if (it != this->sets.end()) {
+      ++this->hits;
+      return it->second;
+    }
+    ++this->misses;
+    VkDescriptorSet set = this->allocate();
+    std::vector<VkDescriptorBufferInfo> bufferInfos(resources.size());
+    std::vector<VkDescriptorImageInfo> imageInfos(resources.size());
+    std::vector<VkWriteDescriptorSet> writes;
+    for (size_t idx = 0; idx < resources.size(); ++idx) {
+      const Resource &resource = resources[idx];
+      bufferInfos[idx] = { resource.buffer, resource.offset, resource.range };
+      imageInfos[idx] = { resource.sampler, resource.imageView, resource.imageLayout };
+      bool image = resource.imageView != VK_NULL_HANDLE || resource.sampler != VK_NULL_HANDLE;
+      writes.push_back({
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = set,
+        .dstBinding = resource.binding,
+        .descriptorCount = 1,
+        .descriptorType = resource.type,
+        .pImageInfo = image ? &imageInfos[idx] : nullptr,
+        .pBufferInfo = image ? nullptr : &bufferInfos[idx],
+      });
+    }
+    vkUpdateDescriptorSets(this->device, writes.size(), writes.data(), 0, nullptr);
+    this->sets.emplace(resources, set);
+    return set;
+  }
+
+  /**
+   * Forget every set and give them back to their pools.
+   */
+  void clear() {
+    for (auto &pool: this->pools) {
+      vkResetDescriptorPool(this->device, pool, 0);
+    }
+    this->sets.clear();
+    this->current = 0;
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  UniqueDescriptorSetLayout layout;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+
+private:
+  /**
+   * A set from the current pool, or from the next one when it is exhausted.
+   */
+  VkDescriptorSet allocate() {
+    while (true) {
+      bool created = this->current == this->pools.size();
+      if (created) {
+        VkDescriptorPoolCreateInfo poolInfo = {
+          .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+          .maxSets = this->setsPerPool,
+          .poolSizeCount = static_cast<uint32_t>(this->poolSizes.size()),
+          .pPoolSizes = this->poolSizes.data(),
+        };
+        this->pools.push_back(createDeviceChild<UniqueDescriptorPool>(vkCreateDescriptorPool,
+          this->device, poolInfo, this->allocationCallbacks, "cached descriptor pool"));
+      }
+      VkDescriptorSetAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = this->pools[this->current],
+        .descriptorSetCount = 1,
+        .pSetLayouts = this->layout.address(),
+      };
+      VkDescriptorSet set;
+      VkResult result = vkAllocateDescriptorSets(this->device, &allocInfo, &set);
+      if (result == VK_SUCCESS) {
+        return set;
+      } else if (created ||
+          (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL)) {
+        // A new pool has room for a set, something else is wrong.
+        throw std::runtime_error("failed to allocate cached descriptor set!");
+      }
+      ++this->current;
+    }
+  }
+
+  uint32_t setsPerPool;
+  std::vector<VkDescriptorPoolSize> poolSizes;
+  // Destroying a pool also frees its sets.
+  std::vector<UniqueDescriptorPool> pools;
+  // Pools before this one are exhausted.
+  size_t current = 0;
+  std::map<std::vector<Resource>, VkDescriptorSet> sets;
+};
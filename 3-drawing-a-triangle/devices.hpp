@@ -0,0 +1,395 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "frames.hpp"
+#include "handles.hpp"
+#include "memory.hpp"
+#include "offscreen.hpp"
+#include "pipeline.hpp"
+#include "shaders.hpp"
+
+/**
+ * How DeviceScheduler spreads the frames over the devices.
+ */
+enum class DeviceSplit {
+  // Frame n goes to device n modulo the device count, whatever their speed ("alternate frame
+  // rendering").
+  Alternate,
+  // Each frame goes to the device expected to be done with it first, from its measured frame time.
+  Balanced,
+};
+
+inline const char *deviceSplitName(DeviceSplit split) {
+  return split == DeviceSplit::Alternate ? "alternate" : "balanced";
+}
+
+inline DeviceSplit parseDeviceSplit(const std::string &name) {
+  if (name == "alternate") {
+    return DeviceSplit::Alternate;
+  } else if (name == "balanced") {
+    return DeviceSplit::Balanced;
+  }
+  throw std::runtime_error("unknown device split " + name + ", expected alternate or balanced!");
+}
+
+/**
+ * A logical device of its own on one physical device, rendering the triangle into offscreen
+ * targets on a thread of its own. Frames are handed over with push() and rendered in order.
+ *
+ * Nothing is shared with the other workers: each has its own queue, memory, frame ring and
+ * pipeline, so that devices never wait for each other. Only the SPIR-V comes from the shared
+ * ShaderLibrary, while the worker is constructed. Several workers may use the same physical
+ * device, they then compete for it like separate processes would.
+ */
+class DeviceWorker {
+public:
+  DeviceWorker(VkPhysicalDevice physicalDevice, const VkPhysicalDeviceProperties &properties,
+    const VkPhysicalDeviceMemoryProperties &memoryProperties, uint32_t graphicsFamily,
+    ShaderLibrary &shaders, const std::vector<const char *> &layers, VkExtent2D extent,
+    uint32_t framesInFlight,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : allocationCallbacks(allocationCallbacks), name(properties.deviceName) {
+    float queuePriority = 1.0f;
+    VkDeviceQueueCreateInfo queueCreateInfo = {
+      .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+      .queueFamilyIndex = graphicsFamily,
+      .queueCount = 1,
+      .pQueuePriorities = &queuePriority,
+    };
+    // The triangle needs no feature nor extension.
+    VkDeviceCreateInfo createInfo = {
+      .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+      .queueCreateInfoCount = 1,
+      .pQueueCreateInfos = &queueCreateInfo,
+      .enabledLayerCount = static_cast<uint32_t>(layers.size()),
+      .ppEnabledLayerNames = layers.data(),
+    };
+    VkDevice device;
+    if (vkCreateDevice(physicalDevice, &createInfo, allocationCallbacks, &device) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create the logical device of " + this->name + "!");
+    }
+    this->device = UniqueDevice(device, { .allocationCallbacks = allocationCallbacks });
+    vkGetDeviceQueue(this->device, graphicsFamily, 0, &this->queue);
+
+    this->allocator = std::make_unique<DeviceMemoryAllocator>(this->device, memoryProperties,
+      properties.limits, DeviceMemoryAllocator::defaultPageSize, allocationCallbacks);
+    this->frames = std::make_unique<FrameRing>(this->device, graphicsFamily, framesInFlight,
+      allocationCallbacks);
+    this->renderPass = UniqueRenderPass(createRenderPass(this->device, VK_FORMAT_R8G8B8A8_UNORM,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, allocationCallbacks),
+      { .device = this->device, .allocationCallbacks = allocationCallbacks });
+    for (uint32_t idx = 0; idx < this->frames->size(); ++idx) {
+      this->targets.push_back(std::make_unique<OffscreenTarget>(this->device, *this->allocator,
+        extent, VK_FORMAT_R8G8B8A8_UNORM, allocationCallbacks));
+      this->targets.back()->createFramebuffer(this->renderPass);
+    }
+    // Pipeline caches are per device, and this one only creates a single pipeline.
+    DeviceChildDeleter<vkDestroyShaderModule> moduleDeleter = {
+      .device = this->device,
+      .allocationCallbacks = allocationCallbacks,
+    };
+    UniqueShaderModule vertexShader(shaders.get("shaders/triangle.vert.spv").createModule(
+      this->device, allocationCallbacks), moduleDeleter);
+    UniqueShaderModule fragmentShader(shaders.get("shaders/triangle.frag.spv").createModule(
+      this->device, allocationCallbacks), moduleDeleter);
+    this->pipeline = std::make_unique<GraphicsPipeline>(this->device, this->renderPass,
+      vertexShader, fragmentShader, PipelineVariant {}, VK_NULL_HANDLE, allocationCallbacks);
+
+    this->thread = std::thread([this]() { this->work(); });
+  }
+
+  ~DeviceWorker() {
+    this->stop();
+    // The ring waits for the frames in flight. The members then go in reverse order, the device
+    // last.
+    this->frames.reset();
+  }
+
+  DeviceWorker(const DeviceWorker &) = delete;
+  DeviceWorker &operator=(const DeviceWorker &) = delete;
+
+  /**
+   * Queue a frame, rendered once the frames queued before it are submitted.
+   */
+  void push(uint64_t frameNumber) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->queued.push_back(frameNumber);
+    }
+    this->changed.notify_all();
+  }
+
+  /**
+   * Block until at most `count` frames are queued and not yet begun.
+   */
+  void waitForPending(size_t count) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->changed.wait(lock, [&]() {
+      return this->queued.size() <= count || this->error != nullptr;
+    });
+  }
+
+  size_t pending() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->queued.size();
+  }
+
+  /**
+   * Smoothed time the worker spends per frame: waiting for a slot of the ring, recording and
+   * submitting. Once frames are queued ahead, the wait is for the GPU, so this converges to the
+   * time the device takes per frame. 0 until the first frame.
+   */
+  double frameMilliseconds() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->averageMilliseconds;
+  }
+
+  /**
+   * Render everything queued, wait for the GPU to be done with it and stop the thread. The first
+   * error of the thread is rethrown here.
+   */
+  void finish() {
+    this->stop();
+    this->frames->waitIdle();
+    if (this->error != nullptr) {
+      std::rethrow_exception(this->error);
+    }
+  }
+
+  const VkAllocationCallbacks *allocationCallbacks;
+  std::string name;
+  UniqueDevice device;
+  VkQueue queue = VK_NULL_HANDLE;
+  // Frames submitted so far, and the time spent on them (see frameMilliseconds). Only read once
+  // the worker is finished.
+  uint64_t framesRendered = 0;
+  double busyMilliseconds = 0.0;
+
+private:
+  // Weight of the last frame in the smoothed frame time.
+  static constexpr double smoothing = 0.1;
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->changed.notify_all();
+    if (this->thread.joinable()) {
+      this->thread.join();
+    }
+  }
+
+  void work() {
+    while (true) {
+      uint64_t frameNumber;
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->changed.wait(lock, [this]() { return this->stopping || !this->queued.empty(); });
+        // Stopping still renders what was queued.
+        if (this->queued.empty()) {
+          return;
+        }
+        frameNumber = this->queued.front();
+        this->queued.pop_front();
+      }
+      this->changed.notify_all();
+
+      auto start = std::chrono::steady_clock::now();
+      try {
+        this->render(frameNumber);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->error = std::current_exception();
+        this->queued.clear();
+        this->changed.notify_all();
+        return;
+      }
+      double milliseconds = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->averageMilliseconds = this->framesRendered == 0
+        ? milliseconds
+        : (1.0 - smoothing) * this->averageMilliseconds + smoothing * milliseconds;
+      ++this->framesRendered;
+      this->busyMilliseconds += milliseconds;
+    }
+  }
+
+  /**
+   * The headless triangle frame of HelloTriangleApplication, with the same clear color for the
+   * same frame number, so that frames look the same whichever device rendered them.
+   */
+  void render(uint64_t frameNumber) {
+    FrameContext &frame = this->frames->begin();
+    OffscreenTarget &target = *this->targets[frame.index];
+    float t = static_cast<float>(frameNumber % 256) / 255.0f;
+    VkClearValue clearColor = { .color = { .float32 = { t, 0.0f, 1.0f - t, 1.0f } } };
+    VkRenderPassBeginInfo renderPassInfo = {
+      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+      .renderPass = this->renderPass,
+      .framebuffer = target.framebuffer,
+      .renderArea = { .offset = { 0, 0 }, .extent = target.extent },
+      .clearValueCount = 1,
+      .pClearValues = &clearColor,
+    };
+    vkCmdBeginRenderPass(frame.commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBindPipeline(frame.commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+      this->pipeline->pipeline);
+    VkViewport viewport = {
+      .x = 0.0f,
+      .y = 0.0f,
+      .width = static_cast<float>(target.extent.width),
+      .height = static_cast<float>(target.extent.height),
+      .minDepth = 0.0f,
+      .maxDepth = 1.0f,
+    };
+    vkCmdSetViewport(frame.commandBuffer, 0, 1, &viewport);
+    VkRect2D scissor = { .offset = { 0, 0 }, .extent = target.extent };
+    vkCmdSetScissor(frame.commandBuffer, 0, 1, &scissor);
+    vkCmdDraw(frame.commandBuffer, 3, 1, 0, 0);
+    vkCmdEndRenderPass(frame.commandBuffer);
+    if (vkEndCommandBuffer(frame.commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record command buffer!");
+    }
+
+    VkSubmitInfo submitInfo = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &frame.commandBuffer,
+    };
+    vkResetFences(this->device, 1, &frame.inFlightFence);
+    if (vkQueueSubmit(this->queue, 1, &submitInfo, frame.inFlightFence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to submit draw command buffer to " + this->name + "!");
+    }
+    this->frames->advance();
+  }
+
+  std::unique_ptr<DeviceMemoryAllocator> allocator;
+  std::unique_ptr<FrameRing> frames;
+  UniqueRenderPass renderPass;
+  // One per frame in flight, like the headless targets of HelloTriangleApplication.
+  std::vector<std::unique_ptr<OffscreenTarget>> targets;
+  std::unique_ptr<GraphicsPipeline> pipeline;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable changed;
+  // Everything below is protected by the mutex.
+  std::deque<uint64_t> queued;
+  double averageMilliseconds = 0.0;
+  std::exception_ptr error;
+  bool stopping = false;
+};
+
+/**
+ * Hand frames to a set of DeviceWorker, split as `split` says. Each worker gets at most
+ * `maxQueued` frames ahead of what it has begun, submit() blocks beyond: the queues stay short, so
+ * that a device getting slower is noticed before it has a backlog.
+ */
+class DeviceScheduler {
+public:
+  DeviceScheduler(std::vector<std::unique_ptr<DeviceWorker>> &workers, DeviceSplit split,
+    uint32_t maxQueued)
+    : workers(workers), split(split), maxQueued(std::max(maxQueued, 1u)) {
+    if (workers.empty()) {
+      throw std::runtime_error("no device to schedule frames on!");
+    }
+  }
+
+  void submit(uint64_t frameNumber) {
+    DeviceWorker &worker = *this->workers[this->pick(frameNumber)];
+    worker.waitForPending(this->maxQueued - 1);
+    worker.push(frameNumber);
+  }
+
+  /**
+   * Wait for every worker to be done, see DeviceWorker::finish.
+   */
+  void finish() {
+    for (auto &worker: this->workers) {
+      worker->finish();
+    }
+  }
+
+  /**
+   * Frames and average frame time per worker, and the share of the frames each one took.
+   */
+  void report(std::ostream &out, double elapsedMilliseconds) const {
+    uint64_t total = 0;
+    for (auto &worker: this->workers) {
+      total += worker->framesRendered;
+    }
+    out << std::fixed << std::setprecision(3) << total << " frames on " << this->workers.size()
+        << " devices (" << deviceSplitName(this->split) << "), "
+        << (elapsedMilliseconds > 0.0 ? total * 1000.0 / elapsedMilliseconds : 0.0) << " fps"
+        << '\n';
+    for (size_t idx = 0; idx < this->workers.size(); ++idx) {
+      const DeviceWorker &worker = *this->workers[idx];
+      out << "  " << idx << " " << worker.name << ": " << worker.framesRendered << " frames ("
+          << (total > 0 ? 100.0 * worker.framesRendered / total : 0.0) << "%), "
+          << (worker.framesRendered > 0 ? worker.busyMilliseconds / worker.framesRendered : 0.0)
+          << " ms per frame" << '\n';
+    }
+    out.unsetf(std::ios_base::floatfield);
+    out.flush();
+  }
+
+private:
+  /**
+   * With the balanced split, the expected time for a worker to be done with one more frame is
+   * its queue, plus that frame, times its frame time. Workers without a frame time yet are tried
+   * first, so that every device gets measured. Until its first frame is done, a worker which
+   * already has one queued is assumed as fast as the fastest measured one, or to take 1 ms when
+   * none is measured yet, so that the shortest queue wins rather than always the first worker.
+   */
+  size_t pick(uint64_t frameNumber) {
+    if (this->split == DeviceSplit::Alternate) {
+      return frameNumber % this->workers.size();
+    }
+    std::vector<double> frameMilliseconds(this->workers.size());
+    std::vector<size_t> pending(this->workers.size());
+    double fastest = 0.0;
+    for (size_t idx = 0; idx < this->workers.size(); ++idx) {
+      frameMilliseconds[idx] = this->workers[idx]->frameMilliseconds();
+      pending[idx] = this->workers[idx]->pending();
+      if (frameMilliseconds[idx] == 0.0 && pending[idx] == 0) {
+        return idx;
+      }
+      if (frameMilliseconds[idx] > 0.0 && (fastest == 0.0 || frameMilliseconds[idx] < fastest)) {
+        fastest = frameMilliseconds[idx];
+      }
+    }
+    double estimate = fastest > 0.0 ? fastest : 1.0;
+    size_t best = 0;
+    double bestCost = 0.0;
+    for (size_t idx = 0; idx < this->workers.size(); ++idx) {
+      double cost = (pending[idx] + 1)
+        * (frameMilliseconds[idx] > 0.0 ? frameMilliseconds[idx] : estimate);
+      if (idx == 0 || cost < bestCost) {
+        best = idx;
+        bestCost = cost;
+      }
+    }
+    return best;
+  }
+
+  std::vector<std::unique_ptr<DeviceWorker>> &workers;
+  DeviceSplit split;
+  uint32_t maxQueued;
+};
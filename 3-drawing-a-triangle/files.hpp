@@ -0,0 +1,57 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Read a whole binary file. Returns an empty vector if the file does not exist or cannot be read.
+ */
+inline std::vector<char> readFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return {};
+  }
+  return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/**
+ * Create an empty file next to `path` with a name no other thread or process can be handed, and
+ * return that name. It lives in the same directory so renaming it over `path` stays atomic.
+ */
+inline std::string createTemporaryFile(const std::string &path) {
+  std::string tmpPath = path + ".XXXXXX";
+  int fd = mkstemp(tmpPath.data());
+  if (fd == -1) {
+    throw std::runtime_error("failed to create a temporary file for " + path + "!");
+  }
+  // mkstemp makes the file private to us; give it the permissions a plain ofstream would.
+  fchmod(fd, 0644);
+  close(fd);
+  return tmpPath;
+}
+
+/**
+ * Write `data` to a temporary file then rename it over `path`. rename is atomic on POSIX file
+ * systems, so a crash or a concurrent reader never sees a partially written file, and every
+ * writer gets its own temporary file so two processes saving the same path cannot interleave.
+ */
+inline void writeFileAtomically(const std::string &path, const std::vector<char> &data) {
+  std::string tmpPath = createTemporaryFile(path);
+  {
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+    if (!file) {
+      std::filesystem::remove(tmpPath);
+      throw std::runtime_error("failed to write " + path + "!");
+    }
+  }
+  std::filesystem::rename(tmpPath, path);
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "bench.hpp"
+#include "handles.hpp"
+
+/**
+ * Everything needed to record and submit one frame. While the GPU executes the commands of one
+ * frame slot, the CPU records the next one in another slot. The handles belong to the FrameRing.
+ */
+struct FrameContext {
+  // Position of this context in the ring.
+  uint32_t index;
+  // Each slot has its own pool so that resetting it does not touch the other frames in flight.
+  VkCommandPool commandPool;
+  VkCommandBuffer commandBuffer;
+  // Signaled by the GPU when the commands submitted for this slot are done.
+  VkFence inFlightFence;
+  // Signaled when the presentation engine hands us an image to render to. The semaphore signaled
+  // when rendering is done belongs to the swap chain image, see Swapchain::renderFinished.
+  VkSemaphore imageAvailable;
+  // The frame number last recorded in this slot.
+  uint64_t frameNumber;
+};
+
+/**
+ * A ring of FrameContext. The number of frames in flight bounds how far the CPU can run ahead of
+ * the GPU.
+ */
+class FrameRing {
+public:
+  FrameRing(VkDevice device, uint32_t queueFamilyIndex, uint32_t framesInFlight,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks) {
+    if (framesInFlight == 0) {
+      throw std::runtime_error("at least one frame in flight is needed!");
+    }
+
+    for (uint32_t idx = 0; idx < framesInFlight; ++idx) {
+      FrameContext frame = { .index = idx, .frameNumber = 0 };
+
+      VkCommandPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        // The command buffers are re-recorded every time the slot comes back around.
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = queueFamilyIndex,
+      };
+      this->commandPools.push_back(createDeviceChild<UniqueCommandPool>(vkCreateCommandPool,
+        device, poolInfo, allocationCallbacks, "frame command pool"));
+      frame.commandPool = this->commandPools.back();
+
+      VkCommandBufferAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = frame.commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+      };
+      if (vkAllocateCommandBuffers(device, &allocInfo, &frame.commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate frame command buffer!");
+      }
+
+      // Created signaled so that waiting on a slot never used before returns immediately.
+      VkFenceCreateInfo fenceInfo = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+      };
+      VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      };
+      this->fences.push_back(createDeviceChild<UniqueFence>(vkCreateFence, device, fenceInfo,
+        allocationCallbacks, "frame fence"));
+      frame.inFlightFence = this->fences.back();
+      this->semaphores.push_back(createDeviceChild<UniqueSemaphore>(vkCreateSemaphore, device,
+        semaphoreInfo, allocationCallbacks, "frame semaphore"));
+      frame.imageAvailable = this->semaphores.back();
+
+      this->frames.push_back(frame);
+    }
+  }
+
+  ~FrameRing() {
+    this->waitIdle();
+  }
+
+  FrameRing(const FrameRing &) = delete;
+  FrameRing &operator=(const FrameRing &) = delete;
+
+  /**
+   * Wait for the GPU to be done with the next slot, then reset its command pool and start
+   * recording its command buffer. The fence is not reset here, it is up to the caller to reset it
+   * right before submitting so that an early exit does not leave an unsignaled fence behind.
+   */
+  FrameContext &begin() {
+    FrameContext &frame = this->frames[this->frameNumber % this->frames.size()];
+    vkWaitForFences(this->device, 1, &frame.inFlightFence, VK_TRUE, UINT64_MAX);
+    // Frames are submitted in order to the same queue, so every frame up to the previous user of
+    // this slot is done.
+    if (this->frameNumber >= this->frames.size()) {
+      this->completedFrames = this->frameNumber - this->frames.size() + 1;
+    }
+    this->deletions.collect(this->completedFrames);
+    vkResetCommandPool(this->device, frame.commandPool, 0);
+    frame.frameNumber = this->frameNumber;
+
+    VkCommandBufferBeginInfo beginInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    if (vkBeginCommandBuffer(frame.commandBuffer, &beginInfo) != VK_SUCCESS) {
+      throw std::runtime_error("failed to begin recording command buffer!");
+    }
+
+    return frame;
+  }
+
+  /**
+   * Move on to the next slot. To be called once the current frame has been submitted.
+   */
+  void advance() {
+    ++this->frameNumber;
+  }
+
+  /**
+   * Block until every frame in flight is done on the GPU.
+   */
+  void waitIdle() {
+    std::vector<VkFence> fences;
+    for (auto &frame: this->frames) {
+      fences.push_back(frame.inFlightFence);
+    }
+    vkWaitForFences(this->device, fences.size(), fences.data(), VK_TRUE, UINT64_MAX);
+    this->completedFrames = this->frameNumber;
+    // No frame is being recorded between two frames, so nothing retired is in use any more.
+    this->deletions.collect(UINT64_MAX);
+  }
+
+  /**
+   * Destroy `resource`, a UniqueHandle or a std::unique_ptr, once the GPU is done with the frames
+   * which might use it, without waiting for them. It may be retired while a frame is recorded, so
+   * that frame is counted as a user too.
+   */
+  template <typename Resource>
+  void retire(Resource &&resource) {
+    this->deletions.push(this->frameNumber + 1, std::forward<Resource>(resource));
+  }
+
+  uint32_t size() const {
+    return this->frames.size();
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  // Total number of frames begun so far.
+  uint64_t frameNumber = 0;
+  // Number of frames known to be done on the GPU.
+  uint64_t completedFrames = 0;
+  std::vector<FrameContext> frames;
+  // What the contexts use. Destroying a pool also frees the command buffer allocated from it.
+  std::vector<UniqueCommandPool> commandPools;
+  std::vector<UniqueFence> fences;
+  std::vector<UniqueSemaphore> semaphores;
+  // What retire() was given, destroyed as the frames complete in begin().
+  DeletionQueue deletions;
+};
+
+/**
+ * Collect frame times and report their distribution.
+ */
+class FrameStats : public Samples {
+public:
+  void report(std::ostream &out) const {
+    double mean = this->mean();
+    out << std::fixed << std::setprecision(3)
+        << this->values.size() << " frames, " << (mean > 0.0 ? 1000.0 / mean : 0.0) << " fps"
+        << '\n'
+        << "  p50 " << this->percentile(50) << " ms" << '\n'
+        << "  p90 " << this->percentile(90) << " ms" << '\n'
+        << "  p99 " << this->percentile(99) << " ms" << '\n'
+        << "  p99.9 " << this->percentile(99.9) << " ms" << '\n'
+        << "  max " << this->percentile(100) << " ms" << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+  }
+};
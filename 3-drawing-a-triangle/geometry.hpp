@@ -0,0 +1,478 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <numbers>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+#include "descriptors.hpp"
+#include "handles.hpp"
+#include "memory.hpp"
+#include "pipeline.hpp"
+#include "upload.hpp"
+
+/**
+ * A mesh as loaded or generated, at full precision. Triangles are counter-clockwise seen from the
+ * outside, the OpenGL convention most files follow.
+ */
+struct MeshData {
+  std::vector<glm::vec3> positions;
+  std::vector<glm::vec3> normals;
+  std::vector<glm::vec3> colors;
+  std::vector<uint32_t> indices;
+};
+
+/**
+ * A unit sphere made of `rings` rings of `segments` quads. Vertices on the seam and at the poles
+ * are duplicated, there are (rings + 1) * (segments + 1) of them.
+ */
+inline MeshData makeSphere(uint32_t rings, uint32_t segments) {
+  MeshData mesh;
+  for (uint32_t ring = 0; ring <= rings; ++ring) {
+    float theta = std::numbers::pi_v<float> * ring / rings;
+    for (uint32_t segment = 0; segment <= segments; ++segment) {
+      float phi = 2.0f * std::numbers::pi_v<float> * segment / segments;
+      glm::vec3 position(std::sin(theta) * std::cos(phi), std::cos(theta),
+        std::sin(theta) * std::sin(phi));
+      mesh.positions.push_back(position);
+      mesh.normals.push_back(position);
+      // The normal mapped to a color, to tell the faces apart.
+      mesh.colors.push_back(glm::vec3(position.x * 0.5f + 0.5f, position.y * 0.5f + 0.5f,
+        position.z * 0.5f + 0.5f));
+    }
+  }
+  for (uint32_t ring = 0; ring < rings; ++ring) {
+    for (uint32_t segment = 0; segment < segments; ++segment) {
+      uint32_t a = ring * (segments + 1) + segment;
+      uint32_t b = a + segments + 1;
+      // a-d on this ring, b-c on the next one down.
+      uint32_t c = b + 1;
+      uint32_t d = a + 1;
+      mesh.indices.insert(mesh.indices.end(), { a, c, b, a, d, c });
+    }
+  }
+  return mesh;
+}
+
+/**
+ * Load the triangles of a Wavefront OBJ file: `v` with an optional color, `vn`, and `f` with any
+ * number of corners (split into a fan). Texture coordinates, groups and materials are ignored.
+ * Missing normals are computed from the faces. The mesh is centered and scaled to fit a unit
+ * sphere.
+ */
+inline MeshData loadObj(const std::string &path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    throw std::runtime_error("failed to open mesh " + path + "!");
+  }
+  std::vector<glm::vec3> positions, colors, normals;
+  MeshData mesh;
+  // OBJ indexes positions and normals separately, vertices are the pairs actually used.
+  std::map<std::pair<int64_t, int64_t>, uint32_t> vertices;
+  auto vertex = [&](const std::string &corner) {
+    // "p", "p/t", "p//n" or "p/t/n", 1-based, negative counting from the end.
+    auto resolve = [](int64_t index, size_t count) {
+      int64_t resolved = index < 0 ? static_cast<int64_t>(count) + index : index - 1;
+      if (resolved < 0 || resolved >= static_cast<int64_t>(count)) {
+        throw std::runtime_error("invalid index in mesh!");
+      }
+      return resolved;
+    };
+    size_t slash = corner.find('/');
+    int64_t position = resolve(std::stoll(corner.substr(0, slash)), positions.size());
+    int64_t normal = -1;
+    size_t lastSlash = corner.rfind('/');
+    if (slash != std::string::npos && lastSlash != slash && lastSlash + 1 < corner.size()) {
+      normal = resolve(std::stoll(corner.substr(lastSlash + 1)), normals.size());
+    }
+    auto [it, inserted] = vertices.try_emplace({ position, normal }, mesh.positions.size());
+    if (inserted) {
+      mesh.positions.push_back(positions[position]);
+      mesh.colors.push_back(colors[position]);
+      mesh.normals.push_back(normal >= 0 ? normals[normal] : glm::vec3(0.0f));
+    }
+    return it->second;
+  };
+
+  bool hasNormals = false;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream in(line);
+    std::string keyword;
+    in >> keyword;
+    if (keyword == "v") {
+      glm::vec3 position(0.0f), color(1.0f);
+      in >> position.x >> position.y >> position.z;
+      // Some exporters append the vertex color.
+      in >> color.x >> color.y >> color.z;
+      positions.push_back(position);
+      colors.push_back(color);
+    } else if (keyword == "vn") {
+      glm::vec3 normal(0.0f);
+      in >> normal.x >> normal.y >> normal.z;
+      normals.push_back(normal);
+      hasNormals = true;
+    } else if (keyword == "f") {
+      std::vector<uint32_t> corners;
+      std::string corner;
+      while (in >> corner) {
+        corners.push_back(vertex(corner));
+      }
+      for (size_t idx = 2; idx < corners.size(); ++idx) {
+        mesh.indices.insert(mesh.indices.end(), { corners[0], corners[idx - 1], corners[idx] });
+      }
+    }
+  }
+  if (mesh.indices.empty()) {
+    throw std::runtime_error("no triangle in mesh " + path + "!");
+  }
+
+  if (!hasNormals) {
+    // Smooth normals: the sum of the normals of the faces around each vertex, weighted by their
+    // area, which is what the length of the cross product is.
+    for (size_t idx = 0; idx < mesh.indices.size(); idx += 3) {
+      glm::vec3 &a = mesh.positions[mesh.indices[idx]];
+      glm::vec3 &b = mesh.positions[mesh.indices[idx + 1]];
+      glm::vec3 &c = mesh.positions[mesh.indices[idx + 2]];
+      glm::vec3 normal = glm::cross(b - a, c - a);
+      for (size_t corner = 0; corner < 3; ++corner) {
+        mesh.normals[mesh.indices[idx + corner]] += normal;
+      }
+    }
+  }
+  for (auto &normal: mesh.normals) {
+    float length = glm::length(normal);
+    normal = length > 0.0f ? normal / length : glm::vec3(0.0f, 1.0f, 0.0f);
+  }
+
+  glm::vec3 lower = mesh.positions.front(), upper = mesh.positions.front();
+  for (auto &position: mesh.positions) {
+    lower = glm::min(lower, position);
+    upper = glm::max(upper, position);
+  }
+  glm::vec3 center = (lower + upper) * 0.5f;
+  float radius = 0.0f;
+  for (auto &position: mesh.positions) {
+    radius = std::max(radius, glm::length(position - center));
+  }
+  for (auto &position: mesh.positions) {
+    position = (position - center) / (radius > 0.0f ? radius : 1.0f);
+  }
+  return mesh;
+}
+
+/**
+ * Map a unit vector onto the octahedron |x| + |y| + |z| = 1, whose lower half is folded over the
+ * upper one: two components in [-1, 1] are enough to store a normal. See "A Survey of Efficient
+ * Representations for Independent Unit Vectors" (Cigolle et al. 2014). Decoded by mesh.vert.
+ */
+inline glm::vec2 encodeOctahedral(glm::vec3 normal) {
+  float sum = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+  if (sum == 0.0f) {
+    return glm::vec2(0.0f, 0.0f);
+  }
+  float x = normal.x / sum, y = normal.y / sum;
+  if (normal.z < 0.0f) {
+    return glm::vec2((1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f),
+      (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f));
+  }
+  return glm::vec2(x, y);
+}
+
+/**
+ * How vertices are laid out in the vertex buffer. Attributes are at location 0 (position),
+ * 1 (normal) and 2 (color), as mesh.vert expects them.
+ */
+struct VertexLayout {
+  // All the attributes of a vertex next to each other in a single stream, or the positions in a
+  // stream of their own followed by the other attributes. Passes which only need positions (depth,
+  // shadows) then fetch nothing else.
+  bool interleaved = true;
+  // Half float positions, octahedral normals in two snorm16 and unorm8 colors: 16 bytes per vertex
+  // instead of 36 with floats. Indices are 16-bit when the mesh has few enough vertices.
+  bool quantized = false;
+
+  static constexpr uint32_t count = 4;
+
+  /**
+   * Every layout, for the benchmark.
+   */
+  static VertexLayout all(uint32_t idx) {
+    return { .interleaved = (idx & 1) == 0, .quantized = (idx & 2) != 0 };
+  }
+
+  const char *name() const {
+    if (this->quantized) {
+      return this->interleaved ? "quantized" : "quantized-split";
+    }
+    return this->interleaved ? "interleaved" : "split";
+  }
+
+  // R16G16B16 formats are rarely supported for vertex input, half positions take 4 halves.
+  uint32_t positionSize() const {
+    return this->quantized ? 8 : 12;
+  }
+
+  uint32_t normalSize() const {
+    return this->quantized ? 4 : 12;
+  }
+
+  uint32_t colorSize() const {
+    return this->quantized ? 4 : 12;
+  }
+
+  uint32_t vertexSize() const {
+    return this->positionSize() + this->normalSize() + this->colorSize();
+  }
+
+  /**
+   * The vertex input of the pipelines drawing meshes in this layout. mesh.vert decodes the normals
+   * according to its specialization constant 0, see MeshPipeline.
+   */
+  PipelineVariant pipelineVariant() const {
+    PipelineVariant variant;
+    uint32_t attributeBinding = this->interleaved ? 0 : 1;
+    uint32_t attributeOffset = this->interleaved ? this->positionSize() : 0;
+    if (this->interleaved) {
+      variant.bindings.push_back({ 0, this->vertexSize(), VK_VERTEX_INPUT_RATE_VERTEX });
+    } else {
+      variant.bindings.push_back({ 0, this->positionSize(), VK_VERTEX_INPUT_RATE_VERTEX });
+      variant.bindings.push_back({ 1, this->normalSize() + this->colorSize(),
+        VK_VERTEX_INPUT_RATE_VERTEX });
+    }
+    variant.attributes = {
+      { 0, 0, this->quantized ? VK_FORMAT_R16G16B16A16_SFLOAT : VK_FORMAT_R32G32B32_SFLOAT, 0 },
+      { 1, attributeBinding,
+        this->quantized ? VK_FORMAT_R16G16_SNORM : VK_FORMAT_R32G32B32_SFLOAT, attributeOffset },
+      { 2, attributeBinding,
+        this->quantized ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_R32G32B32_SFLOAT,
+        attributeOffset + this->normalSize() },
+    };
+    return variant;
+  }
+
+  /**
+   * Encode the vertices: interleaved, or all the positions followed by all the other attributes.
+   */
+  std::vector<char> encode(const MeshData &mesh) const {
+    size_t vertexCount = mesh.positions.size();
+    std::vector<char> data(vertexCount * this->vertexSize());
+    char *positions = data.data();
+    char *attributes = data.data() + (this->interleaved ? this->positionSize()
+                                                        : vertexCount * this->positionSize());
+    size_t positionStride = this->interleaved ? this->vertexSize() : this->positionSize();
+    size_t attributeStride = this->interleaved ? this->vertexSize()
+                                               : this->normalSize() + this->colorSize();
+    for (size_t idx = 0; idx < vertexCount; ++idx) {
+      char *position = positions + idx * positionStride;
+      char *normal = attributes + idx * attributeStride;
+      char *color = normal + this->normalSize();
+      if (this->quantized) {
+        const glm::vec3 &p = mesh.positions[idx];
+        uint32_t halves[2] = {
+          glm::packHalf2x16(glm::vec2(p.x, p.y)),
+          glm::packHalf2x16(glm::vec2(p.z, 1.0f)),
+        };
+        memcpy(position, halves, sizeof(halves));
+        uint32_t packedNormal = glm::packSnorm2x16(encodeOctahedral(mesh.normals[idx]));
+        memcpy(normal, &packedNormal, sizeof(packedNormal));
+        uint32_t packedColor = glm::packUnorm4x8(glm::vec4(mesh.colors[idx], 1.0f));
+        memcpy(color, &packedColor, sizeof(packedColor));
+      } else {
+        memcpy(position, &mesh.positions[idx], 12);
+        memcpy(normal, &mesh.normals[idx], 12);
+        memcpy(color, &mesh.colors[idx], 12);
+      }
+    }
+    return data;
+  }
+};
+
+inline VertexLayout parseVertexLayout(const std::string &name) {
+  for (uint32_t idx = 0; idx < VertexLayout::count; ++idx) {
+    if (name == VertexLayout::all(idx).name()) {
+      return VertexLayout::all(idx);
+    }
+  }
+  throw std::runtime_error("unknown vertex layout " + name
+    + ", expected interleaved, split, quantized or quantized-split");
+}
+
+/**
+ * A mesh in a device local buffer holding the vertex streams followed by the indices, uploaded
+ * through an UploadQueue. The buffer can be drawn from once the upload is acquired by the graphics
+ * queue, like any other upload.
+ */
+class Mesh {
+public:
+  Mesh(VkDevice device, DeviceMemoryAllocator &allocator, UploadQueue &uploadQueue,
+    const MeshData &data, VertexLayout layout,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      layout(layout), vertexCount(data.positions.size()), indexCount(data.indices.size()) {
+    std::vector<char> vertices = layout.encode(data);
+    // The largest index is vertexCount - 1, so 16 bits are enough up to 65536 vertices.
+    bool shortIndices = layout.quantized && this->vertexCount <= 65536;
+    this->indexType = shortIndices ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    std::vector<char> indices(this->indexCount * (shortIndices ? 2 : 4));
+    if (shortIndices) {
+      for (uint32_t idx = 0; idx < this->indexCount; ++idx) {
+        uint16_t index = static_cast<uint16_t>(data.indices[idx]);
+        memcpy(indices.data() + idx * 2, &index, 2);
+      }
+    } else {
+      memcpy(indices.data(), data.indices.data(), indices.size());
+    }
+    this->vertexBytes = vertices.size();
+    this->indexBytes = indices.size();
+    // Attributes are read at offsets multiple of their component size, 16 covers them all.
+    this->indexOffset = (this->vertexBytes + 15) & ~VkDeviceSize(15);
+
+    VkBufferCreateInfo bufferInfo = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = this->indexOffset + this->indexBytes,
+      .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT
+             | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+             | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    this->buffer = createDeviceChild<UniqueBuffer>(vkCreateBuffer, device, bufferInfo,
+      allocationCallbacks, "mesh buffer");
+    this->memory = allocator.allocateBuffer(this->buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    uploadQueue.uploadBuffer(this->buffer, 0, vertices.data(), vertices.size(),
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+    uploadQueue.uploadBuffer(this->buffer, this->indexOffset, indices.data(), indices.size(),
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT);
+  }
+
+  ~Mesh() {
+    // The buffer goes before the memory bound to it.
+    this->buffer.reset();
+    this->allocator.free(this->memory);
+  }
+
+  Mesh(const Mesh &) = delete;
+  Mesh &operator=(const Mesh &) = delete;
+
+  /**
+   * Bind the vertex streams and the indices.
+   */
+  void bind(VkCommandBuffer commandBuffer) const {
+    VkBuffer buffers[] = { this->buffer, this->buffer };
+    VkDeviceSize offsets[] = { 0, this->vertexCount * this->layout.positionSize() };
+    vkCmdBindVertexBuffers(commandBuffer, 0, this->layout.interleaved ? 1 : 2, buffers, offsets);
+    vkCmdBindIndexBuffer(commandBuffer, this->buffer, this->indexOffset, this->indexType);
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  VertexLayout layout;
+  uint32_t vertexCount;
+  uint32_t indexCount;
+  VkIndexType indexType;
+  // Sizes of the vertex streams and of the indices in the buffer.
+  VkDeviceSize vertexBytes = 0;
+  VkDeviceSize indexBytes = 0;
+  VkDeviceSize indexOffset = 0;
+  UniqueBuffer buffer;
+  Allocation memory;
+};
+
+/**
+ * The pipeline drawing meshes in a given vertex layout with mesh.vert, which gets the transform as
+ * push constant. Instanced pipelines use mesh_instanced.vert instead, which reads a transform per
+ * instance from binding 2, after the vertex streams.
+ *
+ * Other variants of mesh.vert read the transform of each draw from the UniformArena (see
+ * DrawData): mesh_bindless.vert through the buffer array of the BindlessTable, whose layout is
+ * `setLayout`, and mesh_uniform.vert through the dynamic uniform buffer of a DescriptorSetCache.
+ */
+class MeshPipeline : public GraphicsPipeline {
+public:
+  struct PushConstants {
+    glm::mat4 transform;
+  };
+  // The push constants of mesh_bindless.vert: the index of the arena in the buffer array, and the
+  // offset of the transform in vec4.
+  struct BindlessPushConstants {
+    uint32_t buffer;
+    uint32_t element;
+  };
+
+  MeshPipeline(VkDevice device, VkRenderPass renderPass, VkShaderModule vertexShader,
+    VkShaderModule fragmentShader, VertexLayout layout, bool instanced, DrawData drawData,
+    VkDescriptorSetLayout setLayout, VkPipelineCache pipelineCache,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : GraphicsPipeline(device, renderPass, vertexShader, fragmentShader,
+        variant(layout, instanced, drawData, setLayout), pipelineCache, allocationCallbacks) {}
+
+  static constexpr uint32_t instanceBinding = 2;
+
+  /**
+   * The SPIR-V the Makefile compiles from mesh.vert for the variant.
+   */
+  static const char *vertexShaderPath(bool instanced, DrawData drawData) {
+    if (instanced) {
+      return "shaders/mesh_instanced.vert.spv";
+    }
+    switch (drawData) {
+      case DrawData::Bindless:
+        return "shaders/mesh_bindless.vert.spv";
+      case DrawData::Cached:
+        return "shaders/mesh_uniform.vert.spv";
+      default:
+        return "shaders/mesh.vert.spv";
+    }
+  }
+
+private:
+  /**
+   * Specialization constant 0 of mesh.vert is true when normals are octahedral encoded. The
+   * specialization is only read while the pipeline is created, statics outlive it.
+   */
+  static PipelineVariant variant(VertexLayout layout, bool instanced, DrawData drawData,
+    VkDescriptorSetLayout setLayout) {
+    static const VkBool32 values[2] = { VK_FALSE, VK_TRUE };
+    static const VkSpecializationMapEntry entry = {
+      .constantID = 0,
+      .offset = 0,
+      .size = sizeof(VkBool32),
+    };
+    static const VkSpecializationInfo specializations[2] = {
+      { 1, &entry, sizeof(VkBool32), &values[0] },
+      { 1, &entry, sizeof(VkBool32), &values[1] },
+    };
+    PipelineVariant variant = layout.pipelineVariant();
+    variant.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    variant.pushConstantSize = sizeof(PushConstants);
+    variant.vertexSpecialization = &specializations[layout.quantized ? 1 : 0];
+    if (instanced) {
+      // A mat4 input takes a location per column.
+      variant.bindings.push_back({ instanceBinding, sizeof(glm::mat4),
+        VK_VERTEX_INPUT_RATE_INSTANCE });
+      for (uint32_t column = 0; column < 4; ++column) {
+        variant.attributes.push_back({ 3 + column, instanceBinding, VK_FORMAT_R32G32B32A32_SFLOAT,
+          column * static_cast<uint32_t>(sizeof(glm::vec4)) });
+      }
+    } else if (drawData == DrawData::Bindless) {
+      variant.setLayouts = { setLayout };
+      variant.pushConstantSize = sizeof(BindlessPushConstants);
+    } else if (drawData == DrawData::Cached) {
+      variant.setLayouts = { setLayout };
+      variant.pushConstantSize = 0;
+    }
+    return variant;
+  }
+};
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.h>
+
+#include "compute.hpp"
+#include "handles.hpp"
+#include "memory.hpp"
+#include "scene.hpp"
+#include "upload.hpp"
+
+/**
+ * Culls the objects of the scene in a compute shader, shaders/cull.comp, which appends a
+ * VkDrawIndexedIndirectCommand and a transform per visible object. The draws are then issued
+ * from the GPU: the CPU records the same two calls whatever the object count.
+ *
+ * The visible objects are compacted at the front of the draw list by an atomic counter, which is
+ * also the draw count of vkCmdDrawIndexedIndirectCount. Without drawIndirectCount, the whole list
+ * is cleared first and drawn with vkCmdDrawIndexedIndirect: the records after the count draw no
+ * instance, which still costs the command processor a little each.
+ *
+ * Each draw has its own firstInstance, its slot in the list, which selects its transform from the
+ * instance buffer bound like the one of InstanceBuffers: this needs drawIndirectFirstInstance.
+ *
+ * The dispatch goes in the frame command buffer, before the render pass, rather than to the
+ * compute queue: the draws of the same frame read its results right away.
+ */
+class GpuCulling {
+public:
+  // Matches the push constant block of the shader.
+  struct Parameters {
+    glm::mat4 viewProjection;
+    uint32_t objectCount;
+    uint32_t indexCount;
+  };
+  // Matches the Object struct of the shader.
+  struct Object {
+    glm::mat4 model;
+    glm::vec4 sphere;
+  };
+  // Matches local_size_x in the shader.
+  static constexpr uint32_t workgroupSize = 64;
+
+  /**
+   * @param drawIndirectCount Whether the device feature of the same name is enabled.
+   * @param maxDrawIndirectCount The device limit, draws per indirect call.
+   */
+  GpuCulling(VkDevice device, DeviceMemoryAllocator &allocator, UploadQueue &uploadQueue,
+    const Shader &shader, VkPipelineCache pipelineCache, const std::vector<SceneObject> &objects,
+    uint32_t slotCount, uint32_t indexCount, bool drawIndirectCount, uint32_t maxDrawIndirectCount,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      objectCount(objects.size()), indexCount(indexCount),
+      // The count is only usable when the whole list fits in a single call.
+      drawIndirectCount(drawIndirectCount && objects.size() <= maxDrawIndirectCount),
+      maxDrawIndirectCount(std::max(maxDrawIndirectCount, 1u)),
+      pipeline(device, shader, pipelineCache, allocationCallbacks) {
+    if (this->pipeline.pushConstantSize != sizeof(Parameters)) {
+      throw std::runtime_error("the push constants of " + shader.path + " do not match!");
+    }
+    // The scene does not move, the bounding spheres are moved to world space once and for all.
+    std::vector<Object> data;
+    for (auto &object: objects) {
+      float scale = std::max({
+        glm::length(glm::vec3(object.model[0])),
+        glm::length(glm::vec3(object.model[1])),
+        glm::length(glm::vec3(object.model[2])),
+      });
+      data.push_back({
+        .model = object.model,
+        .sphere = glm::vec4(glm::vec3(object.model * glm::vec4(glm::vec3(object.bounds), 1.0f)),
+          object.bounds.w * scale),
+      });
+    }
+    VkDeviceSize capacity = std::max<VkDeviceSize>(this->objectCount, 1);
+    this->objects = this->createBuffer(capacity * sizeof(Object),
+      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    uploadQueue.uploadBuffer(this->objects.buffer, 0, data.data(), data.size() * sizeof(Object),
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+    // One set of outputs per frame in flight, so that a dispatch never overwrites what the draws
+    // of the previous frame are still reading.
+    for (uint32_t idx = 0; idx < slotCount; ++idx) {
+      this->slots.push_back({
+        .commands = this->createBuffer(capacity * sizeof(VkDrawIndexedIndirectCommand),
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+          | VK_BUFFER_USAGE_TRANSFER_DST_BIT),
+        .count = this->createBuffer(sizeof(uint32_t),
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+          | VK_BUFFER_USAGE_TRANSFER_DST_BIT),
+        .instances = this->createBuffer(capacity * sizeof(glm::mat4),
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT),
+      });
+    }
+
+    VkDescriptorPoolSize poolSize = {
+      .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 4 * slotCount,
+    };
+    VkDescriptorPoolCreateInfo poolInfo = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = slotCount,
+      .poolSizeCount = 1,
+      .pPoolSizes = &poolSize,
+    };
+    this->descriptorPool = createDeviceChild<UniqueDescriptorPool>(vkCreateDescriptorPool,
+      device, poolInfo, allocationCallbacks, "culling descriptor pool");
+    for (auto &slot: this->slots) {
+      VkDescriptorSetAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = this->descriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = this->pipeline.setLayout.address(),
+      };
+      if (vkAllocateDescriptorSets(device, &allocInfo, &slot.descriptorSet) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate culling descriptor set!");
+      }
+      VkDescriptorBufferInfo bufferDescriptors[] = {
+        { .buffer = this->objects.buffer, .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = slot.commands.buffer, .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = slot.count.buffer, .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = slot.instances.buffer, .offset = 0, .range = VK_WHOLE_SIZE },
+      };
+      VkWriteDescriptorSet write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = slot.descriptorSet,
+        .dstBinding = 0,
+        .descriptorCount = 4,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = bufferDescriptors,
+      };
+      vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+    }
+  }
+
+  ~GpuCulling() {
+    for (auto &slot: this->slots) {
+      this->destroyBuffer(slot.commands);
+      this->destroyBuffer(slot.count);
+      this->destroyBuffer(slot.instances);
+    }
+    this->destroyBuffer(this->objects);
+  }
+
+  GpuCulling(const GpuCulling &) = delete;
+  GpuCulling &operator=(const GpuCulling &) = delete;
+
+  /**
+   * Record the culling of the scene into the draw list of `slot`, outside of any render pass. The
+   * barrier at the end makes the list available to the indirect draws and the transforms to the
+   * vertex input of the commands recorded after it.
+   */
+  void record(VkCommandBuffer commandBuffer, uint32_t slot, const glm::mat4 &viewProjection) {
+    Slot &outputs = this->slots[slot];
+    vkCmdFillBuffer(commandBuffer, outputs.count.buffer, 0, VK_WHOLE_SIZE, 0);
+    if (!this->drawIndirectCount) {
+      // The records past the count are drawn too, with no instance.
+      vkCmdFillBuffer(commandBuffer, outputs.commands.buffer, 0, VK_WHOLE_SIZE, 0);
+    }
+    VkMemoryBarrier clearBarrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &clearBarrier, 0, nullptr, 0, nullptr);
+
+    Parameters parameters = {
+      .viewProjection = viewProjection,
+      .objectCount = this->objectCount,
+      .indexCount = this->indexCount,
+    };
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->pipeline.pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->pipeline.layout,
+      0, 1, &outputs.descriptorSet, 0, nullptr);
+    vkCmdPushConstants(commandBuffer, this->pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+      sizeof(parameters), &parameters);
+    vkCmdDispatch(commandBuffer, (this->objectCount + workgroupSize - 1) / workgroupSize, 1, 1);
+
+    // The cleared records the shader did not overwrite are read by the draws too.
+    VkMemoryBarrier drawBarrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
+    };
+    vkCmdPipelineBarrier(commandBuffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &drawBarrier,
+      0, nullptr, 0, nullptr);
+  }
+
+  /**
+   * The transforms written for `slot`, in the order of its draw list. To bind as the per-instance
+   * vertex buffer of the draws.
+   */
+  VkBuffer instanceBuffer(uint32_t slot) const {
+    return this->slots[slot].instances.buffer;
+  }
+
+  /**
+   * Draw the list of `slot`, with the pipeline, the mesh and the instance buffer already bound.
+   */
+  void draw(VkCommandBuffer commandBuffer, uint32_t slot) const {
+    const Slot &outputs = this->slots[slot];
+    uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    if (this->drawIndirectCount) {
+      vkCmdDrawIndexedIndirectCount(commandBuffer, outputs.commands.buffer, 0,
+        outputs.count.buffer, 0, this->objectCount, stride);
+      return;
+    }
+    // Without multiDrawIndirect the limit is 1, one call per record.
+    for (uint32_t first = 0; first < this->objectCount; first += this->maxDrawIndirectCount) {
+      vkCmdDrawIndexedIndirect(commandBuffer, outputs.commands.buffer, VkDeviceSize(first) * stride,
+        std::min(this->objectCount - first, this->maxDrawIndirectCount), stride);
+    }
+  }
+
+private:
+  struct Buffer {
+    UniqueBuffer buffer;
+    Allocation memory;
+  };
+  struct Slot {
+    Buffer commands;
+    Buffer count;
+    Buffer instances;
+    VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+  };
+
+  Buffer createBuffer(VkDeviceSize size, VkBufferUsageFlags usage) {
+    VkBufferCreateInfo bufferInfo = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = size,
+      .usage = usage,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    Buffer buffer;
+    buffer.buffer = createDeviceChild<UniqueBuffer>(vkCreateBuffer, this->device, bufferInfo,
+      this->allocationCallbacks, "culling buffer");
+    buffer.memory = this->allocator.allocateBuffer(buffer.buffer,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    return buffer;
+  }
+
+  void destroyBuffer(Buffer &buffer) {
+    // The buffer goes before the memory bound to it.
+    buffer.buffer.reset();
+    this->allocator.free(buffer.memory);
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  uint32_t objectCount;
+  uint32_t indexCount;
+  bool drawIndirectCount;
+  uint32_t maxDrawIndirectCount;
+  ComputePipeline pipeline;
+  // The objects, shared by the slots.
+  Buffer objects;
+  std::vector<Slot> slots;
+  UniqueDescriptorPool descriptorPool;
+};
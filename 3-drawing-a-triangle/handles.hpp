@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <vulkan/vulkan.h>
+
+/**
+ * Destroys the handles with no parent, the instance and the device.
+ */
+template <auto destroy>
+struct RootDeleter {
+  const VkAllocationCallbacks *allocationCallbacks = nullptr;
+
+  template <typename T>
+  void operator()(T handle) const {
+    destroy(handle, this->allocationCallbacks);
+  }
+};
+
+/**
+ * Destroys the handles created from an instance, e.g. with vkDestroySurfaceKHR.
+ */
+template <auto destroy>
+struct InstanceChildDeleter {
+  VkInstance instance = VK_NULL_HANDLE;
+  const VkAllocationCallbacks *allocationCallbacks = nullptr;
+
+  template <typename T>
+  void operator()(T handle) const {
+    destroy(this->instance, handle, this->allocationCallbacks);
+  }
+};
+
+/**
+ * Destroys the handles created from a device, which is most of them.
+ */
+template <auto destroy>
+struct DeviceChildDeleter {
+  VkDevice device = VK_NULL_HANDLE;
+  const VkAllocationCallbacks *allocationCallbacks = nullptr;
+
+  template <typename T>
+  void operator()(T handle) const {
+    destroy(this->device, handle, this->allocationCallbacks);
+  }
+};
+
+/**
+ * vkDestroyDebugUtilsMessengerEXT is an extension function, fetched at runtime with the creation
+ * one.
+ */
+struct DebugMessengerDeleter {
+  VkInstance instance = VK_NULL_HANDLE;
+  PFN_vkDestroyDebugUtilsMessengerEXT destroy = nullptr;
+  const VkAllocationCallbacks *allocationCallbacks = nullptr;
+
+  void operator()(VkDebugUtilsMessengerEXT messenger) const {
+    this->destroy(this->instance, messenger, this->allocationCallbacks);
+  }
+};
+
+/**
+ * Owns a Vulkan handle and destroys it when it goes out of scope, like a std::unique_ptr. A null
+ * handle is never destroyed, so a wrapper can be declared before the object exists, or stay empty
+ * when the object is optional (the surface in headless mode, the debug messenger without
+ * validation layers).
+ *
+ * The wrapper converts to the raw handle, so that it can be passed as is to the Vulkan functions
+ * and to the classes of this tutorial which take one.
+ */
+template <typename T, typename Deleter>
+class UniqueHandle {
+public:
+  using Handle = T;
+
+  UniqueHandle() = default;
+
+  UniqueHandle(T handle, Deleter deleter) : handle(handle), deleter(deleter) {}
+
+  ~UniqueHandle() {
+    this->reset();
+  }
+
+  UniqueHandle(const UniqueHandle &) = delete;
+  UniqueHandle &operator=(const UniqueHandle &) = delete;
+
+  UniqueHandle(UniqueHandle &&other) noexcept
+    : handle(other.release()), deleter(other.deleter) {}
+
+  UniqueHandle &operator=(UniqueHandle &&other) noexcept {
+    if (this != &other) {
+      this->reset();
+      this->deleter = other.deleter;
+      this->handle = other.release();
+    }
+    return *this;
+  }
+
+  operator T() const {
+    return this->handle;
+  }
+
+  T get() const {
+    return this->handle;
+  }
+
+  /**
+   * For the functions which take an array of handles, to pass a single one, e.g. a fence to
+   * vkWaitForFences.
+   */
+  const T *address() const {
+    return &this->handle;
+  }
+
+  const Deleter &getDeleter() const {
+    return this->deleter;
+  }
+
+  /**
+   * Give up the ownership of the handle, which the caller is now responsible for destroying.
+   */
+  T release() {
+    return std::exchange(this->handle, T(VK_NULL_HANDLE));
+  }
+
+  /**
+   * Destroy the handle now, if any.
+   */
+  void reset() {
+    T handle = this->release();
+    if (handle != VK_NULL_HANDLE) {
+      this->deleter(handle);
+    }
+  }
+
+private:
+  T handle = VK_NULL_HANDLE;
+  Deleter deleter = {};
+};
+
+using UniqueInstance = UniqueHandle<VkInstance, RootDeleter<vkDestroyInstance>>;
+using UniqueDevice = UniqueHandle<VkDevice, RootDeleter<vkDestroyDevice>>;
+using UniqueSurface = UniqueHandle<VkSurfaceKHR, InstanceChildDeleter<vkDestroySurfaceKHR>>;
+using UniqueDebugMessenger = UniqueHandle<VkDebugUtilsMessengerEXT, DebugMessengerDeleter>;
+using UniqueSwapchain = UniqueHandle<VkSwapchainKHR, DeviceChildDeleter<vkDestroySwapchainKHR>>;
+using UniqueDeviceMemory = UniqueHandle<VkDeviceMemory, DeviceChildDeleter<vkFreeMemory>>;
+using UniqueBuffer = UniqueHandle<VkBuffer, DeviceChildDeleter<vkDestroyBuffer>>;
+using UniqueImage = UniqueHandle<VkImage, DeviceChildDeleter<vkDestroyImage>>;
+using UniqueImageView = UniqueHandle<VkImageView, DeviceChildDeleter<vkDestroyImageView>>;
+using UniqueSampler = UniqueHandle<VkSampler, DeviceChildDeleter<vkDestroySampler>>;
+using UniqueFramebuffer = UniqueHandle<VkFramebuffer, DeviceChildDeleter<vkDestroyFramebuffer>>;
+using UniqueRenderPass = UniqueHandle<VkRenderPass, DeviceChildDeleter<vkDestroyRenderPass>>;
+using UniqueShaderModule =
+  UniqueHandle<VkShaderModule, DeviceChildDeleter<vkDestroyShaderModule>>;
+using UniquePipelineLayout =
+  UniqueHandle<VkPipelineLayout, DeviceChildDeleter<vkDestroyPipelineLayout>>;
+using UniquePipeline = UniqueHandle<VkPipeline, DeviceChildDeleter<vkDestroyPipeline>>;
+using UniquePipelineCache =
+  UniqueHandle<VkPipelineCache, DeviceChildDeleter<vkDestroyPipelineCache>>;
+using UniqueDescriptorSetLayout =
+  UniqueHandle<VkDescriptorSetLayout, DeviceChildDeleter<vkDestroyDescriptorSetLayout>>;
+using UniqueDescriptorPool =
+  UniqueHandle<VkDescriptorPool, DeviceChildDeleter<vkDestroyDescriptorPool>>;
+using UniqueCommandPool = UniqueHandle<VkCommandPool, DeviceChildDeleter<vkDestroyCommandPool>>;
+using UniqueQueryPool = UniqueHandle<VkQueryPool, DeviceChildDeleter<vkDestroyQueryPool>>;
+using UniqueFence = UniqueHandle<VkFence, DeviceChildDeleter<vkDestroyFence>>;
+using UniqueSemaphore = UniqueHandle<VkSemaphore, DeviceChildDeleter<vkDestroySemaphore>>;
+
+/**
+ * Create a device child with `create`, e.g. vkCreateFence, and wrap it, or throw naming `what`.
+ * Most vkCreate* and vkAllocateMemory take the same parameters. A failed creation leaves nothing
+ * to destroy, whatever the driver wrote to the handle.
+ */
+template <typename Unique, typename Create, typename Info>
+Unique createDeviceChild(Create create, VkDevice device, const Info &info,
+  const VkAllocationCallbacks *allocationCallbacks, const std::string &what) {
+  typename Unique::Handle handle = VK_NULL_HANDLE;
+  if (create(device, &info, allocationCallbacks, &handle) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create " + what + "!");
+  }
+  return Unique(handle, { .device = device, .allocationCallbacks = allocationCallbacks });
+}
+
+/**
+ * Resources the CPU is done with but the GPU might still be using. Each is queued with the number
+ * of the first frame which does not use it any more, and destroyed once the frames before it are
+ * done on the GPU, which the frame fences tell. Freeing a resource at runtime then never waits for
+ * the device to be idle.
+ *
+ * Frame numbers only grow, so the queue is ordered and collecting only looks at its front.
+ */
+class DeletionQueue {
+public:
+  DeletionQueue() = default;
+
+  ~DeletionQueue() {
+    this->collect(UINT64_MAX);
+  }
+
+  DeletionQueue(const DeletionQueue &) = delete;
+  DeletionQueue &operator=(const DeletionQueue &) = delete;
+
+  template <typename T, typename Deleter>
+  void push(uint64_t frameNumber, UniqueHandle<T, Deleter> &&handle) {
+    Deleter deleter = handle.getDeleter();
+    T raw = handle.release();
+    if (raw != VK_NULL_HANDLE) {
+      this->push(frameNumber, [raw, deleter]() { deleter(raw); });
+    }
+  }
+
+  /**
+   * The classes of this tutorial destroy their Vulkan objects in their destructor.
+   */
+  template <typename Object>
+  void push(uint64_t frameNumber, std::unique_ptr<Object> &&object) {
+    if (object) {
+      // std::function must be copyable, which std::unique_ptr is not.
+      std::shared_ptr<Object> shared = std::move(object);
+      this->push(frameNumber, [shared]() mutable { shared.reset(); });
+    }
+  }
+
+  void push(uint64_t frameNumber, std::function<void()> destroy) {
+    this->pending.push_back({ .frameNumber = frameNumber, .destroy = std::move(destroy) });
+  }
+
+  /**
+   * Destroy everything no frame before `completedFrames` uses any more.
+   */
+  void collect(uint64_t completedFrames) {
+    while (!this->pending.empty() && this->pending.front().frameNumber <= completedFrames) {
+      this->pending.front().destroy();
+      this->pending.pop_front();
+      ++this->destroyed;
+    }
+  }
+
+  size_t size() const {
+    return this->pending.size();
+  }
+
+  // Resources destroyed so far.
+  uint64_t destroyed = 0;
+
+private:
+  struct Pending {
+    uint64_t frameNumber;
+    std::function<void()> destroy;
+  };
+
+  std::deque<Pending> pending;
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+/**
+ * Counters for one VkSystemAllocationScope.
+ */
+struct HostAllocationScopeStats {
+  // Number of allocations made through pfnAllocation and pfnReallocation.
+  std::atomic<uint64_t> allocationCount = 0;
+  std::atomic<uint64_t> liveBytes = 0;
+  std::atomic<uint64_t> peakBytes = 0;
+  // Allocations the driver made itself and only notified us about (executable memory).
+  std::atomic<uint64_t> internalAllocationCount = 0;
+  std::atomic<uint64_t> internalBytes = 0;
+};
+
+/**
+ * VkAllocationCallbacks backed by size-class pools.
+ *
+ * Drivers do lots of small host allocations for the objects we create. Serving them from
+ * per-size-class free lists is cheaper than going through malloc every time, and being called
+ * lets us count them: number of allocations, peak bytes per scope and time spent in the
+ * callbacks. Allocations made for the duration of a single command
+ * (VK_SYSTEM_ALLOCATION_SCOPE_COMMAND) are served by a bump allocator which is rewound as soon as
+ * no command allocation is alive.
+ *
+ * The callbacks may be called concurrently from any thread calling into Vulkan.
+ */
+class HostAllocator {
+public:
+  HostAllocator() {
+    this->vkCallbacks = {
+      .pUserData = this,
+      .pfnAllocation = &HostAllocator::allocationCallback,
+      .pfnReallocation = &HostAllocator::reallocationCallback,
+      .pfnFree = &HostAllocator::freeCallback,
+      .pfnInternalAllocation = &HostAllocator::internalAllocationCallback,
+      .pfnInternalFree = &HostAllocator::internalFreeCallback,
+    };
+  }
+
+  ~HostAllocator() {
+    for (auto &pool: this->pools) {
+      for (auto chunk: pool.chunks) {
+        std::free(chunk);
+      }
+    }
+    for (auto chunk: this->arena.chunks) {
+      std::free(chunk);
+    }
+  }
+
+  HostAllocator(const HostAllocator &) = delete;
+  HostAllocator &operator=(const HostAllocator &) = delete;
+
+  /**
+   * To be passed as pAllocator to the vkCreate* and vkDestroy* functions. The same callbacks must
+   * be given when destroying an object as when creating it.
+   */
+  const VkAllocationCallbacks *callbacks() const {
+    return &this->vkCallbacks;
+  }
+
+  void report(std::ostream &out) const {
+    static const char *scopeNames[] = { "command", "object", "cache", "device", "instance" };
+    out << "host allocations (" << this->totalNanoseconds / 1000 << " us in callbacks, "
+        << this->arenaRewinds << " command arena rewinds):" << '\n';
+    for (size_t scope = 0; scope < scopeCount; ++scope) {
+      const auto &stats = this->scopes[scope];
+      out << "  " << std::setw(8) << std::left << scopeNames[scope] << std::right
+          << std::setw(8) << stats.allocationCount << " allocations, "
+          << std::setw(8) << stats.liveBytes << " bytes live, "
+          << std::setw(8) << stats.peakBytes << " bytes peak";
+      if (stats.internalAllocationCount > 0) {
+        out << ", " << stats.internalAllocationCount << " internal (" << stats.internalBytes
+            << " bytes)";
+      }
+      out << '\n';
+    }
+    out << std::flush;
+  }
+
+  uint64_t allocationCount() const {
+    uint64_t count = 0;
+    for (const auto &stats: this->scopes) {
+      count += stats.allocationCount;
+    }
+    return count;
+  }
+
+  static constexpr size_t scopeCount = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+  std::array<HostAllocationScopeStats, scopeCount> scopes;
+  std::atomic<uint64_t> totalNanoseconds = 0;
+  std::atomic<uint64_t> arenaRewinds = 0;
+
+private:
+  // Size classes from 16 bytes to 4 KiB, header included. Larger allocations go to malloc.
+  static constexpr size_t minClassShift = 4;
+  static constexpr size_t maxClassShift = 12;
+  static constexpr size_t classCount = maxClassShift - minClassShift + 1;
+  static constexpr size_t poolChunkSize = 64 * 1024;
+  static constexpr size_t arenaChunkSize = 256 * 1024;
+  static constexpr uint8_t largeClass = 0xFF;
+  static constexpr uint8_t arenaClass = 0xFE;
+
+  /**
+   * Stored right before every pointer we hand out.
+   */
+  struct alignas(16) Header {
+    // Start of the block the allocation was carved from.
+    void *block;
+    // Requested size.
+    size_t size;
+    // Size class index, largeClass or arenaClass.
+    uint8_t sizeClass;
+    uint8_t scope;
+  };
+
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  struct Pool {
+    std::mutex mutex;
+    FreeBlock *freeList = nullptr;
+    std::vector<void *> chunks;
+  };
+
+  struct Arena {
+    std::mutex mutex;
+    std::vector<void *> chunks;
+    size_t chunk = 0;
+    size_t offset = 0;
+    size_t liveAllocations = 0;
+  };
+
+  /**
+   * Measures the time spent in a callback.
+   */
+  struct ScopedTimer {
+    ScopedTimer(std::atomic<uint64_t> &total)
+      : total(total), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+      this->total += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - this->start).count();
+    }
+    std::atomic<uint64_t> &total;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  static VKAPI_ATTR void *VKAPI_CALL allocationCallback(void *pUserData, size_t size,
+    size_t alignment, VkSystemAllocationScope allocationScope) {
+    auto self = static_cast<HostAllocator *>(pUserData);
+    ScopedTimer timer(self->totalNanoseconds);
+    return self->allocate(size, alignment, allocationScope);
+  }
+
+  static VKAPI_ATTR void *VKAPI_CALL reallocationCallback(void *pUserData, void *pOriginal,
+    size_t size, size_t alignment, VkSystemAllocationScope allocationScope) {
+    auto self = static_cast<HostAllocator *>(pUserData);
+    ScopedTimer timer(self->totalNanoseconds);
+    if (pOriginal == nullptr) {
+      return self->allocate(size, alignment, allocationScope);
+    }
+    if (size == 0) {
+      self->deallocate(pOriginal);
+      return nullptr;
+    }
+
+    Header *header = headerOf(pOriginal);
+    // Pooled blocks often have room to grow in place.
+    if (header->sizeClass < classCount &&
+        alignedOffset(alignment) + size <= classSize(header->sizeClass)) {
+      self->account(header->scope, static_cast<int64_t>(size) - header->size, false);
+      header->size = size;
+      return pOriginal;
+    }
+
+    void *memory = self->allocate(size, alignment, allocationScope);
+    if (memory != nullptr) {
+      std::memcpy(memory, pOriginal, std::min(size, header->size));
+      self->deallocate(pOriginal);
+    }
+    return memory;
+  }
+
+  static VKAPI_ATTR void VKAPI_CALL freeCallback(void *pUserData, void *pMemory) {
+    auto self = static_cast<HostAllocator *>(pUserData);
+    ScopedTimer timer(self->totalNanoseconds);
+    if (pMemory != nullptr) {
+      self->deallocate(pMemory);
+    }
+  }
+
+  static VKAPI_ATTR void VKAPI_CALL internalAllocationCallback(void *pUserData, size_t size,
+    VkInternalAllocationType allocationType, VkSystemAllocationScope allocationScope) {
+    auto self = static_cast<HostAllocator *>(pUserData);
+    self->scopes[allocationScope].internalAllocationCount++;
+    self->scopes[allocationScope].internalBytes += size;
+  }
+
+  static VKAPI_ATTR void VKAPI_CALL internalFreeCallback(void *pUserData, size_t size,
+    VkInternalAllocationType allocationType, VkSystemAllocationScope allocationScope) {
+    auto self = static_cast<HostAllocator *>(pUserData);
+    self->scopes[allocationScope].internalBytes -= size;
+  }
+
+  static Header *headerOf(void *memory) {
+    return reinterpret_cast<Header *>(static_cast<char *>(memory) - sizeof(Header));
+  }
+
+  static size_t classSize(size_t sizeClass) {
+    return size_t(1) << (sizeClass + minClassShift);
+  }
+
+  /**
+   * Offset of the user pointer from the start of the block: room for the header, rounded up to the
+   * alignment. Blocks are at least 16 bytes aligned, which covers the header alignment.
+   */
+  static size_t alignedOffset(size_t alignment) {
+    return (sizeof(Header) + alignment - 1) / alignment * alignment;
+  }
+
+  void *allocate(size_t size, size_t alignment, VkSystemAllocationScope scope) {
+    if (size == 0) {
+      return nullptr;
+    }
+    alignment = std::max<size_t>(alignment, alignof(Header));
+    size_t offset = alignedOffset(alignment);
+    size_t total = offset + size;
+
+    void *block;
+    uint8_t sizeClass;
+    // Chunks are only guaranteed to be 16 bytes aligned, which also bounds the pool blocks.
+    if (scope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND && total <= arenaChunkSize &&
+        alignment <= 16) {
+      block = this->allocateFromArena(total, alignment);
+      sizeClass = arenaClass;
+    } else if (total <= classSize(classCount - 1) && alignment <= 16) {
+      sizeClass = std::max<size_t>(std::bit_width(total - 1), minClassShift) - minClassShift;
+      block = this->allocateFromPool(sizeClass);
+    } else {
+      // Over-allocate so that the user pointer can be aligned.
+      block = std::malloc(total + alignment);
+      offset = alignedOffset(alignment)
+        + (alignment - reinterpret_cast<uintptr_t>(block) % alignment) % alignment;
+      sizeClass = largeClass;
+    }
+    if (block == nullptr) {
+      return nullptr;
+    }
+
+    void *memory = static_cast<char *>(block) + offset;
+    *headerOf(memory) = {
+      .block = block,
+      .size = size,
+      .sizeClass = sizeClass,
+      .scope = static_cast<uint8_t>(scope),
+    };
+    this->account(scope, size, true);
+    return memory;
+  }
+
+  void deallocate(void *memory) {
+    Header *header = headerOf(memory);
+    this->account(header->scope, -static_cast<int64_t>(header->size), false);
+    if (header->sizeClass == arenaClass) {
+      this->freeToArena();
+    } else if (header->sizeClass == largeClass) {
+      std::free(header->block);
+    } else {
+      this->freeToPool(header->sizeClass, header->block);
+    }
+  }
+
+  void account(uint8_t scope, int64_t bytes, bool newAllocation) {
+    auto &stats = this->scopes[scope];
+    if (newAllocation) {
+      stats.allocationCount++;
+    }
+    uint64_t live = stats.liveBytes += bytes;
+    uint64_t peak = stats.peakBytes;
+    while (live > peak && !stats.peakBytes.compare_exchange_weak(peak, live)) {}
+  }
+
+  void *allocateFromPool(size_t sizeClass) {
+    Pool &pool = this->pools[sizeClass];
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.freeList == nullptr) {
+      // Carve a new chunk into blocks of this class. malloc returns memory aligned for any
+      // fundamental type, and the block sizes are powers of two, so every block is 16 bytes aligned.
+      char *chunk = static_cast<char *>(std::malloc(poolChunkSize));
+      if (chunk == nullptr) {
+        return nullptr;
+      }
+      pool.chunks.push_back(chunk);
+      size_t blockSize = classSize(sizeClass);
+      for (size_t offset = 0; offset + blockSize <= poolChunkSize; offset += blockSize) {
+        auto block = reinterpret_cast<FreeBlock *>(chunk + offset);
+        block->next = pool.freeList;
+        pool.freeList = block;
+      }
+    }
+    FreeBlock *block = pool.freeList;
+    pool.freeList = block->next;
+    return block;
+  }
+
+  void freeToPool(size_t sizeClass, void *block) {
+    Pool &pool = this->pools[sizeClass];
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    auto freeBlock = static_cast<FreeBlock *>(block);
+    freeBlock->next = pool.freeList;
+    pool.freeList = freeBlock;
+  }
+
+  void *allocateFromArena(size_t size, size_t alignment) {
+    std::lock_guard<std::mutex> lock(this->arena.mutex);
+    size_t offset = (this->arena.offset + alignment - 1) / alignment * alignment;
+    if (this->arena.chunks.empty() || offset + size > arenaChunkSize) {
+      // Move on to the next chunk, allocating it the first time we get there.
+      if (!this->arena.chunks.empty()) {
+        ++this->arena.chunk;
+      }
+      if (this->arena.chunk >= this->arena.chunks.size()) {
+        void *chunk = std::malloc(arenaChunkSize);
+        if (chunk == nullptr) {
+          return nullptr;
+        }
+        this->arena.chunks.push_back(chunk);
+      }
+      offset = 0;
+    }
+    this->arena.offset = offset + size;
+    this->arena.liveAllocations++;
+    return static_cast<char *>(this->arena.chunks[this->arena.chunk]) + offset;
+  }
+
+  void freeToArena() {
+    std::lock_guard<std::mutex> lock(this->arena.mutex);
+    // Command allocations don't outlive the command, so the arena regularly gets empty and can be
+    // rewound, keeping its chunks for the next commands.
+    if (--this->arena.liveAllocations == 0) {
+      this->arena.chunk = 0;
+      this->arena.offset = 0;
+      this->arenaRewinds++;
+    }
+  }
+
+  VkAllocationCallbacks vkCallbacks;
+  std::array<Pool, classCount> pools;
+  Arena arena;
+};
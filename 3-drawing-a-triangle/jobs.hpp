@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads running jobs in lock step with the calling thread: run() hands one
+ * job to each worker, runs job 0 itself and returns once every job is done.
+ *
+ * Job `idx` always runs on the same thread, worker `idx`, the caller being worker 0. Per worker
+ * resources, like command pools which must not be used from two threads at the same time, can
+ * then simply be indexed by job.
+ */
+class JobSystem {
+public:
+  /**
+   * `threadCount` counts the calling thread: 1 runs everything inline.
+   */
+  explicit JobSystem(uint32_t threadCount) {
+    for (uint32_t worker = 1; worker < std::max(threadCount, 1u); ++worker) {
+      this->threads.emplace_back([this, worker]() { this->work(worker); });
+    }
+  }
+
+  ~JobSystem() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (auto &thread: this->threads) {
+      thread.join();
+    }
+  }
+
+  JobSystem(const JobSystem &) = delete;
+  JobSystem &operator=(const JobSystem &) = delete;
+
+  /**
+   * Number of workers, the calling thread included.
+   */
+  uint32_t size() const {
+    return this->threads.size() + 1;
+  }
+
+  /**
+   * Run `job(idx)` for idx in [0, jobCount) on as many workers, jobCount being clamped to size().
+   * The first exception thrown by a job is rethrown once all of them are done.
+   */
+  void run(uint32_t jobCount, std::function<void(uint32_t)> job) {
+    jobCount = std::clamp(jobCount, 1u, this->size());
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->job = std::move(job);
+      this->jobCount = jobCount;
+      this->remaining = jobCount - 1;
+      this->error = nullptr;
+      ++this->generation;
+    }
+    if (jobCount > 1) {
+      this->wake.notify_all();
+    }
+
+    std::exception_ptr error;
+    try {
+      this->job(0);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->done.wait(lock, [this]() { return this->remaining == 0; });
+    if (error == nullptr) {
+      error = this->error;
+    }
+    if (error != nullptr) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  void work(uint32_t worker) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+      this->wake.wait(lock, [&]() { return this->stopping || this->generation != seen; });
+      if (this->stopping) {
+        return;
+      }
+      seen = this->generation;
+      if (worker >= this->jobCount) {
+        continue;
+      }
+
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        this->job(worker);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      if (error != nullptr && this->error == nullptr) {
+        this->error = error;
+      }
+      if (--this->remaining == 0) {
+        this->done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  // Everything below is protected by the mutex.
+  std::function<void(uint32_t)> job;
+  uint32_t jobCount = 0;
+  // Jobs not done yet, job 0 excluded.
+  uint32_t remaining = 0;
+  // Bumped by every run(), so that workers tell a new batch of jobs from a spurious wake up.
+  uint64_t generation = 0;
+  std::exception_ptr error;
+  bool stopping = false;
+};
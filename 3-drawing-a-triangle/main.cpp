@@ -1,11 +1,22 @@
 // ls main.cpp | entr -rc bash -c 'make && ./VulkanTest'
 #include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
 #include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <numbers>
+#include <optional>
 #include <set>
 #include <stdexcept>
 #include <string.h>
+#include <string>
+#include <thread>
 // For InstanceExtensionRequested
 #include <vector>
 
@@ -15,9 +26,147 @@
 // GLFW_INCLUDE_VULKAN Will include the vulkin header
 // #include <vulkan/vulkan.h>
 
+// Vulkan's clip space depth goes from 0 to 1, OpenGL's from -1 to 1.
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "baseline.hpp"
+#include "bench.hpp"
+#include "capabilities.hpp"
+#include "capture.hpp"
+#include "compute.hpp"
+#include "debug_messages.hpp"
+#include "descriptors.hpp"
+#include "devices.hpp"
+#include "frames.hpp"
+#include "geometry.hpp"
+#include "gpu_culling.hpp"
+#include "handles.hpp"
+#include "host_allocator.hpp"
+#include "memory.hpp"
+#include "offscreen.hpp"
+#include "pipeline.hpp"
+#include "pipeline_cache.hpp"
+#include "profiler.hpp"
+#include "recording.hpp"
+#include "scene.hpp"
+#include "shaders.hpp"
+#include "streaming.hpp"
+#include "swapchain.hpp"
+#include "upload.hpp"
+
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 
+/**
+ * Runtime options provided on the command line.
+ */
+struct Options {
+  // Render into offscreen images without creating a window nor a surface. Useful on machines
+  // without a display or with a software implementation like lavapipe.
+  bool headless = false;
+  // Number of frames to render before exiting in headless mode.
+  uint32_t frameCount = 100;
+  // How many frames the CPU can record ahead of the GPU.
+  uint32_t framesInFlight = 2;
+  // Print the distribution of the frame times on exit.
+  bool frameStats = false;
+  // Where FrameCapture writes the headless frames, in captureFormat. Empty to disable.
+  std::string capturePath;
+  CaptureFormat captureFormat = CaptureFormat::Png;
+  // Encoder threads of the capture. 0 for one per core but the render loop's.
+  uint32_t captureThreads = 0;
+  // Present mode and image count selection, see PresentPolicy.
+  PresentPolicy presentPolicy = PresentPolicy::LowLatency;
+  // Print the device memory usage on exit.
+  bool memoryStats = false;
+  // Print the host memory the driver allocated through our callbacks on exit.
+  bool allocationStats = false;
+  // Where the pipeline cache is kept between runs. Empty to start cold every time.
+  std::string pipelineCachePath = "pipeline_cache.bin";
+  // When not 0, time that many cold and warm pipeline creations instead of rendering.
+  uint32_t pipelineBenchmark = 0;
+  // Where the physical device capabilities are kept between runs. Empty to query them every time.
+  std::string capabilityCachePath = "capabilities.bin";
+  // Print how long each initialization stage took.
+  bool startupStats = false;
+  // Compile the GLSL sources at startup instead of loading what the Makefile compiled, see
+  // ShaderLibrary. The SPIR-V is cached in shaderCachePath.
+  bool compileShaders = false;
+  std::string shaderCachePath = "shader_cache";
+  // Upload through a dedicated transfer queue family when the device has one.
+  bool transferQueue = true;
+  // Synchronize uploads with timeline semaphores when the device supports them.
+  bool timelineSemaphores = true;
+  // When not 0, stream that many MiB of buffer data, plus a texture, every frame.
+  uint32_t uploadBenchmark = 0;
+  // Dispatch compute work on a dedicated compute queue family when the device has one.
+  bool computeQueue = true;
+  // When not 0, frames per phase of the compute overlap benchmark.
+  uint32_t computeBenchmark = 0;
+  // Particles simulated by the compute benchmark.
+  uint32_t particleCount = 1 << 20;
+  // Triangles drawn per frame.
+  uint32_t drawCount = 1;
+  // Threads recording the draws into secondary command buffers. 0 records them in the primary
+  // command buffer.
+  uint32_t recordThreads = 0;
+  // When not 0, frames per configuration of the recording scaling benchmark.
+  uint32_t recordBenchmark = 0;
+  // Print the GPU time of each pass on exit.
+  bool gpuProfile = false;
+  // Where to write the CPU and GPU timelines, in the Chrome trace format. Empty to disable.
+  std::string tracePath;
+  // Debug messages printed, see DebugMessages. Performance warnings are counted separately.
+  VkDebugUtilsMessageSeverityFlagsEXT debugSeverities = parseMinimumSeverity("warning");
+  VkDebugUtilsMessageTypeFlagsEXT debugTypes = parseMessageTypes("general,validation,performance");
+  // Print the debug message counters, performance warnings included, on exit.
+  bool debugStats = false;
+  // Where to write the benchmark results as JSON, see BenchmarkResults. Empty to disable.
+  std::string benchJsonPath;
+  // Baseline the benchmark results are checked against, the run failing on a regression, see
+  // BenchmarkBaseline. Empty to disable.
+  std::string benchBaselinePath;
+  // Where to write the benchmark results as a new baseline, each with baselineTolerance percent.
+  std::string writeBaselinePath;
+  uint32_t baselineTolerance = 20;
+  // Mesh drawn instead of the triangle: "sphere", or the path of an OBJ file. Empty for the
+  // triangle.
+  std::string mesh;
+  // How the mesh vertices are stored.
+  VertexLayout vertexLayout;
+  // When not 0, frames per layout of the vertex layout benchmark.
+  uint32_t geometryBenchmark = 0;
+  // Where the transform of each draw of the mesh comes from.
+  DrawData drawData = DrawData::Push;
+  // When not 0, frames per path of the draw data benchmark.
+  uint32_t descriptorBenchmark = 0;
+  // Objects of the scene, each an instance of the mesh, culled on the CPU. 0 disables the scene.
+  uint32_t objectCount = 0;
+  CullKernel cullKernel = bestCullKernel();
+  // Cull the scene in a compute shader and draw it with indirect draws instead, see GpuCulling.
+  bool gpuCulling = false;
+  // When not 0, runs per kernel of the culling benchmark.
+  uint32_t sceneBenchmark = 0;
+  // When not 0, render the headless frames with that many DeviceWorker instead, spread over the
+  // suitable physical devices. allDevices for one per device.
+  uint32_t deviceWorkers = 0;
+  DeviceSplit deviceSplit = DeviceSplit::Balanced;
+  // When not 0, frames of the texture streaming benchmark.
+  uint32_t streamingBenchmark = 0;
+  // Texture pack the streaming benchmark reads, written with generated textures if missing.
+  std::string texturePack = "textures.pack";
+  // Device memory the streamed textures may use, in MiB. 0 for whatever the heap budget allows.
+  uint32_t textureBudget = 0;
+  uint32_t width = WIDTH;
+  uint32_t height = HEIGHT;
+};
+
+// The value of Options::deviceWorkers for one worker per physical device.
+const uint32_t allDevices = UINT32_MAX;
+
 const std::vector<const char*> validationLayers = {
   "VK_LAYER_KHRONOS_validation",
 };
@@ -63,8 +212,8 @@ static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
     VkDebugUtilsMessageTypeFlagsEXT messageType,
     const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
     void* pUserData) {
-
-    std::cerr << "validation layer: " << pCallbackData->pMessage << std::endl;
+    // Handed over to a background thread, see DebugMessages.
+    static_cast<DebugMessages *>(pUserData)->push(messageSeverity, messageType, pCallbackData);
     return VK_FALSE;
 }
 
@@ -100,28 +249,17 @@ public:
   std::vector<VkLayerProperties> layers;
 };
 
-/**
- * List the queue families available on the physical device.
- */
-class QueueFamilyEnumerator {
-public:
-  QueueFamilyEnumerator(VkPhysicalDevice device) {
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &this->queueCount, nullptr);
-    this->queues.resize(this->queueCount);
-    vkGetPhysicalDeviceQueueFamilyProperties(device, &this->queueCount, this->queues.data());
-  }
-
-  uint32_t queueCount = 0;
-  std::vector<VkQueueFamilyProperties> queues;
-};
-
 /**
  * Aggregate all the useful information for a physical device.
  */
 struct PhysicalDevice {
   VkPhysicalDevice device;
   VkPhysicalDeviceProperties properties;
+  // Tells apart identical GPUs from Vulkan 1.1, see DeviceIdentity.
+  DeviceIdentity identity;
   VkPhysicalDeviceFeatures features;
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  std::vector<VkQueueFamilyProperties> queueFamilies;
   // Those indices will be used at the creation of the logical device.
   std::map<VkQueueFlagBits, uint32_t> queueFamilyIndices;
   int32_t presentationStateQueueIndex;
@@ -130,11 +268,17 @@ struct PhysicalDevice {
 
 /**
  * List the physical devices on the provided instance with their properties, features and queue
- * family indices.
+ * family indices. The surface can be VK_NULL_HANDLE in headless mode, in which case no queue
+ * family is checked for presentation support.
+ *
+ * Only the properties are queried from devices found in the capability cache, they identify the
+ * device and its driver. Everything else is queried once and cached for the next runs.
+ * `apiVersion` is the version of the instance, which decides how devices are identified.
  */
 class PhysicalDeviceEnumerator {
 public:
-  PhysicalDeviceEnumerator(const VkInstance instance, const VkSurfaceKHR surface) {
+  PhysicalDeviceEnumerator(const VkInstance instance, const VkSurfaceKHR surface,
+    uint32_t apiVersion, CapabilityCache &capabilityCache) {
     vkEnumeratePhysicalDevices(instance, &this->physicalDeviceCount, nullptr);
     std::vector<VkPhysicalDevice> physicalDevices(this->physicalDeviceCount);
     vkEnumeratePhysicalDevices(instance, &this->physicalDeviceCount, physicalDevices.data());
@@ -143,68 +287,95 @@ public:
       VkPhysicalDeviceProperties deviceProperties;
       vkGetPhysicalDeviceProperties(device, &deviceProperties);
 
-      VkPhysicalDeviceFeatures deviceFeatures;
-      vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
+      DeviceIdentity identity = DeviceIdentity::query(device, deviceProperties, apiVersion);
+      const DeviceCapabilities *cached = capabilityCache.find(identity);
+      DeviceCapabilities capabilities = cached != nullptr
+        ? *cached
+        : DeviceCapabilities::query(device, identity);
+      if (cached == nullptr) {
+        capabilityCache.store(capabilities);
+      }
 
-      std::map<VkQueueFlagBits, uint32_t> queueFamilyIndices = getQueueIndices(device);
+      std::map<VkQueueFlagBits, uint32_t> queueFamilyIndices =
+        getQueueIndices(capabilities.queueFamilies);
+      // Presentation support depends on the surface, it is never cached.
       int32_t presentationStateQueueIndex = -1;
-      findQueueWithPresentationCapability(device, surface, queueFamilyIndices,
-        &presentationStateQueueIndex);
-
-      uint32_t extensionCount;
-      vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
-      std::vector<VkExtensionProperties> availableExtensions(extensionCount);
-      vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount,
-        availableExtensions.data());
+      if (surface != VK_NULL_HANDLE) {
+        findQueueWithPresentationCapability(device, surface, capabilities.queueFamilies.size(),
+          queueFamilyIndices, &presentationStateQueueIndex);
+      }
 
       this->physicalDevices.push_back({
         .device = device,
         .properties = deviceProperties,
-        .features = deviceFeatures,
+        .identity = identity,
+        .features = capabilities.features,
+        .memoryProperties = capabilities.memoryProperties,
+        .queueFamilies = capabilities.queueFamilies,
         .queueFamilyIndices = queueFamilyIndices,
         .presentationStateQueueIndex = presentationStateQueueIndex,
-        .availableExtensions = availableExtensions,
+        .availableExtensions = capabilities.extensions,
       });
     }
   }
 
   /**
-   * Creates a map containing the indices of the queue family on the provided device.
+   * Creates a map containing the indices of the queue family on the provided device. For compute
+   * and transfer, the family with the fewest other capabilities is preferred: a transfer only
+   * family is usually a DMA engine running in parallel with the graphics work. The graphics family
+   * is the first one supporting graphics.
    */
-  std::map<VkQueueFlagBits, uint32_t> getQueueIndices(VkPhysicalDevice device) {
-    QueueFamilyEnumerator queueFamilyEnumerator(device);
+  std::map<VkQueueFlagBits, uint32_t> getQueueIndices(
+    const std::vector<VkQueueFamilyProperties> &queueFamilies) {
+    const VkQueueFlags generalFlags =
+      VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+    // Graphics and compute families support transfers even when they do not report it.
+    auto flagsOf = [&queueFamilies](uint32_t idx) -> VkQueueFlags {
+      VkQueueFlags flags = queueFamilies[idx].queueFlags;
+      return (flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))
+        ? flags | VK_QUEUE_TRANSFER_BIT
+        : flags;
+    };
     std::map<VkQueueFlagBits, uint32_t> queueFamilyIndices;
 
-    for (size_t idx = 0; auto &queue: queueFamilyEnumerator.queues) {
-      if (queue.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-        queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT] = idx;
-      }
-      if (queue.queueFlags & VK_QUEUE_COMPUTE_BIT) {
-        queueFamilyIndices[VK_QUEUE_COMPUTE_BIT] = idx;
-      }
-      if (queue.queueFlags & VK_QUEUE_TRANSFER_BIT) {
-        queueFamilyIndices[VK_QUEUE_TRANSFER_BIT] = idx;
-      }
-      if (queue.queueFlags & VK_QUEUE_SPARSE_BINDING_BIT) {
-        queueFamilyIndices[VK_QUEUE_SPARSE_BINDING_BIT] = idx;
-      }
-      if (queue.queueFlags & VK_QUEUE_PROTECTED_BIT) {
-        queueFamilyIndices[VK_QUEUE_PROTECTED_BIT] = idx;
+    for (uint32_t idx = 0; idx < queueFamilies.size(); ++idx) {
+      VkQueueFlags flags = flagsOf(idx);
+      for (auto bit: { VK_QUEUE_GRAPHICS_BIT, VK_QUEUE_COMPUTE_BIT, VK_QUEUE_TRANSFER_BIT,
+                       VK_QUEUE_SPARSE_BINDING_BIT, VK_QUEUE_PROTECTED_BIT }) {
+        if (!(flags & bit)) {
+          continue;
+        }
+        auto it = queueFamilyIndices.find(bit);
+        if (it == queueFamilyIndices.end() || (bit != VK_QUEUE_GRAPHICS_BIT &&
+            std::popcount(flags & generalFlags)
+              < std::popcount(flagsOf(it->second) & generalFlags))) {
+          queueFamilyIndices[bit] = idx;
+        }
       }
     }
 
     return queueFamilyIndices;
   }
 
-  // Find a queue family that supports presentation state. Set the index of the family in queueIndex
-  // and return true if found. Return false otherwise.
+  // Find a queue family that supports presentation state. The graphics family is checked first so
+  // that, when possible, the same queue renders and presents. Set the index of the family in
+  // queueIndex and return 0 if found. Return 1 otherwise.
   uint32_t findQueueWithPresentationCapability(VkPhysicalDevice device, VkSurfaceKHR surface,
-    std::map<VkQueueFlagBits, uint32_t> queueFamilyIndices, int32_t *queueIndex) {
-    for (auto const& familyIndices : queueFamilyIndices) {
+    uint32_t queueCount, std::map<VkQueueFlagBits, uint32_t> queueFamilyIndices,
+    int32_t *queueIndex) {
+    std::vector<uint32_t> candidates;
+    if (queueFamilyIndices.contains(VK_QUEUE_GRAPHICS_BIT)) {
+      candidates.push_back(queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT]);
+    }
+    for (uint32_t idx = 0; idx < queueCount; ++idx) {
+      candidates.push_back(idx);
+    }
+
+    for (auto family: candidates) {
       VkBool32 presentSupport = false;
-      vkGetPhysicalDeviceSurfaceSupportKHR(device, familyIndices.first, surface, &presentSupport);
+      vkGetPhysicalDeviceSurfaceSupportKHR(device, family, surface, &presentSupport);
       if (presentSupport) {
-        *queueIndex = familyIndices.first;
+        *queueIndex = family;
         return 0;
       }
     }
@@ -217,15 +388,80 @@ public:
 };
 
 class HelloTriangleApplication {
+  // Where the compute work of a frame runs, see benchmarkCompute.
+  enum class ComputeMode {
+    None,
+    Serial,
+    Async,
+  };
+  // Simulated seconds per compute step.
+  static constexpr float computeDeltaTime = 0.0001f;
+  // Draws per frame of the draw data benchmark.
+  static constexpr uint32_t descriptorBenchmarkDraws = 10000;
+  // Frames of the main loop before the allocations per frame are counted: the first ones fill
+  // the caches.
+  static constexpr uint64_t warmupFrames = 10;
+  // The pack the streaming benchmark writes when there is none, and what it uploads per frame.
+  static constexpr uint32_t streamingTextures = 64;
+  static constexpr uint32_t streamingTextureSize = 512;
+  static constexpr VkDeviceSize streamingBytesPerFrame = 4 << 20;
+
 public:
+  HelloTriangleApplication(const Options &options)
+    : options(options), drawCount(options.drawCount), recordThreads(options.recordThreads),
+      drawData(options.drawData) {}
+
   void run() {
 #ifdef DEBUG
     this->printVulkanBanner();
 #endif
-    this->initWindow();
+    if (!this->options.headless) {
+      this->initWindow();
+    }
+    // Before the run, a missing baseline should not waste it.
+    std::optional<BenchmarkBaseline> baseline;
+    if (!this->options.benchBaselinePath.empty()) {
+      baseline = BenchmarkBaseline::load(this->options.benchBaselinePath);
+    }
     this->initVulkan();
-    this->mainLoop();
+    if (this->options.pipelineBenchmark > 0) {
+      this->benchmarkPipelineCreation(this->options.pipelineBenchmark);
+    } else if (this->options.computeBenchmark > 0) {
+      this->benchmarkCompute(this->options.computeBenchmark);
+    } else if (this->options.recordBenchmark > 0) {
+      this->benchmarkRecording(this->options.recordBenchmark);
+    } else if (this->options.geometryBenchmark > 0) {
+      this->benchmarkGeometry(this->options.geometryBenchmark);
+    } else if (this->options.descriptorBenchmark > 0) {
+      this->benchmarkDescriptors(this->options.descriptorBenchmark);
+    } else if (this->options.sceneBenchmark > 0) {
+      this->benchmarkScene(this->options.sceneBenchmark);
+    } else if (this->options.streamingBenchmark > 0) {
+      this->benchmarkStreaming(this->options.streamingBenchmark);
+    } else if (this->options.deviceWorkers > 0) {
+      this->renderOnDevices();
+    } else {
+      this->mainLoop();
+    }
+    this->reportProfile();
+    constexpr double mebibyte = 1024.0 * 1024.0;
+    this->benchmarkResults.add("memory.device_peak_mib",
+      this->memoryAllocator->getStats().peakReservedBytes / mebibyte, Better::Lower);
+    this->benchmarkResults.add("memory.rss_peak_mib", peakResidentMebibytes(), Better::Lower);
+    if (!this->options.benchJsonPath.empty()) {
+      this->benchmarkResults.write(this->options.benchJsonPath);
+    }
+    if (!this->options.writeBaselinePath.empty()) {
+      BenchmarkBaseline::write(this->options.writeBaselinePath, this->benchmarkResults,
+        this->options.baselineTolerance / 100.0);
+      std::cout << "baseline written to " << this->options.writeBaselinePath << std::endl;
+    }
+    bool regressed = baseline && !baseline->check(this->benchmarkResults, std::cout);
     this->cleanup();
+    if (regressed) {
+      throw std::runtime_error("failed to match the benchmark baseline "
+        + this->options.benchBaselinePath + "!");
+    }
   }
 
 private:
@@ -234,50 +470,1196 @@ private:
     glfwInit();
     // This function expects an OpenGL context. But in our case, we are passing GLFW_NO_API.
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    // Because handling resized windows takes special care that we'll look into later, disable it
-    // for now with another window hint call:
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-    this->window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
+    this->window = glfwCreateWindow(this->options.width, this->options.height, "Vulkan", nullptr,
+      nullptr);
+    // The swap chain is recreated when the window is resized. Vulkan usually tells us with
+    // VK_ERROR_OUT_OF_DATE_KHR but this is not guaranteed, so we also listen to GLFW.
+    glfwSetWindowUserPointer(this->window, this);
+    glfwSetFramebufferSizeCallback(this->window, framebufferResizeCallback);
+  }
+
+  static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
+    auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+    app->framebufferResized = true;
   }
 
   void initVulkan() {
+    StageTimer timer;
+    // Nothing needs the shaders before the pipelines: they compile while the device is created.
+    this->shaders = std::make_unique<ShaderLibrary>(this->options.shaderCachePath);
+    std::future<void> shadersCompiled;
+    if (this->options.compileShaders) {
+      shadersCompiled = std::async(std::launch::async, [this]() {
+        this->shaders->compile(shaderSources(), std::max(std::thread::hardware_concurrency(), 1u));
+      });
+    }
     // Create the VkInstance
     this->instance = this->createInstance();
+    timer.mark("instance");
     this->setupDebugMessenger();
-    this->surface = this->createSurface(this->instance, this->window);
-    this->physicalDevice = this->getPhysicalDevice(this->instance, this->surface);
+    timer.mark("debug messenger");
+    // In headless mode there is no window system to present to, so no surface is created.
+    if (!this->options.headless) {
+      this->surface = this->createSurface(this->instance, this->window);
+      timer.mark("surface");
+    }
+    CapabilityCache capabilityCache(this->options.capabilityCachePath, enableValidationLayers);
+    this->physicalDevice = this->getPhysicalDevice(this->instance, this->surface, capabilityCache);
+    timer.mark("physical device");
     this->device = this->getLogicalDevice(this->physicalDevice);
     // Retrieve the graphic queue
     vkGetDeviceQueue(this->device, this->physicalDevice.queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT],
       0, &this->graphicsQueue);
+    timer.mark("logical device");
+    this->memoryAllocator = std::make_unique<DeviceMemoryAllocator>(this->device,
+      this->physicalDevice.memoryProperties, this->physicalDevice.properties.limits,
+      DeviceMemoryAllocator::defaultPageSize, this->hostAllocator.callbacks());
+    this->createUploadQueue();
+    timer.mark("upload queue");
+    this->createComputeQueue();
+    this->frames = std::make_unique<FrameRing>(this->device,
+      this->physicalDevice.queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT], this->options.framesInFlight,
+      this->hostAllocator.callbacks());
+    timer.mark("frames in flight");
+    // The profilers and the recorder have a slot per frame in flight.
+    this->createProfilers();
+    // The benchmark goes up to one recording thread per core unless told otherwise.
+    uint32_t recordThreads = this->options.recordThreads;
+    if (recordThreads == 0 && this->options.recordBenchmark > 0) {
+      recordThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    if (recordThreads > 0) {
+      this->jobs = std::make_unique<JobSystem>(recordThreads);
+      this->recorder = std::make_unique<ParallelRecorder>(this->device,
+        this->physicalDevice.queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT], this->frames->size(),
+        *this->jobs, this->hostAllocator.callbacks());
+    }
+    if (this->options.headless) {
+      // One render target per frame in flight, so that a frame never overwrites an image the GPU
+      // is still working on for the previous frame.
+      for (uint32_t idx = 0; idx < this->frames->size(); ++idx) {
+        this->offscreenTargets.push_back(std::make_unique<OffscreenTarget>(this->device,
+          *this->memoryAllocator, VkExtent2D { this->options.width, this->options.height },
+          VK_FORMAT_R8G8B8A8_UNORM, this->hostAllocator.callbacks()));
+      }
+      if (!this->options.capturePath.empty()) {
+        this->createCapture();
+      }
+    } else {
+      if (!this->options.capturePath.empty()) {
+        throw std::runtime_error("failed to capture frames: --capture needs --headless!");
+      }
+      // And the presentation queue, which might well be the same.
+      vkGetDeviceQueue(this->device, this->physicalDevice.presentationStateQueueIndex, 0,
+        &this->presentQueue);
+      std::set<uint32_t> families = {
+        this->physicalDevice.queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT],
+        static_cast<uint32_t>(this->physicalDevice.presentationStateQueueIndex),
+      };
+      this->swapchain = std::make_unique<Swapchain>(this->physicalDevice.device, this->device,
+        this->surface, this->options.presentPolicy,
+        std::vector<uint32_t>(families.begin(), families.end()), this->framebufferExtent(),
+        this->hostAllocator.callbacks());
+    }
+    timer.mark("render targets");
+    if (shadersCompiled.valid()) {
+      // Only the part of the compilation the previous stages did not hide.
+      shadersCompiled.get();
+      timer.mark("shader compilation wait");
+    }
+    this->createDescriptors();
+    this->createPipeline();
+    timer.mark("pipeline");
+
+    if (this->options.startupStats) {
+      std::cout << "initialization (" << capabilityCache.hits << " devices from the capability "
+                << "cache, " << capabilityCache.misses << " queried):" << std::endl;
+      timer.report(std::cout);
+      if (this->options.compileShaders) {
+        this->shaders->report(std::cout);
+      }
+    }
+  }
+
+  /**
+   * Create the capture of the headless frames. Each encoder thread gets two buffers, on top of one
+   * per frame in flight, so that rendering runs ahead while the encoders are busy.
+   */
+  void createCapture() {
+    uint32_t threads = this->options.captureThreads;
+    if (threads == 0) {
+      threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    }
+    this->capture = std::make_unique<FrameCapture>(this->device, *this->memoryAllocator,
+      this->physicalDevice.memoryProperties,
+      this->physicalDevice.properties.limits.nonCoherentAtomSize,
+      VkExtent2D { this->options.width, this->options.height }, this->options.captureFormat,
+      this->options.capturePath, this->options.framesInFlight + 2 * threads, threads,
+      this->options.frameCount, this->hostAllocator.callbacks());
+  }
+
+  /**
+   * Every SPIR-V file the application loads and how the Makefile compiles it, for
+   * --compile-shaders. The mesh.vert variants mirror the rules of the Makefile.
+   */
+  static std::vector<ShaderSource> shaderSources() {
+    return {
+      { "shaders/triangle.vert.spv", "shaders/triangle.vert", {} },
+      { "shaders/triangle.frag.spv", "shaders/triangle.frag", {} },
+      { "shaders/mesh.vert.spv", "shaders/mesh.vert", {} },
+      { "shaders/mesh_instanced.vert.spv", "shaders/mesh.vert", { "INSTANCED" } },
+      { "shaders/mesh_bindless.vert.spv", "shaders/mesh.vert", { "BINDLESS" } },
+      { "shaders/mesh_uniform.vert.spv", "shaders/mesh.vert", { "DRAW_UNIFORMS" } },
+      { "shaders/cull.comp.spv", "shaders/cull.comp", {} },
+      { "shaders/particles.comp.spv", "shaders/particles.comp", {} },
+    };
+  }
+
+  /**
+   * A module of the shader compiled to `spirvPath`, see ShaderLibrary. Can go once the pipelines
+   * using it are created.
+   */
+  UniqueShaderModule loadShader(const std::string &spirvPath) {
+    return UniqueShaderModule(this->shaders->get(spirvPath).createModule(this->device,
+      this->hostAllocator.callbacks()),
+      { .device = this->device, .allocationCallbacks = this->hostAllocator.callbacks() });
+  }
+
+  /**
+   * Create the queue streaming data to device local memory. It uses the transfer family picked by
+   * getQueueIndices when it differs from the graphics one, the graphics queue otherwise.
+   */
+  void createUploadQueue() {
+    uint32_t graphicsFamily = this->physicalDevice.queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT];
+    uint32_t transferFamily = this->options.transferQueue
+      ? this->physicalDevice.queueFamilyIndices[VK_QUEUE_TRANSFER_BIT]
+      : graphicsFamily;
+    VkQueue transferQueue = this->graphicsQueue;
+    if (transferFamily != graphicsFamily) {
+      vkGetDeviceQueue(this->device, transferFamily, 0, &transferQueue);
+    }
+    this->uploadQueue = std::make_unique<UploadQueue>(this->device, *this->memoryAllocator,
+      this->physicalDevice.properties.limits, transferQueue, transferFamily, graphicsFamily,
+      this->timelineSemaphores, UploadQueue::defaultRingSize, this->hostAllocator.callbacks());
+
+    if (this->options.uploadBenchmark > 0) {
+      // One target per frame in flight, so that an upload never overwrites what a frame still in
+      // flight uses.
+      VkDeviceSize bufferSize = VkDeviceSize(this->options.uploadBenchmark) * 1024 * 1024;
+      VkExtent2D textureExtent = { 256, 256 };
+      for (uint32_t idx = 0; idx < this->options.framesInFlight; ++idx) {
+        this->uploadTargets.push_back(std::make_unique<UploadTarget>(this->device,
+          *this->memoryAllocator, bufferSize, textureExtent, this->hostAllocator.callbacks()));
+      }
+      this->uploadData.resize(std::max<VkDeviceSize>(bufferSize,
+        textureExtent.width * textureExtent.height * 4));
+      for (size_t idx = 0; idx < this->uploadData.size(); ++idx) {
+        this->uploadData[idx] = static_cast<char>(idx * 31);
+      }
+    }
+  }
+
+  /**
+   * Create the queue dispatching compute work next to the graphics queue. Like uploads, it uses the
+   * compute family picked by getQueueIndices when it differs from the graphics one.
+   */
+  void createComputeQueue() {
+    uint32_t graphicsFamily = this->physicalDevice.queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT];
+    uint32_t computeFamily = this->options.computeQueue
+      ? this->physicalDevice.queueFamilyIndices[VK_QUEUE_COMPUTE_BIT]
+      : graphicsFamily;
+    VkQueue computeQueue = this->graphicsQueue;
+    if (computeFamily != graphicsFamily) {
+      vkGetDeviceQueue(this->device, computeFamily, 0, &computeQueue);
+    }
+    this->computeQueue = std::make_unique<ComputeQueue>(this->device, computeQueue, computeFamily,
+      graphicsFamily, this->options.framesInFlight, this->hostAllocator.callbacks());
+  }
+
+  /**
+   * Create the timestamp profilers of the graphics and compute queues. They exist even when
+   * profiling is disabled, without any query pool, so that their scopes can be left in place.
+   */
+  void createProfilers() {
+    bool profiling = this->options.gpuProfile || !this->options.tracePath.empty();
+    if (!this->options.tracePath.empty()) {
+      this->trace = std::make_unique<Trace>();
+      this->cpuTrack = this->trace->track("CPU");
+    }
+    uint32_t graphicsFamily = this->physicalDevice.queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT];
+    this->graphicsProfiler = std::make_unique<TimestampProfiler>(this->device, this->graphicsQueue,
+      graphicsFamily, this->physicalDevice.queueFamilies[graphicsFamily],
+      this->physicalDevice.properties.limits.timestampPeriod,
+      profiling ? this->frames->size() : 0, this->trace.get(), "GPU graphics",
+      this->hostAllocator.callbacks());
+
+    uint32_t computeFamily = this->computeQueue->queueFamilyIndex;
+    VkQueue computeQueue = this->graphicsQueue;
+    if (computeFamily != graphicsFamily) {
+      vkGetDeviceQueue(this->device, computeFamily, 0, &computeQueue);
+    }
+    // One query pool per compute slot, which is what its fence protects.
+    this->computeProfiler = std::make_unique<TimestampProfiler>(this->device, computeQueue,
+      computeFamily, this->physicalDevice.queueFamilies[computeFamily],
+      this->physicalDevice.properties.limits.timestampPeriod,
+      profiling ? this->options.framesInFlight : 0, this->trace.get(), "GPU compute",
+      this->hostAllocator.callbacks());
+  }
+
+  /**
+   * Print the GPU time of the passes and write the trace. Waits for the device to be idle, so
+   * that the results of the last frames are available.
+   */
+  void reportProfile() {
+    this->frames->waitIdle();
+    this->computeQueue->waitIdle();
+    this->graphicsProfiler->collectAll();
+    this->computeProfiler->collectAll();
+    // Nothing without --gpu-profile or --trace.
+    this->graphicsProfiler->addResults(this->benchmarkResults, "gpu.graphics.");
+    this->computeProfiler->addResults(this->benchmarkResults, "gpu.compute.");
+    if (this->options.gpuProfile) {
+      this->graphicsProfiler->report(std::cout, "graphics queue");
+      this->computeProfiler->report(std::cout, "compute queue");
+    }
+    if (this->trace) {
+      // A trace that cannot be written is not worth failing the run for.
+      try {
+        this->trace->write(this->options.tracePath);
+        std::cout << "trace written to " << this->options.tracePath << std::endl;
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }
+
+  /**
+   * Create what hands the per-draw data to the mesh pipeline, when it does not go through push
+   * constants (see DrawData). The draw data benchmark needs everything.
+   */
+  void createDescriptors() {
+    bool benchmark = this->options.descriptorBenchmark > 0;
+    // The streamed textures are exposed through the bindless table.
+    bool streaming = this->options.streamingBenchmark > 0;
+    if (this->drawData == DrawData::Bindless && !this->descriptorIndexing) {
+      std::cout << "no descriptor indexing, falling back to cached descriptor sets" << std::endl;
+      this->drawData = DrawData::Cached;
+    }
+    if (this->drawData == DrawData::Push && !benchmark && !streaming) {
+      return;
+    }
+
+    // A transform per draw and per frame in flight, for as many draws as the benchmarks do.
+    uint32_t draws = std::max({ this->options.drawCount,
+      this->options.recordBenchmark > 0 ? 100000u : 0u,
+      benchmark ? descriptorBenchmarkDraws : 0u });
+    const VkPhysicalDeviceLimits &limits = this->physicalDevice.properties.limits;
+    this->uniforms = std::make_unique<UniformArena>(this->device, *this->memoryAllocator, limits,
+      this->frames->size(), VkDeviceSize(draws) * std::max<VkDeviceSize>(sizeof(glm::mat4),
+        std::max(limits.minUniformBufferOffsetAlignment, limits.minStorageBufferOffsetAlignment)),
+      this->hostAllocator.callbacks());
+
+    if (this->descriptorIndexing) {
+      // Large arrays, within what the device takes in a set and in a shader stage.
+      const VkPhysicalDeviceDescriptorIndexingProperties &properties =
+        this->descriptorIndexingProperties;
+      uint32_t textures = std::min({ 4096u,
+        properties.maxDescriptorSetUpdateAfterBindSampledImages,
+        properties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+        properties.maxPerStageDescriptorUpdateAfterBindSamplers });
+      uint32_t buffers = std::min({ 1024u,
+        properties.maxDescriptorSetUpdateAfterBindStorageBuffers,
+        properties.maxPerStageDescriptorUpdateAfterBindStorageBuffers });
+      this->bindless = std::make_unique<BindlessTable>(this->device, textures, buffers,
+        this->hostAllocator.callbacks());
+      this->uniformsIndex = this->bindless->addBuffer(this->uniforms->buffer);
+    }
+    this->descriptorSets = std::make_unique<DescriptorSetCache>(this->device,
+      std::vector<VkDescriptorSetLayoutBinding> {
+        {
+          .binding = 0,
+          .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+          .descriptorCount = 1,
+          .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        },
+      }, 64, this->hostAllocator.callbacks());
+  }
+
+  /**
+   * Create the render pass, the framebuffers of the render targets and the triangle pipeline. The
+   * pipeline cache is loaded from disk first so that the driver can skip compiling the shaders it
+   * already compiled during a previous run.
+   */
+  void createPipeline() {
+    this->pipelineCache = std::make_unique<PipelineCache>(this->device,
+      this->physicalDevice.properties, this->options.pipelineCachePath,
+      this->hostAllocator.callbacks());
+
+    // Offscreen images are left ready to be copied back, swap chain images ready to be presented.
+    this->renderPass = UniqueRenderPass(this->options.headless
+      ? createRenderPass(this->device, this->offscreenTargets.front()->format,
+          VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, this->hostAllocator.callbacks())
+      : createRenderPass(this->device, this->swapchain->format, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+          this->hostAllocator.callbacks()),
+      { .device = this->device, .allocationCallbacks = this->hostAllocator.callbacks() });
+    for (auto &target: this->offscreenTargets) {
+      target->createFramebuffer(this->renderPass);
+    }
+    if (this->swapchain) {
+      this->swapchain->createFramebuffers(this->renderPass);
+    }
+
+    this->vertexShader = this->loadShader("shaders/triangle.vert.spv");
+    this->fragmentShader = this->loadShader("shaders/triangle.frag.spv");
+    this->pipelineCreationTime = timeMilliseconds([this]() {
+      this->pipeline = std::make_unique<GraphicsPipeline>(this->device, this->renderPass,
+        this->vertexShader, this->fragmentShader, PipelineVariant {}, this->pipelineCache->cache,
+        this->hostAllocator.callbacks());
+    });
+
+    // The geometry and draw data benchmarks bring their own.
+    bool scene = this->options.objectCount > 0;
+    if ((!this->options.mesh.empty() || scene) && this->options.geometryBenchmark == 0 &&
+        this->options.descriptorBenchmark == 0) {
+      // Without a mesh, the objects of the scene are small spheres.
+      this->createMesh(this->options.mesh.empty() ? makeSphere(8, 16)
+        : this->options.mesh == "sphere" ? makeSphere(64, 128)
+        : loadObj(this->options.mesh), this->options.vertexLayout, scene);
+      if (scene && this->options.gpuCulling) {
+        this->gpuCulling = std::make_unique<GpuCulling>(this->device, *this->memoryAllocator,
+          *this->uploadQueue, this->shaders->get("shaders/cull.comp.spv"),
+          this->pipelineCache->cache,
+          generateScene(this->options.objectCount), this->frames->size(), this->mesh->indexCount,
+          this->drawIndirectCount, this->physicalDevice.properties.limits.maxDrawIndirectCount,
+          this->hostAllocator.callbacks());
+        this->uploadQueue->flush();
+      } else if (scene) {
+        this->scene = std::make_unique<SceneObjects>(generateScene(this->options.objectCount));
+        this->instances = std::make_unique<InstanceBuffers>(this->device, *this->memoryAllocator,
+          this->frames->size(), this->options.objectCount, this->hostAllocator.callbacks());
+      }
+    }
+  }
+
+  /**
+   * Upload the mesh in the given layout and create the pipeline drawing it, instanced for the
+   * scene and otherwise for the current draw data path. The upload is acquired by the next frame,
+   * like the streaming uploads.
+   */
+  void createMesh(const MeshData &data, VertexLayout layout, bool instanced = false) {
+    // The previous mesh might still be drawn by the frames in flight.
+    this->frames->retire(std::move(this->mesh));
+    this->frames->retire(std::move(this->meshPipeline));
+    this->mesh = std::make_unique<Mesh>(this->device, *this->memoryAllocator, *this->uploadQueue,
+      data, layout, this->hostAllocator.callbacks());
+    this->uploadQueue->flush();
+    UniqueShaderModule vertexShader =
+      this->loadShader(MeshPipeline::vertexShaderPath(instanced, this->drawData));
+    VkDescriptorSetLayout setLayout = this->drawData == DrawData::Bindless
+      ? this->bindless->layout.get()
+      : this->drawData == DrawData::Cached ? this->descriptorSets->layout.get() : VK_NULL_HANDLE;
+    this->meshPipeline = std::make_unique<MeshPipeline>(this->device, this->renderPass,
+      vertexShader, this->fragmentShader, layout, instanced, this->drawData, setLayout,
+      this->pipelineCache->cache, this->hostAllocator.callbacks());
+  }
+
+  /**
+   * Compare the creation time of the triangle pipeline with an empty cache (cold) and with a cache
+   * primed with the data of a previous creation (warm), which is what a new process finds on disk.
+   * Drivers often keep a cache of their own (Mesa, NVIDIA) which makes cold creations look warm:
+   * disable it for meaningful numbers, e.g. MESA_SHADER_CACHE_DISABLE=true.
+   */
+  void benchmarkPipelineCreation(uint32_t iterations) {
+    // Each creation gets its own cache so that they do not warm each other up.
+    auto timeCreation = [this](const std::vector<char> &initialData, std::vector<char> *data) {
+      VkPipelineCacheCreateInfo createInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = initialData.size(),
+        .pInitialData = initialData.empty() ? nullptr : initialData.data(),
+      };
+      VkPipelineCache handle;
+      if (vkCreatePipelineCache(this->device, &createInfo, this->hostAllocator.callbacks(), &handle)
+          != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline cache!");
+      }
+      UniquePipelineCache cache(handle,
+        { .device = this->device, .allocationCallbacks = this->hostAllocator.callbacks() });
+      double elapsed = timeMilliseconds([&]() {
+        GraphicsPipeline pipeline(this->device, this->renderPass, this->vertexShader,
+          this->fragmentShader, PipelineVariant {}, cache, this->hostAllocator.callbacks());
+      });
+      if (data != nullptr) {
+        *data = PipelineCache::serialize(this->device, cache);
+      }
+      return elapsed;
+    };
+
+    std::vector<char> warmData;
+    timeCreation({}, &warmData);
+    Samples cold, warm;
+    // Interleaved so that clock changes and other processes affect both the same way.
+    for (uint32_t idx = 0; idx < iterations; ++idx) {
+      cold.record(timeCreation({}, nullptr));
+      warm.record(timeCreation(warmData, nullptr));
+    }
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "pipeline creation at startup " << this->pipelineCreationTime << " ms ("
+              << (this->pipelineCache->loaded ? "warm" : "cold") << " on-disk cache)" << '\n'
+              << iterations << " iterations, " << warmData.size() << " bytes of cache data" << '\n'
+              << "  cold p50 " << cold.median() << " ms, mean " << cold.mean() << " ms" << '\n'
+              << "  warm p50 " << warm.median() << " ms, mean " << warm.mean() << " ms" << '\n'
+              << "  speedup " << (warm.median() > 0.0 ? cold.median() / warm.median() : 0.0)
+              << "x" << std::endl;
+    std::cout.unsetf(std::ios_base::floatfield);
+    this->benchmarkResults.add("pipeline.cold_p50_ms", cold.median(), Better::Lower);
+    this->benchmarkResults.add("pipeline.warm_p50_ms", warm.median(), Better::Lower);
+  }
+
+  /**
+   * Measure how much the particle simulation overlaps with the triangle pass. Four phases of
+   * `frameCount` frames: the triangle pass alone, the simulation alone, both on the graphics queue
+   * with the pass waiting for the simulation (serial), and the simulation on the compute queue
+   * without any dependency (async). Async work only overlaps when the device schedules both queues
+   * at the same time, which a dedicated compute family makes more likely.
+   */
+  void benchmarkCompute(uint32_t frameCount) {
+    std::set<uint32_t> families = {
+      this->computeQueue->graphicsQueueFamilyIndex,
+      this->computeQueue->queueFamilyIndex,
+    };
+    // Enough steps per dispatch for the simulation to take about as long as a frame.
+    this->particles = std::make_unique<ParticleSimulation>(this->device, *this->memoryAllocator,
+      this->shaders->get("shaders/particles.comp.spv"), this->pipelineCache->cache,
+      std::vector<uint32_t>(families.begin(), families.end()), this->options.particleCount, 64,
+      this->hostAllocator.callbacks());
+
+    struct Phase {
+      const char *name;
+      ComputeMode mode;
+      bool graphics;
+    };
+    Phase phases[] = {
+      { "graphics", ComputeMode::None, true },
+      { "compute", ComputeMode::Async, false },
+      { "serial", ComputeMode::Serial, true },
+      { "async", ComputeMode::Async, true },
+    };
+    auto runFrames = [this](const Phase &phase, uint32_t count) {
+      for (uint32_t idx = 0; idx < count; ++idx) {
+        if (!this->options.headless) {
+          glfwPollEvents();
+        }
+        if (phase.graphics) {
+          this->drawFrame();
+        } else {
+          this->dispatchParticles();
+        }
+      }
+      // A phase is done when the GPU is, and the next one starts from idle queues.
+      this->frames->waitIdle();
+      this->computeQueue->waitIdle();
+    };
+
+    std::vector<double> results;
+    for (auto &phase: phases) {
+      this->computeMode = phase.mode;
+      // Warm up the clocks and the caches first.
+      runFrames(phase, 2 * this->frames->size());
+      results.push_back(timeMilliseconds([&]() { runFrames(phase, frameCount); }) / frameCount);
+    }
+    this->computeMode = ComputeMode::None;
+    this->particles.reset();
+
+    std::cout << std::fixed << std::setprecision(3) << "compute benchmark ("
+              << this->options.particleCount << " particles, "
+              << (this->computeQueue->dedicated() ? "dedicated compute queue" : "graphics queue")
+              << "), " << frameCount << " frames per phase:" << '\n';
+    for (size_t idx = 0; idx < results.size(); ++idx) {
+      std::cout << "  " << std::left << std::setw(20) << phases[idx].name << std::right
+                << results[idx] << " ms per frame" << '\n';
+      this->benchmarkResults.add(std::string("compute.") + phases[idx].name + "_ms", results[idx],
+        Better::Lower);
+    }
+    // How much of the shorter workload running them asynchronously hides, 100% being perfect
+    // overlap.
+    double shorter = std::min(results[0], results[1]);
+    double overlap = shorter > 0.0 ? (results[2] - results[3]) / shorter * 100.0 : 0.0;
+    std::cout << "  " << std::left << std::setw(20) << "overlap" << std::right << overlap << " %"
+              << std::endl;
+    std::cout.unsetf(std::ios_base::floatfield);
+    this->benchmarkResults.add("compute.overlap_percent", overlap, Better::Higher);
+  }
+
+  /**
+   * Measure the CPU time spent recording a frame against the number of draws, inline in the
+   * primary command buffer and with 1 to N recording threads. Each configuration renders
+   * `frameCount` frames and reports the median recording time.
+   */
+  void benchmarkRecording(uint32_t frameCount) {
+    std::vector<uint32_t> threadCounts;
+    for (uint32_t threads = 1; threads < this->jobs->size(); threads *= 2) {
+      threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(this->jobs->size());
+
+    std::cout << std::fixed << std::setprecision(3) << "recording time (median of " << frameCount
+              << " frames, ms), speedup against 1 thread:" << '\n';
+    for (uint32_t draws: { 1000u, 10000u, 100000u }) {
+      this->drawCount = draws;
+      auto measure = [&](uint32_t threads) {
+        this->recordThreads = threads;
+        Samples samples;
+        for (uint32_t idx = 0; idx < frameCount; ++idx) {
+          if (!this->options.headless) {
+            glfwPollEvents();
+          }
+          this->drawFrame();
+          samples.record(this->recordMilliseconds);
+        }
+        this->benchmarkResults.add("record." + std::to_string(draws) + "_draws."
+          + (threads == 0 ? "inline" : std::to_string(threads) + "t") + "_ms", samples.median(),
+          Better::Lower);
+        return samples.median();
+      };
+      std::cout << "  " << std::setw(6) << draws << " draws: inline " << measure(0);
+      double single = 0.0;
+      for (auto threads: threadCounts) {
+        double median = measure(threads);
+        single = threads == 1 ? median : single;
+        std::cout << ", " << threads << "t " << median << " (" << std::setprecision(2)
+                  << (median > 0.0 ? single / median : 0.0) << "x)" << std::setprecision(3);
+      }
+      std::cout << std::endl;
+    }
+    std::cout.unsetf(std::ios_base::floatfield);
+    this->frames->waitIdle();
+    this->drawCount = this->options.drawCount;
+    this->recordThreads = this->options.recordThreads;
+  }
+
+  /**
+   * Compare the vertex layouts: the memory they take, and how many vertices per second the GPU
+   * fetches and transforms from them. Each layout draws `frameCount` frames of many instances of a
+   * 65536 vertices sphere, the largest that fits 16-bit indices. The sphere is moved beyond the far
+   * plane, so that every triangle is clipped after the vertex shader and rasterization costs
+   * nothing: what is left is mostly vertex fetch.
+   */
+  void benchmarkGeometry(uint32_t frameCount) {
+    MeshData data = makeSphere(255, 255);
+    this->meshDistance = 1000.0f;
+    this->meshInstances = 64;
+    uint64_t vertices = uint64_t(data.indices.size()) * this->meshInstances * this->drawCount;
+
+    std::cout << std::fixed << std::setprecision(3) << "vertex layouts (" << data.positions.size()
+              << " vertices, " << vertices << " indices per frame, " << frameCount
+              << " frames each):" << '\n';
+    for (uint32_t idx = 0; idx < VertexLayout::count; ++idx) {
+      VertexLayout layout = VertexLayout::all(idx);
+      this->createMesh(data, layout);
+      auto runFrames = [this](uint32_t count) {
+        for (uint32_t frame = 0; frame < count; ++frame) {
+          if (!this->options.headless) {
+            glfwPollEvents();
+          }
+          this->drawFrame();
+        }
+        // The frames are only done once the GPU is.
+        this->frames->waitIdle();
+      };
+      // Warm up the clocks and the caches first.
+      runFrames(2 * this->frames->size());
+      double milliseconds = timeMilliseconds([&]() { runFrames(frameCount); }) / frameCount;
+      double rate = milliseconds > 0.0 ? vertices / milliseconds / 1000.0 : 0.0;
+      std::cout << "  " << std::left << std::setw(16) << layout.name() << std::right
+                << layout.vertexSize() << " B/vertex, " << this->mesh->vertexBytes / 1024
+                << " KiB vertices, " << this->mesh->indexBytes / 1024 << " KiB indices, "
+                << milliseconds << " ms per frame, " << rate << " Mvertices/s" << '\n';
+      std::string name = std::string("geometry.") + layout.name();
+      this->benchmarkResults.add(name + ".bytes",
+        this->mesh->vertexBytes + this->mesh->indexBytes, Better::Lower);
+      this->benchmarkResults.add(name + ".frame_ms", milliseconds, Better::Lower);
+      this->benchmarkResults.add(name + ".mvertices_per_s", rate, Better::Higher);
+    }
+    std::cout << std::flush;
+    std::cout.unsetf(std::ios_base::floatfield);
+  }
+
+  /**
+   * Compare the draw data paths: the CPU time recording a frame of many draws of a small mesh
+   * takes with each, the median of `frameCount` frames. Every draw gets its own transform.
+   */
+  void benchmarkDescriptors(uint32_t frameCount) {
+    MeshData data = makeSphere(8, 16);
+    this->drawCount = descriptorBenchmarkDraws;
+    std::cout << std::fixed << std::setprecision(3) << "draw data (" << this->drawCount
+              << " draws, median recording time of " << frameCount << " frames):" << '\n';
+    for (DrawData drawData: { DrawData::Push, DrawData::Bindless, DrawData::Cached }) {
+      if (drawData == DrawData::Bindless && !this->bindless) {
+        std::cout << "  " << std::left << std::setw(10) << drawDataName(drawData) << std::right
+                  << "no descriptor indexing" << '\n';
+        continue;
+      }
+      this->drawData = drawData;
+      this->createMesh(data, VertexLayout {});
+      Samples samples;
+      for (uint32_t frame = 0; frame < frameCount; ++frame) {
+        if (!this->options.headless) {
+          glfwPollEvents();
+        }
+        this->drawFrame();
+        samples.record(this->recordMilliseconds);
+      }
+      std::cout << "  " << std::left << std::setw(10) << drawDataName(drawData) << std::right
+                << samples.median() << " ms" << '\n';
+      this->benchmarkResults.add(std::string("descriptors.") + drawDataName(drawData)
+        + "_record_ms", samples.median(), Better::Lower);
+    }
+    std::cout << "  descriptor set cache: " << this->descriptorSets->hits << " hits, "
+              << this->descriptorSets->misses << " misses" << std::endl;
+    std::cout.unsetf(std::ios_base::floatfield);
+    this->drawCount = this->options.drawCount;
+    this->drawData = this->options.drawData;
+  }
+
+  /**
+   * Stream the textures of a pack while a camera turns twice around them, over `frameCount`
+   * frames. The textures stand on a circle around the camera, each at its own distance: the ones
+   * in the 90 degrees field of view are used at the size they would have on screen, the others are
+   * not. Nothing samples them yet, the benchmark measures the streaming itself.
+   */
+  void benchmarkStreaming(uint32_t frameCount) {
+    const std::string &path = this->options.texturePack;
+    if (!std::filesystem::exists(path)) {
+      std::cout << "writing " << streamingTextures << " textures of " << streamingTextureSize
+                << "x" << streamingTextureSize << " to " << path << std::endl;
+      writeTexturePack(path, streamingTextures, streamingTextureSize);
+    }
+    this->textures = std::make_unique<TextureStreamer>(this->device, this->physicalDevice.device,
+      this->physicalDevice.memoryProperties, this->memoryBudget, *this->memoryAllocator,
+      *this->uploadQueue, *this->frames, this->bindless.get(), path,
+      VkDeviceSize(this->options.textureBudget) << 20, streamingBytesPerFrame,
+      this->hostAllocator.callbacks());
+
+    constexpr float pi = std::numbers::pi_v<float>;
+    uint32_t count = this->textures->textureCount();
+    double elapsed = timeMilliseconds([&]() {
+      for (uint32_t frame = 0; frame < frameCount; ++frame) {
+        if (!this->options.headless) {
+          glfwPollEvents();
+        }
+        float heading = 4.0f * pi * frame / frameCount;
+        for (uint32_t index = 0; index < count; ++index) {
+          // Between -pi and pi from where the camera looks.
+          float angle = std::remainder(2.0f * pi * index / count - heading, 2.0f * pi);
+          if (std::abs(angle) < pi / 4.0f) {
+            // From 2 to 17 units away. A texture is 4 units wide, the height of the screen at 2.
+            float distance = 2.0f + (index * 7) % 16;
+            this->textures->use(index, 2.0f * this->options.height / distance);
+          }
+        }
+        this->drawFrame();
+      }
+      this->frames->waitIdle();
+    });
+
+    constexpr double mebibyte = 1024.0 * 1024.0;
+    const auto &counters = this->textures->counters;
+    this->textures->report(std::cout, elapsed);
+    this->benchmarkResults.add("streaming.throughput_mib_s", this->textures->throughput(elapsed),
+      Better::Higher);
+    this->benchmarkResults.add("streaming.resident_mib", counters.residentBytes / mebibyte,
+      Better::None);
+    this->benchmarkResults.add("streaming.peak_mib", counters.peakResidentBytes / mebibyte,
+      Better::Lower);
+    this->benchmarkResults.add("streaming.budget_mib", counters.budget / mebibyte, Better::None);
+    this->benchmarkResults.add("streaming.promotions", counters.promotions, Better::None);
+    this->benchmarkResults.add("streaming.demotions", counters.demotions, Better::None);
+    this->benchmarkResults.add("streaming.evictions", counters.evictions, Better::Lower);
+    this->benchmarkResults.add("streaming.over_budget_frames", counters.overBudgetFrames,
+      Better::Lower);
+    this->benchmarkResults.add("streaming.satisfied_percent", this->textures->satisfiedPercent(),
+      Better::Higher);
+  }
+
+  /**
+   * Compare the culling kernels with the naive glm loop on 100k and 1M objects, the median of
+   * `iterations` runs each. The transforms go to host memory here rather than to an instance
+   * buffer, which can be slower to write to when it is not cached. Every kernel must find the same
+   * objects as the naive loop and write the same transforms, up to rounding.
+   */
+  void benchmarkScene(uint32_t iterations) {
+    glm::mat4 projection = glm::perspective(glm::radians(60.0f), 4.0f / 3.0f, 0.1f, 1000.0f);
+    projection[1][1] *= -1.0f;
+    glm::mat4 viewProjection = projection * glm::lookAt(glm::vec3(0.0f),
+      glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+    std::cout << std::fixed << std::setprecision(3) << "culling and transform (median of "
+              << iterations << " runs, ms), speedup against the naive loop:" << '\n';
+    for (uint32_t count: { 100000u, 1000000u }) {
+      std::vector<SceneObject> objects = generateScene(count);
+      SceneObjects soa(objects);
+      std::vector<glm::mat4> reference(count);
+      std::vector<glm::mat4> instances(count);
+      uint32_t visible = 0;
+      auto measure = [&](auto &&cull) {
+        Samples samples;
+        for (uint32_t idx = 0; idx < iterations; ++idx) {
+          samples.record(timeMilliseconds([&]() { visible = cull(); }));
+        }
+        return samples.median();
+      };
+
+      double naive = measure([&]() {
+        return cullNaive(objects, viewProjection, reference.data());
+      });
+      uint32_t expected = visible;
+      std::cout << "  " << std::setw(7) << count << " objects: naive " << naive << " ("
+                << visible << " visible)";
+      std::string name = "scene." + std::to_string(count);
+      this->benchmarkResults.add(name + ".naive_ms", naive, Better::Lower);
+      for (CullKernel kernel: { CullKernel::Scalar, CullKernel::SSE, CullKernel::AVX2 }) {
+        if (!cullKernelSupported(kernel)) {
+          continue;
+        }
+        double milliseconds = measure([&]() {
+          return soa.cull(viewProjection, kernel, reinterpret_cast<float *>(instances.data()));
+        });
+        if (visible != expected || !sameTransforms(reference.data(),
+            reinterpret_cast<const float *>(instances.data()), visible)) {
+          throw std::runtime_error(std::string("the ") + cullKernelName(kernel)
+            + " culling kernel disagrees with the naive loop!");
+        }
+        std::cout << ", " << cullKernelName(kernel) << " " << milliseconds << " ("
+                  << std::setprecision(2) << (milliseconds > 0.0 ? naive / milliseconds : 0.0)
+                  << "x)" << std::setprecision(3);
+        this->benchmarkResults.add(name + "." + cullKernelName(kernel) + "_ms", milliseconds,
+          Better::Lower);
+      }
+      std::cout << std::endl;
+    }
+    std::cout.unsetf(std::ios_base::floatfield);
+  }
+
+  /**
+   * Record the compute work of the frame. In serial mode it goes into the frame command buffer and
+   * the render pass waits for it, in async mode it is submitted to the compute queue on its own.
+   */
+  void recordCompute(FrameContext &frame) {
+    if (this->computeMode == ComputeMode::Serial) {
+      {
+        TimestampProfiler::Scope scope(*this->graphicsProfiler, frame.commandBuffer, "particles");
+        this->particles->record(frame.commandBuffer, computeDeltaTime);
+      }
+      VkMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      };
+      vkCmdPipelineBarrier(frame.commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    } else if (this->computeMode == ComputeMode::Async) {
+      this->dispatchParticles();
+    }
+  }
+
+  /**
+   * Submit one step of the particle simulation to the compute queue.
+   */
+  void dispatchParticles() {
+    VkCommandBuffer commandBuffer = this->computeQueue->begin();
+    this->computeProfiler->begin(commandBuffer, this->computeQueue->slot());
+    {
+      TimestampProfiler::Scope scope(*this->computeProfiler, commandBuffer, "particles");
+      this->particles->record(commandBuffer, computeDeltaTime);
+    }
+    this->computeQueue->submit();
+  }
+
+  /**
+   * The size of the window in pixels, which might differ from its size in screen coordinates on
+   * high DPI displays.
+   */
+  VkExtent2D framebufferExtent() {
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(this->window, &width, &height);
+    return { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+  }
+
+  /**
+   * Recreate the swap chain for the new size of the window. The old swap chain is retired to the
+   * FrameRing until the frames in flight using it are done, so there is no vkDeviceWaitIdle here.
+   */
+  void recreateSwapchain() {
+    VkExtent2D extent = this->framebufferExtent();
+    // A minimized window has a 0x0 framebuffer for which no swap chain can be created. Wait until
+    // it comes back.
+    while (extent.width == 0 || extent.height == 0) {
+      glfwWaitEvents();
+      extent = this->framebufferExtent();
+    }
+    this->swapchain->recreate(extent, *this->frames);
+    this->framebufferResized = false;
   }
 
   void mainLoop() {
-    while (!glfwWindowShouldClose(this->window)) {
-      glfwPollEvents();
+    auto start = std::chrono::steady_clock::now();
+    auto previous = start;
+    uint64_t hostAllocations = 0;
+    while (this->options.headless
+           ? this->frames->frameNumber < this->options.frameCount
+           : !glfwWindowShouldClose(this->window)) {
+      if (!this->options.headless) {
+        glfwPollEvents();
+      }
+      this->drawFrame();
+      if (this->frames->frameNumber == warmupFrames) {
+        hostAllocations = this->hostAllocator.allocationCount();
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      this->frameStats.record(std::chrono::duration<double, std::milli>(now - previous).count());
+      previous = now;
+    }
+    // Everything in flight must be done before we start destroying resources.
+    this->frames->waitIdle();
+
+    auto elapsed = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+    std::cout << "rendered " << this->frames->frameNumber << " frames in " << elapsed << " ms ("
+              << this->frames->size() << " frames in flight)" << std::endl;
+    if (this->options.frameStats) {
+      this->frameStats.report(std::cout);
+    }
+    if (this->options.memoryStats) {
+      this->memoryAllocator->report(std::cout);
+    }
+    if (this->capture) {
+      this->capture->finish();
+      this->capture->report(std::cout);
+      this->benchmarkResults.add("capture.fps", this->capture->framesPerSecond(), Better::Higher);
+      this->benchmarkResults.add("capture.throughput_mib_s", this->capture->mebibytesPerSecond(),
+        Better::Higher);
+      this->benchmarkResults.add("capture.latency_p50_ms", this->capture->latencies.percentile(50),
+        Better::Lower);
+      this->benchmarkResults.add("capture.latency_p99_ms", this->capture->latencies.percentile(99),
+        Better::Lower);
+      this->benchmarkResults.add("capture.stalls", this->capture->stalls, Better::Lower);
+    }
+    if (this->options.uploadBenchmark > 0) {
+      this->uploadQueue->report(std::cout, elapsed);
+      this->benchmarkResults.add("upload.throughput_mib_s", this->uploadQueue->throughput(elapsed),
+        Better::Higher);
+    }
+    this->benchmarkResults.add("frames.count", this->frameStats.values.size(), Better::None);
+    this->benchmarkResults.add("frames.fps",
+      elapsed > 0.0 ? this->frames->frameNumber * 1000.0 / elapsed : 0.0, Better::Higher);
+    this->benchmarkResults.add("frames.p50_ms", this->frameStats.percentile(50), Better::Lower);
+    this->benchmarkResults.add("frames.p99_ms", this->frameStats.percentile(99), Better::Lower);
+    // Not compared: a single frame the OS preempted decides it.
+    this->benchmarkResults.add("frames.max_ms", this->frameStats.percentile(100), Better::None);
+    // What the driver allocates through our callbacks once warm, see HostAllocator.
+    uint64_t steadyFrames = this->frames->frameNumber - std::min(this->frames->frameNumber,
+      warmupFrames);
+    this->benchmarkResults.add("frames.host_allocations_per_frame", steadyFrames > 0
+      ? double(this->hostAllocator.allocationCount() - hostAllocations) / steadyFrames : 0.0,
+      Better::Lower);
+  }
+
+  /**
+   * The headless main loop over several devices: every suitable physical device, not only the
+   * best one, gets DeviceWorker instances of its own (see --devices) and the frames are spread
+   * over them by a DeviceScheduler. The device of initVulkan stays idle.
+   */
+  void renderOnDevices() {
+    if (!this->options.headless) {
+      throw std::runtime_error("rendering on several devices needs --headless!");
+    }
+    CapabilityCache capabilityCache(this->options.capabilityCachePath, enableValidationLayers);
+    PhysicalDeviceEnumerator availablePhysicalDevices(this->instance, VK_NULL_HANDLE,
+      this->apiVersion, capabilityCache);
+    std::vector<const PhysicalDevice *> suitable;
+    for (auto &physicalDevice: availablePhysicalDevices.physicalDevices) {
+      if (this->isDeviceSuitable(physicalDevice, false)) {
+        suitable.push_back(&physicalDevice);
+      }
+    }
+    if (suitable.empty()) {
+      throw std::runtime_error("failed to find a suitable GPU!");
+    }
+    this->reportDeviceGroups();
+
+    // More workers than devices share them in turn, which is how a single lavapipe device can
+    // stand for several.
+    uint32_t workerCount = this->options.deviceWorkers == allDevices
+      ? static_cast<uint32_t>(suitable.size())
+      : this->options.deviceWorkers;
+    std::vector<const char *> layers;
+    if (enableValidationLayers) {
+      layers = validationLayers;
+    }
+    std::vector<std::unique_ptr<DeviceWorker>> workers;
+    for (uint32_t idx = 0; idx < workerCount; ++idx) {
+      const PhysicalDevice &physicalDevice = *suitable[idx % suitable.size()];
+      workers.push_back(std::make_unique<DeviceWorker>(physicalDevice.device,
+        physicalDevice.properties, physicalDevice.memoryProperties,
+        physicalDevice.queueFamilyIndices.at(VK_QUEUE_GRAPHICS_BIT), *this->shaders, layers,
+        VkExtent2D { this->options.width, this->options.height }, this->options.framesInFlight,
+        this->hostAllocator.callbacks()));
+    }
+
+    // Enough queued per worker to keep its frames in flight busy, see DeviceScheduler.
+    DeviceScheduler scheduler(workers, this->options.deviceSplit, this->options.framesInFlight);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t frame = 0; frame < this->options.frameCount; ++frame) {
+      scheduler.submit(frame);
+    }
+    scheduler.finish();
+    double elapsed = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+
+    scheduler.report(std::cout, elapsed);
+    this->benchmarkResults.add("devices.count", workers.size(), Better::None);
+    this->benchmarkResults.add("devices.fps",
+      elapsed > 0.0 ? this->options.frameCount * 1000.0 / elapsed : 0.0, Better::Higher);
+    for (size_t idx = 0; idx < workers.size(); ++idx) {
+      this->benchmarkResults.add("devices." + std::to_string(idx) + "_frames",
+        workers[idx]->framesRendered, Better::None);
+    }
+  }
+
+  /**
+   * Print the device groups of more than one device. A group, e.g. linked GPUs, could render
+   * alternate frames from a single logical device with device masks. Groups are rare and
+   * software implementations never form one, so the workers treat every device on its own.
+   */
+  void reportDeviceGroups() {
+    if (this->apiVersion < VK_API_VERSION_1_1) {
+      return;
+    }
+    uint32_t groupCount = 0;
+    vkEnumeratePhysicalDeviceGroups(this->instance, &groupCount, nullptr);
+    std::vector<VkPhysicalDeviceGroupProperties> groups(groupCount, {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GROUP_PROPERTIES,
+    });
+    vkEnumeratePhysicalDeviceGroups(this->instance, &groupCount, groups.data());
+    for (auto &group: groups) {
+      if (group.physicalDeviceCount > 1) {
+        std::cout << "device group of " << group.physicalDeviceCount << " devices, rendered "
+                  << "as independent devices" << std::endl;
+      }
+    }
+  }
+
+  /**
+   * Record and submit one frame. Only waits for the GPU if it is still busy with the frame that
+   * used the same slot, framesInFlight frames ago.
+   */
+  void drawFrame() {
+    CpuScope frameScope(this->trace.get(), this->cpuTrack, "frame");
+    FrameContext &frame = [this]() -> FrameContext & {
+      CpuScope scope(this->trace.get(), this->cpuTrack, "wait for frame slot");
+      return this->frames->begin();
+    }();
+    this->graphicsProfiler->begin(frame.commandBuffer, frame.index);
+    if (this->capture) {
+      // The frames the ring now knows are done can be written.
+      this->capture->collect(this->frames->completedFrames);
+    }
+    if (this->options.headless) {
+      this->stageUploads(frame);
+      OffscreenTarget &target = *this->offscreenTargets[frame.index];
+      {
+        CpuScope scope(this->trace.get(), this->cpuTrack, "record and submit");
+        UploadWait uploadWait = this->uploadQueue->acquire(frame.commandBuffer);
+        this->recordCompute(frame);
+        this->recordFrame(frame, target.framebuffer, target.extent);
+        if (this->capture) {
+          this->capture->record(frame.commandBuffer, target.image, frame.frameNumber);
+        }
+        this->submitFrame(frame, {}, {}, uploadWait);
+      }
+      this->frames->advance();
+      return;
+    }
+
+    uint32_t imageIndex;
+    VkResult result = this->swapchain->acquire(frame.imageAvailable, &imageIndex);
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+      // Nothing was submitted for this slot: its fence is still signaled and its command buffer
+      // is reset by the next begin().
+      this->recreateSwapchain();
+      return;
+    } else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+      throw std::runtime_error("failed to acquire swap chain image!");
+    }
+    // After the acquire: a frame dropped because the swap chain is out of date streams nothing.
+    this->stageUploads(frame);
+
+    {
+      CpuScope scope(this->trace.get(), this->cpuTrack, "record and submit");
+      // Only once we know this frame gets submitted: acquired uploads must be waited for.
+      UploadWait uploadWait = this->uploadQueue->acquire(frame.commandBuffer);
+      this->recordCompute(frame);
+      this->recordFrame(frame, this->swapchain->framebuffers[imageIndex], this->swapchain->extent);
+      this->submitFrame(frame, frame.imageAvailable, this->swapchain->renderFinished[imageIndex],
+        uploadWait);
+    }
+    this->frames->advance();
+
+    {
+      CpuScope scope(this->trace.get(), this->cpuTrack, "present");
+      result = this->swapchain->present(this->presentQueue, imageIndex);
+    }
+    // A suboptimal swap chain can still be presented to, but we recreate it for the next frame.
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
+        this->framebufferResized) {
+      this->recreateSwapchain();
+    } else if (result != VK_SUCCESS) {
+      throw std::runtime_error("failed to present swap chain image!");
+    }
+  }
+
+  /**
+   * Stream the texture levels and record the uploads of the frame, to be acquired by its command
+   * buffer. Only called once the frame is known to be submitted.
+   */
+  void stageUploads(const FrameContext &frame) {
+    if (this->textures) {
+      // Before the uploads are flushed below, so that the levels it streams get to this frame.
+      this->textures->update();
+    }
+    if (!this->uploadTargets.empty()) {
+      this->uploadTargets[frame.index]->upload(*this->uploadQueue, this->uploadData);
+      this->uploadQueue->flush();
+    }
+  }
+
+  /**
+   * End the frame command buffer and submit it. The frame fence gets signaled when it is done.
+   * `upload` is what the frame must wait for before using the resources it acquired from the
+   * upload queue.
+   */
+  void submitFrame(FrameContext &frame, VkSemaphore waitSemaphore, VkSemaphore signalSemaphore,
+    const UploadWait &upload = {}) {
+    if (vkEndCommandBuffer(frame.commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record command buffer!");
+    }
+
+    std::vector<VkSemaphore> waitSemaphores;
+    std::vector<VkPipelineStageFlags> waitStages;
+    // One value per wait semaphore, ignored for binary semaphores.
+    std::vector<uint64_t> waitValues;
+    if (waitSemaphore != VK_NULL_HANDLE) {
+      // Writing to the image must wait for the presentation engine to be done reading it.
+      waitSemaphores.push_back(waitSemaphore);
+      waitStages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+      waitValues.push_back(0);
+    }
+    if (upload.semaphore != VK_NULL_HANDLE) {
+      waitSemaphores.push_back(upload.semaphore);
+      waitStages.push_back(upload.stages);
+      waitValues.push_back(upload.value);
+    }
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size()),
+      .pWaitSemaphoreValues = waitValues.data(),
+    };
+    VkSubmitInfo submitInfo = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .pNext = upload.semaphore != VK_NULL_HANDLE ? &timelineInfo : nullptr,
+      .waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size()),
+      .pWaitSemaphores = waitSemaphores.data(),
+      .pWaitDstStageMask = waitStages.data(),
+      .commandBufferCount = 1,
+      .pCommandBuffers = &frame.commandBuffer,
+      .signalSemaphoreCount = signalSemaphore != VK_NULL_HANDLE ? 1u : 0u,
+      .pSignalSemaphores = &signalSemaphore,
+    };
+    vkResetFences(this->device, 1, &frame.inFlightFence);
+    if (vkQueueSubmit(this->graphicsQueue, 1, &submitInfo, frame.inFlightFence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to submit draw command buffer!");
     }
   }
 
   void cleanup() {
-    this->unSetupDebugMessenger();
+    // A cache that cannot be written only makes the next start slower.
+    try {
+      this->pipelineCache->save();
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+    }
+    this->pipeline.reset();
+    this->meshPipeline.reset();
+    this->fragmentShader.reset();
+    this->vertexShader.reset();
+    this->pipelineCache.reset();
+    // The framebuffers go with the render targets, before the render pass.
+    this->swapchain.reset();
+    this->offscreenTargets.clear();
+    this->renderPass.reset();
+    // Before the frames: the secondary command buffers are executed by theirs.
+    this->recorder.reset();
+    this->jobs.reset();
+    // Also destroys what was retired in the meantime.
+    this->frames.reset();
+    this->capture.reset();
+    // Before the bindless table, which its textures have entries in.
+    this->textures.reset();
+    this->uploadTargets.clear();
+    this->mesh.reset();
+    this->instances.reset();
+    this->gpuCulling.reset();
+    this->bindless.reset();
+    this->descriptorSets.reset();
+    this->uniforms.reset();
+    this->uploadQueue.reset();
+    this->computeQueue.reset();
+    this->computeProfiler.reset();
+    this->graphicsProfiler.reset();
+    // After every resource using device memory.
+    this->memoryAllocator.reset();
+    this->debugMessenger.reset();
+    if (this->debugMessages) {
+      this->debugMessages->stop();
+      if (this->options.debugStats) {
+        this->debugMessages->report(std::cout);
+      }
+    }
     // Goes with vkCreateDevice
-    vkDestroyDevice(this->device, nullptr);
-    // Goes with glfwCreateWindowSurface.
+    this->device.reset();
+    // Goes with glfwCreateWindowSurface, empty in headless mode.
     // Surface must be destroyed before the instance.
-    vkDestroySurfaceKHR(this->instance, this->surface, nullptr);
+    this->surface.reset();
     // Goes with vkCreateInstance
-    vkDestroyInstance(this->instance, nullptr);
+    this->instance.reset();
+    // Everything the driver allocated through the callbacks should have been given back by now.
+    if (this->options.allocationStats) {
+      this->hostAllocator.report(std::cout);
+    }
     // For the glfw library
-    glfwDestroyWindow(this->window);
-    glfwTerminate();
+    if (this->window != nullptr) {
+      glfwDestroyWindow(this->window);
+      glfwTerminate();
+    }
   }
 
 private:
-  VkInstance createInstance() {
+  UniqueInstance createInstance() {
     if (enableValidationLayers && !this->checkValidationLayerSupport(validationLayers)) {
       throw std::runtime_error("validation layers requested, but not available!");
     }
 
+    // Vulkan 1.0 loaders do not have vkEnumerateInstanceVersion. We ask for 1.2 at most, for
+    // timeline semaphores, and keep working with 1.0 otherwise.
+    auto enumerateInstanceVersion = reinterpret_cast<PFN_vkEnumerateInstanceVersion>(
+      vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion"));
+    if (enumerateInstanceVersion != nullptr &&
+        enumerateInstanceVersion(&this->apiVersion) == VK_SUCCESS) {
+      this->apiVersion = std::min<uint32_t>(this->apiVersion, VK_API_VERSION_1_2);
+    } else {
+      this->apiVersion = VK_API_VERSION_1_0;
+    }
+
     VkApplicationInfo appInfo = {
       .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
       .pNext = nullptr,
@@ -285,13 +1667,15 @@ private:
       .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
       .pEngineName = "No Engine",
       .engineVersion = VK_MAKE_VERSION(1, 0, 0),
-      .apiVersion = VK_API_VERSION_1_0,
+      .apiVersion = this->apiVersion,
     };
 
     // Vulkan is a platform agnostic API, which means that you need an extension to interface with
     // the window system. GLFW has a handy built-in function that returns the extension(s) it needs
-    // to do that
-    ExtensionInfo glfwExtensions = this->glfwExtensionInfo();
+    // to do that. Headless rendering does not need any of those.
+    ExtensionInfo glfwExtensions = this->options.headless
+      ? ExtensionInfo {}
+      : this->glfwExtensionInfo();
     ExtensionInfo debugExtensions = this->getDebugExtensions();
     ExtensionInfo extensionInfo;
     std::merge(
@@ -311,17 +1695,17 @@ private:
 
     // The general pattern that object creation function parameters in Vulkan follow is:
     // 1. Pointer to struct with creation info
-    // 2. Pointer to custom allocator callbacks, always nullptr in this tutorial
+    // 2. Pointer to custom allocator callbacks, nullptr lets the driver use its own allocator
     // 3. Pointer to the variable that stores the handle to the new object
     // https://www.khronos.org/registry/vulkan/specs/1.2-extensions/man/html/vkCreateInstance.html
     VkInstance instance;
-    VkResult result = vkCreateInstance(&createInfo, nullptr, &instance);
+    VkResult result = vkCreateInstance(&createInfo, this->hostAllocator.callbacks(), &instance);
     if (result != VK_SUCCESS) {
       std::cerr << "vkCreateInstance failed with " << result << std::endl;
       throw std::runtime_error("failed to create instance!");
     }
 
-    return instance;
+    return UniqueInstance(instance, { .allocationCallbacks = this->hostAllocator.callbacks() });
   }
 
   /**
@@ -342,20 +1726,27 @@ private:
     return { };
   }
 
-  VkSurfaceKHR createSurface(VkInstance instance, GLFWwindow* window) {
+  UniqueSurface createSurface(VkInstance instance, GLFWwindow* window) {
     VkSurfaceKHR surface;
-    if (glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS) {
+    if (glfwCreateWindowSurface(instance, window, this->hostAllocator.callbacks(), &surface)
+        != VK_SUCCESS) {
       throw std::runtime_error("failed to create window surface!");
     }
 
-    return surface;
+    return UniqueSurface(surface,
+      { .instance = instance, .allocationCallbacks = this->hostAllocator.callbacks() });
   }
 
   /**
-   * Enumerate, select and return the best physical device available.
+   * Enumerate, select and return the best physical device available. Without a surface (headless
+   * mode), devices unable to present are still eligible. The device selected by the previous run
+   * is picked again without scoring the others, as long as it is still there and suitable and no
+   * other device appeared since.
    */
-  PhysicalDevice getPhysicalDevice(const VkInstance instance, const VkSurfaceKHR surface) {
-    PhysicalDeviceEnumerator availablePhysicalDevices(instance, surface);
+  PhysicalDevice getPhysicalDevice(const VkInstance instance, const VkSurfaceKHR surface,
+    CapabilityCache &capabilityCache) {
+    PhysicalDeviceEnumerator availablePhysicalDevices(instance, surface, this->apiVersion,
+      capabilityCache);
 
     if (availablePhysicalDevices.physicalDevices.size() <= 0) {
       throw std::runtime_error("No physical device present!");
@@ -373,31 +1764,34 @@ private:
 
     // TODO: put here a check on the mandatory properties
 
+    // Presentation is only required when rendering to a window.
+    bool needsPresentation = surface != VK_NULL_HANDLE;
+    // A device missing from the snapshot is new, e.g. a GPU or an ICD added since: it might be
+    // better than the previous choice, so every device is scored again.
+    const DeviceCapabilities *previous = capabilityCache.selectedDevice();
+    if (previous != nullptr && capabilityCache.misses == 0) {
+      for (auto &physicalDevice: availablePhysicalDevices.physicalDevices) {
+        if (previous->matches(physicalDevice.identity) &&
+            this->isDeviceSuitable(physicalDevice, needsPresentation)) {
+          this->saveCapabilityCache(capabilityCache);
+          return physicalDevice;
+        }
+      }
+    }
+
     // Establish a score for each device through an heuristic and select the best device according
     // to that score.
     size_t bestDevice = 0;
     uint32_t bestScore = 0;
-    for (size_t idx = 0; auto physicalDevice: availablePhysicalDevices.physicalDevices) {
-      uint32_t score = 0;
-
-      // We need the GPU to have a graphic queue...
-      if (!physicalDevice.queueFamilyIndices.contains(VK_QUEUE_GRAPHICS_BIT)) {
-        continue;
-      }
-      /// ... a queue able to manage a presentation state...
-      if (physicalDevice.presentationStateQueueIndex == -1) {
-        continue;
-      }
-      /// ... and to ha ve a swap chain.
-      if (std::find_if(physicalDevice.availableExtensions.begin(),
-                       physicalDevice.availableExtensions.end(),
-                       [](auto &extension) {
-                         return std::string(extension.extensionName) == VK_KHR_SWAPCHAIN_EXTENSION_NAME;
-                       }
-          ) == physicalDevice.availableExtensions.end()) {
+    for (size_t idx = 0; idx < availablePhysicalDevices.physicalDevices.size(); ++idx) {
+      auto &physicalDevice = availablePhysicalDevices.physicalDevices[idx];
+      if (!this->isDeviceSuitable(physicalDevice, needsPresentation)) {
         continue;
       }
 
+      // Software implementations like lavapipe report VK_PHYSICAL_DEVICE_TYPE_CPU and get no bonus,
+      // but remain selectable when nothing better is available.
+      uint32_t score = 0;
       score += (physicalDevice.properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
         ? 1000 : 0;
       score += physicalDevice.properties.limits.maxImageDimension2D;
@@ -408,21 +1802,72 @@ private:
       }
     }
 
+    if (bestScore == 0) {
+      throw std::runtime_error("failed to find a suitable GPU!");
+    }
+
+    capabilityCache.select(availablePhysicalDevices.physicalDevices[bestDevice].identity);
+    this->saveCapabilityCache(capabilityCache);
     return availablePhysicalDevices.physicalDevices[bestDevice];
   }
 
+  bool isDeviceSuitable(const PhysicalDevice &physicalDevice, bool needsPresentation) {
+    // We need the GPU to have a graphic queue...
+    if (!physicalDevice.queueFamilyIndices.contains(VK_QUEUE_GRAPHICS_BIT)) {
+      return false;
+    }
+    /// ... a queue able to manage a presentation state...
+    if (needsPresentation && physicalDevice.presentationStateQueueIndex == -1) {
+      return false;
+    }
+    /// ... and to ha ve a swap chain.
+    if (needsPresentation &&
+        std::find_if(physicalDevice.availableExtensions.begin(),
+                     physicalDevice.availableExtensions.end(),
+                     [](auto &extension) {
+                       return std::string(extension.extensionName)
+                         == VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+                     }
+        ) == physicalDevice.availableExtensions.end()) {
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Failing to write the capability cache only makes the next start slower.
+   */
+  void saveCapabilityCache(CapabilityCache &capabilityCache) {
+    try {
+      capabilityCache.save();
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
   /**
    * Creates and returns a logical device.
    */
-  VkDevice getLogicalDevice(PhysicalDevice &physicalDevice) {
+  UniqueDevice getLogicalDevice(PhysicalDevice &physicalDevice) {
     float queuePriority = 1.0f;
     // The queues we need.
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
     std::set<uint32_t> uniqueQueueFamilies = {
       physicalDevice.queueFamilyIndices[VK_QUEUE_GRAPHICS_BIT],
-      // This could be equal to -1 but let's ignore that for the moment
-      static_cast<uint32_t>(physicalDevice.presentationStateQueueIndex),
     };
+    // Equal to -1 in headless mode, where nothing is presented.
+    bool presents = physicalDevice.presentationStateQueueIndex != -1;
+    if (presents) {
+      uniqueQueueFamilies.insert(static_cast<uint32_t>(physicalDevice.presentationStateQueueIndex));
+    }
+    // Uploads go through their own queue, when the device has a transfer family we prefer.
+    if (this->options.transferQueue) {
+      uniqueQueueFamilies.insert(physicalDevice.queueFamilyIndices[VK_QUEUE_TRANSFER_BIT]);
+    }
+    // And so does compute work.
+    if (this->options.computeQueue) {
+      uniqueQueueFamilies.insert(physicalDevice.queueFamilyIndices[VK_QUEUE_COMPUTE_BIT]);
+    }
     for (uint32_t queueFamily : uniqueQueueFamilies) {
         VkDeviceQueueCreateInfo queueCreateInfo = {
           .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
@@ -434,15 +1879,111 @@ private:
     }
 
     // TODO: Also use this array when checking extension availablility in getPhysicalDevice.
-    const std::vector<const char*> deviceExtensions = {
-      VK_KHR_SWAPCHAIN_EXTENSION_NAME
-    };
+    std::vector<const char*> deviceExtensions;
+    if (presents) {
+      deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
 
-    // The needed features.
+    // The needed features. Only what we use is enabled, optional features only when the device
+    // has them.
     VkPhysicalDeviceFeatures deviceFeatures = {};
+    bool gpuCulling = this->options.gpuCulling && this->options.objectCount > 0;
+    if (gpuCulling) {
+      // Each indirect draw picks its transform with firstInstance.
+      if (!physicalDevice.features.drawIndirectFirstInstance) {
+        throw std::runtime_error("GPU culling needs drawIndirectFirstInstance, which the device "
+          "does not support!");
+      }
+      deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+      // Without it, indirect draws are issued one by one.
+      deviceFeatures.multiDrawIndirect = physicalDevice.features.multiDrawIndirect;
+    }
+    // Timeline semaphores and draw counts are core in Vulkan 1.2, for both the instance and the
+    // device. Features beyond 1.0 are queried and enabled through a VkPhysicalDeviceFeatures2
+    // chain, which then replaces pEnabledFeatures.
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    };
+    VkPhysicalDeviceFeatures2 features2 = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+      .pNext = &vulkan12Features,
+    };
+    bool vulkan12 = this->apiVersion >= VK_API_VERSION_1_2 &&
+      physicalDevice.properties.apiVersion >= VK_API_VERSION_1_2;
+    // Descriptor indexing is also core in 1.2. Before, VK_EXT_descriptor_indexing brings it to 1.1
+    // devices, where the VkPhysicalDeviceFeatures2 chain already exists.
+    bool vulkan11 = this->apiVersion >= VK_API_VERSION_1_1 &&
+      physicalDevice.properties.apiVersion >= VK_API_VERSION_1_1;
+    bool bindless = this->options.drawData == DrawData::Bindless ||
+      this->options.descriptorBenchmark > 0 || this->options.streamingBenchmark > 0;
+    VkPhysicalDeviceDescriptorIndexingFeatures indexingFeatures = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+    };
+    bool indexingExtension = !vulkan12 && vulkan11 && bindless &&
+      std::any_of(physicalDevice.availableExtensions.begin(),
+        physicalDevice.availableExtensions.end(), [](auto &extension) {
+          return std::string(extension.extensionName) == VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME;
+        });
+    if (indexingExtension) {
+      features2.pNext = &indexingFeatures;
+    }
+    bool chained = vulkan12 || indexingExtension;
+    this->timelineSemaphores = false;
+    this->drawIndirectCount = false;
+    this->descriptorIndexing = false;
+    if (chained) {
+      vkGetPhysicalDeviceFeatures2(physicalDevice.device, &features2);
+      features2.features = deviceFeatures;
+    }
+    if (vulkan12) {
+      this->timelineSemaphores = this->options.timelineSemaphores &&
+        vulkan12Features.timelineSemaphore == VK_TRUE;
+      this->drawIndirectCount = gpuCulling && vulkan12Features.drawIndirectCount == VK_TRUE;
+      this->descriptorIndexing = bindless && supportsBindless(vulkan12Features);
+      vulkan12Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+        .drawIndirectCount = this->drawIndirectCount,
+        .timelineSemaphore = this->timelineSemaphores,
+      };
+      if (this->descriptorIndexing) {
+        vulkan12Features.descriptorIndexing = VK_TRUE;
+        enableBindless(vulkan12Features);
+      }
+    } else if (indexingExtension) {
+      this->descriptorIndexing = supportsBindless(indexingFeatures);
+      indexingFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+      };
+      if (this->descriptorIndexing) {
+        enableBindless(indexingFeatures);
+        deviceExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+      }
+    }
+    if (this->descriptorIndexing) {
+      // The limits of the descriptor arrays, see createDescriptors.
+      this->descriptorIndexingProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES,
+      };
+      VkPhysicalDeviceProperties2 properties2 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &this->descriptorIndexingProperties,
+      };
+      vkGetPhysicalDeviceProperties2(physicalDevice.device, &properties2);
+    }
+    // The texture streaming asks the heap budget through vkGetPhysicalDeviceMemoryProperties2,
+    // which is core in 1.1. Without it, it has to guess what the other processes use.
+    this->memoryBudget = vulkan11 && this->options.streamingBenchmark > 0 &&
+      std::any_of(physicalDevice.availableExtensions.begin(),
+        physicalDevice.availableExtensions.end(), [](auto &extension) {
+          return std::string(extension.extensionName) == VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+        });
+    if (this->memoryBudget) {
+      deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    }
     // Now the main logical device create structure.
     VkDeviceCreateInfo createInfo = {
       .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+      .pNext = chained ? &features2 : nullptr,
       .queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size()),
       .pQueueCreateInfos = queueCreateInfos.data(),
       // Validation layers also needs to be specified when creating a logical device.
@@ -450,21 +1991,217 @@ private:
       .ppEnabledLayerNames = enableValidationLayers ? validationLayers.data() : nullptr,
       .enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size()),
       .ppEnabledExtensionNames = deviceExtensions.data(),
-      .pEnabledFeatures = &deviceFeatures,
+      .pEnabledFeatures = chained ? nullptr : &deviceFeatures,
     };
     VkDevice device;
-    if (vkCreateDevice(physicalDevice.device, &createInfo, nullptr, &device) != VK_SUCCESS) {
+    if (vkCreateDevice(physicalDevice.device, &createInfo, this->hostAllocator.callbacks(), &device)
+        != VK_SUCCESS) {
         throw std::runtime_error("failed to create logical device!");
     }
 
-    return device;
+    return UniqueDevice(device, { .allocationCallbacks = this->hostAllocator.callbacks() });
+  }
+
+  /**
+   * Record the commands rendering one frame into the framebuffer. The render pass takes care of
+   * the layout transitions. With recording threads, the draws are recorded in parallel into
+   * secondary command buffers.
+   */
+  void recordFrame(FrameContext &frame, VkFramebuffer framebuffer, VkExtent2D extent) {
+    // The background color changes over time, to see frames go by.
+    float t = static_cast<float>(frame.frameNumber % 256) / 255.0f;
+    VkClearValue clearColor = { .color = { .float32 = { t, 0.0f, 1.0f - t, 1.0f } } };
+    VkRenderPassBeginInfo renderPassInfo = {
+      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+      .renderPass = this->renderPass,
+      .framebuffer = framebuffer,
+      .renderArea = { .offset = { 0, 0 }, .extent = extent },
+      .clearValueCount = 1,
+      .pClearValues = &clearColor,
+    };
+
+    // The mesh, or the camera in the scene, turns a full circle every 360 frames.
+    this->meshAngle = glm::radians(static_cast<float>(frame.frameNumber % 360));
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f),
+      glm::vec3(std::sin(this->meshAngle), 0.0f, -std::cos(this->meshAngle)),
+      glm::vec3(0.0f, 1.0f, 0.0f));
+    if (this->scene) {
+      CpuScope cullScope(this->trace.get(), this->cpuTrack, "cull");
+      this->visibleObjects = this->scene->cull(this->cellProjection(extent, 60.0f, 1000.0f) * view,
+        this->options.cullKernel, this->instances->data(frame.index));
+      this->instanceBuffer = this->instances->buffers[frame.index];
+    } else if (this->gpuCulling) {
+      // Outside of the render pass, which only accepts graphics work.
+      TimestampProfiler::Scope scope(*this->graphicsProfiler, frame.commandBuffer, "cull");
+      this->gpuCulling->record(frame.commandBuffer, frame.index,
+        this->cellProjection(extent, 60.0f, 1000.0f) * view);
+      this->instanceBuffer = this->gpuCulling->instanceBuffer(frame.index);
+      this->cullingSlot = frame.index;
+    }
+
+    // The GPU is done with the previous frame of this slot, and with its draw data.
+    if (this->uniforms) {
+      this->uniforms->begin(frame.index);
+    }
+    if (this->drawData == DrawData::Cached) {
+      // The same set every frame: the offsets into the arena are dynamic.
+      this->drawDataSet = this->descriptorSets->get({
+        {
+          .binding = 0,
+          .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+          .buffer = this->uniforms->buffer,
+          .offset = 0,
+          .range = sizeof(glm::mat4),
+        },
+      });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    TimestampProfiler::Scope scope(*this->graphicsProfiler, frame.commandBuffer, "triangle pass");
+    if (this->recordThreads == 0) {
+      vkCmdBeginRenderPass(frame.commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+      this->recordDraws(frame.commandBuffer, extent, 0, this->drawCount);
+    } else {
+      // A render pass started with secondary contents only accepts vkCmdExecuteCommands.
+      vkCmdBeginRenderPass(frame.commandBuffer, &renderPassInfo,
+        VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+      VkCommandBufferInheritanceInfo inheritance = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+        .renderPass = this->renderPass,
+        .subpass = 0,
+        .framebuffer = framebuffer,
+      };
+      std::vector<VkCommandBuffer> secondaries = this->recorder->record(frame.index,
+        this->recordThreads, this->drawCount, inheritance,
+        [this, extent](VkCommandBuffer commandBuffer, uint32_t begin, uint32_t end) {
+          this->recordDraws(commandBuffer, extent, begin, end);
+        });
+      vkCmdExecuteCommands(frame.commandBuffer, secondaries.size(), secondaries.data());
+    }
+    vkCmdEndRenderPass(frame.commandBuffer);
+    this->recordMilliseconds = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+  }
+
+  /**
+   * Record the draws in [begin, end). The triangles, or the meshes, are laid out on a grid, each
+   * one drawn in its own viewport: a single draw fills the whole framebuffer. State is not
+   * inherited by secondary command buffers, so each range binds the pipeline and sets the scissor
+   * again.
+   */
+  void recordDraws(VkCommandBuffer commandBuffer, VkExtent2D extent, uint32_t begin,
+    uint32_t end) {
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+      this->mesh ? this->meshPipeline->pipeline : this->pipeline->pipeline);
+    VkRect2D scissor = { .offset = { 0, 0 }, .extent = extent };
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(double(this->drawCount))));
+    uint32_t rows = (this->drawCount + columns - 1) / columns;
+    float width = static_cast<float>(extent.width) / columns;
+    float height = static_cast<float>(extent.height) / rows;
+    if (this->scene || this->gpuCulling) {
+      // The transforms of the visible objects, see recordFrame.
+      this->mesh->bind(commandBuffer);
+      VkDeviceSize offset = 0;
+      vkCmdBindVertexBuffers(commandBuffer, MeshPipeline::instanceBinding, 1,
+        &this->instanceBuffer, &offset);
+    } else if (this->mesh) {
+      this->mesh->bind(commandBuffer);
+      if (this->drawData == DrawData::Bindless) {
+        // Once for all the draws.
+        this->bindless->bind(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+          this->meshPipeline->layout);
+      }
+    }
+    glm::mat4 viewProjection = this->cellProjection(extent, 45.0f, 100.0f) * glm::lookAt(
+      glm::vec3(0.0f, 0.0f, this->meshDistance), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    for (uint32_t idx = begin; idx < end; ++idx) {
+      VkViewport viewport = {
+        .x = (idx % columns) * width,
+        .y = (idx / columns) * height,
+        .width = width,
+        .height = height,
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f,
+      };
+      vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+      if (this->gpuCulling) {
+        this->gpuCulling->draw(commandBuffer, this->cullingSlot);
+      } else if (this->mesh) {
+        if (!this->scene) {
+          // Each mesh a little further turned than the previous one.
+          this->bindDrawData(commandBuffer, viewProjection * glm::rotate(glm::mat4(1.0f),
+            this->meshAngle + 0.1f * idx, glm::vec3(0.0f, 1.0f, 0.0f)));
+        }
+        vkCmdDrawIndexed(commandBuffer, this->mesh->indexCount,
+          this->scene ? this->visibleObjects : this->meshInstances, 0, 0, 0);
+      } else {
+        // 3 vertices, 1 instance.
+        vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+      }
+    }
+  }
+
+  /**
+   * Hand the transform of one draw to the mesh pipeline, the way `drawData` says. Called from the
+   * recording threads too.
+   */
+  void bindDrawData(VkCommandBuffer commandBuffer, const glm::mat4 &transform) {
+    VkPipelineLayout layout = this->meshPipeline->layout;
+    if (this->drawData == DrawData::Push) {
+      MeshPipeline::PushConstants constants = { .transform = transform };
+      vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants),
+        &constants);
+      return;
+    }
+    UniformArena::Block block = this->uniforms->allocate(sizeof(transform));
+    memcpy(block.data, &transform, sizeof(transform));
+    if (this->drawData == DrawData::Bindless) {
+      MeshPipeline::BindlessPushConstants constants = {
+        .buffer = this->uniformsIndex,
+        .element = static_cast<uint32_t>(block.offset / sizeof(glm::vec4)),
+      };
+      vkCmdPushConstants(commandBuffer, layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants),
+        &constants);
+    } else {
+      uint32_t dynamicOffset = static_cast<uint32_t>(block.offset);
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1,
+        &this->drawDataSet, 1, &dynamicOffset);
+    }
+  }
+
+  /**
+   * A perspective projection for the viewports of recordDraws, with a vertical field of view of
+   * `fovy` degrees.
+   */
+  glm::mat4 cellProjection(VkExtent2D extent, float fovy, float far) const {
+    uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(double(this->drawCount))));
+    uint32_t rows = (this->drawCount + columns - 1) / columns;
+    float aspect = (static_cast<float>(extent.width) / columns)
+      / (static_cast<float>(extent.height) / rows);
+    glm::mat4 projection = glm::perspective(glm::radians(fovy), aspect, 0.1f, far);
+    // Vulkan's clip space y axis points down, OpenGL's up.
+    projection[1][1] *= -1.0f;
+    return projection;
+  }
+
+  /**
+   * The layers available on the system, enumerated once: the loader reads every layer manifest
+   * each time they are enumerated.
+   */
+  const ValidationLayerEnumerator &getAvailableLayers() {
+    if (!this->availableLayers) {
+      this->availableLayers.emplace();
+    }
+    return *this->availableLayers;
   }
 
   /**
    * Check all the provided validation layers are present on the system.
    */
   bool checkValidationLayerSupport(const std::vector<const char*> &validationLayers) {
-    ValidationLayerEnumerator availableLayers;
+    const ValidationLayerEnumerator &availableLayers = this->getAvailableLayers();
     // For all the expected validation layers
     return std::all_of(validationLayers.begin(), validationLayers.end(), [&availableLayers](auto &layer) {
       // Check they are available
@@ -486,7 +2223,7 @@ private:
       std::cout << '\t' << extension.extensionName << '\n';
     }
 
-    ValidationLayerEnumerator availableLayers;
+    const ValidationLayerEnumerator &availableLayers = this->getAvailableLayers();
     std::cout << availableLayers.layerCount << " validation layers:\n";
     for (const auto& layer : availableLayers.layers) {
       std::cout << '\t' << layer.layerName << '\n';
@@ -499,52 +2236,365 @@ private:
   void setupDebugMessenger() {
     if (!enableValidationLayers) return;
 
+    this->debugMessages = std::make_unique<DebugMessages>(this->options.debugSeverities,
+      this->options.debugTypes);
+    // Every severity is requested, the filters of DebugMessages can then change at runtime.
     VkDebugUtilsMessengerCreateInfoEXT createInfo{
       .sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT,
       .messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT
+                       | VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT
                        | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT
                        | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT,
       .messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT
                    | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT
                    | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT,
       .pfnUserCallback = debugCallback,
-      .pUserData = nullptr, // Optional
+      .pUserData = this->debugMessages.get(),
     };
-    // The function to register the callback is an extension function and must be fetched dynamically
+    // The functions to register and unregister the callback are extension functions and must be
+    // fetched dynamically
     auto func = (PFN_vkCreateDebugUtilsMessengerEXT) vkGetInstanceProcAddr(this->instance,
       "vkCreateDebugUtilsMessengerEXT");
-    auto errorCode = (func != nullptr)
-      ? func(this->instance, &createInfo, nullptr, &this->debugMessenger)
+    auto destroy = (PFN_vkDestroyDebugUtilsMessengerEXT) vkGetInstanceProcAddr(this->instance,
+      "vkDestroyDebugUtilsMessengerEXT");
+    VkDebugUtilsMessengerEXT messenger;
+    auto errorCode = (func != nullptr && destroy != nullptr)
+      ? func(this->instance, &createInfo, this->hostAllocator.callbacks(), &messenger)
       : VK_ERROR_EXTENSION_NOT_PRESENT;
     if (errorCode != VK_SUCCESS) {
       throw std::runtime_error("failed to attach debug messenger!");
     }
-  }
-
-  void unSetupDebugMessenger() {
-    auto func = (PFN_vkDestroyDebugUtilsMessengerEXT) vkGetInstanceProcAddr(this->instance,
-      "vkDestroyDebugUtilsMessengerEXT");
-    if (func != nullptr) {
-      func(this->instance, this->debugMessenger, nullptr);
-    }
+    // Without validation layers, the messenger is left empty and there is nothing to destroy.
+    this->debugMessenger = UniqueDebugMessenger(messenger, {
+      .instance = this->instance,
+      .destroy = destroy,
+      .allocationCallbacks = this->hostAllocator.callbacks(),
+    });
   }
 
 private:
+  Options options;
+  std::optional<ValidationLayerEnumerator> availableLayers;
+  // Declared first so that it outlives every Vulkan object allocated through it.
+  HostAllocator hostAllocator;
+  // Receives the messages of the debug messenger, so it must outlive it.
+  std::unique_ptr<DebugMessages> debugMessages;
   GLFWwindow* window = nullptr;
-  VkInstance instance = VK_NULL_HANDLE;
+  // Parents first, so that even without cleanup() their children are destroyed before them.
+  UniqueInstance instance;
   PhysicalDevice physicalDevice; // the vulkan physical device is a field of this structure.
-  VkDevice device = VK_NULL_HANDLE;
+  UniqueDevice device;
   VkQueue graphicsQueue = VK_NULL_HANDLE;
   VkQueue presentQueue = VK_NULL_HANDLE;
-  VkSurfaceKHR surface;
-
-  VkDebugUtilsMessengerEXT debugMessenger = VK_NULL_HANDLE;
+  UniqueSurface surface;
+
+  // The version we created the instance with.
+  uint32_t apiVersion = VK_API_VERSION_1_0;
+  // Whether the device was created with timeline semaphores enabled.
+  bool timelineSemaphores = false;
+  // Whether the device was created with drawIndirectCount enabled, only asked for by GPU culling.
+  bool drawIndirectCount = false;
+  // Whether the device was created with the descriptor indexing features of BindlessTable, only
+  // asked for by the bindless draw data path. Its limits when it was.
+  bool descriptorIndexing = false;
+  VkPhysicalDeviceDescriptorIndexingProperties descriptorIndexingProperties = {};
+  // Whether the device was created with VK_EXT_memory_budget, only asked for by the texture
+  // streaming.
+  bool memoryBudget = false;
+
+  std::unique_ptr<DeviceMemoryAllocator> memoryAllocator;
+  std::unique_ptr<UploadQueue> uploadQueue;
+  // Only exists during the texture streaming benchmark.
+  std::unique_ptr<TextureStreamer> textures;
+  // Streamed to every frame by the upload benchmark, one per frame in flight.
+  std::vector<std::unique_ptr<UploadTarget>> uploadTargets;
+  std::vector<char> uploadData;
+  std::unique_ptr<ComputeQueue> computeQueue;
+  // Only exists during the compute benchmark.
+  std::unique_ptr<ParticleSimulation> particles;
+  ComputeMode computeMode = ComputeMode::None;
+  // Only exist with recording threads.
+  std::unique_ptr<JobSystem> jobs;
+  std::unique_ptr<ParallelRecorder> recorder;
+  // What recordFrame does, initialized from the options and changed by the benchmarks.
+  uint32_t drawCount;
+  uint32_t recordThreads;
+  DrawData drawData;
+  // CPU time recordFrame took for the last frame.
+  double recordMilliseconds = 0.0;
+  // Only exists when a trace is written.
+  std::unique_ptr<Trace> trace;
+  uint32_t cpuTrack = 0;
+  std::unique_ptr<TimestampProfiler> graphicsProfiler;
+  std::unique_ptr<TimestampProfiler> computeProfiler;
+  std::unique_ptr<FrameRing> frames;
+  FrameStats frameStats;
+  // Filled by the benchmarks and the main loop, written with --bench-json.
+  BenchmarkResults benchmarkResults;
+  // Writes the headless frames to disk with --capture.
+  std::unique_ptr<FrameCapture> capture;
+  // Render targets in headless mode, one per frame in flight.
+  std::vector<std::unique_ptr<OffscreenTarget>> offscreenTargets;
+  // Render targets otherwise.
+  std::unique_ptr<Swapchain> swapchain;
+  std::unique_ptr<PipelineCache> pipelineCache;
+  UniqueRenderPass renderPass;
+  // Kept around for the pipeline benchmark.
+  UniqueShaderModule vertexShader;
+  UniqueShaderModule fragmentShader;
+  std::unique_ptr<GraphicsPipeline> pipeline;
+  // Only exist with --mesh or during the geometry benchmark.
+  std::unique_ptr<Mesh> mesh;
+  std::unique_ptr<MeshPipeline> meshPipeline;
+  // Only exist with --objects.
+  std::unique_ptr<SceneObjects> scene;
+  std::unique_ptr<InstanceBuffers> instances;
+  // The SPIR-V of the Makefile, or compiled at startup with --compile-shaders.
+  std::unique_ptr<ShaderLibrary> shaders;
+  // Replaces scene and instances with --gpu-cull.
+  std::unique_ptr<GpuCulling> gpuCulling;
+  // Only exist when the draw data does not go through push constants, see createDescriptors.
+  // The bindless table also needs descriptor indexing.
+  std::unique_ptr<UniformArena> uniforms;
+  std::unique_ptr<BindlessTable> bindless;
+  std::unique_ptr<DescriptorSetCache> descriptorSets;
+  // Index of the arena in the buffer array of the bindless table.
+  uint32_t uniformsIndex = 0;
+  // The set of the arena for the cached path, for recordDraws.
+  VkDescriptorSet drawDataSet = VK_NULL_HANDLE;
+  // What the last culling left for recordDraws to draw. On the GPU, the draws of the frame slot.
+  VkBuffer instanceBuffer = VK_NULL_HANDLE;
+  uint32_t visibleObjects = 0;
+  uint32_t cullingSlot = 0;
+  // Where the mesh is drawn from, see recordDraws. The benchmark moves it out of view.
+  float meshDistance = 3.0f;
+  float meshAngle = 0.0f;
+  uint32_t meshInstances = 1;
+  double pipelineCreationTime = 0.0;
+  // Set by GLFW when the window is resized.
+  bool framebufferResized = false;
+
+  UniqueDebugMessenger debugMessenger;
 };
 
-int main() {
-  HelloTriangleApplication app;
+/**
+ * Parse the command line. Supported options:
+ *   --headless      Render offscreen, without window nor surface.
+ *   --frames <n>    Number of frames to render in headless mode.
+ *   --frames-in-flight <n>
+ *                   Number of frames the CPU can record while the GPU renders the previous ones.
+ *   --frame-stats   Print the frame time percentiles on exit.
+ *   --capture <path>
+ *                   Write every frame of the headless main loop to the directory path.
+ *   --capture-format <png|raw>
+ *                   One PNG per frame (default), or all the frames in a single raw RGBA8 file.
+ *   --capture-threads <n>
+ *                   Threads encoding the captured frames.
+ *   --present <latency|throughput|vsync>
+ *                   Swap chain present mode policy.
+ *   --memory-stats  Print the device memory usage on exit.
+ *   --alloc-stats   Print the host allocations made by the driver on exit.
+ *   --pipeline-cache <path>
+ *                   Pipeline cache file, loaded on start and saved on exit. Empty to disable.
+ *   --pipeline-bench <n>
+ *                   Time n cold and n warm pipeline creations instead of rendering.
+ *   --capability-cache <path>
+ *                   Physical device capability snapshot, loaded on start. Empty to disable.
+ *   --startup-stats Print the time spent in each initialization stage.
+ *   --compile-shaders
+ *                   Compile the shaders with glslc at startup, in parallel with the device
+ *                   creation, rather than loading the SPIR-V of the Makefile.
+ *   --shader-cache <path>
+ *                   Directory of the SPIR-V compiled at startup, by hash of the source.
+ *   --no-transfer-queue
+ *                   Upload through the graphics queue even if the device has a transfer family.
+ *   --no-timeline-semaphores
+ *                   Synchronize uploads with fences even if timeline semaphores are supported.
+ *   --upload-bench <MiB>
+ *                   Stream that many MiB of buffer data, plus a 256x256 texture, every frame.
+ *   --no-compute-queue
+ *                   Dispatch compute work on the graphics queue family.
+ *   --compute-bench <n>
+ *                   Measure the overlap of compute and graphics work over phases of n frames.
+ *   --particles <n> Particles simulated by the compute benchmark.
+ *   --draws <n>     Number of triangles drawn per frame.
+ *   --record-threads <n>
+ *                   Record the draws on n threads, into secondary command buffers.
+ *   --record-bench <n>
+ *                   Time the recording of n frames against the draw and thread counts.
+ *   --gpu-profile   Print the GPU time of each pass on exit.
+ *   --trace <path>  Write the CPU and GPU timelines to path, in the Chrome trace format.
+ *   --debug-severity <verbose|info|warning|error>
+ *                   Minimum severity of the debug messages printed, warning by default.
+ *   --debug-types <general,validation,performance>
+ *                   Types of debug messages handled.
+ *   --debug-stats   Print the debug message counters and the performance warnings on exit.
+ *   --bench-json <path>
+ *                   Write the benchmark results to path, as a flat JSON object.
+ *   --bench-baseline <path>
+ *                   Compare the benchmark results with a baseline, and fail if one regressed.
+ *   --write-baseline <path>
+ *                   Write the benchmark results to path as a baseline.
+ *   --baseline-tolerance <percent>
+ *                   Tolerance of the results written with --write-baseline, 20% by default.
+ *   --mesh <sphere|path>
+ *                   Draw a generated sphere or an OBJ file instead of the triangle.
+ *   --vertex-layout <interleaved|split|quantized|quantized-split>
+ *                   How the vertices of the mesh are stored, interleaved by default.
+ *   --geometry-bench <n>
+ *                   Compare the footprint and vertex fetch rate of the layouts over n frames each.
+ *   --draw-data <push|bindless|cached>
+ *                   How the transform of each draw of the mesh reaches the shader, push constants
+ *                   by default. Bindless falls back to cached without descriptor indexing.
+ *   --descriptor-bench <n>
+ *                   Time the recording of n frames of many draws with each draw data path.
+ *   --objects <n>   Draw a scene of n instances of the mesh, culled on the CPU.
+ *   --cull <auto|avx2|sse|scalar>
+ *                   Kernel culling the scene, the widest the CPU supports by default.
+ *   --gpu-cull      Cull the scene on the GPU and draw the visible objects with indirect draws.
+ *   --scene-bench <n>
+ *                   Time n runs of each culling kernel and of a naive loop.
+ *   --devices <n|all>
+ *                   Render the headless frames on n logical devices, or one per physical device,
+ *                   each on its own thread.
+ *   --device-split <alternate|balanced>
+ *                   Give the devices frames in turn, or by their measured frame time (default).
+ *   --streaming-bench <n>
+ *                   Stream the textures of a pack while a camera turns around them for n frames.
+ *   --texture-pack <path>
+ *                   Texture pack of the streaming benchmark, generated if missing.
+ *   --texture-budget <MiB>
+ *                   Device memory the streamed textures may use, the heap budget by default.
+ *   --width <n>     Width of the window or of the offscreen target.
+ *   --height <n>    Height of the window or of the offscreen target.
+ */
+Options parseOptions(int argc, char **argv) {
+  Options options;
+  for (int idx = 1; idx < argc; ++idx) {
+    std::string arg = argv[idx];
+    auto next = [&]() -> std::string {
+      if (idx + 1 >= argc) {
+        throw std::runtime_error("missing value for " + arg);
+      }
+      return argv[++idx];
+    };
+    auto value = [&]() -> uint32_t {
+      return static_cast<uint32_t>(std::stoul(next()));
+    };
+
+    if (arg == "--headless") {
+      options.headless = true;
+    } else if (arg == "--frames") {
+      options.frameCount = value();
+    } else if (arg == "--frames-in-flight") {
+      options.framesInFlight = value();
+    } else if (arg == "--frame-stats") {
+      options.frameStats = true;
+    } else if (arg == "--capture") {
+      options.capturePath = next();
+    } else if (arg == "--capture-format") {
+      options.captureFormat = parseCaptureFormat(next());
+    } else if (arg == "--capture-threads") {
+      options.captureThreads = value();
+    } else if (arg == "--present") {
+      options.presentPolicy = parsePresentPolicy(next());
+    } else if (arg == "--memory-stats") {
+      options.memoryStats = true;
+    } else if (arg == "--alloc-stats") {
+      options.allocationStats = true;
+    } else if (arg == "--pipeline-cache") {
+      options.pipelineCachePath = next();
+    } else if (arg == "--pipeline-bench") {
+      options.pipelineBenchmark = value();
+    } else if (arg == "--capability-cache") {
+      options.capabilityCachePath = next();
+    } else if (arg == "--startup-stats") {
+      options.startupStats = true;
+    } else if (arg == "--compile-shaders") {
+      options.compileShaders = true;
+    } else if (arg == "--shader-cache") {
+      options.shaderCachePath = next();
+    } else if (arg == "--no-transfer-queue") {
+      options.transferQueue = false;
+    } else if (arg == "--no-timeline-semaphores") {
+      options.timelineSemaphores = false;
+    } else if (arg == "--upload-bench") {
+      options.uploadBenchmark = value();
+    } else if (arg == "--no-compute-queue") {
+      options.computeQueue = false;
+    } else if (arg == "--compute-bench") {
+      options.computeBenchmark = value();
+    } else if (arg == "--particles") {
+      options.particleCount = value();
+    } else if (arg == "--draws") {
+      options.drawCount = std::max(value(), 1u);
+    } else if (arg == "--record-threads") {
+      options.recordThreads = value();
+    } else if (arg == "--record-bench") {
+      options.recordBenchmark = value();
+    } else if (arg == "--gpu-profile") {
+      options.gpuProfile = true;
+    } else if (arg == "--trace") {
+      options.tracePath = next();
+    } else if (arg == "--debug-severity") {
+      options.debugSeverities = parseMinimumSeverity(next());
+    } else if (arg == "--debug-types") {
+      options.debugTypes = parseMessageTypes(next());
+    } else if (arg == "--debug-stats") {
+      options.debugStats = true;
+    } else if (arg == "--bench-json") {
+      options.benchJsonPath = next();
+    } else if (arg == "--bench-baseline") {
+      options.benchBaselinePath = next();
+    } else if (arg == "--write-baseline") {
+      options.writeBaselinePath = next();
+    } else if (arg == "--baseline-tolerance") {
+      options.baselineTolerance = value();
+    } else if (arg == "--mesh") {
+      options.mesh = next();
+    } else if (arg == "--vertex-layout") {
+      options.vertexLayout = parseVertexLayout(next());
+    } else if (arg == "--geometry-bench") {
+      options.geometryBenchmark = value();
+    } else if (arg == "--draw-data") {
+      options.drawData = parseDrawData(next());
+    } else if (arg == "--descriptor-bench") {
+      options.descriptorBenchmark = value();
+    } else if (arg == "--objects") {
+      options.objectCount = value();
+    } else if (arg == "--cull") {
+      options.cullKernel = parseCullKernel(next());
+    } else if (arg == "--gpu-cull") {
+      options.gpuCulling = true;
+    } else if (arg == "--scene-bench") {
+      options.sceneBenchmark = value();
+    } else if (arg == "--devices") {
+      std::string devices = next();
+      options.deviceWorkers = devices == "all" ? allDevices
+        : static_cast<uint32_t>(std::stoul(devices));
+    } else if (arg == "--device-split") {
+      options.deviceSplit = parseDeviceSplit(next());
+    } else if (arg == "--streaming-bench") {
+      options.streamingBenchmark = value();
+    } else if (arg == "--texture-pack") {
+      options.texturePack = next();
+    } else if (arg == "--texture-budget") {
+      options.textureBudget = value();
+    } else if (arg == "--width") {
+      options.width = value();
+    } else if (arg == "--height") {
+      options.height = value();
+    } else {
+      throw std::runtime_error("unknown option " + arg);
+    }
+  }
+
+  return options;
+}
 
+int main(int argc, char **argv) {
   try {
+    HelloTriangleApplication app(parseOptions(argc, argv));
     app.run();
   } catch (const std::exception& e) {
     std::cerr << e.what() << std::endl;
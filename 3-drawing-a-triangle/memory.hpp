@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "handles.hpp"
+
+/**
+ * Find a memory type on the physical device matching the type filter returned by
+ * vkGet*MemoryRequirements and having all the requested properties, std::nullopt if none does.
+ */
+inline std::optional<uint32_t> tryFindMemoryType(
+  const VkPhysicalDeviceMemoryProperties &memoryProperties, uint32_t typeFilter,
+  VkMemoryPropertyFlags properties) {
+  for (uint32_t idx = 0; idx < memoryProperties.memoryTypeCount; ++idx) {
+    if ((typeFilter & (1 << idx)) &&
+        (memoryProperties.memoryTypes[idx].propertyFlags & properties) == properties) {
+      return idx;
+    }
+  }
+  return std::nullopt;
+}
+
+/**
+ * Same as tryFindMemoryType, for when no other memory type would do.
+ */
+inline uint32_t findMemoryType(const VkPhysicalDeviceMemoryProperties &memoryProperties,
+  uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+  std::optional<uint32_t> memoryType = tryFindMemoryType(memoryProperties, typeFilter, properties);
+  if (!memoryType) {
+    throw std::runtime_error("failed to find suitable memory type!");
+  }
+  return *memoryType;
+}
+
+/**
+ * Buffers and linear images must not share a page with optimal images closer than
+ * bufferImageGranularity. Rather than padding every allocation, each kind gets its own pages.
+ */
+enum class ResourceKind {
+  Linear,
+  Optimal,
+};
+
+/**
+ * A range of device memory handed out by DeviceMemoryAllocator. Bind resources at
+ * (memory, offset).
+ */
+struct Allocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  // Size of the whole VkDeviceMemory, which bounds the ranges flushed or invalidated around the
+  // allocation once rounded to nonCoherentAtomSize.
+  VkDeviceSize memorySize = 0;
+  // Pointer to the first byte of the allocation if the memory is host visible, nullptr otherwise.
+  void *mapped = nullptr;
+  uint32_t memoryType = 0;
+
+  // Bookkeeping for DeviceMemoryAllocator::free.
+  void *page = nullptr;
+  uint32_t order = 0;
+
+  bool valid() const {
+    return this->memory != VK_NULL_HANDLE;
+  }
+};
+
+/**
+ * Counters describing how well the device memory is used.
+ */
+struct MemoryStats {
+  // Number of live vkAllocateMemory allocations, bounded by maxMemoryAllocationCount.
+  uint32_t deviceAllocationCount = 0;
+  // Number of live sub-allocations.
+  uint32_t allocationCount = 0;
+  // Bytes obtained from the driver, now and at most.
+  VkDeviceSize reservedBytes = 0;
+  VkDeviceSize peakReservedBytes = 0;
+  // Bytes requested by the resources.
+  VkDeviceSize usedBytes = 0;
+  // Bytes handed out, requests being rounded up to a power of two.
+  VkDeviceSize blockBytes = 0;
+  // Largest allocation that can be made without a new page.
+  VkDeviceSize largestFreeBlock = 0;
+
+  // Lost to the rounding of the requests.
+  double internalFragmentation() const {
+    return this->blockBytes > 0 ? 1.0 - (double) this->usedBytes / this->blockBytes : 0.0;
+  }
+
+  // Free memory that cannot serve a request as large as the total free memory.
+  double externalFragmentation() const {
+    VkDeviceSize freeBytes = this->reservedBytes - this->blockBytes;
+    return freeBytes > 0 ? 1.0 - (double) this->largestFreeBlock / freeBytes : 0.0;
+  }
+};
+
+/**
+ * Sub-allocates buffers and images from large VkDeviceMemory pages instead of calling
+ * vkAllocateMemory for every resource. Drivers limit the number of live allocations
+ * (maxMemoryAllocationCount, as low as 4096) and each allocation is an expensive kernel call.
+ *
+ * Each (memory type, resource kind) pair has a pool of pages. Within a page, memory is managed by a
+ * buddy allocator: blocks are powers of two, split in halves to serve smaller requests and merged
+ * back with their buddy when both are free. A block is always aligned to its own size, which
+ * satisfies the alignment of any resource no larger than the block. Requests larger than a page
+ * get a dedicated allocation.
+ *
+ * Host visible pages are persistently mapped.
+ */
+class DeviceMemoryAllocator {
+public:
+  // Smallest block handed out. Smaller requests are rounded up.
+  static constexpr VkDeviceSize minBlockSize = 256;
+  static constexpr VkDeviceSize defaultPageSize = 64 * 1024 * 1024;
+
+  DeviceMemoryAllocator(VkDevice device, const VkPhysicalDeviceMemoryProperties &memoryProperties,
+    const VkPhysicalDeviceLimits &limits, VkDeviceSize pageSize = defaultPageSize,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), memoryProperties(memoryProperties),
+      limits(limits), pageSize(pageSize) {}
+
+  DeviceMemoryAllocator(const DeviceMemoryAllocator &) = delete;
+  DeviceMemoryAllocator &operator=(const DeviceMemoryAllocator &) = delete;
+
+  /**
+   * Allocate memory matching the requirements with all the `required` properties. Memory types
+   * also having the `preferred` properties are tried first.
+   */
+  Allocation allocate(const VkMemoryRequirements &requirements, ResourceKind kind,
+    VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred = 0) {
+    std::optional<uint32_t> preferredType = tryFindMemoryType(this->memoryProperties,
+      requirements.memoryTypeBits, required | preferred);
+    uint32_t memoryType = preferredType
+      ? *preferredType
+      : findMemoryType(this->memoryProperties, requirements.memoryTypeBits, required);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    VkDeviceSize blockSize = std::bit_ceil(std::max({ requirements.size, requirements.alignment,
+      minBlockSize }));
+    VkDeviceSize pageSize = this->pageSizeFor(memoryType);
+    if (blockSize > pageSize) {
+      return this->allocateDedicated(requirements.size, memoryType);
+    }
+
+    Pool &pool = this->pools[{ memoryType, kind }];
+    uint32_t order = std::countr_zero(blockSize / minBlockSize);
+    for (auto &page: pool.pages) {
+      VkDeviceSize offset;
+      if (page->allocate(order, &offset)) {
+        return this->makeAllocation(*page, offset, order, requirements.size);
+      }
+    }
+
+    pool.pages.push_back(this->createPage(memoryType, kind, pageSize));
+    Page &page = *pool.pages.back();
+    VkDeviceSize offset;
+    page.allocate(order, &offset);
+    return this->makeAllocation(page, offset, order, requirements.size);
+  }
+
+  /**
+   * Return the allocation to its page. Empty pages are released, except the last one of each pool
+   * to avoid allocating and freeing a page over and over.
+   */
+  void free(Allocation &allocation) {
+    if (!allocation.valid()) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stats.allocationCount--;
+    this->stats.usedBytes -= allocation.size;
+    if (allocation.page == nullptr) {
+      // Dedicated allocation
+      vkFreeMemory(this->device, allocation.memory, this->allocationCallbacks);
+      this->stats.deviceAllocationCount--;
+      this->stats.reservedBytes -= allocation.size;
+      this->stats.blockBytes -= allocation.size;
+      allocation = {};
+      return;
+    }
+
+    Page *page = static_cast<Page *>(allocation.page);
+    page->free(allocation.offset, allocation.order);
+    this->stats.blockBytes -= minBlockSize << allocation.order;
+
+    Pool &pool = this->pools[{ page->memoryType, page->kind }];
+    if (page->empty() && pool.pages.size() > 1) {
+      auto it = std::find_if(pool.pages.begin(), pool.pages.end(),
+        [page](auto &candidate) { return candidate.get() == page; });
+      this->stats.deviceAllocationCount--;
+      this->stats.reservedBytes -= page->size;
+      // Frees the memory of the page.
+      pool.pages.erase(it);
+    }
+    allocation = {};
+  }
+
+  /**
+   * Allocate and bind memory for the buffer.
+   */
+  Allocation allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags required,
+    VkMemoryPropertyFlags preferred = 0) {
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(this->device, buffer, &requirements);
+    Allocation allocation = this->allocate(requirements, ResourceKind::Linear, required, preferred);
+    if (vkBindBufferMemory(this->device, buffer, allocation.memory, allocation.offset)
+        != VK_SUCCESS) {
+      this->free(allocation);
+      throw std::runtime_error("failed to bind buffer memory!");
+    }
+    return allocation;
+  }
+
+  /**
+   * Allocate and bind memory for the image.
+   */
+  Allocation allocateImage(VkImage image, VkImageTiling tiling, VkMemoryPropertyFlags required,
+    VkMemoryPropertyFlags preferred = 0) {
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(this->device, image, &requirements);
+    Allocation allocation = this->allocate(requirements,
+      tiling == VK_IMAGE_TILING_OPTIMAL ? ResourceKind::Optimal : ResourceKind::Linear,
+      required, preferred);
+    if (vkBindImageMemory(this->device, image, allocation.memory, allocation.offset)
+        != VK_SUCCESS) {
+      this->free(allocation);
+      throw std::runtime_error("failed to bind image memory!");
+    }
+    return allocation;
+  }
+
+  /**
+   * A snapshot of the counters, with the largest free block computed over all pages.
+   */
+  MemoryStats getStats() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    MemoryStats stats = this->stats;
+    for (auto &[key, pool]: this->pools) {
+      for (auto &page: pool.pages) {
+        stats.largestFreeBlock = std::max(stats.largestFreeBlock, page->largestFreeBlock());
+      }
+    }
+    return stats;
+  }
+
+  void report(std::ostream &out) {
+    MemoryStats stats = this->getStats();
+    out << std::fixed << std::setprecision(2)
+        << "device memory: " << stats.usedBytes / 1024.0 << " KiB used, "
+        << stats.reservedBytes / 1024.0 << " KiB reserved (peak "
+        << stats.peakReservedBytes / 1024.0 << " KiB) in " << stats.deviceAllocationCount
+        << " allocations (limit " << this->limits.maxMemoryAllocationCount << ") for "
+        << stats.allocationCount << " resources" << '\n'
+        << "  internal fragmentation " << stats.internalFragmentation() * 100.0 << "%, "
+        << "external fragmentation " << stats.externalFragmentation() * 100.0 << "%"
+        << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+  }
+
+private:
+  /**
+   * A VkDeviceMemory managed as a buddy allocator. freeBlocks[order] holds the offsets of the free
+   * blocks of size minBlockSize << order.
+   */
+  struct Page {
+    UniqueDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t memoryType;
+    ResourceKind kind;
+    void *mapped;
+    std::vector<std::set<VkDeviceSize>> freeBlocks;
+    uint32_t liveAllocations = 0;
+
+    bool allocate(uint32_t order, VkDeviceSize *offset) {
+      // Find the smallest free block large enough...
+      uint32_t candidate = order;
+      while (candidate < this->freeBlocks.size() && this->freeBlocks[candidate].empty()) {
+        ++candidate;
+      }
+      if (candidate >= this->freeBlocks.size()) {
+        return false;
+      }
+
+      VkDeviceSize block = *this->freeBlocks[candidate].begin();
+      this->freeBlocks[candidate].erase(this->freeBlocks[candidate].begin());
+      // ... and split it until it has the requested size, freeing the upper halves.
+      while (candidate > order) {
+        --candidate;
+        this->freeBlocks[candidate].insert(block + (minBlockSize << candidate));
+      }
+      ++this->liveAllocations;
+      *offset = block;
+      return true;
+    }
+
+    void free(VkDeviceSize offset, uint32_t order) {
+      // Merge with the buddy as long as it is free.
+      while (order + 1 < this->freeBlocks.size()) {
+        VkDeviceSize buddy = offset ^ (minBlockSize << order);
+        auto it = this->freeBlocks[order].find(buddy);
+        if (it == this->freeBlocks[order].end()) {
+          break;
+        }
+        this->freeBlocks[order].erase(it);
+        offset = std::min(offset, buddy);
+        ++order;
+      }
+      this->freeBlocks[order].insert(offset);
+      --this->liveAllocations;
+    }
+
+    bool empty() const {
+      return this->liveAllocations == 0;
+    }
+
+    VkDeviceSize largestFreeBlock() const {
+      for (size_t order = this->freeBlocks.size(); order > 0; --order) {
+        if (!this->freeBlocks[order - 1].empty()) {
+          return minBlockSize << (order - 1);
+        }
+      }
+      return 0;
+    }
+  };
+
+  struct Pool {
+    std::vector<std::unique_ptr<Page>> pages;
+  };
+
+  /**
+   * Pages must be a power of two for the buddy allocator. On small heaps (integrated GPUs
+   * reporting a small device local heap, software implementations) use at most 1/8th of the heap.
+   */
+  VkDeviceSize pageSizeFor(uint32_t memoryType) {
+    VkDeviceSize heapSize = this->memoryProperties.memoryHeaps[
+      this->memoryProperties.memoryTypes[memoryType].heapIndex].size;
+    return std::min(this->pageSize, std::bit_floor(std::max(heapSize / 8, minBlockSize)));
+  }
+
+  std::unique_ptr<Page> createPage(uint32_t memoryType, ResourceKind kind, VkDeviceSize size) {
+    auto page = std::make_unique<Page>();
+    page->memory = this->allocateDeviceMemory(size, memoryType, &page->mapped);
+    page->size = size;
+    page->memoryType = memoryType;
+    page->kind = kind;
+    page->freeBlocks.resize(std::countr_zero(size / minBlockSize) + 1);
+    page->freeBlocks.back().insert(0);
+    this->stats.reservedBytes += size;
+    this->stats.peakReservedBytes = std::max(this->stats.peakReservedBytes,
+      this->stats.reservedBytes);
+    return page;
+  }
+
+  Allocation allocateDedicated(VkDeviceSize size, uint32_t memoryType) {
+    Allocation allocation = {
+      .size = size,
+      .memorySize = size,
+      .memoryType = memoryType,
+    };
+    // Owned by the allocation from now on, see free().
+    allocation.memory = this->allocateDeviceMemory(size, memoryType, &allocation.mapped).release();
+    this->stats.allocationCount++;
+    this->stats.usedBytes += size;
+    this->stats.blockBytes += size;
+    this->stats.reservedBytes += size;
+    this->stats.peakReservedBytes = std::max(this->stats.peakReservedBytes,
+      this->stats.reservedBytes);
+    return allocation;
+  }
+
+  UniqueDeviceMemory allocateDeviceMemory(VkDeviceSize size, uint32_t memoryType, void **mapped) {
+    if (this->stats.deviceAllocationCount >= this->limits.maxMemoryAllocationCount) {
+      throw std::runtime_error("maxMemoryAllocationCount reached!");
+    }
+
+    VkMemoryAllocateInfo allocInfo = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = size,
+      .memoryTypeIndex = memoryType,
+    };
+    UniqueDeviceMemory memory = createDeviceChild<UniqueDeviceMemory>(vkAllocateMemory,
+      this->device, allocInfo, this->allocationCallbacks, "device memory");
+
+    *mapped = nullptr;
+    if (this->memoryProperties.memoryTypes[memoryType].propertyFlags
+        & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+      if (vkMapMemory(this->device, memory, 0, VK_WHOLE_SIZE, 0, mapped) != VK_SUCCESS) {
+        throw std::runtime_error("failed to map device memory!");
+      }
+    }
+    this->stats.deviceAllocationCount++;
+    return memory;
+  }
+
+  Allocation makeAllocation(Page &page, VkDeviceSize offset, uint32_t order, VkDeviceSize size) {
+    this->stats.allocationCount++;
+    this->stats.usedBytes += size;
+    this->stats.blockBytes += minBlockSize << order;
+    return {
+      .memory = page.memory,
+      .offset = offset,
+      .size = size,
+      .memorySize = page.size,
+      .mapped = page.mapped != nullptr ? static_cast<char *>(page.mapped) + offset : nullptr,
+      .memoryType = page.memoryType,
+      .page = &page,
+      .order = order,
+    };
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  VkPhysicalDeviceLimits limits;
+  VkDeviceSize pageSize;
+  std::mutex mutex;
+  std::map<std::pair<uint32_t, ResourceKind>, Pool> pools;
+  MemoryStats stats;
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdexcept>
+
+#include <vulkan/vulkan.h>
+
+#include "handles.hpp"
+#include "memory.hpp"
+
+/**
+ * A device local color image used as a render target when there is no window to present to.
+ * The image can be rendered to, cleared and copied from so that its content can be read back.
+ */
+class OffscreenTarget {
+public:
+  OffscreenTarget(VkDevice device, DeviceMemoryAllocator &allocator, VkExtent2D extent,
+    VkFormat format = VK_FORMAT_R8G8B8A8_UNORM,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      extent(extent), format(format) {
+    VkImageCreateInfo imageInfo = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = format,
+      .extent = { extent.width, extent.height, 1 },
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      // Optimal tiling lets the driver lay out texels the way the GPU prefers. We never map this
+      // image, reading it back goes through a copy into a buffer.
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+             | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+             | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+    this->image = createDeviceChild<UniqueImage>(vkCreateImage, this->device, imageInfo,
+      this->allocationCallbacks, "offscreen image");
+
+    this->memory = allocator.allocateImage(this->image, imageInfo.tiling,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VkImageViewCreateInfo viewInfo = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .image = this->image,
+      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .format = format,
+      .subresourceRange = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+      },
+    };
+    this->view = createDeviceChild<UniqueImageView>(vkCreateImageView, this->device, viewInfo,
+      this->allocationCallbacks, "offscreen image view");
+  }
+
+  ~OffscreenTarget() {
+    // What uses the image goes before it, and the image before the memory bound to it.
+    this->framebuffer.reset();
+    this->view.reset();
+    this->image.reset();
+    this->allocator.free(this->memory);
+  }
+
+  OffscreenTarget(const OffscreenTarget &) = delete;
+  OffscreenTarget &operator=(const OffscreenTarget &) = delete;
+
+  /**
+   * Create the framebuffer to render into the image with `renderPass`, which must outlive the
+   * target.
+   */
+  void createFramebuffer(VkRenderPass renderPass) {
+    VkFramebufferCreateInfo framebufferInfo = {
+      .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+      .renderPass = renderPass,
+      .attachmentCount = 1,
+      .pAttachments = this->view.address(),
+      .width = this->extent.width,
+      .height = this->extent.height,
+      .layers = 1,
+    };
+    this->framebuffer = createDeviceChild<UniqueFramebuffer>(vkCreateFramebuffer, this->device,
+      framebufferInfo, this->allocationCallbacks, "offscreen framebuffer");
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  VkExtent2D extent;
+  VkFormat format;
+  UniqueImage image;
+  Allocation memory;
+  UniqueImageView view;
+  UniqueFramebuffer framebuffer;
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stdexcept>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "handles.hpp"
+
+/**
+ * A render pass with a single color attachment, cleared on load and left in `finalLayout`: the
+ * image is then ready to be presented or copied without any explicit barrier.
+ */
+inline VkRenderPass createRenderPass(VkDevice device, VkFormat format, VkImageLayout finalLayout,
+  const VkAllocationCallbacks *allocationCallbacks = nullptr) {
+  VkAttachmentDescription colorAttachment = {
+    .format = format,
+    .samples = VK_SAMPLE_COUNT_1_BIT,
+    .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+    .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+    .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+    .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+    // The previous content is cleared anyway.
+    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    .finalLayout = finalLayout,
+  };
+  VkAttachmentReference colorAttachmentRef = {
+    .attachment = 0,
+    .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+  };
+  VkSubpassDescription subpass = {
+    .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+    .colorAttachmentCount = 1,
+    .pColorAttachments = &colorAttachmentRef,
+  };
+  // The layout transition at the start of the render pass must wait for the image to be acquired,
+  // which the submission waits for at the color attachment output stage.
+  VkSubpassDependency dependency = {
+    .srcSubpass = VK_SUBPASS_EXTERNAL,
+    .dstSubpass = 0,
+    .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .srcAccessMask = 0,
+    .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+  };
+  VkRenderPassCreateInfo createInfo = {
+    .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+    .attachmentCount = 1,
+    .pAttachments = &colorAttachment,
+    .subpassCount = 1,
+    .pSubpasses = &subpass,
+    .dependencyCount = 1,
+    .pDependencies = &dependency,
+  };
+  VkRenderPass renderPass;
+  if (vkCreateRenderPass(device, &createInfo, allocationCallbacks, &renderPass) != VK_SUCCESS) {
+    throw std::runtime_error("failed to create render pass!");
+  }
+  return renderPass;
+}
+
+/**
+ * What differs between the graphics pipelines drawing into the render pass: the vertex input, the
+ * winding of front faces, the descriptor sets, the push constants and the specialization of the
+ * vertex shader. The defaults are the triangle's, whose vertices are hardcoded in the shader.
+ */
+struct PipelineVariant {
+  std::vector<VkVertexInputBindingDescription> bindings;
+  std::vector<VkVertexInputAttributeDescription> attributes;
+  VkFrontFace frontFace = VK_FRONT_FACE_CLOCKWISE;
+  // Layouts of the descriptor sets, from set 0. Owned by whoever allocates the sets.
+  std::vector<VkDescriptorSetLayout> setLayouts;
+  // Size of the push constants, read by the vertex shader.
+  uint32_t pushConstantSize = 0;
+  const VkSpecializationInfo *vertexSpecialization = nullptr;
+};
+
+/**
+ * A graphics pipeline drawing into the single subpass of the render pass. Viewport and scissor are
+ * dynamic so that the pipeline survives swap chain recreations.
+ */
+class GraphicsPipeline {
+public:
+  GraphicsPipeline(VkDevice device, VkRenderPass renderPass, VkShaderModule vertexShader,
+    VkShaderModule fragmentShader, const PipelineVariant &variant, VkPipelineCache pipelineCache,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks) {
+    VkPipelineShaderStageCreateInfo shaderStages[] = {
+      {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_VERTEX_BIT,
+        .module = vertexShader,
+        .pName = "main",
+        .pSpecializationInfo = variant.vertexSpecialization,
+      },
+      {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .module = fragmentShader,
+        .pName = "main",
+      },
+    };
+
+    VkPipelineVertexInputStateCreateInfo vertexInputInfo = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+      .vertexBindingDescriptionCount = static_cast<uint32_t>(variant.bindings.size()),
+      .pVertexBindingDescriptions = variant.bindings.data(),
+      .vertexAttributeDescriptionCount = static_cast<uint32_t>(variant.attributes.size()),
+      .pVertexAttributeDescriptions = variant.attributes.data(),
+    };
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+      .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+      .primitiveRestartEnable = VK_FALSE,
+    };
+    // Only the counts matter, the actual values are set when recording.
+    VkPipelineViewportStateCreateInfo viewportState = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+      .viewportCount = 1,
+      .scissorCount = 1,
+    };
+    VkPipelineRasterizationStateCreateInfo rasterizer = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+      .depthClampEnable = VK_FALSE,
+      .rasterizerDiscardEnable = VK_FALSE,
+      .polygonMode = VK_POLYGON_MODE_FILL,
+      .cullMode = VK_CULL_MODE_BACK_BIT,
+      .frontFace = variant.frontFace,
+      .depthBiasEnable = VK_FALSE,
+      .lineWidth = 1.0f,
+    };
+    VkPipelineMultisampleStateCreateInfo multisampling = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+      .sampleShadingEnable = VK_FALSE,
+    };
+    VkPipelineColorBlendAttachmentState colorBlendAttachment = {
+      .blendEnable = VK_FALSE,
+      .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
+                      | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+    };
+    VkPipelineColorBlendStateCreateInfo colorBlending = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+      .logicOpEnable = VK_FALSE,
+      .attachmentCount = 1,
+      .pAttachments = &colorBlendAttachment,
+    };
+    VkDynamicState dynamicStates[] = {
+      VK_DYNAMIC_STATE_VIEWPORT,
+      VK_DYNAMIC_STATE_SCISSOR,
+    };
+    VkPipelineDynamicStateCreateInfo dynamicState = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+      .dynamicStateCount = 2,
+      .pDynamicStates = dynamicStates,
+    };
+
+    VkPushConstantRange pushConstantRange = {
+      .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+      .offset = 0,
+      .size = variant.pushConstantSize,
+    };
+    VkPipelineLayoutCreateInfo layoutInfo = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount = static_cast<uint32_t>(variant.setLayouts.size()),
+      .pSetLayouts = variant.setLayouts.data(),
+      .pushConstantRangeCount = variant.pushConstantSize > 0 ? 1u : 0u,
+      .pPushConstantRanges = &pushConstantRange,
+    };
+    this->layout = createDeviceChild<UniquePipelineLayout>(vkCreatePipelineLayout, device,
+      layoutInfo, allocationCallbacks, "pipeline layout");
+
+    VkGraphicsPipelineCreateInfo pipelineInfo = {
+      .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+      .stageCount = 2,
+      .pStages = shaderStages,
+      .pVertexInputState = &vertexInputInfo,
+      .pInputAssemblyState = &inputAssembly,
+      .pViewportState = &viewportState,
+      .pRasterizationState = &rasterizer,
+      .pMultisampleState = &multisampling,
+      .pColorBlendState = &colorBlending,
+      .pDynamicState = &dynamicState,
+      .layout = this->layout,
+      .renderPass = renderPass,
+      .subpass = 0,
+    };
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, allocationCallbacks,
+        &pipeline) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create graphics pipeline!");
+    }
+    this->pipeline = UniquePipeline(pipeline,
+      { .device = device, .allocationCallbacks = allocationCallbacks });
+  }
+
+  GraphicsPipeline(const GraphicsPipeline &) = delete;
+  GraphicsPipeline &operator=(const GraphicsPipeline &) = delete;
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  UniquePipelineLayout layout;
+  UniquePipeline pipeline;
+};
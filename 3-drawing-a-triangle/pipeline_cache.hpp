@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "files.hpp"
+#include "handles.hpp"
+
+/**
+ * A VkPipelineCache persisted on disk between runs.
+ *
+ * Compiling shaders into a pipeline is the most expensive part of creating it. The driver can
+ * serialize what it compiled so that the next run skips most of that work. The data is only valid
+ * for the exact same device and driver, which is what the header checked on load is for: a cache
+ * created by another GPU or driver version is dropped rather than handed to the driver.
+ */
+class PipelineCache {
+public:
+  // Size of VkPipelineCacheHeaderVersionOne as laid out in the serialized data.
+  static constexpr size_t headerSize = 16 + VK_UUID_SIZE;
+
+  PipelineCache(VkDevice device, const VkPhysicalDeviceProperties &properties, std::string path,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), path(std::move(path)) {
+    // No file yet is a cold start.
+    std::vector<char> data = this->path.empty() ? std::vector<char> {} : readFile(this->path);
+    if (!data.empty()) {
+      if (isCompatible(data, properties)) {
+        this->loadedData = std::move(data);
+        this->loaded = true;
+      } else {
+        std::cerr << "ignoring incompatible pipeline cache " << this->path << std::endl;
+      }
+    }
+
+    VkPipelineCacheCreateInfo createInfo = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+      .initialDataSize = this->loadedData.size(),
+      .pInitialData = this->loadedData.empty() ? nullptr : this->loadedData.data(),
+    };
+    this->cache = createDeviceChild<UniquePipelineCache>(vkCreatePipelineCache, device,
+      createInfo, allocationCallbacks, "pipeline cache");
+  }
+
+  PipelineCache(const PipelineCache &) = delete;
+  PipelineCache &operator=(const PipelineCache &) = delete;
+
+  /**
+   * Write the cache back to disk, atomically so that a crash or a concurrent reader never sees a
+   * partially written cache. Nothing is written when the driver added nothing since the cache was
+   * loaded.
+   */
+  void save() {
+    if (this->path.empty()) {
+      return;
+    }
+    std::vector<char> data = this->getData();
+    if (data.empty() || data == this->loadedData) {
+      return;
+    }
+    writeFileAtomically(this->path, data);
+    this->loadedData = std::move(data);
+  }
+
+  /**
+   * Serialize the current content of the cache.
+   */
+  std::vector<char> getData() const {
+    return serialize(this->device, this->cache);
+  }
+
+  static std::vector<char> serialize(VkDevice device, VkPipelineCache cache) {
+    size_t size = 0;
+    vkGetPipelineCacheData(device, cache, &size, nullptr);
+    std::vector<char> data(size);
+    if (vkGetPipelineCacheData(device, cache, &size, data.data()) != VK_SUCCESS) {
+      throw std::runtime_error("failed to get pipeline cache data!");
+    }
+    data.resize(size);
+    return data;
+  }
+
+  /**
+   * Check the header of serialized cache data against the device we run on. The header is laid
+   * out as VkPipelineCacheHeaderVersionOne, little endian:
+   *   - header size (4 bytes), at least 32
+   *   - header version (4 bytes), VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+   *   - vendor ID (4 bytes)
+   *   - device ID (4 bytes)
+   *   - pipeline cache UUID (16 bytes), which changes with the driver version
+   */
+  static bool isCompatible(const std::vector<char> &data,
+    const VkPhysicalDeviceProperties &properties) {
+    if (data.size() < headerSize) {
+      return false;
+    }
+    uint32_t header[4];
+    memcpy(header, data.data(), sizeof(header));
+    return header[0] >= headerSize && header[0] <= data.size()
+      && header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+      && header[2] == properties.vendorID
+      && header[3] == properties.deviceID
+      && memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+  }
+
+private:
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  std::string path;
+  // What was last read from or written to disk.
+  std::vector<char> loadedData;
+
+public:
+  UniquePipelineCache cache;
+  // Whether the cache was primed with data read from disk.
+  bool loaded = false;
+};
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "bench.hpp"
+#include "files.hpp"
+#include "handles.hpp"
+
+/**
+ * CPU and GPU events on a common timeline, written in the Chrome trace event format. Open the file
+ * in chrome://tracing or https://ui.perfetto.dev. Each track shows up as a thread.
+ *
+ * Not thread safe.
+ */
+class Trace {
+public:
+  explicit Trace(size_t maxEvents = 1 << 20)
+    : epoch(std::chrono::steady_clock::now()), maxEvents(maxEvents) {}
+
+  /**
+   * Create a track, e.g. "CPU" or "GPU graphics", and return its id.
+   */
+  uint32_t track(std::string name) {
+    this->tracks.push_back(std::move(name));
+    return this->tracks.size() - 1;
+  }
+
+  /**
+   * Microseconds between the creation of the trace and `time`, the unit of the trace format.
+   */
+  double microseconds(std::chrono::steady_clock::time_point time) const {
+    return std::chrono::duration<double, std::micro>(time - this->epoch).count();
+  }
+
+  /**
+   * Add a complete event. Past maxEvents, events are counted and dropped.
+   */
+  void add(uint32_t track, const char *name, double startMicroseconds,
+    double durationMicroseconds) {
+    if (this->events.size() >= this->maxEvents) {
+      ++this->dropped;
+      return;
+    }
+    this->events.push_back({ track, name, startMicroseconds, durationMicroseconds });
+  }
+
+  void write(const std::string &path) const {
+    std::string json = "{\"traceEvents\":[\n";
+    for (uint32_t idx = 0; idx < this->tracks.size(); ++idx) {
+      json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(idx)
+        + ",\"args\":{\"name\":\"" + escape(this->tracks[idx]) + "\"}},\n";
+    }
+    for (auto &event: this->events) {
+      json += "{\"name\":\"" + escape(event.name) + "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+        + std::to_string(event.track) + ",\"ts\":" + std::to_string(event.start) + ",\"dur\":"
+        + std::to_string(event.duration) + "},\n";
+    }
+    // The format does not allow a trailing comma.
+    json += "{\"name\":\"dropped events\",\"ph\":\"M\",\"pid\":1,\"args\":{\"count\":"
+      + std::to_string(this->dropped) + "}}\n]}\n";
+    writeFileAtomically(path, std::vector<char>(json.begin(), json.end()));
+  }
+
+  size_t dropped = 0;
+
+private:
+  struct Event {
+    uint32_t track;
+    // Names are string literals, they outlive the trace.
+    const char *name;
+    double start;
+    double duration;
+  };
+
+  static std::string escape(const std::string &value) {
+    std::string escaped;
+    for (char c: value) {
+      if (c == '"' || c == '\\') {
+        escaped += '\\';
+      }
+      escaped += c;
+    }
+    return escaped;
+  }
+
+  std::chrono::steady_clock::time_point epoch;
+  size_t maxEvents;
+  std::vector<std::string> tracks;
+  std::vector<Event> events;
+};
+
+/**
+ * Adds the lifetime of the scope to a CPU track of the trace. Does nothing without a trace.
+ */
+class CpuScope {
+public:
+  CpuScope(Trace *trace, uint32_t track, const char *name)
+    : trace(trace), track(track), name(name), start(std::chrono::steady_clock::now()) {}
+
+  ~CpuScope() {
+    if (this->trace != nullptr) {
+      double start = this->trace->microseconds(this->start);
+      this->trace->add(this->track, this->name,
+        start, this->trace->microseconds(std::chrono::steady_clock::now()) - start);
+    }
+  }
+
+  CpuScope(const CpuScope &) = delete;
+  CpuScope &operator=(const CpuScope &) = delete;
+
+private:
+  Trace *trace;
+  uint32_t track;
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+};
+
+/**
+ * GPU time of named scopes of the command buffers submitted to one queue, measured with timestamp
+ * queries.
+ *
+ * Query results are only available once the GPU is done with them, and waiting for them would
+ * stall the CPU until the GPU catches up. Each slot (e.g. frame in flight) has its own query pool
+ * instead: when a slot comes back around, its fence has been waited for and the results of its
+ * previous use are read without waiting. They are at most slot count frames late.
+ *
+ * Queue families with timestampValidBits set to 0 do not support timestamps, the profiler then
+ * does nothing, as it does when created without slots.
+ */
+class TimestampProfiler {
+public:
+  // Scopes per slot, each one takes a query at its beginning and one at its end.
+  static constexpr uint32_t maxScopes = 64;
+
+  TimestampProfiler(VkDevice device, VkQueue queue, uint32_t queueFamilyIndex,
+    const VkQueueFamilyProperties &queueFamily, float timestampPeriod, uint32_t slotCount,
+    Trace *trace, const std::string &trackName,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), timestampPeriod(timestampPeriod),
+      validMask(queueFamily.timestampValidBits >= 64
+        ? ~uint64_t(0)
+        : (uint64_t(1) << queueFamily.timestampValidBits) - 1),
+      trace(trace) {
+    // No slot disables the profiler.
+    if (queueFamily.timestampValidBits == 0 || slotCount == 0) {
+      return;
+    }
+    this->slots.resize(slotCount);
+    for (auto &slot: this->slots) {
+      VkQueryPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = 2 * maxScopes,
+      };
+      slot.pool = createDeviceChild<UniqueQueryPool>(vkCreateQueryPool, device, poolInfo,
+        allocationCallbacks, "timestamp query pool");
+    }
+    if (trace != nullptr) {
+      this->track = trace->track(trackName);
+      this->calibrate(queue, queueFamilyIndex);
+    }
+  }
+
+  TimestampProfiler(const TimestampProfiler &) = delete;
+  TimestampProfiler &operator=(const TimestampProfiler &) = delete;
+
+  bool enabled() const {
+    return !this->slots.empty();
+  }
+
+  /**
+   * Collect the results of the previous use of the slot and reset its queries. Must be recorded
+   * first in the command buffer, outside of any render pass, once the GPU is done with the
+   * previous submission of the slot.
+   */
+  void begin(VkCommandBuffer commandBuffer, uint32_t slot) {
+    if (!this->enabled()) {
+      return;
+    }
+    this->collect(slot);
+    this->current = slot;
+    vkCmdResetQueryPool(commandBuffer, this->slots[slot].pool, 0, 2 * maxScopes);
+  }
+
+  /**
+   * Write a timestamp when the GPU reaches the scope, and one when it is done with it.
+   */
+  class Scope {
+  public:
+    Scope(TimestampProfiler &profiler, VkCommandBuffer commandBuffer, const char *name)
+      : profiler(profiler), commandBuffer(commandBuffer),
+        index(profiler.open(commandBuffer, name)) {}
+
+    ~Scope() {
+      if (this->index) {
+        this->profiler.close(this->commandBuffer, *this->index);
+      }
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    TimestampProfiler &profiler;
+    VkCommandBuffer commandBuffer;
+    std::optional<uint32_t> index;
+  };
+
+  /**
+   * Collect every slot, once the device is idle.
+   */
+  void collectAll() {
+    for (uint32_t slot = 0; slot < this->slots.size(); ++slot) {
+      this->collect(slot);
+    }
+  }
+
+  void report(std::ostream &out, const std::string &title) const {
+    if (!this->enabled()) {
+      out << title << ": timestamps not supported by the queue family" << std::endl;
+      return;
+    }
+    out << std::fixed << std::setprecision(3) << title << " (GPU ms, p50 / p99 / max):" << '\n';
+    for (auto &[name, samples]: this->durations) {
+      out << "  " << std::left << std::setw(20) << name << std::right << samples.median() << " / "
+          << samples.percentile(99) << " / " << samples.percentile(100) << '\n';
+    }
+    out << "  " << this->dropped << " scopes dropped, " << this->unavailable
+        << " results not available in time" << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+  }
+
+  /**
+   * Add the median and p99 of every scope to `results`, named e.g. "<prefix>triangle_pass.p50_ms".
+   */
+  void addResults(BenchmarkResults &results, const std::string &prefix) const {
+    for (auto &[name, samples]: this->durations) {
+      std::string key = prefix + name;
+      std::replace(key.begin(), key.end(), ' ', '_');
+      results.add(key + ".p50_ms", samples.median(), Better::Lower);
+      results.add(key + ".p99_ms", samples.percentile(99), Better::Lower);
+    }
+  }
+
+private:
+  struct Slot {
+    UniqueQueryPool pool;
+    // Names of the scopes written since the last begin(), in query order.
+    std::vector<const char *> names;
+  };
+
+  std::optional<uint32_t> open(VkCommandBuffer commandBuffer, const char *name) {
+    if (!this->enabled()) {
+      return std::nullopt;
+    }
+    Slot &slot = this->slots[this->current];
+    if (slot.names.size() >= maxScopes) {
+      ++this->dropped;
+      return std::nullopt;
+    }
+    uint32_t index = slot.names.size();
+    slot.names.push_back(name);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, slot.pool, 2 * index);
+    return index;
+  }
+
+  void close(VkCommandBuffer commandBuffer, uint32_t index) {
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      this->slots[this->current].pool, 2 * index + 1);
+  }
+
+  /**
+   * Read the results of the slot without waiting. A query is only available once written, so a
+   * scope which was recorded but not submitted, e.g. a frame dropped on an out of date swap chain,
+   * is skipped.
+   */
+  void collect(uint32_t slotIndex) {
+    Slot &slot = this->slots[slotIndex];
+    if (slot.names.empty()) {
+      return;
+    }
+    // A value and its availability per query.
+    std::vector<uint64_t> results(4 * slot.names.size());
+    VkResult result = vkGetQueryPoolResults(this->device, slot.pool, 0, 2 * slot.names.size(),
+      results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t),
+      VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (result != VK_SUCCESS && result != VK_NOT_READY) {
+      throw std::runtime_error("failed to get timestamp query results!");
+    }
+    for (uint32_t idx = 0; idx < slot.names.size(); ++idx) {
+      uint64_t *begin = &results[4 * idx];
+      uint64_t *end = &results[4 * idx + 2];
+      if (begin[1] == 0 || end[1] == 0) {
+        ++this->unavailable;
+        continue;
+      }
+      double beginNanoseconds = (begin[0] & this->validMask) * double(this->timestampPeriod);
+      double nanoseconds = ((end[0] - begin[0]) & this->validMask) * double(this->timestampPeriod);
+      this->durations[slot.names[idx]].record(nanoseconds / 1e6);
+      if (this->trace != nullptr) {
+        this->trace->add(this->track, slot.names[idx],
+          beginNanoseconds / 1e3 + this->offsetMicroseconds, nanoseconds / 1e3);
+      }
+    }
+    slot.names.clear();
+  }
+
+  /**
+   * Find the offset between the GPU timestamps and the CPU clock of the trace: write a timestamp,
+   * and take the middle of the submission and of the end of the wait as the CPU time it was
+   * written at. The error is at most half of that round trip, usually tens of microseconds.
+   * VK_EXT_calibrated_timestamps gives both clocks at once, but is not available everywhere.
+   */
+  void calibrate(VkQueue queue, uint32_t queueFamilyIndex) {
+    VkCommandPoolCreateInfo poolInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+      .queueFamilyIndex = queueFamilyIndex,
+    };
+    UniqueCommandPool commandPool = createDeviceChild<UniqueCommandPool>(vkCreateCommandPool,
+      this->device, poolInfo, this->allocationCallbacks, "calibration command pool");
+    VkCommandBufferAllocateInfo allocInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = commandPool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = 1,
+    };
+    VkCommandBuffer commandBuffer;
+    vkAllocateCommandBuffers(this->device, &allocInfo, &commandBuffer);
+    VkCommandBufferBeginInfo beginInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    VkQueryPool pool = this->slots.front().pool;
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    vkCmdResetQueryPool(commandBuffer, pool, 0, 1);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool, 0);
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo submitInfo = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &commandBuffer,
+    };
+    auto submitted = std::chrono::steady_clock::now();
+    if (vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+      throw std::runtime_error("failed to submit calibration command buffer!");
+    }
+    vkQueueWaitIdle(queue);
+    auto done = std::chrono::steady_clock::now();
+    uint64_t timestamp = 0;
+    vkGetQueryPoolResults(this->device, pool, 0, 1, sizeof(timestamp), &timestamp,
+      sizeof(timestamp), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+
+    double cpuMicroseconds = (this->trace->microseconds(submitted)
+      + this->trace->microseconds(done)) / 2.0;
+    this->offsetMicroseconds = cpuMicroseconds
+      - (timestamp & this->validMask) * double(this->timestampPeriod) / 1e3;
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  // Nanoseconds per timestamp tick.
+  float timestampPeriod;
+  // Timestamps only have timestampValidBits significant bits, and wrap around.
+  uint64_t validMask;
+  Trace *trace;
+  uint32_t track = 0;
+  // Added to GPU timestamps converted to microseconds to put them on the trace timeline.
+  double offsetMicroseconds = 0.0;
+  std::vector<Slot> slots;
+  // Slot passed to the last begin().
+  uint32_t current = 0;
+  std::map<std::string, Samples> durations;
+  uint64_t dropped = 0;
+  uint64_t unavailable = 0;
+};
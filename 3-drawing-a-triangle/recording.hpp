@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "handles.hpp"
+#include "jobs.hpp"
+
+/**
+ * Records the content of a render pass on several threads, into secondary command buffers the
+ * primary command buffer then executes.
+ *
+ * Command pools are externally synchronized: each worker of the JobSystem has its own pool, per
+ * frame slot so that resetting the pools of a slot never touches buffers the GPU might still be
+ * executing for another frame in flight.
+ */
+class ParallelRecorder {
+public:
+  ParallelRecorder(VkDevice device, uint32_t queueFamilyIndex, uint32_t slotCount, JobSystem &jobs,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), jobs(jobs) {
+    this->slots.resize(slotCount);
+    for (auto &slot: this->slots) {
+      slot.resize(jobs.size());
+      for (auto &worker: slot) {
+        VkCommandPoolCreateInfo poolInfo = {
+          .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+          .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+          .queueFamilyIndex = queueFamilyIndex,
+        };
+        worker.commandPool = createDeviceChild<UniqueCommandPool>(vkCreateCommandPool, device,
+          poolInfo, allocationCallbacks, "recording command pool");
+        VkCommandBufferAllocateInfo allocInfo = {
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+          .commandPool = worker.commandPool,
+          .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+          .commandBufferCount = 1,
+        };
+        if (vkAllocateCommandBuffers(device, &allocInfo, &worker.commandBuffer) != VK_SUCCESS) {
+          throw std::runtime_error("failed to allocate secondary command buffer!");
+        }
+      }
+    }
+  }
+
+  ParallelRecorder(const ParallelRecorder &) = delete;
+  ParallelRecorder &operator=(const ParallelRecorder &) = delete;
+
+  /**
+   * Split [0, itemCount) into one contiguous range per thread, up to `threadCount` threads, and
+   * call `recordRange(commandBuffer, begin, end)` for each range on its own thread. The returned
+   * secondary command buffers are in range order, to be executed by the primary command buffer
+   * inside the render pass described by `inheritance`, started with
+   * VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS. The frame in `slot` must be done on the GPU.
+   */
+  template<typename F>
+  std::vector<VkCommandBuffer> record(uint32_t slot, uint32_t threadCount, uint32_t itemCount,
+    const VkCommandBufferInheritanceInfo &inheritance, F &&recordRange) {
+    uint32_t jobCount = std::clamp(threadCount, 1u, this->jobs.size());
+    std::vector<Worker> &workers = this->slots[slot];
+    this->jobs.run(jobCount, [&](uint32_t job) {
+      Worker &worker = workers[job];
+      vkResetCommandPool(this->device, worker.commandPool, 0);
+      VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+               | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+        .pInheritanceInfo = &inheritance,
+      };
+      if (vkBeginCommandBuffer(worker.commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording secondary command buffer!");
+      }
+      uint64_t begin = uint64_t(itemCount) * job / jobCount;
+      uint64_t end = uint64_t(itemCount) * (job + 1) / jobCount;
+      recordRange(worker.commandBuffer, static_cast<uint32_t>(begin), static_cast<uint32_t>(end));
+      if (vkEndCommandBuffer(worker.commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record secondary command buffer!");
+      }
+    });
+
+    std::vector<VkCommandBuffer> commandBuffers;
+    for (uint32_t job = 0; job < jobCount; ++job) {
+      commandBuffers.push_back(workers[job].commandBuffer);
+    }
+    return commandBuffers;
+  }
+
+private:
+  struct Worker {
+    // Destroying the pool also frees the command buffer.
+    UniqueCommandPool commandPool;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+  };
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  JobSystem &jobs;
+  // Indexed by frame slot, then by worker.
+  std::vector<std::vector<Worker>> slots;
+};
@@ -0,0 +1,480 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The SIMD kernels are x86-64 only, other architectures use the scalar one.
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCENE_SIMD 1
+#endif
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <vulkan/vulkan.h>
+
+#include "handles.hpp"
+#include "memory.hpp"
+
+/**
+ * An object of the scene as a naive renderer stores it: its model matrix and its bounding sphere in
+ * model space (center, radius). Only used to build SceneObjects and by the reference loop of the
+ * benchmark.
+ */
+struct SceneObject {
+  glm::mat4 model;
+  glm::vec4 bounds;
+};
+
+/**
+ * `count` objects scattered in a cube, with a random orientation around the y axis and a random
+ * scale. The cube grows with the count so that the density stays the same.
+ */
+inline std::vector<SceneObject> generateScene(uint32_t count, uint32_t seed = 1) {
+  std::mt19937 random(seed);
+  float extent = 4.0f * std::cbrt(static_cast<float>(count));
+  std::uniform_real_distribution<float> position(-extent, extent);
+  std::uniform_real_distribution<float> angle(0.0f, 6.2831853f);
+  std::uniform_real_distribution<float> scale(0.5f, 1.5f);
+  std::vector<SceneObject> objects(count);
+  for (auto &object: objects) {
+    glm::vec3 translation(position(random), position(random), position(random));
+    object.model = glm::scale(glm::rotate(glm::translate(glm::mat4(1.0f), translation),
+      angle(random), glm::vec3(0.0f, 1.0f, 0.0f)), glm::vec3(scale(random)));
+    object.bounds = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+  }
+  return objects;
+}
+
+/**
+ * The six planes of the frustum of a view projection matrix, facing inwards and normalized: the
+ * signed distance of a point p to plane i is dot(plane.xyz, p) + plane.w. Extracted from the rows
+ * of the matrix (Gribb and Hartmann), with Vulkan's 0 to 1 clip space depth.
+ */
+struct Frustum {
+  glm::vec4 planes[6];
+
+  static Frustum fromMatrix(const glm::mat4 &m) {
+    // glm matrices are column-major, m[column][row].
+    auto row = [&m](int idx) { return glm::vec4(m[0][idx], m[1][idx], m[2][idx], m[3][idx]); };
+    Frustum frustum = {{
+      row(3) + row(0), row(3) - row(0),
+      row(3) + row(1), row(3) - row(1),
+      row(2), row(3) - row(2),
+    }};
+    for (auto &plane: frustum.planes) {
+      plane = plane / glm::length(glm::vec3(plane));
+    }
+    return frustum;
+  }
+};
+
+enum class CullKernel {
+  Scalar,
+  SSE,
+  AVX2,
+};
+
+inline const char *cullKernelName(CullKernel kernel) {
+  switch (kernel) {
+    case CullKernel::SSE:
+      return "sse";
+    case CullKernel::AVX2:
+      return "avx2";
+    default:
+      return "scalar";
+  }
+}
+
+inline bool cullKernelSupported(CullKernel kernel) {
+#ifdef SCENE_SIMD
+  // SSE2 is part of x86-64.
+  return kernel != CullKernel::AVX2 || __builtin_cpu_supports("avx2");
+#else
+  return kernel == CullKernel::Scalar;
+#endif
+}
+
+/**
+ * The widest kernel the CPU runs.
+ */
+inline CullKernel bestCullKernel() {
+  for (CullKernel kernel: { CullKernel::AVX2, CullKernel::SSE }) {
+    if (cullKernelSupported(kernel)) {
+      return kernel;
+    }
+  }
+  return CullKernel::Scalar;
+}
+
+inline CullKernel parseCullKernel(const std::string &name) {
+  if (name == "auto") {
+    return bestCullKernel();
+  }
+  for (CullKernel kernel: { CullKernel::Scalar, CullKernel::SSE, CullKernel::AVX2 }) {
+    if (name == cullKernelName(kernel)) {
+      if (!cullKernelSupported(kernel)) {
+        throw std::runtime_error("the " + name + " culling kernel is not supported by this CPU");
+      }
+      return kernel;
+    }
+  }
+  throw std::runtime_error("unknown culling kernel " + name
+    + ", expected auto, avx2, sse or scalar");
+}
+
+/**
+ * The objects of the scene in structure of arrays form: one array per component of the model
+ * matrices and of the bounding spheres. A SIMD kernel loads a component of 4 (SSE) or 8 (AVX2)
+ * consecutive objects with a single instruction, where an array of SceneObject would need a gather
+ * or a transposition. Model matrices are affine, their last row (0, 0, 0, 1) is not stored.
+ */
+class SceneObjects {
+public:
+  explicit SceneObjects(const std::vector<SceneObject> &objects) {
+    for (auto &array: this->model) {
+      array.reserve(objects.size());
+    }
+    for (auto &object: objects) {
+      for (int column = 0; column < 4; ++column) {
+        for (int row = 0; row < 3; ++row) {
+          this->model[column * 3 + row].push_back(object.model[column][row]);
+        }
+      }
+      this->centerX.push_back(object.bounds.x);
+      this->centerY.push_back(object.bounds.y);
+      this->centerZ.push_back(object.bounds.z);
+      this->radius.push_back(object.bounds.w);
+    }
+  }
+
+  size_t size() const {
+    return this->radius.size();
+  }
+
+  /**
+   * Cull the objects against the frustum of `viewProjection` and write viewProjection * model of
+   * each visible one, in order, to `instances` (16 floats per object, column-major). Returns the
+   * number of visible objects. `instances` must have room for all of them. Every kernel gives the
+   * same result: they do the same operations in the same order, without fused multiply-adds.
+   */
+  uint32_t cull(const glm::mat4 &viewProjection, CullKernel kernel, float *instances) const {
+    Frustum frustum = Frustum::fromMatrix(viewProjection);
+    size_t simdCount = 0;
+    uint32_t visible = 0;
+#ifdef SCENE_SIMD
+    if (kernel == CullKernel::AVX2) {
+      simdCount = this->size() & ~size_t(7);
+      visible = this->cullAVX2(simdCount, frustum, viewProjection, instances);
+    } else if (kernel == CullKernel::SSE) {
+      simdCount = this->size() & ~size_t(3);
+      visible = this->cullSSE(simdCount, frustum, viewProjection, instances);
+    }
+#endif
+    // What is left of a partial SIMD register goes through the scalar kernel.
+    return visible + this->cullScalar(simdCount, this->size(), frustum, viewProjection,
+      instances + visible * 16);
+  }
+
+  // model[column * 3 + row].
+  std::vector<float> model[12];
+  std::vector<float> centerX;
+  std::vector<float> centerY;
+  std::vector<float> centerZ;
+  std::vector<float> radius;
+
+private:
+  uint32_t cullScalar(size_t begin, size_t end, const Frustum &frustum,
+    const glm::mat4 &viewProjection, float *instances) const {
+    uint32_t visible = 0;
+    for (size_t idx = begin; idx < end; ++idx) {
+      float m[12];
+      for (int component = 0; component < 12; ++component) {
+        m[component] = this->model[component][idx];
+      }
+      float cx = this->centerX[idx], cy = this->centerY[idx], cz = this->centerZ[idx];
+      // The center in world space, and the radius scaled by the largest scale of the model.
+      float x = m[0] * cx + m[3] * cy + m[6] * cz + m[9];
+      float y = m[1] * cx + m[4] * cy + m[7] * cz + m[10];
+      float z = m[2] * cx + m[5] * cy + m[8] * cz + m[11];
+      float scale = std::max({
+        m[0] * m[0] + m[1] * m[1] + m[2] * m[2],
+        m[3] * m[3] + m[4] * m[4] + m[5] * m[5],
+        m[6] * m[6] + m[7] * m[7] + m[8] * m[8],
+      });
+      float negativeRadius = -(this->radius[idx] * std::sqrt(scale));
+      bool inside = true;
+      for (auto &plane: frustum.planes) {
+        inside = inside && plane.x * x + plane.y * y + plane.z * z + plane.w >= negativeRadius;
+      }
+      if (!inside) {
+        continue;
+      }
+      float *instance = instances + visible++ * 16;
+      for (int column = 0; column < 4; ++column) {
+        for (int row = 0; row < 4; ++row) {
+          float value = viewProjection[0][row] * m[column * 3]
+            + viewProjection[1][row] * m[column * 3 + 1]
+            + viewProjection[2][row] * m[column * 3 + 2];
+          instance[column * 4 + row] = column == 3 ? value + viewProjection[3][row] : value;
+        }
+      }
+    }
+    return visible;
+  }
+
+#ifdef SCENE_SIMD
+  /**
+   * 4 objects at a time. Each lane computes the transform of its object, but only the visible
+   * lanes are written out, which is where the structure of arrays goes back to one matrix per
+   * object.
+   */
+  uint32_t cullSSE(size_t count, const Frustum &frustum, const glm::mat4 &viewProjection,
+    float *instances) const {
+    __m128 planes[6][4];
+    for (int plane = 0; plane < 6; ++plane) {
+      for (int component = 0; component < 4; ++component) {
+        planes[plane][component] = _mm_set1_ps(frustum.planes[plane][component]);
+      }
+    }
+    __m128 vp[4][4];
+    for (int column = 0; column < 4; ++column) {
+      for (int row = 0; row < 4; ++row) {
+        vp[column][row] = _mm_set1_ps(viewProjection[column][row]);
+      }
+    }
+    alignas(16) float lanes[16][4];
+    uint32_t visible = 0;
+    for (size_t base = 0; base < count; base += 4) {
+      __m128 m[12];
+      for (int component = 0; component < 12; ++component) {
+        m[component] = _mm_loadu_ps(this->model[component].data() + base);
+      }
+      __m128 cx = _mm_loadu_ps(this->centerX.data() + base);
+      __m128 cy = _mm_loadu_ps(this->centerY.data() + base);
+      __m128 cz = _mm_loadu_ps(this->centerZ.data() + base);
+      __m128 center[3];
+      for (int row = 0; row < 3; ++row) {
+        center[row] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[row], cx),
+          _mm_mul_ps(m[3 + row], cy)), _mm_mul_ps(m[6 + row], cz)), m[9 + row]);
+      }
+      __m128 scale = _mm_setzero_ps();
+      for (int column = 0; column < 3; ++column) {
+        __m128 x = m[column * 3], y = m[column * 3 + 1], z = m[column * 3 + 2];
+        scale = _mm_max_ps(scale, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+          _mm_mul_ps(z, z)));
+      }
+      __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(),
+        _mm_mul_ps(_mm_loadu_ps(this->radius.data() + base), _mm_sqrt_ps(scale)));
+      __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      for (auto &plane: planes) {
+        __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(plane[0], center[0]),
+          _mm_mul_ps(plane[1], center[1])), _mm_mul_ps(plane[2], center[2])), plane[3]);
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+      }
+      int mask = _mm_movemask_ps(inside);
+      if (mask == 0) {
+        continue;
+      }
+
+      for (int column = 0; column < 4; ++column) {
+        for (int row = 0; row < 4; ++row) {
+          __m128 value = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vp[0][row], m[column * 3]),
+            _mm_mul_ps(vp[1][row], m[column * 3 + 1])), _mm_mul_ps(vp[2][row], m[column * 3 + 2]));
+          if (column == 3) {
+            value = _mm_add_ps(value, vp[3][row]);
+          }
+          _mm_store_ps(lanes[column * 4 + row], value);
+        }
+      }
+      visible += writeLanes(mask, lanes[0], 4, instances + visible * 16);
+    }
+    return visible;
+  }
+
+  /**
+   * The same as cullSSE, 8 objects at a time. Compiled for AVX2 whatever the flags of the build,
+   * and only called when the CPU has it.
+   */
+  __attribute__((target("avx2")))
+  uint32_t cullAVX2(size_t count, const Frustum &frustum, const glm::mat4 &viewProjection,
+    float *instances) const {
+    __m256 planes[6][4];
+    for (int plane = 0; plane < 6; ++plane) {
+      for (int component = 0; component < 4; ++component) {
+        planes[plane][component] = _mm256_set1_ps(frustum.planes[plane][component]);
+      }
+    }
+    __m256 vp[4][4];
+    for (int column = 0; column < 4; ++column) {
+      for (int row = 0; row < 4; ++row) {
+        vp[column][row] = _mm256_set1_ps(viewProjection[column][row]);
+      }
+    }
+    alignas(32) float lanes[16][8];
+    uint32_t visible = 0;
+    for (size_t base = 0; base < count; base += 8) {
+      __m256 m[12];
+      for (int component = 0; component < 12; ++component) {
+        m[component] = _mm256_loadu_ps(this->model[component].data() + base);
+      }
+      __m256 cx = _mm256_loadu_ps(this->centerX.data() + base);
+      __m256 cy = _mm256_loadu_ps(this->centerY.data() + base);
+      __m256 cz = _mm256_loadu_ps(this->centerZ.data() + base);
+      __m256 center[3];
+      for (int row = 0; row < 3; ++row) {
+        center[row] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[row], cx),
+          _mm256_mul_ps(m[3 + row], cy)), _mm256_mul_ps(m[6 + row], cz)), m[9 + row]);
+      }
+      __m256 scale = _mm256_setzero_ps();
+      for (int column = 0; column < 3; ++column) {
+        __m256 x = m[column * 3], y = m[column * 3 + 1], z = m[column * 3 + 2];
+        scale = _mm256_max_ps(scale, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x),
+          _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+      }
+      __m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(),
+        _mm256_mul_ps(_mm256_loadu_ps(this->radius.data() + base), _mm256_sqrt_ps(scale)));
+      __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+      for (auto &plane: planes) {
+        __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+          _mm256_mul_ps(plane[0], center[0]), _mm256_mul_ps(plane[1], center[1])),
+          _mm256_mul_ps(plane[2], center[2])), plane[3]);
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+      }
+      int mask = _mm256_movemask_ps(inside);
+      if (mask == 0) {
+        continue;
+      }
+
+      for (int column = 0; column < 4; ++column) {
+        for (int row = 0; row < 4; ++row) {
+          __m256 value = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vp[0][row], m[column * 3]),
+            _mm256_mul_ps(vp[1][row], m[column * 3 + 1])),
+            _mm256_mul_ps(vp[2][row], m[column * 3 + 2]));
+          if (column == 3) {
+            value = _mm256_add_ps(value, vp[3][row]);
+          }
+          _mm256_store_ps(lanes[column * 4 + row], value);
+        }
+      }
+      visible += writeLanes(mask, lanes[0], 8, instances + visible * 16);
+    }
+    return visible;
+  }
+
+  /**
+   * Write the matrices of the lanes set in `mask`, lanes holding 16 rows of `width` floats.
+   */
+  static uint32_t writeLanes(int mask, const float *lanes, int width, float *instances) {
+    uint32_t written = 0;
+    while (mask != 0) {
+      int lane = __builtin_ctz(mask);
+      mask &= mask - 1;
+      float *instance = instances + written++ * 16;
+      for (int component = 0; component < 16; ++component) {
+        instance[component] = lanes[component * width + lane];
+      }
+    }
+    return written;
+  }
+#endif
+};
+
+/**
+ * The reference for the benchmark: one object at a time, with glm, on the array of SceneObject.
+ * Returns the number of visible objects, whose transforms are written to `instances`.
+ */
+inline uint32_t cullNaive(const std::vector<SceneObject> &objects,
+  const glm::mat4 &viewProjection, glm::mat4 *instances) {
+  Frustum frustum = Frustum::fromMatrix(viewProjection);
+  uint32_t visible = 0;
+  for (auto &object: objects) {
+    glm::vec3 center = glm::vec3(object.model * glm::vec4(glm::vec3(object.bounds), 1.0f));
+    float scale = std::max({
+      glm::length(glm::vec3(object.model[0])),
+      glm::length(glm::vec3(object.model[1])),
+      glm::length(glm::vec3(object.model[2])),
+    });
+    bool inside = true;
+    for (auto &plane: frustum.planes) {
+      inside = inside && glm::dot(glm::vec3(plane), center) + plane.w >= -object.bounds.w * scale;
+    }
+    if (inside) {
+      instances[visible++] = viewProjection * object.model;
+    }
+  }
+  return visible;
+}
+
+/**
+ * Whether the `count` transforms written by SceneObjects::cull are the ones cullNaive wrote, up to
+ * `epsilon` relative to each value: glm may order or fuse the multiply-adds differently.
+ */
+inline bool sameTransforms(const glm::mat4 *expected, const float *actual, uint32_t count,
+  float epsilon = 1e-5f) {
+  for (uint32_t idx = 0; idx < count; ++idx) {
+    for (int column = 0; column < 4; ++column) {
+      for (int row = 0; row < 4; ++row) {
+        float reference = expected[idx][column][row];
+        float value = actual[idx * 16 + column * 4 + row];
+        if (!(std::abs(value - reference) <= epsilon * std::max(1.0f, std::abs(reference)))) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Host visible buffers receiving the transforms of the visible objects, one per frame in flight so
+ * that the CPU never writes what the GPU reads. Bound as a per-instance vertex buffer.
+ */
+class InstanceBuffers {
+public:
+  InstanceBuffers(VkDevice device, DeviceMemoryAllocator &allocator, uint32_t slotCount,
+    uint32_t capacity, const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      capacity(capacity) {
+    for (uint32_t idx = 0; idx < slotCount; ++idx) {
+      VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = std::max<VkDeviceSize>(capacity, 1) * sizeof(glm::mat4),
+        .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      };
+      this->buffers.push_back(createDeviceChild<UniqueBuffer>(vkCreateBuffer, device, bufferInfo,
+        allocationCallbacks, "instance buffer"));
+      // Coherent, so that nothing needs to be flushed after writing.
+      this->memory.push_back(allocator.allocateBuffer(this->buffers.back(),
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT));
+    }
+  }
+
+  ~InstanceBuffers() {
+    for (size_t idx = 0; idx < this->buffers.size(); ++idx) {
+      // The buffer goes before the memory bound to it.
+      this->buffers[idx].reset();
+      this->allocator.free(this->memory[idx]);
+    }
+  }
+
+  InstanceBuffers(const InstanceBuffers &) = delete;
+  InstanceBuffers &operator=(const InstanceBuffers &) = delete;
+
+  float *data(uint32_t slot) {
+    return static_cast<float *>(this->memory[slot].mapped);
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  // Objects per buffer.
+  uint32_t capacity;
+  std::vector<UniqueBuffer> buffers;
+  std::vector<Allocation> memory;
+};
@@ -0,0 +1,488 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "files.hpp"
+#include "jobs.hpp"
+
+/**
+ * What a SPIR-V module expects from the pipeline layout: its descriptor bindings, set by set, and
+ * the size of its push constant block.
+ *
+ * Uniform buffers always reflect as VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER: whether the offset is
+ * dynamic is up to the pipeline, SPIR-V does not say. Nor does it say anything of the binding
+ * flags, e.g. update after bind. Layouts needing either are still written by hand.
+ */
+struct ShaderReflection {
+  struct Binding {
+    VkDescriptorType type;
+    // 0 for a runtime sized array.
+    uint32_t count;
+  };
+
+  VkShaderStageFlagBits stage = VK_SHADER_STAGE_ALL;
+  // Bindings by set, then by binding number.
+  std::map<uint32_t, std::map<uint32_t, Binding>> sets;
+  uint32_t pushConstantSize = 0;
+
+  /**
+   * The bindings of `set` as layout bindings for this stage. Runtime sized arrays get
+   * `runtimeCount` descriptors.
+   */
+  std::vector<VkDescriptorSetLayoutBinding> layoutBindings(uint32_t set,
+    uint32_t runtimeCount = 1) const {
+    std::vector<VkDescriptorSetLayoutBinding> bindings;
+    auto it = this->sets.find(set);
+    if (it == this->sets.end()) {
+      return bindings;
+    }
+    for (auto &[binding, reflected]: it->second) {
+      bindings.push_back({
+        .binding = binding,
+        .descriptorType = reflected.type,
+        .descriptorCount = reflected.count == 0 ? runtimeCount : reflected.count,
+        .stageFlags = static_cast<VkShaderStageFlags>(this->stage),
+      });
+    }
+    return bindings;
+  }
+};
+
+/**
+ * Read the entry point, the descriptor bindings and the push constant block of a SPIR-V module.
+ * Only the few instructions declaring types, variables and their decorations are looked at, see
+ * the SPIR-V specification, section 2.3 for the layout of the module.
+ */
+inline ShaderReflection reflectSpirv(const std::vector<uint32_t> &code,
+  const std::string &name = "shader") {
+  if (code.size() < 5 || code[0] != 0x07230203) {
+    throw std::runtime_error(name + " is not SPIR-V!");
+  }
+
+  // What is known of each id, filled in a single pass: SPIR-V declares types before their uses.
+  struct Id {
+    uint32_t opcode = 0;
+    std::vector<uint32_t> operands;
+    int32_t set = -1;
+    int32_t binding = -1;
+    bool block = false;
+    bool bufferBlock = false;
+    uint32_t arrayStride = 0;
+    // Of the members of a struct, by member index. Decorations come before the struct, which
+    // bounds the indices once it is declared.
+    std::map<uint32_t, uint32_t> offsets;
+    std::map<uint32_t, uint32_t> matrixStrides;
+  };
+  std::vector<Id> ids(code[3]);
+  std::vector<uint32_t> variables;
+  ShaderReflection reflection;
+
+  auto idOf = [&](uint32_t id) -> Id & {
+    if (id >= ids.size()) {
+      throw std::runtime_error(name + " has an id out of bounds!");
+    }
+    return ids[id];
+  };
+  for (size_t word = 5; word < code.size();) {
+    uint32_t opcode = code[word] & 0xffff;
+    uint32_t wordCount = code[word] >> 16;
+    if (wordCount == 0 || word + wordCount > code.size()) {
+      throw std::runtime_error(name + " has a truncated instruction!");
+    }
+    const uint32_t *operands = &code[word + 1];
+    uint32_t operandCount = wordCount - 1;
+    // Every operand read below is one the instruction must have.
+    auto require = [&](uint32_t count) {
+      if (operandCount < count) {
+        throw std::runtime_error(name + " has an instruction with too few operands!");
+      }
+    };
+    switch (opcode) {
+      case 15: { // OpEntryPoint
+        require(3);
+        switch (operands[0]) {
+          case 0: reflection.stage = VK_SHADER_STAGE_VERTEX_BIT; break;
+          case 4: reflection.stage = VK_SHADER_STAGE_FRAGMENT_BIT; break;
+          case 5: reflection.stage = VK_SHADER_STAGE_COMPUTE_BIT; break;
+        }
+        break;
+      }
+      case 71: { // OpDecorate
+        require(2);
+        Id &target = idOf(operands[0]);
+        switch (operands[1]) {
+          case 2: target.block = true; break;
+          case 3: target.bufferBlock = true; break;
+          case 6: require(3); target.arrayStride = operands[2]; break;
+          case 33: require(3); target.binding = operands[2]; break;
+          case 34: require(3); target.set = operands[2]; break;
+        }
+        break;
+      }
+      case 72: { // OpMemberDecorate
+        require(3);
+        Id &target = idOf(operands[0]);
+        if (operands[2] == 35 || operands[2] == 7) {
+          require(4);
+          auto &values = operands[2] == 35 ? target.offsets : target.matrixStrides;
+          values[operands[1]] = operands[3];
+        }
+        break;
+      }
+      // OpTypeBool, OpTypeInt, OpTypeFloat, OpTypeVector, OpTypeMatrix, OpTypeImage,
+      // OpTypeSampler, OpTypeSampledImage, OpTypeArray, OpTypeRuntimeArray, OpTypeStruct,
+      // OpTypePointer: the result id comes first.
+      case 20: case 21: case 22: case 23: case 24: case 25: case 26: case 27: case 28: case 29:
+      case 30: case 32: {
+        // The result id and the operands read below: the width of numbers, the component type and
+        // count of vectors and matrices, up to Sampled for images, the element type and length of
+        // arrays, the storage class and type of pointers.
+        switch (opcode) {
+          case 22: case 27: case 29: require(2); break;
+          case 21: case 23: case 24: case 28: case 32: require(3); break;
+          case 25: require(8); break;
+          default: require(1); break;
+        }
+        Id &type = idOf(operands[0]);
+        type.opcode = opcode;
+        type.operands.assign(operands + 1, operands + operandCount);
+        break;
+      }
+      // OpConstant, OpVariable: the result type comes first.
+      case 43: case 59: {
+        // The value of constants, the storage class of variables.
+        require(3);
+        Id &value = idOf(operands[1]);
+        value.opcode = opcode;
+        value.operands.assign(operands, operands + operandCount);
+        value.operands.erase(value.operands.begin() + 1);
+        if (opcode == 59) {
+          variables.push_back(operands[1]);
+        }
+        break;
+      }
+    }
+    word += wordCount;
+  }
+  for (auto &id: ids) {
+    size_t members = id.opcode == 30 ? id.operands.size() : 0;
+    for (auto *values: { &id.offsets, &id.matrixStrides }) {
+      if (!values->empty() && values->rbegin()->first >= members) {
+        throw std::runtime_error(name + " decorates a struct member which does not exist!");
+      }
+    }
+  }
+
+  // Length of an OpTypeArray. Only OpConstant lengths are known here: one set by a specialization
+  // constant (OpSpecConstant) is only known once the pipeline is created.
+  auto arrayLength = [&](const Id &array) -> uint32_t {
+    const Id &length = idOf(array.operands[1]);
+    if (length.opcode != 43 || length.operands.size() < 2) {
+      throw std::runtime_error(name + " has an array whose length is not a constant, e.g. a "
+        "specialization constant, which reflection does not support!");
+    }
+    return length.operands[1];
+  };
+
+  // Size of a type as laid out in a block, from the offsets and strides of the decorations. A type
+  // containing itself, which valid SPIR-V never declares, would recurse forever.
+  std::vector<bool> sizing(ids.size());
+  std::function<uint32_t(uint32_t)> sizeOf = [&](uint32_t id) -> uint32_t {
+    const Id &type = idOf(id);
+    if (sizing[id]) {
+      throw std::runtime_error(name + " has a type containing itself!");
+    }
+    sizing[id] = true;
+    uint32_t size = 0;
+    switch (type.opcode) {
+      case 21: case 22: // OpTypeInt, OpTypeFloat
+        size = type.operands[0] / 8;
+        break;
+      case 23: // OpTypeVector
+        size = type.operands[1] * sizeOf(type.operands[0]);
+        break;
+      case 28: { // OpTypeArray
+        uint32_t stride = type.arrayStride > 0 ? type.arrayStride : sizeOf(type.operands[0]);
+        size = arrayLength(type) * stride;
+        break;
+      }
+      case 30: { // OpTypeStruct
+        for (uint32_t member = 0; member < type.operands.size(); ++member) {
+          const Id &memberType = idOf(type.operands[member]);
+          auto offset = type.offsets.find(member);
+          uint32_t memberOffset = offset != type.offsets.end() ? offset->second : size;
+          uint32_t memberSize = sizeOf(type.operands[member]);
+          // Matrices are arrays of columns, MatrixStride apart.
+          auto matrixStride = type.matrixStrides.find(member);
+          if (memberType.opcode == 24 && matrixStride != type.matrixStrides.end()) {
+            memberSize = (memberType.operands[1] - 1) * matrixStride->second
+              + sizeOf(memberType.operands[0]);
+          }
+          size = std::max(size, memberOffset + memberSize);
+        }
+        break;
+      }
+      case 24: // OpTypeMatrix, outside of a struct
+        size = type.operands[1] * sizeOf(type.operands[0]);
+        break;
+    }
+    sizing[id] = false;
+    return size;
+  };
+
+  for (uint32_t variable: variables) {
+    const Id &value = idOf(variable);
+    uint32_t storageClass = value.operands[1];
+    const Id &pointer = idOf(value.operands[0]);
+    if (pointer.opcode != 32) {
+      throw std::runtime_error(name + " has a variable whose type is not a pointer!");
+    }
+    uint32_t typeId = pointer.operands[1];
+    if (storageClass == 9) { // PushConstant
+      reflection.pushConstantSize = sizeOf(typeId);
+      continue;
+    }
+    if (value.set < 0 || value.binding < 0) {
+      continue;
+    }
+
+    // Arrays of descriptors.
+    uint32_t count = 1;
+    const Id *type = &idOf(typeId);
+    if (type->opcode == 28) {
+      count = arrayLength(*type);
+      type = &idOf(type->operands[0]);
+    } else if (type->opcode == 29) {
+      count = 0;
+      type = &idOf(type->operands[0]);
+    }
+
+    VkDescriptorType descriptorType;
+    if (storageClass == 12 || (storageClass == 2 && type->bufferBlock)) { // StorageBuffer
+      descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    } else if (storageClass == 2) { // Uniform
+      descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    } else if (type->opcode == 27) {
+      descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    } else if (type->opcode == 26) {
+      descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+    } else if (type->opcode == 25) {
+      // Dim, then Depth, Arrayed, MS and Sampled: 1 when sampled, 2 when read or written.
+      uint32_t dim = type->operands[1];
+      bool storage = type->operands[5] == 2;
+      descriptorType = dim == 6 ? VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT
+        : dim == 5 ? (storage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+                              : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER)
+        : storage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+    } else {
+      continue;
+    }
+    reflection.sets[value.set][value.binding] = { descriptorType, count };
+  }
+  return reflection;
+}
+
+/**
+ * A SPIR-V module and its reflection. Modules are created on demand, and only needed while
+ * creating pipelines.
+ */
+struct Shader {
+  std::string path;
+  std::vector<uint32_t> code;
+  ShaderReflection reflection;
+
+  VkShaderModule createModule(VkDevice device,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr) const {
+    VkShaderModuleCreateInfo createInfo = {
+      .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+      .codeSize = this->code.size() * sizeof(uint32_t),
+      .pCode = this->code.data(),
+    };
+    VkShaderModule module;
+    if (vkCreateShaderModule(device, &createInfo, allocationCallbacks, &module) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create shader module for " + this->path + "!");
+    }
+    return module;
+  }
+};
+
+/**
+ * A GLSL source compiled to the SPIR-V file `spirvPath`, with the given preprocessor definitions,
+ * like the rules of the Makefile.
+ */
+struct ShaderSource {
+  std::string spirvPath;
+  std::string sourcePath;
+  std::vector<std::string> defines;
+};
+
+/**
+ * The shaders of the application, by SPIR-V path.
+ *
+ * By default they are the files the Makefile compiled with glslc. compile() compiles the sources
+ * at runtime instead, with the glslc found in the PATH, so that editing a shader only takes a
+ * restart. The SPIR-V is cached in `cacheDirectory` under a hash of the source, the definitions
+ * and the compiler's `--version` output: only new or modified shaders are compiled, on every
+ * thread of a JobSystem, and upgrading the compiler compiles everything again.
+ * #include directives are not followed, an included file changing does not invalidate the cache.
+ */
+class ShaderLibrary {
+public:
+  explicit ShaderLibrary(const std::string &cacheDirectory, const std::string &compiler = "glslc")
+    : cacheDirectory(cacheDirectory), compiler(compiler) {}
+
+  ShaderLibrary(const ShaderLibrary &) = delete;
+  ShaderLibrary &operator=(const ShaderLibrary &) = delete;
+
+  /**
+   * Compile, or find in the cache, every source on `threadCount` threads. Throws the first
+   * compilation error once they are all done.
+   */
+  void compile(const std::vector<ShaderSource> &sources, uint32_t threadCount) {
+    auto start = std::chrono::steady_clock::now();
+    std::filesystem::create_directories(this->cacheDirectory);
+    std::string version = this->compilerVersion();
+    std::vector<Shader> shaders(sources.size());
+    JobSystem jobs(std::min<uint32_t>(threadCount, std::max<size_t>(sources.size(), 1)));
+    jobs.run(jobs.size(), [&](uint32_t job) {
+      for (size_t idx = job; idx < sources.size(); idx += jobs.size()) {
+        shaders[idx] = this->compile(sources[idx], version);
+      }
+    });
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (auto &shader: shaders) {
+      this->shaders[shader.path] = std::move(shader);
+    }
+    this->compileMilliseconds = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+  }
+
+  /**
+   * The shader compiled to `spirvPath`, read from that file when it was not compiled at runtime.
+   */
+  const Shader &get(const std::string &spirvPath) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->shaders.find(spirvPath);
+    if (it == this->shaders.end()) {
+      it = this->shaders.emplace(spirvPath, load(spirvPath, spirvPath)).first;
+    }
+    return it->second;
+  }
+
+  void report(std::ostream &out) const {
+    out << "shaders: " << this->hits << " from the cache, " << this->misses << " compiled in "
+        << this->compileMilliseconds << " ms" << std::endl;
+  }
+
+  std::string cacheDirectory;
+  std::string compiler;
+  std::atomic<uint32_t> hits = 0;
+  std::atomic<uint32_t> misses = 0;
+  double compileMilliseconds = 0.0;
+
+private:
+  /**
+   * Read a SPIR-V file and reflect it, `path` being the name it is known by.
+   */
+  static Shader load(const std::string &file, const std::string &path) {
+    std::vector<char> bytes = readFile(file);
+    if (bytes.empty() || bytes.size() % sizeof(uint32_t) != 0) {
+      throw std::runtime_error("failed to open shader " + file + "!");
+    }
+    std::vector<uint32_t> code(bytes.size() / sizeof(uint32_t));
+    memcpy(code.data(), bytes.data(), bytes.size());
+    ShaderReflection reflection = reflectSpirv(code, path);
+    return { .path = path, .code = std::move(code), .reflection = std::move(reflection) };
+  }
+
+  /**
+   * Quote `argument` for the shell, so that paths with spaces reach the compiler in one piece.
+   */
+  static std::string quote(const std::string &argument) {
+    std::string quoted = "'";
+    for (char c: argument) {
+      quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    return quoted + "'";
+  }
+
+  /**
+   * What `compiler --version` prints, which names the compiler and the versions it is built from.
+   */
+  std::string compilerVersion() const {
+    std::string command = quote(this->compiler) + " --version";
+    FILE *pipe = popen(command.c_str(), "r");
+    if (pipe == nullptr) {
+      throw std::runtime_error("failed to run " + this->compiler + " --version!");
+    }
+    std::string version;
+    char buffer[256];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+      version.append(buffer, size);
+    }
+    if (pclose(pipe) != 0 || version.empty()) {
+      throw std::runtime_error("failed to run " + this->compiler + " --version!");
+    }
+    return version;
+  }
+
+  Shader compile(const ShaderSource &source, const std::string &version) {
+    std::vector<char> text = readFile(source.sourcePath);
+    if (text.empty()) {
+      throw std::runtime_error("failed to open shader source " + source.sourcePath + "!");
+    }
+    std::string command = quote(this->compiler);
+    for (auto &define: source.defines) {
+      command += " " + quote("-D" + define);
+    }
+    // FNV-1a of everything the output depends on.
+    uint64_t hash = 0xcbf29ce484222325;
+    auto mix = [&hash](const char *data, size_t size) {
+      for (size_t idx = 0; idx < size; ++idx) {
+        hash = (hash ^ static_cast<uint8_t>(data[idx])) * 0x100000001b3;
+      }
+    };
+    mix(text.data(), text.size());
+    mix(command.c_str(), command.size() + 1);
+    mix(version.c_str(), version.size() + 1);
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    std::string cached = this->cacheDirectory + "/" + name + ".spv";
+
+    if (std::filesystem::exists(cached)) {
+      ++this->hits;
+      return load(cached, source.spirvPath);
+    }
+    // Written to a unique file next to the cached one then renamed, like writeFileAtomically, so
+    // another process compiling the same shader never shares the output path.
+    std::string tmpPath = createTemporaryFile(cached);
+    command += " " + quote(source.sourcePath) + " -o " + quote(tmpPath);
+    if (std::system(command.c_str()) != 0) {
+      std::filesystem::remove(tmpPath);
+      throw std::runtime_error("failed to compile " + source.sourcePath + "!");
+    }
+    std::filesystem::rename(tmpPath, cached);
+    ++this->misses;
+    return load(cached, source.spirvPath);
+  }
+
+  std::mutex mutex;
+  // Protected by the mutex.
+  std::map<std::string, Shader> shaders;
+};
@@ -0,0 +1,72 @@
+#version 450
+#ifdef BINDLESS
+// Runtime sized arrays of descriptors.
+#extension GL_EXT_nonuniform_qualifier : require
+#endif
+
+// Whether normals are octahedral encoded in two components, as in the quantized vertex layouts
+// (see VertexLayout). Missing components of a vertex attribute read as 0, so they still arrive in
+// a vec3.
+layout(constant_id = 0) const bool octahedralNormals = false;
+
+#if defined(INSTANCED)
+// One transform per instance, written by the culling stage (see SceneObjects and GpuCulling).
+// Compiled to mesh_instanced.vert.spv.
+layout(location = 3) in mat4 instanceTransform;
+mat4 transform() {
+  return instanceTransform;
+}
+#elif defined(BINDLESS)
+// The transform of the draw, in one of the buffers of the global array (see BindlessTable).
+// Compiled to mesh_bindless.vert.spv.
+layout(std430, set = 0, binding = 1) readonly buffer Buffers {
+  vec4 words[];
+} buffers[];
+layout(push_constant) uniform PushConstants {
+  uint buffer;
+  uint element;
+};
+mat4 transform() {
+  return mat4(buffers[buffer].words[element], buffers[buffer].words[element + 1],
+    buffers[buffer].words[element + 2], buffers[buffer].words[element + 3]);
+}
+#elif defined(DRAW_UNIFORMS)
+// The transform of the draw, from a dynamic uniform buffer (see DescriptorSetCache). Compiled to
+// mesh_uniform.vert.spv.
+layout(set = 0, binding = 0) uniform DrawData {
+  mat4 drawTransform;
+};
+mat4 transform() {
+  return drawTransform;
+}
+#else
+layout(push_constant) uniform PushConstants {
+  mat4 pushedTransform;
+};
+mat4 transform() {
+  return pushedTransform;
+}
+#endif
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+layout(location = 2) in vec3 inColor;
+
+layout(location = 0) out vec3 fragColor;
+
+// Unfold the lower half of the octahedron, the inverse of encodeOctahedral.
+vec3 decodeOctahedral(vec2 encoded) {
+  vec3 normal = vec3(encoded, 1.0 - abs(encoded.x) - abs(encoded.y));
+  float fold = max(-normal.z, 0.0);
+  normal.x += normal.x >= 0.0 ? -fold : fold;
+  normal.y += normal.y >= 0.0 ? -fold : fold;
+  return normalize(normal);
+}
+
+void main() {
+  vec3 normal = octahedralNormals ? decodeOctahedral(inNormal.xy) : normalize(inNormal);
+  // A light fixed to the mesh, enough to see its shape.
+  float diffuse = max(dot(normal, normalize(vec3(0.5, 1.0, 0.8))), 0.0);
+  gl_Position = transform() * vec4(inPosition, 1.0);
+  fragColor = inColor * (0.2 + 0.8 * diffuse);
+}
@@ -0,0 +1,832 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vulkan/vulkan.h>
+
+#include "descriptors.hpp"
+#include "files.hpp"
+#include "frames.hpp"
+#include "handles.hpp"
+#include "memory.hpp"
+#include "upload.hpp"
+
+/**
+ * A texture pack is the container textures are streamed from: a header, a table of textures, then
+ * the texels. Textures are RGBA8 with a full mip chain, each level tightly packed. The levels of a
+ * texture are stored coarsest first, in the order they are streamed in. Fields are in the byte
+ * order of the machine which wrote the pack.
+ */
+struct TexturePackHeader {
+  static constexpr char magic[4] = { 'V', 'K', 'T', 'P' };
+  static constexpr uint32_t currentVersion = 1;
+
+  char fileMagic[4];
+  uint32_t version;
+  uint32_t textureCount;
+  uint32_t reserved;
+};
+
+struct TexturePackLevel {
+  // From the start of the file.
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct TexturePackEntry {
+  static constexpr uint32_t maxLevels = 16;
+
+  uint32_t width;
+  uint32_t height;
+  uint32_t levelCount;
+  uint32_t reserved;
+  TexturePackLevel levels[maxLevels];
+};
+
+/**
+ * Size of a mip level of a width×height texture.
+ */
+inline VkExtent2D mipExtent(uint32_t width, uint32_t height, uint32_t level) {
+  return { std::max(width >> level, 1u), std::max(height >> level, 1u) };
+}
+
+/**
+ * Write a pack of `count` procedural size×size textures, checkerboards of a color of their own,
+ * their mip chains box filtered. Used by the streaming benchmark.
+ */
+inline void writeTexturePack(const std::string &path, uint32_t count, uint32_t size) {
+  if (!std::has_single_bit(size)) {
+    throw std::runtime_error("texture pack textures must have a power of two size!");
+  }
+  uint32_t levelCount = std::bit_width(size);
+  if (levelCount > TexturePackEntry::maxLevels) {
+    throw std::runtime_error("texture pack textures are too large!");
+  }
+
+  TexturePackHeader header = { .version = TexturePackHeader::currentVersion,
+    .textureCount = count };
+  memcpy(header.fileMagic, TexturePackHeader::magic, sizeof(header.fileMagic));
+  std::vector<char> data(sizeof(TexturePackHeader) + count * sizeof(TexturePackEntry));
+  memcpy(data.data(), &header, sizeof(header));
+  for (uint32_t texture = 0; texture < count; ++texture) {
+    std::vector<std::vector<uint8_t>> levels(levelCount);
+    levels[0].resize(size_t(size) * size * 4);
+    uint8_t color[3] = {
+      uint8_t(texture * 97), uint8_t(texture * 57 + 80), uint8_t(texture * 31),
+    };
+    for (uint32_t y = 0; y < size; ++y) {
+      for (uint32_t x = 0; x < size; ++x) {
+        uint8_t *texel = &levels[0][(size_t(y) * size + x) * 4];
+        bool dark = ((x / 32) + (y / 32)) % 2 == 0;
+        for (int channel = 0; channel < 3; ++channel) {
+          texel[channel] = dark ? color[channel] / 4 : color[channel];
+        }
+        texel[3] = 255;
+      }
+    }
+    for (uint32_t level = 1; level < levelCount; ++level) {
+      uint32_t side = size >> level;
+      const std::vector<uint8_t> &previous = levels[level - 1];
+      levels[level].resize(size_t(side) * side * 4);
+      for (uint32_t y = 0; y < side; ++y) {
+        for (uint32_t x = 0; x < side; ++x) {
+          for (uint32_t channel = 0; channel < 4; ++channel) {
+            auto at = [&](uint32_t dx, uint32_t dy) {
+              return previous[((size_t(2 * y + dy) * 2 * side) + 2 * x + dx) * 4 + channel];
+            };
+            levels[level][(size_t(y) * side + x) * 4 + channel] =
+              (at(0, 0) + at(1, 0) + at(0, 1) + at(1, 1) + 2) / 4;
+          }
+        }
+      }
+    }
+
+    TexturePackEntry entry = { .width = size, .height = size, .levelCount = levelCount };
+    for (uint32_t level = levelCount; level-- > 0;) {
+      // Aligned for the copies to the staging ring.
+      data.resize((data.size() + 15) / 16 * 16);
+      entry.levels[level] = { .offset = data.size(), .size = levels[level].size() };
+      data.insert(data.end(), levels[level].begin(), levels[level].end());
+    }
+    memcpy(data.data() + sizeof(TexturePackHeader) + texture * sizeof(TexturePackEntry), &entry,
+      sizeof(entry));
+  }
+  writeFileAtomically(path, data);
+}
+
+/**
+ * A texture pack mapped in memory, read only. Nothing is read up front: the pages of a level are
+ * only brought in, from the page cache or the disk, when the level is copied to the staging ring.
+ */
+class TexturePack {
+public:
+  explicit TexturePack(const std::string &path) : path(path) {
+    int file = open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if (file < 0 || fstat(file, &status) != 0 || status.st_size == 0) {
+      if (file >= 0) {
+        close(file);
+      }
+      throw std::runtime_error("failed to open texture pack " + path + "!");
+    }
+    this->size = status.st_size;
+    void *mapped = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapped == MAP_FAILED) {
+      throw std::runtime_error("failed to map texture pack " + path + "!");
+    }
+    this->data = static_cast<const char *>(mapped);
+    if (!this->valid()) {
+      munmap(const_cast<char *>(this->data), this->size);
+      throw std::runtime_error("invalid texture pack " + path + "!");
+    }
+  }
+
+  ~TexturePack() {
+    munmap(const_cast<char *>(this->data), this->size);
+  }
+
+  TexturePack(const TexturePack &) = delete;
+  TexturePack &operator=(const TexturePack &) = delete;
+
+  uint32_t textureCount() const {
+    return reinterpret_cast<const TexturePackHeader *>(this->data)->textureCount;
+  }
+
+  const TexturePackEntry &texture(uint32_t index) const {
+    auto table = reinterpret_cast<const TexturePackEntry *>(this->data + sizeof(TexturePackHeader));
+    return table[index];
+  }
+
+  const char *level(uint32_t texture, uint32_t level) const {
+    return this->data + this->texture(texture).levels[level].offset;
+  }
+
+  std::string path;
+
+private:
+  /**
+   * Whether the header and the table are consistent and every level is within the file, so that
+   * nothing past the mapping is ever read.
+   */
+  bool valid() const {
+    if (this->size < sizeof(TexturePackHeader)) {
+      return false;
+    }
+    auto header = reinterpret_cast<const TexturePackHeader *>(this->data);
+    if (memcmp(header->fileMagic, TexturePackHeader::magic, sizeof(header->fileMagic)) != 0 ||
+        header->version != TexturePackHeader::currentVersion ||
+        (this->size - sizeof(TexturePackHeader)) / sizeof(TexturePackEntry)
+          < header->textureCount) {
+      return false;
+    }
+    for (uint32_t index = 0; index < header->textureCount; ++index) {
+      const TexturePackEntry &entry = this->texture(index);
+      if (entry.width == 0 || entry.height == 0 || entry.levelCount == 0 ||
+          entry.levelCount > TexturePackEntry::maxLevels ||
+          entry.levelCount > uint32_t(std::bit_width(std::max(entry.width, entry.height)))) {
+        return false;
+      }
+      for (uint32_t level = 0; level < entry.levelCount; ++level) {
+        VkExtent2D extent = mipExtent(entry.width, entry.height, level);
+        const TexturePackLevel &range = entry.levels[level];
+        if (range.size != uint64_t(extent.width) * extent.height * 4 ||
+            range.offset > this->size || range.size > this->size - range.offset) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  const char *data = nullptr;
+  size_t size = 0;
+};
+
+/**
+ * The device copy of a texture: an image with room for the levels from baseLevel to the smallest
+ * one, filled coarsest first. Only the levels the graphics queue has acquired are in its view, and
+ * in its entry of the bindless table if there is one. Levels are numbered as in the pack, level
+ * baseLevel being the first level of the image.
+ */
+class StreamedImage {
+public:
+  static constexpr uint32_t noDescriptor = UINT32_MAX;
+
+  StreamedImage(VkDevice device, DeviceMemoryAllocator &allocator, BindlessTable *bindless,
+    const TexturePackEntry &entry, uint32_t baseLevel,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      bindless(bindless), baseLevel(baseLevel), levelCount(entry.levelCount),
+      uploadedLevel(entry.levelCount), residentLevel(entry.levelCount),
+      batches(entry.levelCount - baseLevel, 0) {
+    VkExtent2D extent = mipExtent(entry.width, entry.height, baseLevel);
+    VkImageCreateInfo imageInfo = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = VK_FORMAT_R8G8B8A8_UNORM,
+      .extent = { extent.width, extent.height, 1 },
+      .mipLevels = entry.levelCount - baseLevel,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+    VkImage handle;
+    if (vkCreateImage(device, &imageInfo, allocationCallbacks, &handle) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create streamed image!");
+    }
+    this->image = UniqueImage(handle,
+      { .device = device, .allocationCallbacks = allocationCallbacks });
+    this->memory = allocator.allocateImage(this->image, imageInfo.tiling,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  }
+
+  ~StreamedImage() {
+    if (this->descriptor != noDescriptor) {
+      this->bindless->removeTexture(this->descriptor);
+    }
+    this->view.reset();
+    this->image.reset();
+    this->allocator.free(this->memory);
+  }
+
+  StreamedImage(const StreamedImage &) = delete;
+  StreamedImage &operator=(const StreamedImage &) = delete;
+
+  /**
+   * Whether uploads to the image have not been acquired by the graphics queue yet. The transfer
+   * queue may still be writing it, so it cannot be destroyed.
+   */
+  bool busy(uint64_t acquiredValue) const {
+    return this->lastBatch > acquiredValue;
+  }
+
+  /**
+   * Move residentLevel to the finest level the graphics queue has acquired. Returns whether it
+   * changed.
+   */
+  bool collect(uint64_t acquiredValue) {
+    uint32_t level = this->residentLevel;
+    while (level > this->uploadedLevel) {
+      uint64_t batch = this->batches[level - 1 - this->baseLevel];
+      if (batch == 0 || batch > acquiredValue) {
+        break;
+      }
+      --level;
+    }
+    bool changed = level != this->residentLevel;
+    this->residentLevel = level;
+    return changed;
+  }
+
+  /**
+   * Point the view and the descriptor at the resident levels. The previous ones may be used by the
+   * frames in flight, they are retired to `frames`.
+   */
+  void expose(VkSampler sampler, FrameRing &frames) {
+    if (this->residentLevel == this->levelCount || this->residentLevel == this->exposedLevel) {
+      return;
+    }
+    VkImageViewCreateInfo viewInfo = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .image = this->image,
+      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .format = VK_FORMAT_R8G8B8A8_UNORM,
+      .subresourceRange = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = this->residentLevel - this->baseLevel,
+        .levelCount = this->levelCount - this->residentLevel,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+      },
+    };
+    VkImageView handle;
+    if (vkCreateImageView(this->device, &viewInfo, this->allocationCallbacks, &handle)
+        != VK_SUCCESS) {
+      throw std::runtime_error("failed to create streamed image view!");
+    }
+    frames.retire(std::move(this->view));
+    this->view = UniqueImageView(handle,
+      { .device = this->device, .allocationCallbacks = this->allocationCallbacks });
+    if (this->bindless != nullptr) {
+      if (this->descriptor != noDescriptor) {
+        frames.retire([bindless = this->bindless, descriptor = this->descriptor]() {
+          bindless->removeTexture(descriptor);
+        });
+      }
+      this->descriptor = this->bindless->addTexture(this->view, sampler);
+    }
+    this->exposedLevel = this->residentLevel;
+  }
+
+  VkDeviceSize bytes() const {
+    return this->memory.size;
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  BindlessTable *bindless;
+  uint32_t baseLevel;
+  uint32_t levelCount;
+  // Finest level whose upload is recorded, levelCount if none.
+  uint32_t uploadedLevel;
+  // Finest level of the contiguous levels the graphics queue has acquired, levelCount if none.
+  uint32_t residentLevel;
+  // Finest level in the view.
+  uint32_t exposedLevel = UINT32_MAX;
+  // The upload batch of each level, 0 until it is flushed.
+  std::vector<uint64_t> batches;
+  uint64_t lastBatch = 0;
+  UniqueImage image;
+  Allocation memory;
+  UniqueImageView view;
+  // Entry of the bindless table.
+  uint32_t descriptor = noDescriptor;
+};
+
+/**
+ * Streams the textures of a pack to device memory as the frames need them, within a memory budget.
+ *
+ * Every frame, the caller tells with use() how large each visible texture is on screen, which
+ * gives the finest level worth having. update() then:
+ *   1. Exposes the levels the graphics queue has acquired.
+ *   2. Fits what the textures need in the budget. Textures no frame used for idleFrames only keep
+ *      their mip tail, the levels no larger than tailSize, which are cheap to keep around. Over
+ *      budget, the least recently used textures are evicted first, then the least recently used
+ *      and smallest on screen lose a level, round after round.
+ *   3. Moves each texture towards its level. An image cannot grow or shrink, so a texture changing
+ *      level gets a new image, streamed coarsest first. The texture keeps showing the old one until
+ *      the new one has finer levels, or is complete when shrinking.
+ *   4. Uploads up to bytesPerFrame through the UploadQueue, coarsest levels of all the textures
+ *      first, so that every texture shows something as soon as possible.
+ *
+ * The budget is what VK_EXT_memory_budget says the process can use of the device local heap, minus
+ * what the rest of the process uses, with some headroom, and at most `limit` if not 0. Images are
+ * destroyed through FrameRing::retire, never while a frame or an upload may still use them.
+ */
+class TextureStreamer {
+public:
+  // Levels no larger than this are the mip tail, kept as long as the texture is resident.
+  static constexpr uint32_t tailSize = 64;
+  // Frames without use() after which a texture is only kept for its mip tail.
+  static constexpr uint64_t idleFrames = 30;
+  // Frames between two queries of the heap budget.
+  static constexpr uint64_t budgetInterval = 16;
+
+  TextureStreamer(VkDevice device, VkPhysicalDevice physicalDevice,
+    const VkPhysicalDeviceMemoryProperties &memoryProperties, bool memoryBudget,
+    DeviceMemoryAllocator &allocator, UploadQueue &uploadQueue, FrameRing &frames,
+    BindlessTable *bindless, const std::string &packPath, VkDeviceSize limit,
+    VkDeviceSize bytesPerFrame, const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), physicalDevice(physicalDevice),
+      memoryProperties(memoryProperties), memoryBudget(memoryBudget), allocator(allocator),
+      uploadQueue(uploadQueue), frames(frames), bindless(bindless), pack(packPath), limit(limit),
+      bytesPerFrame(bytesPerFrame) {
+    this->heap = this->memoryProperties.memoryTypes[findMemoryType(this->memoryProperties,
+      UINT32_MAX, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)].heapIndex;
+
+    VkSamplerCreateInfo samplerInfo = {
+      .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+      .magFilter = VK_FILTER_LINEAR,
+      .minFilter = VK_FILTER_LINEAR,
+      .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+      .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+      .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+      .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+      // The views only hold the resident levels: no clamping is needed here.
+      .maxLod = VK_LOD_CLAMP_NONE,
+    };
+    VkSampler sampler;
+    if (vkCreateSampler(device, &samplerInfo, allocationCallbacks, &sampler) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create streaming sampler!");
+    }
+    this->sampler = UniqueSampler(sampler,
+      { .device = device, .allocationCallbacks = allocationCallbacks });
+
+    this->textures.resize(this->pack.textureCount());
+    for (uint32_t index = 0; index < this->textures.size(); ++index) {
+      const TexturePackEntry &entry = this->pack.texture(index);
+      Texture &texture = this->textures[index];
+      texture.levelCount = entry.levelCount;
+      texture.tailLevel = entry.levelCount - 1;
+      while (texture.tailLevel > 0) {
+        VkExtent2D extent = mipExtent(entry.width, entry.height, texture.tailLevel - 1);
+        if (std::max(extent.width, extent.height) > tailSize) {
+          break;
+        }
+        --texture.tailLevel;
+      }
+      // Bytes from each level to the smallest one.
+      texture.levelBytes.resize(entry.levelCount + 1, 0);
+      for (uint32_t level = entry.levelCount; level-- > 0;) {
+        texture.levelBytes[level] = texture.levelBytes[level + 1] + entry.levels[level].size;
+      }
+    }
+  }
+
+  ~TextureStreamer() {
+    // The images may still be written by the transfer queue. The frames must be done already.
+    this->uploadQueue.waitIdle();
+  }
+
+  TextureStreamer(const TextureStreamer &) = delete;
+  TextureStreamer &operator=(const TextureStreamer &) = delete;
+
+  uint32_t textureCount() const {
+    return this->textures.size();
+  }
+
+  /**
+   * The current frame draws `texture` about `screenSize` pixels wide. To be called before
+   * update(), for every texture the frame draws.
+   */
+  void use(uint32_t texture, float screenSize) {
+    Texture &entry = this->textures.at(texture);
+    entry.lastUsed = this->frames.frameNumber;
+    entry.used = true;
+    entry.screenSize = screenSize;
+  }
+
+  /**
+   * The entry of the texture in the bindless table, StreamedImage::noDescriptor until a level is
+   * resident.
+   */
+  uint32_t descriptor(uint32_t texture) const {
+    const Texture &entry = this->textures.at(texture);
+    return entry.current ? entry.current->descriptor : StreamedImage::noDescriptor;
+  }
+
+  /**
+   * Once per frame, after FrameRing::begin and before UploadQueue::acquire, so that the uploads it
+   * flushes are acquired by the frame.
+   */
+  void update() {
+    uint64_t frame = this->frames.frameNumber;
+    if (frame >= this->nextBudgetQuery) {
+      this->queryBudget();
+      this->nextBudgetQuery = frame + budgetInterval;
+    }
+    this->collect();
+    this->plan(frame);
+    this->stream();
+
+    for (auto &texture: this->textures) {
+      if (this->recent(texture, frame)) {
+        uint32_t resident = texture.current ? texture.current->residentLevel : texture.levelCount;
+        ++this->counters.wanted;
+        this->counters.satisfied += resident <= this->neededLevel(texture) ? 1 : 0;
+      }
+    }
+    this->counters.peakResidentBytes = std::max(this->counters.peakResidentBytes,
+      this->counters.residentBytes);
+  }
+
+  /**
+   * MiB streamed per second over `elapsedMilliseconds`.
+   */
+  double throughput(double elapsedMilliseconds) const {
+    double megabytes = this->counters.bytesStreamed / (1024.0 * 1024.0);
+    return elapsedMilliseconds > 0.0 ? megabytes * 1000.0 / elapsedMilliseconds : 0.0;
+  }
+
+  /**
+   * Percentage of the textures used by the frames which had the level they needed resident.
+   */
+  double satisfiedPercent() const {
+    return this->counters.wanted > 0
+      ? 100.0 * this->counters.satisfied / this->counters.wanted : 100.0;
+  }
+
+  void report(std::ostream &out, double elapsedMilliseconds) const {
+    constexpr double mebibyte = 1024.0 * 1024.0;
+    uint32_t resident = 0;
+    uint32_t full = 0;
+    for (auto &texture: this->textures) {
+      resident += texture.current ? 1 : 0;
+      full += texture.current && texture.current->residentLevel == 0 ? 1 : 0;
+    }
+    out << std::fixed << std::setprecision(3)
+        << "texture streaming (" << this->pack.path << ", " << this->textures.size()
+        << " textures, " << (this->memoryBudget ? "VK_EXT_memory_budget" : "no memory budget")
+        << "):" << '\n'
+        << "  " << this->counters.bytesStreamed / mebibyte << " MiB in "
+        << this->counters.levelsStreamed << " levels, " << this->throughput(elapsedMilliseconds)
+        << " MiB/s" << '\n'
+        << "  " << resident << " textures resident, " << full << " at full resolution, "
+        << this->counters.residentBytes / mebibyte << " MiB (peak "
+        << this->counters.peakResidentBytes / mebibyte << " MiB) of a "
+        << this->counters.budget / mebibyte << " MiB budget" << '\n'
+        << "  heap " << this->counters.heapUsage / mebibyte << " MiB used of "
+        << this->counters.heapBudget / mebibyte << " MiB" << '\n'
+        << "  " << this->counters.promotions << " promotions, " << this->counters.demotions
+        << " demotions, " << this->counters.evictions << " evictions, "
+        << this->counters.overBudgetFrames << " frames over budget" << '\n'
+        << "  " << this->satisfiedPercent() << " % of the used textures at the level they need"
+        << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+  }
+
+  struct {
+    uint64_t bytesStreamed = 0;
+    uint64_t levelsStreamed = 0;
+    // New images: finer than the current one, coarser, and textures dropped entirely.
+    uint64_t promotions = 0;
+    uint64_t demotions = 0;
+    uint64_t evictions = 0;
+    uint64_t overBudgetFrames = 0;
+    // Device memory of the images, the ones being streamed in included.
+    VkDeviceSize residentBytes = 0;
+    VkDeviceSize peakResidentBytes = 0;
+    VkDeviceSize budget = 0;
+    // The device local heap, as VK_EXT_memory_budget or the allocator reports it.
+    VkDeviceSize heapUsage = 0;
+    VkDeviceSize heapBudget = 0;
+    // Textures used by a frame, and how many of them had the level they needed.
+    uint64_t wanted = 0;
+    uint64_t satisfied = 0;
+  } counters;
+
+private:
+  struct Texture {
+    uint32_t levelCount = 0;
+    uint32_t tailLevel = 0;
+    std::vector<VkDeviceSize> levelBytes;
+    bool used = false;
+    uint64_t lastUsed = 0;
+    float screenSize = 0.0f;
+    // What the frames sample, and the image being streamed in to replace it.
+    std::unique_ptr<StreamedImage> current;
+    std::unique_ptr<StreamedImage> loading;
+  };
+
+  bool recent(const Texture &texture, uint64_t frame) const {
+    return texture.used && texture.lastUsed + idleFrames >= frame;
+  }
+
+  /**
+   * The finest level worth having: about one texel per pixel.
+   */
+  uint32_t neededLevel(const Texture &texture) const {
+    const TexturePackEntry &entry = this->pack.texture(&texture - this->textures.data());
+    float size = float(std::max(entry.width, entry.height));
+    float level = std::floor(std::log2(size / std::max(texture.screenSize, 1.0f)));
+    return std::clamp(level, 0.0f, float(texture.tailLevel));
+  }
+
+  void queryBudget() {
+    if (this->memoryBudget) {
+      VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
+      };
+      VkPhysicalDeviceMemoryProperties2 properties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2,
+        .pNext = &budgetProperties,
+      };
+      vkGetPhysicalDeviceMemoryProperties2(this->physicalDevice, &properties);
+      this->counters.heapUsage = budgetProperties.heapUsage[this->heap];
+      this->counters.heapBudget = budgetProperties.heapBudget[this->heap];
+    } else {
+      // Without the extension, other processes are invisible: assume a share of the heap is ours.
+      this->counters.heapUsage = this->allocator.getStats().reservedBytes;
+      this->counters.heapBudget = this->memoryProperties.memoryHeaps[this->heap].size / 4 * 3;
+    }
+    VkDeviceSize others = this->counters.heapUsage - std::min(this->counters.heapUsage,
+      this->counters.residentBytes);
+    // The budget moves with what other processes do: keep some headroom.
+    VkDeviceSize available = this->counters.heapBudget > others
+      ? (this->counters.heapBudget - others) / 10 * 9 : 0;
+    this->counters.budget = this->limit > 0 ? std::min(this->limit, available) : available;
+  }
+
+  /**
+   * Expose the levels acquired since the last frame, and replace the current images by the ones
+   * streamed in when they are good enough.
+   */
+  void collect() {
+    uint64_t acquired = this->uploadQueue.acquiredValue;
+    for (auto &texture: this->textures) {
+      if (texture.current && texture.current->collect(acquired)) {
+        texture.current->expose(this->sampler, this->frames);
+      }
+      if (!texture.loading) {
+        continue;
+      }
+      StreamedImage &loading = *texture.loading;
+      loading.collect(acquired);
+      bool complete = loading.residentLevel == loading.baseLevel;
+      bool better = loading.residentLevel < loading.levelCount && (!texture.current ||
+        loading.residentLevel < texture.current->residentLevel);
+      if ((complete || better) && (!texture.current || !texture.current->busy(acquired))) {
+        this->retire(texture.current);
+        texture.current = std::move(texture.loading);
+        texture.current->expose(this->sampler, this->frames);
+      }
+    }
+  }
+
+  /**
+   * Pick the level of each texture within the budget, and start the new images.
+   */
+  void plan(uint64_t frame) {
+    std::vector<uint32_t> levels(this->textures.size());
+    VkDeviceSize total = 0;
+    for (size_t index = 0; index < this->textures.size(); ++index) {
+      Texture &texture = this->textures[index];
+      bool resident = texture.current || texture.loading;
+      levels[index] = this->recent(texture, frame) ? this->neededLevel(texture)
+        : resident ? texture.tailLevel : texture.levelCount;
+      total += texture.levelBytes[levels[index]];
+    }
+
+    bool pressure = total > this->counters.budget;
+    if (pressure) {
+      // Least recently used first, then smallest on screen.
+      std::vector<uint32_t> order(this->textures.size());
+      for (uint32_t index = 0; index < order.size(); ++index) {
+        order[index] = index;
+      }
+      std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+        const Texture &first = this->textures[a], &second = this->textures[b];
+        return first.lastUsed != second.lastUsed ? first.lastUsed < second.lastUsed
+          : first.screenSize < second.screenSize;
+      });
+      for (uint32_t index: order) {
+        Texture &texture = this->textures[index];
+        if (total <= this->counters.budget) {
+          break;
+        }
+        if (!this->recent(texture, frame) && levels[index] < texture.levelCount) {
+          total -= texture.levelBytes[levels[index]];
+          levels[index] = texture.levelCount;
+        }
+      }
+      bool demoted = true;
+      while (total > this->counters.budget && demoted) {
+        demoted = false;
+        for (uint32_t index: order) {
+          Texture &texture = this->textures[index];
+          if (total <= this->counters.budget) {
+            break;
+          }
+          if (levels[index] < texture.tailLevel) {
+            total -= texture.levelBytes[levels[index]] - texture.levelBytes[levels[index] + 1];
+            ++levels[index];
+            demoted = true;
+          }
+        }
+      }
+      this->counters.overBudgetFrames += total > this->counters.budget ? 1 : 0;
+    }
+
+    for (size_t index = 0; index < this->textures.size(); ++index) {
+      bool reclaim = pressure || !this->recent(this->textures[index], frame);
+      this->reconcile(index, levels[index], reclaim);
+    }
+  }
+
+  /**
+   * Start moving the texture to `level`, levelCount to evict it. Coarser images are only worth
+   * the churn for two levels or more, unless memory is needed.
+   */
+  void reconcile(size_t index, uint32_t level, bool reclaim) {
+    Texture &texture = this->textures[index];
+    uint64_t acquired = this->uploadQueue.acquiredValue;
+    // One change at a time.
+    if (texture.loading) {
+      return;
+    }
+    if (level == texture.levelCount) {
+      if (texture.current && !texture.current->busy(acquired)) {
+        this->retire(texture.current);
+        ++this->counters.evictions;
+      }
+      return;
+    }
+    VkDeviceSize cost = texture.levelBytes[level];
+    bool fits = this->counters.residentBytes + cost <= this->counters.budget;
+    if (!texture.current) {
+      // The mip tail is always worth having.
+      if (fits || level == texture.tailLevel) {
+        texture.loading = this->createImage(index, level);
+      }
+      return;
+    }
+    uint32_t base = texture.current->baseLevel;
+    if (level < base && fits) {
+      texture.loading = this->createImage(index, level);
+      ++this->counters.promotions;
+    } else if (level > base && (reclaim || level >= base + 2) &&
+               !texture.current->busy(acquired)) {
+      texture.loading = this->createImage(index, level);
+      ++this->counters.demotions;
+    }
+  }
+
+  /**
+   * Record the uploads of the frame, coarsest levels first, and flush them.
+   */
+  void stream() {
+    struct Upload {
+      StreamedImage *image;
+      uint32_t level;
+    };
+    std::vector<Upload> uploads;
+    VkDeviceSize remaining = this->bytesPerFrame;
+    while (remaining > 0) {
+      StreamedImage *next = nullptr;
+      uint32_t texture = 0;
+      VkDeviceSize nextSize = 0;
+      float nextScreenSize = 0.0f;
+      for (uint32_t index = 0; index < this->textures.size(); ++index) {
+        Texture &entry = this->textures[index];
+        for (StreamedImage *image: { entry.loading.get(), entry.current.get() }) {
+          if (image == nullptr || image->uploadedLevel == image->baseLevel) {
+            continue;
+          }
+          uint32_t level = image->uploadedLevel - 1;
+          VkDeviceSize size = entry.levelBytes[level] - entry.levelBytes[level + 1];
+          if (next == nullptr || size < nextSize ||
+              (size == nextSize && entry.screenSize > nextScreenSize)) {
+            next = image;
+            texture = index;
+            nextSize = size;
+            nextScreenSize = entry.screenSize;
+          }
+        }
+      }
+      // A level larger than what is left waits for the next frame, unless nothing was uploaded
+      // yet: large levels must make progress too.
+      if (next == nullptr || (nextSize > remaining && !uploads.empty())) {
+        break;
+      }
+      const TexturePackEntry &entry = this->pack.texture(texture);
+      uint32_t level = next->uploadedLevel - 1;
+      this->uploadQueue.uploadImage(next->image, mipExtent(entry.width, entry.height, level),
+        this->pack.level(texture, level), nextSize, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        level - next->baseLevel);
+      next->uploadedLevel = level;
+      uploads.push_back({ next, level });
+      remaining -= std::min(remaining, nextSize);
+      this->counters.bytesStreamed += nextSize;
+      ++this->counters.levelsStreamed;
+    }
+    if (uploads.empty()) {
+      return;
+    }
+    uint64_t value = this->uploadQueue.flush();
+    for (auto &upload: uploads) {
+      upload.image->batches[upload.level - upload.image->baseLevel] = value;
+      upload.image->lastBatch = value;
+    }
+  }
+
+  std::unique_ptr<StreamedImage> createImage(size_t index, uint32_t level) {
+    auto image = std::make_unique<StreamedImage>(this->device, this->allocator, this->bindless,
+      this->pack.texture(index), level, this->allocationCallbacks);
+    this->counters.residentBytes += image->bytes();
+    return image;
+  }
+
+  void retire(std::unique_ptr<StreamedImage> &image) {
+    if (image) {
+      this->counters.residentBytes -= image->bytes();
+      this->frames.retire(std::move(image));
+    }
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  VkPhysicalDevice physicalDevice;
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  bool memoryBudget;
+  DeviceMemoryAllocator &allocator;
+  UploadQueue &uploadQueue;
+  FrameRing &frames;
+  BindlessTable *bindless;
+  TexturePack pack;
+  VkDeviceSize limit;
+  VkDeviceSize bytesPerFrame;
+  // The device local heap the images are allocated from.
+  uint32_t heap = 0;
+  UniqueSampler sampler;
+  std::vector<Texture> textures;
+  uint64_t nextBudgetQuery = 0;
+};
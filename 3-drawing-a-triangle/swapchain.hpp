@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "frames.hpp"
+#include "handles.hpp"
+
+/**
+ * What the swap chain configuration optimizes for.
+ */
+enum class PresentPolicy {
+  // Present as soon as possible without tearing: MAILBOX replaces the queued image with the newest
+  // one instead of waiting for the next vertical blank. Without it, FIFO_RELAXED only tears a frame
+  // which already missed its vertical blank, and FIFO never does. IMMEDIATE is never used.
+  LowLatency,
+  // Render as many frames as possible: IMMEDIATE does not wait for vertical blank at all (tearing
+  // is possible) and an extra image keeps the GPU busy.
+  Throughput,
+  // Classic double/triple buffering synchronized on the vertical blank. FIFO is the only mode
+  // guaranteed to be available.
+  VSync,
+};
+
+inline PresentPolicy parsePresentPolicy(const std::string &name) {
+  if (name == "latency") return PresentPolicy::LowLatency;
+  if (name == "throughput") return PresentPolicy::Throughput;
+  if (name == "vsync") return PresentPolicy::VSync;
+  throw std::runtime_error("unknown present policy " + name);
+}
+
+/**
+ * What the surface supports on a given physical device.
+ */
+struct SwapchainSupport {
+  SwapchainSupport(VkPhysicalDevice device, VkSurfaceKHR surface) {
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &this->capabilities);
+
+    uint32_t formatCount;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &formatCount, nullptr);
+    this->formats.resize(formatCount);
+    vkGetPhysicalDeviceSurfaceFormatsKHR(device, surface, &formatCount, this->formats.data());
+
+    uint32_t presentModeCount;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &presentModeCount, nullptr);
+    this->presentModes.resize(presentModeCount);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface, &presentModeCount,
+      this->presentModes.data());
+  }
+
+  VkSurfaceCapabilitiesKHR capabilities;
+  std::vector<VkSurfaceFormatKHR> formats;
+  std::vector<VkPresentModeKHR> presentModes;
+};
+
+/**
+ * Owns the VkSwapchainKHR, its images and image views. Whoever owns the swap chain must have waited
+ * for the frames in flight before destroying it.
+ *
+ * On resize, the swap chain is recreated with the current one passed as `oldSwapchain`, which lets
+ * the presentation engine hand over resources. The old swap chain is not destroyed right away: it
+ * is retired to the FrameRing, which destroys it once the frames which used it are done on the
+ * GPU. This way recreation never waits for the whole device to be idle.
+ */
+class Swapchain {
+public:
+  Swapchain(VkPhysicalDevice physicalDevice, VkDevice device, VkSurfaceKHR surface,
+    PresentPolicy policy, std::vector<uint32_t> queueFamilyIndices, VkExtent2D framebufferExtent,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : physicalDevice(physicalDevice), device(device), allocationCallbacks(allocationCallbacks),
+      surface(surface), policy(policy), queueFamilyIndices(queueFamilyIndices) {
+    this->create(framebufferExtent, VK_NULL_HANDLE);
+  }
+
+  Swapchain(const Swapchain &) = delete;
+  Swapchain &operator=(const Swapchain &) = delete;
+
+  /**
+   * Recreate the swap chain for the new framebuffer extent. The current swap chain is retired to
+   * `frames` until the frames which might use it are done.
+   */
+  void recreate(VkExtent2D framebufferExtent, FrameRing &frames) {
+    VkSwapchainKHR oldSwapchain = this->swapchain;
+    frames.retire(std::make_unique<RetiredSwapchain>(RetiredSwapchain {
+      .swapchain = std::move(this->swapchain),
+      .imageViews = std::move(this->imageViews),
+      .framebuffers = std::move(this->framebuffers),
+      .renderFinished = std::move(this->renderFinished),
+    }));
+    this->framebuffers.clear();
+    this->imageViews.clear();
+    this->renderFinished.clear();
+    this->images.clear();
+    // Still valid: the retired swap chain is only destroyed once a later frame begins.
+    this->create(framebufferExtent, oldSwapchain);
+  }
+
+  /**
+   * Create one framebuffer per image for `renderPass`. Swap chains created by later recreations get
+   * theirs right away. The render pass must outlive the swap chain.
+   */
+  void createFramebuffers(VkRenderPass renderPass) {
+    this->renderPass = renderPass;
+    for (auto &view: this->imageViews) {
+      VkFramebufferCreateInfo framebufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+        .renderPass = renderPass,
+        .attachmentCount = 1,
+        .pAttachments = view.address(),
+        .width = this->extent.width,
+        .height = this->extent.height,
+        .layers = 1,
+      };
+      this->framebuffers.push_back(createDeviceChild<UniqueFramebuffer>(vkCreateFramebuffer,
+        this->device, framebufferInfo, this->allocationCallbacks, "swap chain framebuffer"));
+    }
+  }
+
+  /**
+   * Acquire the next image to render to. `imageAvailable` gets signaled once the presentation
+   * engine is done reading from it.
+   */
+  VkResult acquire(VkSemaphore imageAvailable, uint32_t *imageIndex) {
+    return vkAcquireNextImageKHR(this->device, this->swapchain, UINT64_MAX, imageAvailable,
+      VK_NULL_HANDLE, imageIndex);
+  }
+
+  /**
+   * Queue the image for presentation once its renderFinished semaphore is signaled.
+   */
+  VkResult present(VkQueue presentQueue, uint32_t imageIndex) {
+    VkPresentInfoKHR presentInfo = {
+      .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+      .waitSemaphoreCount = 1,
+      .pWaitSemaphores = this->renderFinished[imageIndex].address(),
+      .swapchainCount = 1,
+      .pSwapchains = this->swapchain.address(),
+      .pImageIndices = &imageIndex,
+    };
+    return vkQueuePresentKHR(presentQueue, &presentInfo);
+  }
+
+  /**
+   * The format does not depend on the policy: 8 bits sRGB is universally supported and the sRGB
+   * conversion is done for free by the hardware.
+   */
+  static VkSurfaceFormatKHR chooseSurfaceFormat(const std::vector<VkSurfaceFormatKHR> &formats) {
+    for (const auto &format: formats) {
+      if (format.format == VK_FORMAT_B8G8R8A8_SRGB &&
+          format.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+        return format;
+      }
+    }
+    return formats[0];
+  }
+
+  static VkPresentModeKHR choosePresentMode(const std::vector<VkPresentModeKHR> &presentModes,
+    PresentPolicy policy) {
+    std::vector<VkPresentModeKHR> preferences;
+    switch (policy) {
+      case PresentPolicy::LowLatency:
+        preferences = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+        break;
+      case PresentPolicy::Throughput:
+        preferences = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR };
+        break;
+      case PresentPolicy::VSync:
+        break;
+    }
+    for (auto preference: preferences) {
+      if (std::find(presentModes.begin(), presentModes.end(), preference) != presentModes.end()) {
+        return preference;
+      }
+    }
+    // Always available.
+    return VK_PRESENT_MODE_FIFO_KHR;
+  }
+
+  /**
+   * With one image more than the minimum we never wait for the driver to release an image before
+   * acquiring the next one. Throughput asks for yet another one so that the GPU always has an
+   * image to render to.
+   */
+  static uint32_t chooseImageCount(const VkSurfaceCapabilitiesKHR &capabilities,
+    PresentPolicy policy) {
+    uint32_t imageCount = capabilities.minImageCount + (policy == PresentPolicy::Throughput ? 2 : 1);
+    // 0 means there is no maximum.
+    if (capabilities.maxImageCount > 0) {
+      imageCount = std::min(imageCount, capabilities.maxImageCount);
+    }
+    return imageCount;
+  }
+
+  /**
+   * Most window managers set currentExtent to the window size. Some let us choose, by setting it to
+   * the max value of uint32_t, in which case we use the framebuffer size in pixels.
+   */
+  static VkExtent2D chooseExtent(const VkSurfaceCapabilitiesKHR &capabilities,
+    VkExtent2D framebufferExtent) {
+    if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
+      return capabilities.currentExtent;
+    }
+    return {
+      std::clamp(framebufferExtent.width, capabilities.minImageExtent.width,
+        capabilities.maxImageExtent.width),
+      std::clamp(framebufferExtent.height, capabilities.minImageExtent.height,
+        capabilities.maxImageExtent.height),
+    };
+  }
+
+private:
+  void create(VkExtent2D framebufferExtent, VkSwapchainKHR oldSwapchain) {
+    SwapchainSupport support(this->physicalDevice, this->surface);
+    if (support.formats.empty() || support.presentModes.empty()) {
+      throw std::runtime_error("surface supports no format or present mode!");
+    }
+
+    VkSurfaceFormatKHR surfaceFormat = chooseSurfaceFormat(support.formats);
+    this->presentMode = choosePresentMode(support.presentModes, this->policy);
+    this->extent = chooseExtent(support.capabilities, framebufferExtent);
+    this->format = surfaceFormat.format;
+
+    // Images are cleared and rendered to. They can also be copied from, to read frames back.
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+      | (support.capabilities.supportedUsageFlags
+         & (VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT));
+
+    // When graphics and presentation are done by different queue families, let both use the images
+    // without explicit ownership transfers.
+    bool concurrent = this->queueFamilyIndices.size() > 1;
+    VkSwapchainCreateInfoKHR createInfo = {
+      .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+      .surface = this->surface,
+      .minImageCount = chooseImageCount(support.capabilities, this->policy),
+      .imageFormat = surfaceFormat.format,
+      .imageColorSpace = surfaceFormat.colorSpace,
+      .imageExtent = this->extent,
+      .imageArrayLayers = 1,
+      .imageUsage = usage,
+      .imageSharingMode = concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = concurrent ? (uint32_t) this->queueFamilyIndices.size() : 0,
+      .pQueueFamilyIndices = concurrent ? this->queueFamilyIndices.data() : nullptr,
+      .preTransform = support.capabilities.currentTransform,
+      .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+      .presentMode = this->presentMode,
+      // We don't care about the pixels hidden behind other windows.
+      .clipped = VK_TRUE,
+      .oldSwapchain = oldSwapchain,
+    };
+    this->swapchain = createDeviceChild<UniqueSwapchain>(vkCreateSwapchainKHR, this->device,
+      createInfo, this->allocationCallbacks, "swap chain");
+
+    // The implementation may create more images than requested.
+    uint32_t imageCount;
+    vkGetSwapchainImagesKHR(this->device, this->swapchain, &imageCount, nullptr);
+    this->images.resize(imageCount);
+    vkGetSwapchainImagesKHR(this->device, this->swapchain, &imageCount, this->images.data());
+
+    for (auto image: this->images) {
+      VkImageViewCreateInfo viewInfo = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = this->format,
+        .subresourceRange = {
+          .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+          .baseMipLevel = 0,
+          .levelCount = 1,
+          .baseArrayLayer = 0,
+          .layerCount = 1,
+        },
+      };
+      this->imageViews.push_back(createDeviceChild<UniqueImageView>(vkCreateImageView,
+        this->device, viewInfo, this->allocationCallbacks, "swap chain image view"));
+
+      // Presentation does not signal any fence we could wait on before reusing a semaphore, so
+      // there is one renderFinished semaphore per image rather than per frame in flight: it is
+      // only signaled again once the image has been presented and acquired back.
+      VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      };
+      this->renderFinished.push_back(createDeviceChild<UniqueSemaphore>(vkCreateSemaphore,
+        this->device, semaphoreInfo, this->allocationCallbacks, "swap chain semaphore"));
+    }
+
+    // The surface format is chosen the same way every time, so the render pass stays compatible.
+    if (this->renderPass != VK_NULL_HANDLE) {
+      this->createFramebuffers(this->renderPass);
+    }
+  }
+
+  /**
+   * What recreate() hands to the FrameRing, destroyed in reverse order: the framebuffers before the
+   * views they use, the views before the swap chain images.
+   */
+  struct RetiredSwapchain {
+    UniqueSwapchain swapchain;
+    std::vector<UniqueImageView> imageViews;
+    std::vector<UniqueFramebuffer> framebuffers;
+    std::vector<UniqueSemaphore> renderFinished;
+  };
+
+  VkPhysicalDevice physicalDevice;
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  VkSurfaceKHR surface;
+  PresentPolicy policy;
+  std::vector<uint32_t> queueFamilyIndices;
+  VkRenderPass renderPass = VK_NULL_HANDLE;
+
+public:
+  // The members are destroyed in reverse order, the swap chain last.
+  UniqueSwapchain swapchain;
+  VkFormat format;
+  VkExtent2D extent;
+  VkPresentModeKHR presentMode;
+  std::vector<VkImage> images;
+  std::vector<UniqueImageView> imageViews;
+  // Empty until createFramebuffers is called.
+  std::vector<UniqueFramebuffer> framebuffers;
+  // Signaled when rendering to the image of the same index is done.
+  std::vector<UniqueSemaphore> renderFinished;
+};
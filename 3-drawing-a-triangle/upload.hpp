@@ -0,0 +1,632 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "handles.hpp"
+#include "memory.hpp"
+
+/**
+ * What a graphics submission must wait for before using uploaded resources. No semaphore when
+ * there is nothing to wait for on the GPU.
+ */
+struct UploadWait {
+  VkSemaphore semaphore = VK_NULL_HANDLE;
+  // The timeline value to wait for.
+  uint64_t value = 0;
+  // Stages of the graphics queue using the uploaded resources.
+  VkPipelineStageFlags stages = 0;
+};
+
+/**
+ * Streams buffer and image data to device local memory without stalling the render queue.
+ *
+ * Data is copied into a persistently mapped staging ring, then copied to its destination by
+ * command buffers submitted to the transfer queue in batches. Dedicated transfer queue families
+ * are usually backed by DMA engines running in parallel with graphics work. Resources are created
+ * with exclusive sharing, so their ownership is released by the transfer queue family and acquired
+ * by the graphics queue family: acquire() records the acquire barriers in a graphics command
+ * buffer.
+ *
+ * Each batch signals the next value of a timeline semaphore, which the graphics submission waits
+ * for on the GPU. Without timeline semaphores, each batch signals a fence instead and acquire()
+ * only picks the batches the fence says are done. When uploads go through the graphics queue
+ * itself, there is no ownership to transfer and submission order is enough.
+ *
+ * Not thread safe: the transfer queue may be the graphics queue, which is externally synchronized.
+ */
+class UploadQueue {
+public:
+  static constexpr VkDeviceSize defaultRingSize = 16 * 1024 * 1024;
+  // Batches submitted and not known to be done at the same time.
+  static constexpr uint32_t batchCount = 8;
+
+  UploadQueue(VkDevice device, DeviceMemoryAllocator &allocator,
+    const VkPhysicalDeviceLimits &limits, VkQueue queue, uint32_t queueFamilyIndex,
+    uint32_t graphicsQueueFamilyIndex, bool timelineSemaphores,
+    VkDeviceSize ringSize = defaultRingSize,
+    const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      queue(queue), queueFamilyIndex(queueFamilyIndex),
+      graphicsQueueFamilyIndex(graphicsQueueFamilyIndex), timeline(timelineSemaphores),
+      ringSize(ringSize),
+      // Buffer to image copies need 4 bytes aligned offsets, and a multiple of the texel size.
+      alignment(std::max<VkDeviceSize>(16, limits.optimalBufferCopyOffsetAlignment)) {
+    VkBufferCreateInfo bufferInfo = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = ringSize,
+      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    this->ring = createDeviceChild<UniqueBuffer>(vkCreateBuffer, device, bufferInfo,
+      allocationCallbacks, "staging buffer");
+    // Coherent so that nothing needs to be flushed after writing.
+    this->ringMemory = allocator.allocateBuffer(this->ring,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    if (this->timeline) {
+      VkSemaphoreTypeCreateInfo typeInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+      };
+      VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &typeInfo,
+      };
+      this->semaphore = createDeviceChild<UniqueSemaphore>(vkCreateSemaphore, device,
+        semaphoreInfo, allocationCallbacks, "upload timeline semaphore");
+    }
+
+    this->batches.resize(batchCount);
+    for (auto &batch: this->batches) {
+      VkCommandPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = queueFamilyIndex,
+      };
+      batch.commandPool = createDeviceChild<UniqueCommandPool>(vkCreateCommandPool, device,
+        poolInfo, allocationCallbacks, "upload command pool");
+      VkCommandBufferAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = batch.commandPool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+      };
+      if (vkAllocateCommandBuffers(device, &allocInfo, &batch.commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate upload command buffer!");
+      }
+      if (!this->timeline) {
+        VkFenceCreateInfo fenceInfo = {
+          .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        };
+        batch.fence = createDeviceChild<UniqueFence>(vkCreateFence, device, fenceInfo,
+          allocationCallbacks, "upload fence");
+      }
+    }
+  }
+
+  ~UploadQueue() {
+    this->waitIdle();
+    // The buffer goes before the memory bound to it.
+    this->ring.reset();
+    this->allocator.free(this->ringMemory);
+  }
+
+  UploadQueue(const UploadQueue &) = delete;
+  UploadQueue &operator=(const UploadQueue &) = delete;
+
+  /**
+   * Whether uploads run on their own queue family, in parallel with the graphics queue.
+   */
+  bool dedicated() const {
+    return this->queueFamilyIndex != this->graphicsQueueFamilyIndex;
+  }
+
+  /**
+   * Copy `size` bytes to the buffer at `offset`. The buffer is then used by the graphics queue at
+   * `dstStage` with `dstAccess`, e.g. VK_PIPELINE_STAGE_VERTEX_INPUT_BIT and
+   * VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT for a vertex buffer. Big uploads are split so that they
+   * never need more than a quarter of the staging ring at once.
+   */
+  void uploadBuffer(VkBuffer buffer, VkDeviceSize offset, const void *data, VkDeviceSize size,
+    VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+    VkDeviceSize chunkSize = this->ringSize / 4;
+    for (VkDeviceSize done = 0; done < size; done += chunkSize) {
+      VkDeviceSize length = std::min(chunkSize, size - done);
+      VkDeviceSize stagingOffset = this->stage(static_cast<const char *>(data) + done, length);
+      Batch &batch = this->current();
+      VkBufferCopy region = {
+        .srcOffset = stagingOffset,
+        .dstOffset = offset + done,
+        .size = length,
+      };
+      vkCmdCopyBuffer(batch.commandBuffer, this->ring, buffer, 1, &region);
+    }
+
+    VkBufferMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = dstAccess,
+      .srcQueueFamilyIndex = this->queueFamilyIndex,
+      .dstQueueFamilyIndex = this->graphicsQueueFamilyIndex,
+      .buffer = buffer,
+      .offset = offset,
+      .size = size,
+    };
+    this->release(barrier);
+    this->current().pending.bufferBarriers.push_back(barrier);
+    this->current().pending.stages |= dstStage;
+    this->stats.bytes += size;
+  }
+
+  /**
+   * Copy the texels of a mip level of a 2D color image, `extent` being the size of that level. The
+   * level is left in SHADER_READ_ONLY_OPTIMAL layout for the graphics queue to sample it at
+   * `dstStage`, the other levels are not touched.
+   */
+  void uploadImage(VkImage image, VkExtent2D extent, const void *data, VkDeviceSize size,
+    VkPipelineStageFlags dstStage, uint32_t mipLevel = 0) {
+    VkDeviceSize stagingOffset = this->stage(data, size);
+    Batch &batch = this->current();
+
+    VkImageSubresourceRange range = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel = mipLevel,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+    // The previous content is overwritten, so we can transition from UNDEFINED.
+    VkImageMemoryBarrier toTransferDst = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = 0,
+      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = image,
+      .subresourceRange = range,
+    };
+    vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toTransferDst);
+
+    VkBufferImageCopy region = {
+      .bufferOffset = stagingOffset,
+      // Tightly packed.
+      .bufferRowLength = 0,
+      .bufferImageHeight = 0,
+      .imageSubresource = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .mipLevel = mipLevel,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+      },
+      .imageOffset = { 0, 0, 0 },
+      .imageExtent = { extent.width, extent.height, 1 },
+    };
+    vkCmdCopyBufferToImage(batch.commandBuffer, this->ring, image,
+      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    // The layout transition is part of the ownership transfer: release and acquire both declare it.
+    VkImageMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      .srcQueueFamilyIndex = this->queueFamilyIndex,
+      .dstQueueFamilyIndex = this->graphicsQueueFamilyIndex,
+      .image = image,
+      .subresourceRange = range,
+    };
+    this->release(barrier);
+    batch.pending.imageBarriers.push_back(barrier);
+    batch.pending.stages |= dstStage;
+    this->stats.bytes += size;
+  }
+
+  /**
+   * Submit the copies recorded since the last flush. Returns the value identifying the batch,
+   * 0 if there was nothing to submit.
+   */
+  uint64_t flush() {
+    if (!this->recording) {
+      return 0;
+    }
+    this->recording = false;
+    Batch &batch = this->batches[this->nextValue % batchCount];
+    if (vkEndCommandBuffer(batch.commandBuffer) != VK_SUCCESS) {
+      throw std::runtime_error("failed to record upload command buffer!");
+    }
+
+    batch.value = this->nextValue++;
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .signalSemaphoreValueCount = 1,
+      .pSignalSemaphoreValues = &batch.value,
+    };
+    VkSubmitInfo submitInfo = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .pNext = this->timeline ? &timelineInfo : nullptr,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &batch.commandBuffer,
+      .signalSemaphoreCount = this->timeline ? 1u : 0u,
+      .pSignalSemaphores = this->semaphore.address(),
+    };
+    if (!this->timeline) {
+      vkResetFences(this->device, 1, batch.fence.address());
+    }
+    if (vkQueueSubmit(this->queue, 1, &submitInfo, batch.fence) != VK_SUCCESS) {
+      throw std::runtime_error("failed to submit upload command buffer!");
+    }
+
+    this->inFlight.push_back({ .value = batch.value, .ringEnd = this->head });
+    batch.pending.value = batch.value;
+    this->pendingAcquires.push_back(std::move(batch.pending));
+    batch.pending = {};
+    this->stats.batches++;
+    return batch.value;
+  }
+
+  /**
+   * Record in a graphics command buffer, outside of any render pass, the acquire barriers of the
+   * flushed batches, and return what its submission must wait for.
+   */
+  UploadWait acquire(VkCommandBuffer commandBuffer) {
+    this->poll();
+    UploadWait wait;
+    std::vector<VkBufferMemoryBarrier> bufferBarriers;
+    std::vector<VkImageMemoryBarrier> imageBarriers;
+    while (!this->pendingAcquires.empty()) {
+      PendingAcquire &pending = this->pendingAcquires.front();
+      // Without a timeline semaphore to wait for on the GPU, only take what is already done.
+      if (this->dedicated() && !this->timeline && pending.value > this->completedValue) {
+        break;
+      }
+      bufferBarriers.insert(bufferBarriers.end(), pending.bufferBarriers.begin(),
+        pending.bufferBarriers.end());
+      imageBarriers.insert(imageBarriers.end(), pending.imageBarriers.begin(),
+        pending.imageBarriers.end());
+      wait.stages |= pending.stages;
+      wait.value = pending.value;
+      this->acquiredValue = pending.value;
+      this->pendingAcquires.pop_front();
+    }
+    if (bufferBarriers.empty() && imageBarriers.empty()) {
+      return {};
+    }
+
+    // Across queue families the source stage only has to match the stages waiting on the
+    // semaphore. On the same queue, the barrier waits for the copies submitted before.
+    VkPipelineStageFlags srcStage = wait.stages;
+    if (!this->dedicated()) {
+      srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    } else {
+      for (auto &barrier: bufferBarriers) {
+        barrier.srcAccessMask = 0;
+      }
+      for (auto &barrier: imageBarriers) {
+        barrier.srcAccessMask = 0;
+      }
+    }
+    vkCmdPipelineBarrier(commandBuffer, srcStage, wait.stages, 0, 0, nullptr,
+      bufferBarriers.size(), bufferBarriers.data(), imageBarriers.size(), imageBarriers.data());
+
+    if (this->dedicated() && this->timeline) {
+      wait.semaphore = this->semaphore;
+    } else {
+      wait.value = 0;
+    }
+    return wait;
+  }
+
+  /**
+   * Flush and wait for every upload to be done.
+   */
+  void waitIdle() {
+    this->flush();
+    if (this->nextValue > 1) {
+      this->waitFor(this->nextValue - 1);
+    }
+  }
+
+  /**
+   * MiB uploaded per second over `elapsedMilliseconds`.
+   */
+  double throughput(double elapsedMilliseconds) const {
+    double megabytes = this->stats.bytes / (1024.0 * 1024.0);
+    return elapsedMilliseconds > 0.0 ? megabytes * 1000.0 / elapsedMilliseconds : 0.0;
+  }
+
+  void report(std::ostream &out, double elapsedMilliseconds) const {
+    double megabytes = this->stats.bytes / (1024.0 * 1024.0);
+    out << std::fixed << std::setprecision(3)
+        << "uploads (" << (this->dedicated() ? "dedicated transfer queue" : "graphics queue")
+        << ", " << (this->timeline ? "timeline semaphore" : "fences") << "): "
+        << megabytes << " MiB in " << this->stats.batches << " batches, "
+        << this->throughput(elapsedMilliseconds) << " MiB/s" << '\n'
+        << "  " << this->stats.stalls << " stalls on a full staging ring or batch, "
+        << this->stats.stallMilliseconds << " ms" << std::endl;
+    out.unsetf(std::ios_base::floatfield);
+  }
+
+  // Batches up to this value have been acquired by the graphics queue.
+  uint64_t acquiredValue = 0;
+  // Batches up to this value are known to be done.
+  uint64_t completedValue = 0;
+
+private:
+  struct PendingAcquire {
+    uint64_t value = 0;
+    std::vector<VkBufferMemoryBarrier> bufferBarriers;
+    std::vector<VkImageMemoryBarrier> imageBarriers;
+    VkPipelineStageFlags stages = 0;
+  };
+
+  struct Batch {
+    // Destroying the pool also frees the command buffer.
+    UniqueCommandPool commandPool;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    // Only without timeline semaphores.
+    UniqueFence fence;
+    // Value of the last submission of this batch, 0 if never submitted.
+    uint64_t value = 0;
+    // Acquire barriers of the copies being recorded.
+    PendingAcquire pending;
+  };
+
+  struct InFlight {
+    uint64_t value;
+    // Position in the ring right after the last byte staged for this batch.
+    VkDeviceSize ringEnd;
+  };
+
+  /**
+   * The batch being recorded. Its command buffer is reset and begun on first use.
+   */
+  Batch &current() {
+    Batch &batch = this->batches[this->nextValue % batchCount];
+    if (this->recording) {
+      return batch;
+    }
+    // The previous submission of this slot must be done before its command pool is reset.
+    if (batch.value > this->completedValue) {
+      this->stall([&]() { this->waitFor(batch.value); });
+    }
+    vkResetCommandPool(this->device, batch.commandPool, 0);
+    VkCommandBufferBeginInfo beginInfo = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    if (vkBeginCommandBuffer(batch.commandBuffer, &beginInfo) != VK_SUCCESS) {
+      throw std::runtime_error("failed to begin recording upload command buffer!");
+    }
+    this->recording = true;
+    return batch;
+  }
+
+  /**
+   * Copy the data into the staging ring and return its offset in the ring buffer. The ring is
+   * addressed with ever increasing positions, the offset in the buffer being the position modulo
+   * the ring size. Data never wraps around the end of the buffer.
+   */
+  VkDeviceSize stage(const void *data, VkDeviceSize size) {
+    if (size > this->ringSize) {
+      throw std::runtime_error("upload does not fit in the staging ring!");
+    }
+    while (true) {
+      VkDeviceSize start = (this->head + this->alignment - 1) / this->alignment * this->alignment;
+      if (start % this->ringSize + size > this->ringSize) {
+        start = (start / this->ringSize + 1) * this->ringSize;
+      }
+      if (this->inFlight.empty() && !this->recording) {
+        // Nothing uses the ring.
+        this->tail = start;
+      }
+      if (start + size - this->tail <= this->ringSize) {
+        this->head = start + size;
+        memcpy(static_cast<char *>(this->ringMemory.mapped) + start % this->ringSize, data, size);
+        return start % this->ringSize;
+      }
+      // The ring is full, wait for the oldest batch. If that is the one being recorded, submit it
+      // first.
+      if (this->inFlight.empty()) {
+        this->flush();
+      }
+      this->stall([&]() { this->waitFor(this->inFlight.front().value); });
+    }
+  }
+
+  /**
+   * Record the release half of an ownership transfer. Nothing to release within a queue family,
+   * the acquire barrier is then a regular barrier.
+   */
+  template<typename Barrier>
+  void release(Barrier &barrier) {
+    if (!this->dedicated()) {
+      barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      return;
+    }
+    Barrier release = barrier;
+    // The acquire half makes the writes visible, the destination access is ignored here.
+    release.dstAccessMask = 0;
+    VkCommandBuffer commandBuffer = this->current().commandBuffer;
+    if constexpr (std::is_same_v<Barrier, VkImageMemoryBarrier>) {
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &release);
+    } else {
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &release, 0, nullptr);
+    }
+  }
+
+  /**
+   * Update completedValue and free the ring space of the batches done.
+   */
+  void poll() {
+    if (this->timeline) {
+      vkGetSemaphoreCounterValue(this->device, this->semaphore, &this->completedValue);
+    } else {
+      // Batches complete in submission order on a single queue.
+      for (auto &inFlight: this->inFlight) {
+        Batch &batch = this->batches[inFlight.value % batchCount];
+        if (vkGetFenceStatus(this->device, batch.fence) != VK_SUCCESS) {
+          break;
+        }
+        this->completedValue = inFlight.value;
+      }
+    }
+    while (!this->inFlight.empty() && this->inFlight.front().value <= this->completedValue) {
+      this->tail = this->inFlight.front().ringEnd;
+      this->inFlight.pop_front();
+    }
+  }
+
+  void waitFor(uint64_t value) {
+    if (value <= this->completedValue) {
+      return;
+    }
+    if (this->timeline) {
+      VkSemaphoreWaitInfo waitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = this->semaphore.address(),
+        .pValues = &value,
+      };
+      vkWaitSemaphores(this->device, &waitInfo, UINT64_MAX);
+    } else {
+      Batch &batch = this->batches[value % batchCount];
+      vkWaitForFences(this->device, 1, batch.fence.address(), VK_TRUE, UINT64_MAX);
+    }
+    this->poll();
+  }
+
+  template<typename F>
+  void stall(F &&f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    this->stats.stalls++;
+    this->stats.stallMilliseconds += std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  VkQueue queue;
+  uint32_t queueFamilyIndex;
+  uint32_t graphicsQueueFamilyIndex;
+  bool timeline;
+  VkDeviceSize ringSize;
+  VkDeviceSize alignment;
+
+  UniqueBuffer ring;
+  Allocation ringMemory;
+  // Ring positions: data is staged at head, everything before tail is free.
+  VkDeviceSize head = 0;
+  VkDeviceSize tail = 0;
+
+  UniqueSemaphore semaphore;
+  std::vector<Batch> batches;
+  // Value of the next batch to be submitted, the first one being 1.
+  uint64_t nextValue = 1;
+  bool recording = false;
+  std::deque<InFlight> inFlight;
+  std::deque<PendingAcquire> pendingAcquires;
+
+  struct {
+    uint64_t bytes = 0;
+    uint64_t batches = 0;
+    uint64_t stalls = 0;
+    double stallMilliseconds = 0.0;
+  } stats;
+};
+
+/**
+ * A device local buffer, usable as vertex and index buffer, and a texture, both streamed to by an
+ * UploadQueue. Used to measure upload throughput while rendering.
+ */
+class UploadTarget {
+public:
+  UploadTarget(VkDevice device, DeviceMemoryAllocator &allocator, VkDeviceSize bufferSize,
+    VkExtent2D textureExtent, const VkAllocationCallbacks *allocationCallbacks = nullptr)
+    : device(device), allocationCallbacks(allocationCallbacks), allocator(allocator),
+      bufferSize(bufferSize), textureExtent(textureExtent) {
+    VkBufferCreateInfo bufferInfo = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = bufferSize,
+      .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT
+             | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+             | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    this->buffer = createDeviceChild<UniqueBuffer>(vkCreateBuffer, device, bufferInfo,
+      allocationCallbacks, "upload target buffer");
+    this->bufferMemory = allocator.allocateBuffer(this->buffer,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VkImageCreateInfo imageInfo = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = VK_FORMAT_R8G8B8A8_UNORM,
+      .extent = { textureExtent.width, textureExtent.height, 1 },
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+    this->texture = createDeviceChild<UniqueImage>(vkCreateImage, device, imageInfo,
+      allocationCallbacks, "upload target texture");
+    this->textureMemory = allocator.allocateImage(this->texture, imageInfo.tiling,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  }
+
+  ~UploadTarget() {
+    // The resources go before the memory bound to them.
+    this->texture.reset();
+    this->allocator.free(this->textureMemory);
+    this->buffer.reset();
+    this->allocator.free(this->bufferMemory);
+  }
+
+  UploadTarget(const UploadTarget &) = delete;
+  UploadTarget &operator=(const UploadTarget &) = delete;
+
+  /**
+   * Stream new content to the buffer and the texture. `data` must hold at least bufferSize bytes
+   * and the 4 bytes per texel of the texture.
+   */
+  void upload(UploadQueue &uploadQueue, const std::vector<char> &data) {
+    uploadQueue.uploadBuffer(this->buffer, 0, data.data(), this->bufferSize,
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+      VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT);
+    uploadQueue.uploadImage(this->texture, this->textureExtent, data.data(),
+      this->textureExtent.width * this->textureExtent.height * 4,
+      VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+  }
+
+  VkDevice device;
+  const VkAllocationCallbacks *allocationCallbacks;
+  DeviceMemoryAllocator &allocator;
+  VkDeviceSize bufferSize;
+  VkExtent2D textureExtent;
+  UniqueBuffer buffer;
+  Allocation bufferMemory;
+  UniqueImage texture;
+  Allocation textureMemory;
+};